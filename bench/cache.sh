@@ -0,0 +1,133 @@
+#!/bin/sh
+# Attributes simulated cache misses to the allocator and the application
+#
+# Usage:
+#   cache.sh <cachebench binary> <libarmalloc64.a> > results.csv
+#
+# Environment:
+#   QEMU          Emulator command (default: qemu-aarch64 -L /usr/aarch64-linux-gnu)
+#   CACHE_PLUGIN  Path to QEMU's libcache.so (contrib/plugins in a QEMU build)
+#   NM            nm that reads aarch64 objects (default: aarch64-linux-gnu-nm)
+#   CACHE_SCALE   Workload size passed to cachebench (default: cachebench's)
+#
+# The simulated caches follow a Neoverse N1 core: 64 KiB 4-way L1D and L1I,
+# a unified 1 MiB 8-way L2, 64-byte lines and LRU replacement. The plugin
+# reports the misses of every instruction, and each instruction is mapped
+# to the function containing it through the binary's symbol table (the
+# binary is linked -no-pie so the addresses match):
+#   allocator  functions defined in libarmalloc64.a
+#   app        the workload's app_* functions, which make every access to
+#              allocated objects
+#   other      startup, libc and anything outside the binary
+# L2 misses include instruction fetches that missed L1I and L2.
+#
+# The output is CSV:
+# workload,l1d_accesses,l1d_misses,l1d_allocator,l1d_app,l1d_other,l2_misses,l2_allocator,l2_app,l2_other
+
+set -eu
+
+WORKLOADS="list tree hash queue"
+
+CACHE_CONFIG="dcachesize=65536,dassoc=4,dblksize=64"
+CACHE_CONFIG="$CACHE_CONFIG,icachesize=65536,iassoc=4,iblksize=64"
+CACHE_CONFIG="$CACHE_CONFIG,l2=on,l2cachesize=1048576,l2assoc=8,l2blksize=64"
+CACHE_CONFIG="$CACHE_CONFIG,evict=lru,limit=1000000000"
+
+if [ $# -ne 2 ]; then
+    sed -n '2,5p' "$0" >&2
+    exit 2
+fi
+BIN=$1
+LIB=$2
+QEMU=${QEMU:-qemu-aarch64 -L /usr/aarch64-linux-gnu}
+NM=${NM:-aarch64-linux-gnu-nm}
+if [ -z "${CACHE_PLUGIN:-}" ] || [ ! -f "$CACHE_PLUGIN" ]; then
+    echo "cache.sh: set CACHE_PLUGIN to QEMU's libcache.so" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Allocator functions, then every text symbol of the binary by address
+$NM --defined-only "$LIB" | awk 'NF == 3 { print $3 }' > "$tmp/allocator"
+$NM -n "$BIN" | awk 'NF == 3' > "$tmp/symbols"
+
+echo "workload,l1d_accesses,l1d_misses,l1d_allocator,l1d_app,l1d_other,l2_misses,l2_allocator,l2_app,l2_other"
+for workload in $WORKLOADS; do
+    $QEMU -plugin "$CACHE_PLUGIN,$CACHE_CONFIG" -d plugin -D "$tmp/log" \
+        "$BIN" "$workload" ${CACHE_SCALE:-} > /dev/null
+    awk -v workload="$workload" '
+        function hex(s,    i, n) {
+            s = tolower(s)
+            sub(/^0x/, "", s)
+            n = 0
+            for (i = 1; i <= length(s); i++) {
+                n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+            }
+            return n
+        }
+        # Class of the function containing addr: binary search for the
+        # last symbol at or below it
+        function classify(addr,    lo, hi, mid) {
+            if (nsyms == 0 || addr < sym_addr[1] || addr >= text_end) {
+                return "other"
+            }
+            lo = 1
+            hi = nsyms
+            while (lo < hi) {
+                mid = int((lo + hi + 1) / 2)
+                if (sym_addr[mid] <= addr) lo = mid; else hi = mid - 1
+            }
+            if (sym_name[lo] in allocator) return "allocator"
+            if (sym_name[lo] ~ /^app_/) return "app"
+            return "other"
+        }
+        FILENAME == ARGV[1] { allocator[$1] = 1; next }
+        FILENAME == ARGV[2] {
+            # Text ends at etext, or else at the first read-only or data
+            # symbol after it
+            if ($3 == "etext" || $3 == "_etext" || $3 == "__etext") {
+                text_end = hex($1)
+                have_etext = 1
+            } else if ($2 ~ /^[TtWw]$/) {
+                nsyms++
+                sym_addr[nsyms] = hex($1)
+                sym_name[nsyms] = $3
+            } else if (nsyms > 0 && text_end == 0 && !have_etext &&
+                       hex($1) > sym_addr[nsyms]) {
+                text_end = hex($1)
+            }
+            next
+        }
+        FNR == 1 { if (text_end == 0) text_end = 2 ^ 64 }
+        /^core #/ { section = "stats"; next }
+        /^address, data misses/ { section = "l1d"; next }
+        /^address, fetch misses/ { section = "l1i"; next }
+        /^address, L2 misses/ { section = "l2"; next }
+        section == "stats" && $1 ~ /^[0-9]+$/ {
+            l1d_accesses = $2
+            l1d_misses = $3
+            l2_misses = $9
+            section = ""
+            next
+        }
+        (section == "l1d" || section == "l2") && /^0x/ {
+            split($0, fields, ",")
+            split(fields[1], addr, " ")
+            misses[section, classify(hex(addr[1]))] += fields[2]
+        }
+        END {
+            if (l1d_accesses == "") {
+                print "cache.sh: no statistics from the cache plugin" > "/dev/stderr"
+                exit 1
+            }
+            printf "%s,%s,%s,%d,%d,%d,%s,%d,%d,%d\n", workload,
+                l1d_accesses, l1d_misses,
+                misses["l1d", "allocator"], misses["l1d", "app"],
+                misses["l1d", "other"], l2_misses,
+                misses["l2", "allocator"], misses["l2", "app"],
+                misses["l2", "other"]
+        }
+    ' "$tmp/allocator" "$tmp/symbols" "$tmp/log"
+done
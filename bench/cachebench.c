@@ -0,0 +1,377 @@
+// Allocation-heavy workloads for cache simulation
+//
+// cache.sh runs each workload under QEMU's cache plugin and attributes the
+// data-cache misses to the instructions that caused them. Every access the
+// workloads make to allocated objects happens in a function named app_*, so
+// the misses split into allocator code (libarmalloc64), application accesses
+// to allocated objects (app_*) and everything else (startup, libc).
+//
+// The workloads are deterministic: they use a fixed-seed generator and no
+// timing, so the same binary produces the same miss counts on every run.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mm.h"
+
+#define ARENA_SIZE (64UL << 20)
+#define DEFAULT_SCALE 20000
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Spreads consecutive integers over 64 bits (splitmix64 finalizer)
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void *xmalloc(size_t size) {
+    void *ptr = mm_malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "cachebench: mm_malloc(%zu) failed\n", size);
+        exit(1);
+    }
+    return ptr;
+}
+
+// Writes one byte in every cache line of the object. A plain memset would
+// run in libc and count as "other" rather than as an application access.
+__attribute__((noinline)) static void app_touch(void *ptr, size_t len,
+                                                unsigned char value) {
+    unsigned char *bytes = ptr;
+    for (size_t i = 0; i < len; i += 64) {
+        bytes[i] = value;
+    }
+    bytes[len - 1] = value;
+}
+
+// ---------------------------------------------------------------------------
+// list: a singly linked list of mixed-size nodes built between short-lived
+// temporaries, then traversed repeatedly. Measures how far apart the
+// allocator places objects allocated one after another.
+// ---------------------------------------------------------------------------
+
+struct list_node {
+    struct list_node *next;
+    uint64_t value;
+    unsigned char payload[];
+};
+
+__attribute__((noinline)) static struct list_node *app_list_build(size_t n) {
+    struct list_node *head = NULL;
+    for (size_t i = 0; i < n; i++) {
+        size_t payload = 8 + rng_next() % 120;
+        const size_t temp_size = 16 + rng_next() % 240;
+        void *temp = xmalloc(temp_size);
+        app_touch(temp, temp_size, 0);
+        struct list_node *node = xmalloc(sizeof(*node) + payload);
+        node->value = i;
+        node->payload[0] = (unsigned char)i;
+        node->next = head;
+        head = node;
+        mm_free(temp);
+    }
+    return head;
+}
+
+__attribute__((noinline)) static uint64_t app_list_walk(struct list_node *head) {
+    uint64_t sum = 0;
+    for (struct list_node *node = head; node != NULL; node = node->next) {
+        sum += node->value + node->payload[0];
+    }
+    return sum;
+}
+
+__attribute__((noinline)) static void app_list_free(struct list_node *head) {
+    while (head != NULL) {
+        struct list_node *next = head->next;
+        mm_free(head);
+        head = next;
+    }
+}
+
+static uint64_t run_list(size_t scale) {
+    struct list_node *head = app_list_build(scale);
+    uint64_t sum = 0;
+    for (int pass = 0; pass < 8; pass++) {
+        sum += app_list_walk(head);
+    }
+    app_list_free(head);
+    return sum;
+}
+
+// ---------------------------------------------------------------------------
+// tree: an unbalanced binary search tree with random keys, then random
+// lookups, then deletion of half the keys and more lookups. Measures the
+// locality of small fixed-size nodes reached by pointer chasing.
+// ---------------------------------------------------------------------------
+
+struct tree_node {
+    struct tree_node *left;
+    struct tree_node *right;
+    uint64_t key;
+    uint64_t value;
+};
+
+__attribute__((noinline)) static struct tree_node *app_tree_insert(
+    struct tree_node *root, uint64_t key) {
+    struct tree_node **link = &root;
+    while (*link != NULL) {
+        if (key == (*link)->key) {
+            (*link)->value++;
+            return root;
+        }
+        link = key < (*link)->key ? &(*link)->left : &(*link)->right;
+    }
+    struct tree_node *node = xmalloc(sizeof(*node));
+    node->left = NULL;
+    node->right = NULL;
+    node->key = key;
+    node->value = 1;
+    *link = node;
+    return root;
+}
+
+__attribute__((noinline)) static uint64_t app_tree_lookup(
+    const struct tree_node *node, uint64_t key) {
+    while (node != NULL) {
+        if (key == node->key) {
+            return node->value;
+        }
+        node = key < node->key ? node->left : node->right;
+    }
+    return 0;
+}
+
+// Removes the node with the key, replacing it with its in-order successor
+__attribute__((noinline)) static struct tree_node *app_tree_delete(
+    struct tree_node *root, uint64_t key) {
+    struct tree_node **link = &root;
+    while (*link != NULL && (*link)->key != key) {
+        link = key < (*link)->key ? &(*link)->left : &(*link)->right;
+    }
+    struct tree_node *node = *link;
+    if (node == NULL) {
+        return root;
+    }
+    if (node->left == NULL) {
+        *link = node->right;
+    } else if (node->right == NULL) {
+        *link = node->left;
+    } else {
+        struct tree_node **succ = &node->right;
+        while ((*succ)->left != NULL) {
+            succ = &(*succ)->left;
+        }
+        struct tree_node *next = *succ;
+        *succ = next->right;
+        next->left = node->left;
+        next->right = node->right;
+        *link = next;
+    }
+    mm_free(node);
+    return root;
+}
+
+__attribute__((noinline)) static void app_tree_free(struct tree_node *node) {
+    while (node != NULL) {
+        app_tree_free(node->left);
+        struct tree_node *right = node->right;
+        mm_free(node);
+        node = right;
+    }
+}
+
+static uint64_t run_tree(size_t scale) {
+    const uint64_t key_space = 4 * (uint64_t)scale;
+    struct tree_node *root = NULL;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < scale; i++) {
+        root = app_tree_insert(root, rng_next() % key_space);
+    }
+    for (size_t i = 0; i < 4 * scale; i++) {
+        sum += app_tree_lookup(root, rng_next() % key_space);
+    }
+    for (size_t i = 0; i < scale; i++) {
+        root = app_tree_delete(root, rng_next() % key_space);
+        root = app_tree_insert(root, rng_next() % key_space);
+    }
+    for (size_t i = 0; i < 4 * scale; i++) {
+        sum += app_tree_lookup(root, rng_next() % key_space);
+    }
+    app_tree_free(root);
+    return sum;
+}
+
+// ---------------------------------------------------------------------------
+// hash: a chained hash table of variable-length string entries under
+// insert/delete churn, with lookups between. Measures how reused blocks of
+// mixed sizes scatter the live set.
+// ---------------------------------------------------------------------------
+
+struct hash_entry {
+    struct hash_entry *next;
+    uint64_t hash;
+    size_t len;
+    char text[];
+};
+
+__attribute__((noinline)) static void app_hash_insert(struct hash_entry **table,
+                                                      size_t buckets,
+                                                      uint64_t hash) {
+    size_t len = 8 + hash % 200;
+    struct hash_entry *entry = xmalloc(sizeof(*entry) + len);
+    entry->hash = hash;
+    entry->len = len;
+    app_touch(entry->text, len, (unsigned char)hash);
+    entry->next = table[hash % buckets];
+    table[hash % buckets] = entry;
+}
+
+__attribute__((noinline)) static size_t app_hash_lookup(
+    struct hash_entry *const *table, size_t buckets, uint64_t hash) {
+    for (const struct hash_entry *entry = table[hash % buckets];
+         entry != NULL; entry = entry->next) {
+        if (entry->hash == hash) {
+            return entry->len + (unsigned char)entry->text[entry->len - 1];
+        }
+    }
+    return 0;
+}
+
+__attribute__((noinline)) static void app_hash_remove_first(
+    struct hash_entry **table, size_t bucket) {
+    struct hash_entry *entry = table[bucket];
+    if (entry != NULL) {
+        table[bucket] = entry->next;
+        mm_free(entry);
+    }
+}
+
+static uint64_t run_hash(size_t scale) {
+    const size_t buckets = scale / 4 + 1;
+    struct hash_entry **table = xmalloc(buckets * sizeof(*table));
+    for (size_t i = 0; i < buckets; i++) {
+        table[i] = NULL;
+    }
+    // Entry i has hash mix(i), so lookups can pick keys that were inserted
+    uint64_t inserted = 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < scale; i++) {
+        app_hash_insert(table, buckets, mix(inserted++));
+    }
+    for (size_t round = 0; round < 4; round++) {
+        for (size_t i = 0; i < scale / 2; i++) {
+            app_hash_remove_first(table, rng_next() % buckets);
+            app_hash_insert(table, buckets, mix(inserted++));
+        }
+        for (size_t i = 0; i < scale; i++) {
+            sum += app_hash_lookup(table, buckets, mix(rng_next() % inserted));
+        }
+    }
+    for (size_t i = 0; i < buckets; i++) {
+        while (table[i] != NULL) {
+            app_hash_remove_first(table, i);
+        }
+    }
+    mm_free(table);
+    return sum;
+}
+
+// ---------------------------------------------------------------------------
+// queue: a producer/consumer ring of messages of random sizes. Each message
+// is written when allocated and read once before it is freed, so this
+// measures how quickly freed memory comes back while still cached.
+// ---------------------------------------------------------------------------
+
+struct message {
+    size_t len;
+    unsigned char data[];
+};
+
+__attribute__((noinline)) static struct message *app_message_new(size_t len) {
+    struct message *msg = xmalloc(sizeof(*msg) + len);
+    msg->len = len;
+    app_touch(msg->data, len, (unsigned char)len);
+    return msg;
+}
+
+__attribute__((noinline)) static uint64_t app_message_consume(
+    struct message *msg) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < msg->len; i += 64) {
+        sum += msg->data[i];
+    }
+    mm_free(msg);
+    return sum;
+}
+
+static uint64_t run_queue(size_t scale) {
+    enum { DEPTH = 256 };
+    struct message *ring[DEPTH] = {NULL};
+    uint64_t sum = 0;
+    for (size_t i = 0; i < 8 * scale; i++) {
+        size_t slot = rng_next() % DEPTH;
+        if (ring[slot] != NULL) {
+            sum += app_message_consume(ring[slot]);
+        }
+        size_t len = rng_next() % 4 == 0 ? 512 + rng_next() % 3584
+                                         : 16 + rng_next() % 240;
+        ring[slot] = app_message_new(len);
+    }
+    for (size_t slot = 0; slot < DEPTH; slot++) {
+        if (ring[slot] != NULL) {
+            sum += app_message_consume(ring[slot]);
+        }
+    }
+    return sum;
+}
+
+struct workload {
+    const char *name;
+    uint64_t (*run)(size_t scale);
+};
+
+static const struct workload workloads[] = {
+    {"list", run_list},
+    {"tree", run_tree},
+    {"hash", run_hash},
+    {"queue", run_queue},
+};
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: cachebench <workload> [scale]\n");
+        return 2;
+    }
+    const struct workload *workload = NULL;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(argv[1], workloads[i].name) == 0) {
+            workload = &workloads[i];
+        }
+    }
+    const size_t scale = argc == 3 ? strtoul(argv[2], NULL, 0) : DEFAULT_SCALE;
+    if (workload == NULL || scale == 0) {
+        fprintf(stderr, "cachebench: bad workload or scale\n");
+        return 2;
+    }
+
+    if (mm_init(ARENA_SIZE) != 0) {
+        fprintf(stderr, "cachebench: mm_init failed\n");
+        return 1;
+    }
+    // Printing the result keeps the workload from being optimized away
+    printf("%s %llu\n", workload->name,
+           (unsigned long long)workload->run(scale));
+    mm_deinit();
+    return 0;
+}
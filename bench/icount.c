@@ -0,0 +1,123 @@
+// Runs one allocator operation many times for instruction counting
+//
+// icount.sh runs this under QEMU's instruction-counting plugin with two
+// operation counts and divides the difference by the extra operations, so
+// startup, setup and teardown cancel out. Setup never depends on the count,
+// and the per-operation loop is shared with the "empty" workload, whose
+// cost icount.sh subtracts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mm.h"
+
+#define ARENA_SIZE (64UL << 20)
+#define MAX_OPS 2000
+
+static void *ptrs[2 * MAX_OPS];
+static size_t request_size;
+
+// Operation i of each workload. noinline keeps every workload on the same
+// call path as op_empty.
+__attribute__((noinline)) static void op_empty(size_t i) {
+    (void)i;
+    __asm__ volatile("");
+}
+
+__attribute__((noinline)) static void op_malloc(size_t i) {
+    ptrs[i] = mm_malloc(request_size);
+}
+
+__attribute__((noinline)) static void op_free_even(size_t i) {
+    mm_free(ptrs[2 * i]);
+}
+
+__attribute__((noinline)) static void op_free_sized_even(size_t i) {
+    mm_free_sized(ptrs[2 * i], request_size);
+}
+
+__attribute__((noinline)) static void op_free_in_order(size_t i) {
+    mm_free(ptrs[i]);
+}
+
+static void allocate_all(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ptrs[i] = mm_malloc(request_size);
+        if (ptrs[i] == NULL) {
+            fprintf(stderr, "icount: setup allocation failed\n");
+            exit(1);
+        }
+    }
+}
+
+// Setup for reuse: MAX_OPS free blocks of the size, each between two
+// allocated ones so none coalesce. They are reused from index 0 upward.
+static void setup_reuse(void) {
+    allocate_all(2 * MAX_OPS);
+    for (size_t i = 0; i < MAX_OPS; i++) {
+        mm_free(ptrs[2 * i]);
+    }
+}
+
+static void setup_interleaved(void) {
+    allocate_all(2 * MAX_OPS);
+}
+
+static void setup_in_order(void) {
+    allocate_all(MAX_OPS);
+}
+
+static void setup_none(void) {
+}
+
+struct workload {
+    const char *name;
+    void (*setup)(void);
+    void (*op)(size_t i);
+};
+
+static const struct workload workloads[] = {
+    // Loop and call overhead, subtracted from the others
+    {"empty", setup_none, op_empty},
+    // mm_malloc carving blocks from the end of the heap, extensions included
+    {"malloc_fresh", setup_none, op_malloc},
+    // mm_malloc taking an exact fit from the size class's free list
+    {"malloc_reuse", setup_reuse, op_malloc},
+    // mm_free with both neighbors allocated (no coalescing)
+    {"free_isolated", setup_interleaved, op_free_even},
+    // mm_free_sized with both neighbors allocated
+    {"free_sized_isolated", setup_interleaved, op_free_sized_even},
+    // mm_free merging with the previous block, which was just freed
+    {"free_coalesce", setup_in_order, op_free_in_order},
+};
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: icount <workload> <request_size> <ops>\n");
+        return 2;
+    }
+    const struct workload *workload = NULL;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(argv[1], workloads[i].name) == 0) {
+            workload = &workloads[i];
+        }
+    }
+    request_size = strtoul(argv[2], NULL, 0);
+    const size_t ops = strtoul(argv[3], NULL, 0);
+    if (workload == NULL || request_size == 0 || ops > MAX_OPS) {
+        fprintf(stderr, "icount: bad workload, size or count (max %d)\n",
+                MAX_OPS);
+        return 2;
+    }
+
+    if (mm_init(ARENA_SIZE) != 0) {
+        fprintf(stderr, "icount: mm_init failed\n");
+        return 1;
+    }
+    workload->setup();
+    for (size_t i = 0; i < ops; i++) {
+        workload->op(i);
+    }
+    mm_deinit();
+    return 0;
+}
@@ -0,0 +1,114 @@
+#!/bin/sh
+# Counts the instructions per allocator call with QEMU's insn plugin
+#
+# Usage:
+#   icount.sh measure <icount binary> > results.csv
+#   icount.sh compare <baseline.csv> <results.csv> [tolerance_percent]
+#
+# Environment for measure:
+#   QEMU         Emulator command (default: qemu-aarch64 -L /usr/aarch64-linux-gnu)
+#   INSN_PLUGIN  Path to QEMU's libinsn.so (tests/plugin in a QEMU build)
+#   ICOUNT_OPS   Operations in the shorter run (default: 1000); the longer
+#                run does twice as many
+#
+# Each workload and request size runs twice, with ICOUNT_OPS and
+# 2 * ICOUNT_OPS operations. The difference in instructions executed,
+# divided by ICOUNT_OPS, is the cost of one operation; the loop overhead
+# measured by the "empty" workload is subtracted. The output is CSV:
+# workload,request_size,instructions_per_op
+#
+# compare exits with status 1 if any row of results.csv is more than
+# tolerance_percent (default 0) above the same row of baseline.csv, or if a
+# row of baseline.csv is missing from results.csv. It exits with status 2 if
+# there is no baseline.csv; `make icount-baseline` records one.
+
+set -eu
+
+WORKLOADS="malloc_fresh malloc_reuse free_isolated free_sized_isolated free_coalesce"
+
+# One request size per segregated list: block sizes below 64, 64-127,
+# 128-255, ..., 4096 and up
+SIZES="16 48 100 200 400 1000 2000 5000"
+
+# Prints the instructions executed by one run of the icount binary
+count() {
+    log=$(mktemp)
+    $QEMU -plugin "$INSN_PLUGIN,inline=on" -d plugin -D "$log" \
+        "$ICOUNT_BIN" "$1" "$2" "$3" > /dev/null
+    awk '/insns/ { n = $NF } END { if (n == "") exit 1; print n }' "$log"
+    rm -f "$log"
+}
+
+# Prints the instructions per operation of a workload and size
+per_op() {
+    short=$(count "$1" "$2" "$ICOUNT_OPS")
+    long=$(count "$1" "$2" $((2 * ICOUNT_OPS)))
+    echo "$short $long $ICOUNT_OPS" | awk '{ printf "%.2f\n", ($2 - $1) / $3 }'
+}
+
+measure() {
+    ICOUNT_BIN=$1
+    QEMU=${QEMU:-qemu-aarch64 -L /usr/aarch64-linux-gnu}
+    ICOUNT_OPS=${ICOUNT_OPS:-1000}
+    if [ -z "${INSN_PLUGIN:-}" ] || [ ! -f "$INSN_PLUGIN" ]; then
+        echo "icount.sh: set INSN_PLUGIN to QEMU's libinsn.so" >&2
+        exit 2
+    fi
+
+    empty=$(per_op empty 16)
+    echo "workload,request_size,instructions_per_op"
+    for workload in $WORKLOADS; do
+        for size in $SIZES; do
+            total=$(per_op "$workload" "$size")
+            echo "$workload,$size,$total,$empty" |
+                awk -F, '{ printf "%s,%s,%.2f\n", $1, $2, $3 - $4 }'
+        done
+    done
+}
+
+compare() {
+    if [ ! -f "$1" ]; then
+        echo "icount.sh: no baseline $1; run make icount-baseline" >&2
+        exit 2
+    fi
+    awk -F, -v tolerance="${3:-0}" '
+        FNR == 1 { next }
+        NR == FNR { baseline[$1 "," $2] = $3; next }
+        {
+            key = $1 "," $2
+            if (!(key in baseline)) {
+                printf "NEW   %-24s %6s %10.2f\n", $1, $2, $3
+                next
+            }
+            seen[key] = 1
+            limit = baseline[key] * (1 + tolerance / 100)
+            status = $3 > limit ? "FAIL" : "ok"
+            if ($3 > limit) failed = 1
+            printf "%-5s %-24s %6s %10.2f (baseline %.2f)\n",
+                status, $1, $2, $3, baseline[key]
+        }
+        END {
+            for (key in baseline) {
+                if (key in seen) continue
+                split(key, row, ",")
+                printf "MISS  %-24s %6s %10s (baseline %.2f)\n",
+                    row[1], row[2], "-", baseline[key]
+                failed = 1
+            }
+            exit failed
+        }
+    ' "$1" "$2"
+}
+
+case "${1:-}" in
+measure)
+    measure "$2"
+    ;;
+compare)
+    compare "$2" "$3" "${4:-0}"
+    ;;
+*)
+    sed -n '2,7p' "$0" >&2
+    exit 2
+    ;;
+esac
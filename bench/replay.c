@@ -0,0 +1,672 @@
+// Replays allocation traces against the allocator in src/ and glibc malloc
+//
+// Reads CMU malloclab .rep traces and binary traces written by mm_trace_start,
+// then reports throughput, peak heap size and space utilization for each
+// allocator. Utilization is the peak of the live requested bytes divided by
+// the peak heap size, measured in a separate untimed pass. With -l, one more
+// pass runs under mm_latency_start and prints latency percentiles per
+// operation and size class. With -p, the allocator in src/ is replayed under
+// one placement policy or, with -p all, under each of them in turn.
+
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mem.h"
+#include "mm.h"
+#include "mm_errno.h"
+
+#define DEFAULT_ARENA_SIZE (64UL << 20)
+#define DEFAULT_ITERATIONS 5
+
+enum op_type { OP_ALLOC, OP_REALLOC, OP_FREE };
+
+struct trace_op {
+    enum op_type type;
+    size_t id;    // Block the operation applies to
+    size_t size;  // Requested size (OP_ALLOC and OP_REALLOC)
+};
+
+struct trace {
+    const char *name;
+    size_t num_ids;
+    size_t num_ops;
+    struct trace_op *ops;
+};
+
+// Allocator under test. Every call goes through these pointers in both
+// passes, so both allocators pay the same indirection.
+struct allocator {
+    const char *name;
+    int (*init)(size_t arena_size);
+    void *(*malloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    void (*deinit)(void);
+    size_t (*heap_bytes)(void);  // Peak heap size since init
+};
+
+static void die(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "replay: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *ptr = calloc(n, size);
+    if (ptr == NULL && n != 0) {
+        die("out of memory");
+    }
+    return ptr;
+}
+
+// ---------------------------------------------------------------------------
+// Allocators
+// ---------------------------------------------------------------------------
+
+// Placement policy mm_bench_init selects for each new heap
+static int placement_policy = MM_PLACEMENT_FIRST_FIT;
+
+static const char *const policy_names[MM_NUM_PLACEMENT_POLICIES] = {
+    "first", "addr", "next", "best", "wild"};
+
+static int mm_bench_init(size_t arena_size) {
+    if (mm_init(arena_size) != 0) {
+        return -1;
+    }
+    return mm_set_placement_policy(placement_policy);
+}
+
+static void mm_bench_deinit(void) {
+    mm_deinit();
+}
+
+// There is no mm_realloc: grow in place with mm_expand when possible, and
+// move the block otherwise. Shrinking keeps the block as it is.
+static void *mm_bench_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return mm_malloc(size);
+    }
+    const size_t usable = mm_usable_size(ptr);
+    if (usable >= size || mm_expand(ptr, size, size) != 0) {
+        return ptr;
+    }
+    void *new_ptr = mm_malloc(size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, usable);
+        mm_free(ptr);
+    }
+    return new_ptr;
+}
+
+static size_t mm_bench_heap_bytes(void) {
+    return (size_t)((const char *)mem_get_peak_brk() -
+                    (const char *)_get_mem_heap_start());
+}
+
+static const struct allocator mm_allocator = {
+    .name = "mm",
+    .init = mm_bench_init,
+    .malloc = mm_malloc,
+    .realloc = mm_bench_realloc,
+    .free = mm_free,
+    .deinit = mm_bench_deinit,
+    .heap_bytes = mm_bench_heap_bytes,
+};
+
+static size_t libc_base_bytes;
+static size_t libc_peak_bytes;
+
+// Memory glibc has obtained from the kernel, minus what the driver itself
+// holds (the trace and the pointer arrays), which was measured at init
+static size_t libc_footprint(void) {
+    const struct mallinfo2 info = mallinfo2();
+    const size_t mapped = info.arena + info.hblkhd;
+    return mapped > libc_base_bytes ? mapped - libc_base_bytes : 0;
+}
+
+static int libc_init(size_t arena_size) {
+    (void)arena_size;
+    malloc_trim(0);
+    const struct mallinfo2 info = mallinfo2();
+    libc_base_bytes = info.arena + info.hblkhd;
+    libc_peak_bytes = 0;
+    return 0;
+}
+
+static void libc_deinit(void) {
+    malloc_trim(0);
+}
+
+// glibc has no peak counter; the utilization pass samples this after every
+// operation instead
+static size_t libc_heap_bytes(void) {
+    const size_t bytes = libc_footprint();
+    if (bytes > libc_peak_bytes) {
+        libc_peak_bytes = bytes;
+    }
+    return libc_peak_bytes;
+}
+
+static const struct allocator libc_allocator = {
+    .name = "libc",
+    .init = libc_init,
+    .malloc = malloc,
+    .realloc = realloc,
+    .free = free,
+    .deinit = libc_deinit,
+    .heap_bytes = libc_heap_bytes,
+};
+
+// ---------------------------------------------------------------------------
+// Trace readers
+// ---------------------------------------------------------------------------
+
+// Reads a CMU malloclab trace: a header of suggested heap size, number of
+// ids, number of operations and weight, then one "a id size", "r id size" or
+// "f id" per line.
+static void read_rep_trace(FILE *file, struct trace *trace) {
+    size_t heap_size, weight;
+    if (fscanf(file, "%zu %zu %zu %zu", &heap_size, &trace->num_ids,
+               &trace->num_ops, &weight) != 4) {
+        die("%s: bad .rep header", trace->name);
+    }
+    trace->ops = xcalloc(trace->num_ops, sizeof(trace->ops[0]));
+
+    for (size_t i = 0; i < trace->num_ops; i++) {
+        struct trace_op *op = &trace->ops[i];
+        char type;
+        if (fscanf(file, " %c %zu", &type, &op->id) != 2) {
+            die("%s: truncated .rep trace", trace->name);
+        }
+        if (op->id >= trace->num_ids) {
+            die("%s: id out of range", trace->name);
+        }
+        switch (type) {
+        case 'a':
+        case 'r':
+            op->type = type == 'a' ? OP_ALLOC : OP_REALLOC;
+            if (fscanf(file, "%zu", &op->size) != 1) {
+                die("%s: missing size", trace->name);
+            }
+            break;
+        case 'f':
+            op->type = OP_FREE;
+            break;
+        default:
+            die("%s: unknown .rep operation", trace->name);
+        }
+    }
+}
+
+// Maps the payload pointers of a binary trace to block ids, with open
+// addressing. Freed entries keep their key as a tombstone with id SIZE_MAX.
+struct ptr_map {
+    uint64_t *keys;
+    size_t *ids;
+    size_t mask;
+};
+
+static size_t ptr_map_slot(const struct ptr_map *map, uint64_t ptr) {
+    size_t slot = (size_t)((ptr * 0x9e3779b97f4a7c15ULL) >> 32) & map->mask;
+    while (map->keys[slot] != 0 && map->keys[slot] != ptr) {
+        slot = (slot + 1) & map->mask;
+    }
+    return slot;
+}
+
+// Sort key of an event: its timestamp, then its position in the file, which
+// keeps a thread's events in order when the counter did not tick between them
+struct event_key {
+    uint64_t timestamp;
+    size_t index;
+};
+
+static int compare_event_keys(const void *a, const void *b) {
+    const struct event_key *x = a;
+    const struct event_key *y = b;
+    if (x->timestamp != y->timestamp) {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Reads a trace written by mm_trace_start. Events are merged across threads
+// by timestamp. Failed allocations, failed expansions and frees of blocks
+// allocated before tracing started are skipped; a successful mm_expand is
+// replayed as a realloc to the new usable size.
+static void read_binary_trace(FILE *file, struct trace *trace) {
+    struct mm_trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != MM_TRACE_MAGIC ||
+        header.version != MM_TRACE_VERSION ||
+        header.event_size != sizeof(struct mm_trace_event)) {
+        die("%s: bad trace header", trace->name);
+    }
+
+    size_t capacity = 1024, num_events = 0;
+    struct mm_trace_event *events = xcalloc(capacity, sizeof(events[0]));
+    for (;;) {
+        if (num_events == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(events[0]));
+            if (events == NULL) {
+                die("out of memory");
+            }
+        }
+        const size_t n = fread(
+            &events[num_events], sizeof(events[0]), capacity - num_events,
+            file);
+        num_events += n;
+        if (n == 0) {
+            break;
+        }
+    }
+    struct event_key *keys = xcalloc(num_events, sizeof(keys[0]));
+    for (size_t i = 0; i < num_events; i++) {
+        keys[i] = (struct event_key){events[i].timestamp, i};
+    }
+    qsort(keys, num_events, sizeof(keys[0]), compare_event_keys);
+
+    struct ptr_map map;
+    size_t slots = 16;
+    while (slots < 2 * num_events) {
+        slots *= 2;
+    }
+    map.keys = xcalloc(slots, sizeof(map.keys[0]));
+    map.ids = xcalloc(slots, sizeof(map.ids[0]));
+    map.mask = slots - 1;
+
+    trace->num_ids = 0;
+    trace->num_ops = 0;
+    trace->ops = xcalloc(num_events, sizeof(trace->ops[0]));
+    for (size_t i = 0; i < num_events; i++) {
+        const struct mm_trace_event *event = &events[keys[i].index];
+        if (event->ptr == 0) {
+            continue;
+        }
+        const size_t slot = ptr_map_slot(&map, event->ptr);
+        const int live = map.keys[slot] == event->ptr &&
+                         map.ids[slot] != SIZE_MAX;
+        struct trace_op *op = &trace->ops[trace->num_ops];
+
+        switch (event->op) {
+        case MM_TRACE_MALLOC:
+            map.keys[slot] = event->ptr;
+            map.ids[slot] = trace->num_ids++;
+            *op = (struct trace_op){OP_ALLOC, map.ids[slot], event->size};
+            break;
+        case MM_TRACE_FREE:
+            if (!live) {
+                continue;
+            }
+            *op = (struct trace_op){OP_FREE, map.ids[slot], 0};
+            map.ids[slot] = SIZE_MAX;
+            break;
+        case MM_TRACE_EXPAND:
+            if (!live || event->size == 0) {
+                continue;
+            }
+            *op = (struct trace_op){OP_REALLOC, map.ids[slot], event->size};
+            break;
+        default:
+            die("%s: unknown trace operation", trace->name);
+        }
+        trace->num_ops++;
+    }
+
+    free(map.keys);
+    free(map.ids);
+    free(keys);
+    free(events);
+}
+
+static void read_trace(const char *path, struct trace *trace) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        die("cannot open %s", path);
+    }
+    trace->name = path;
+
+    uint64_t magic = 0;
+    const int is_binary =
+        fread(&magic, sizeof(magic), 1, file) == 1 && magic == MM_TRACE_MAGIC;
+    rewind(file);
+    if (is_binary) {
+        read_binary_trace(file, trace);
+    } else {
+        read_rep_trace(file, trace);
+    }
+    fclose(file);
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+
+struct result {
+    double ops_per_sec;
+    size_t peak_heap_bytes;
+    size_t peak_live_bytes;
+};
+
+// Byte written at both ends of each block in the utilization pass, so a
+// block that is overwritten by a neighbor is noticed when it is released
+static unsigned char fill_byte(size_t id) {
+    return (unsigned char)(id * 31 + 7);
+}
+
+static void check_fill(const struct trace *trace, const unsigned char *ptr,
+                       size_t id, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (ptr[0] != fill_byte(id) || ptr[size - 1] != fill_byte(id)) {
+        die("%s: block %zu was overwritten", trace->name, id);
+    }
+}
+
+// Runs the trace once. With `measure` set, also checks block contents and
+// tracks the peak live bytes and heap size.
+static void replay_once(const struct allocator *alloc, const struct trace *trace,
+                        void **ptrs, size_t *sizes, int measure,
+                        struct result *result) {
+    size_t live_bytes = 0;
+    for (size_t i = 0; i < trace->num_ops; i++) {
+        const struct trace_op *op = &trace->ops[i];
+        void *ptr = ptrs[op->id];
+
+        switch (op->type) {
+        case OP_ALLOC:
+        case OP_REALLOC:
+            if (measure) {
+                check_fill(trace, ptr, op->id, sizes[op->id]);
+            }
+            ptr = op->type == OP_ALLOC ? alloc->malloc(op->size)
+                                       : alloc->realloc(ptr, op->size);
+            if (ptr == NULL && op->size > 0) {
+                die("%s: %s failed at operation %zu", trace->name,
+                    alloc->name, i);
+            }
+            if (measure) {
+                live_bytes += op->size - sizes[op->id];
+                if (op->size > 0) {
+                    ((unsigned char *)ptr)[0] = fill_byte(op->id);
+                    ((unsigned char *)ptr)[op->size - 1] = fill_byte(op->id);
+                }
+            }
+            ptrs[op->id] = ptr;
+            sizes[op->id] = op->size;
+            break;
+        case OP_FREE:
+            if (measure) {
+                check_fill(trace, ptr, op->id, sizes[op->id]);
+                live_bytes -= sizes[op->id];
+            }
+            alloc->free(ptr);
+            ptrs[op->id] = NULL;
+            sizes[op->id] = 0;
+            break;
+        }
+
+        if (measure) {
+            if (live_bytes > result->peak_live_bytes) {
+                result->peak_live_bytes = live_bytes;
+            }
+            result->peak_heap_bytes = alloc->heap_bytes();
+        }
+    }
+
+    // Release what the trace leaves allocated
+    for (size_t id = 0; id < trace->num_ids; id++) {
+        if (ptrs[id] != NULL) {
+            alloc->free(ptrs[id]);
+            ptrs[id] = NULL;
+        }
+        sizes[id] = 0;
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void replay(const struct allocator *alloc, const struct trace *trace,
+                   size_t arena_size, int iterations, struct result *result) {
+    void **ptrs = xcalloc(trace->num_ids, sizeof(ptrs[0]));
+    size_t *sizes = xcalloc(trace->num_ids, sizeof(sizes[0]));
+    memset(result, 0, sizeof(*result));
+
+    // Untimed pass for correctness and space
+    if (alloc->init(arena_size) != 0) {
+        die("%s: init failed (mm_errno %d)", alloc->name, get_mm_errno());
+    }
+    replay_once(alloc, trace, ptrs, sizes, 1, result);
+    alloc->deinit();
+
+    double elapsed = 0;
+    for (int i = 0; i < iterations; i++) {
+        if (alloc->init(arena_size) != 0) {
+            die("%s: init failed (mm_errno %d)", alloc->name, get_mm_errno());
+        }
+        const double start = now_seconds();
+        replay_once(alloc, trace, ptrs, sizes, 0, result);
+        elapsed += now_seconds() - start;
+        alloc->deinit();
+    }
+    result->ops_per_sec =
+        elapsed > 0 ? (double)trace->num_ops * iterations / elapsed : 0;
+
+    free(ptrs);
+    free(sizes);
+}
+
+// Highest tick count in a latency bucket (see MM_LATENCY_BUCKETS in mm.h)
+static uint64_t bucket_top(int bucket) {
+    if (bucket < 8) {
+        return (uint64_t)bucket;
+    }
+    return ((uint64_t)(5 + bucket % 4) << (bucket / 4 - 1)) - 1;
+}
+
+// Top of the bucket holding call number ceil(count * permille / 1000)
+static uint64_t percentile(const uint64_t counts[MM_LATENCY_BUCKETS],
+                           uint64_t count, uint64_t permille) {
+    const uint64_t rank = (count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < MM_LATENCY_BUCKETS - 1; bucket++) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return bucket_top(bucket);
+}
+
+// Replays the trace once more with latency timing on and prints, for each
+// operation, a row per non-empty size class and one for all classes. The
+// class rows' max is the top of their highest non-empty bucket; the "all"
+// row has the exact longest call.
+static void replay_latency(const struct trace *trace, size_t arena_size) {
+    void **ptrs = xcalloc(trace->num_ids, sizeof(ptrs[0]));
+    size_t *sizes = xcalloc(trace->num_ids, sizeof(sizes[0]));
+    struct result unused;
+    if (mm_bench_init(arena_size) != 0) {
+        die("mm: init failed (mm_errno %d)", get_mm_errno());
+    }
+    if (mm_latency_start() != 0) {
+        die("mm_latency_start failed (mm_errno %d)", get_mm_errno());
+    }
+    replay_once(&mm_allocator, trace, ptrs, sizes, 0, &unused);
+    mm_latency_stop();
+    struct mm_stats stats;
+    if (mm_get_stats(&stats) != 0) {
+        die("mm_get_stats failed (mm_errno %d)", get_mm_errno());
+    }
+    mm_deinit();
+
+    static const char *const op_names[MM_LATENCY_OPS] = {"malloc", "free"};
+    const double ns_per_tick = 1e9 / (double)stats.latency_counter_hz;
+    for (int op = 0; op < MM_LATENCY_OPS; op++) {
+        for (int size_class = 0; size_class <= NUM_SEG_LISTS; size_class++) {
+            uint64_t counts[MM_LATENCY_BUCKETS];
+            if (mm_latency_histogram(op, size_class, counts) != 0) {
+                die("mm_latency_histogram failed");
+            }
+            uint64_t count = 0;
+            int last = 0;
+            for (int i = 0; i < MM_LATENCY_BUCKETS; i++) {
+                count += counts[i];
+                if (counts[i] != 0) {
+                    last = i;
+                }
+            }
+            if (count == 0) {
+                continue;
+            }
+            char class_name[8];
+            uint64_t max = bucket_top(last);
+            if (size_class == NUM_SEG_LISTS) {
+                snprintf(class_name, sizeof(class_name), "all");
+                max = stats.latency[op].max;
+            } else {
+                snprintf(class_name, sizeof(class_name), "%d", size_class);
+            }
+            printf("  latency %-6s class %-3s %10llu %10.0f %10.0f %10.0f "
+                   "%10.0f\n",
+                   op_names[op], class_name, (unsigned long long)count,
+                   percentile(counts, count, 500) * ns_per_tick,
+                   percentile(counts, count, 990) * ns_per_tick,
+                   percentile(counts, count, 999) * ns_per_tick,
+                   max * ns_per_tick);
+        }
+    }
+
+    free(ptrs);
+    free(sizes);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: replay [-a mm|libc|both] [-n iterations] "
+            "[-s arena_bytes] [-p first|addr|next|best|wild|all] [-l] "
+            "trace...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const struct allocator *allocators[2] = {&mm_allocator, &libc_allocator};
+    size_t num_allocators = 1;
+    size_t arena_size = DEFAULT_ARENA_SIZE;
+    int iterations = DEFAULT_ITERATIONS;
+    int latency = 0;
+    // Placement policies to replay mm under; labeled only when -p is given
+    int first_policy = MM_PLACEMENT_FIRST_FIT;
+    int last_policy = MM_PLACEMENT_FIRST_FIT;
+    int label_policy = 0;
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        const char option = argv[arg][1];
+        if (option == 'l') {
+            latency = 1;
+            continue;
+        }
+        if (arg + 1 >= argc) {
+            usage();
+        }
+        const char *value = argv[++arg];
+        switch (option) {
+        case 'a':
+            if (strcmp(value, "mm") == 0) {
+                allocators[0] = &mm_allocator;
+                num_allocators = 1;
+            } else if (strcmp(value, "libc") == 0) {
+                allocators[0] = &libc_allocator;
+                num_allocators = 1;
+            } else if (strcmp(value, "both") == 0) {
+                num_allocators = 2;
+            } else {
+                usage();
+            }
+            break;
+        case 'n':
+            iterations = atoi(value);
+            break;
+        case 's':
+            arena_size = strtoul(value, NULL, 0);
+            break;
+        case 'p':
+            label_policy = 1;
+            first_policy = 0;
+            last_policy = MM_NUM_PLACEMENT_POLICIES - 1;
+            if (strcmp(value, "all") == 0) {
+                break;
+            }
+            while (first_policy < MM_NUM_PLACEMENT_POLICIES &&
+                   strcmp(value, policy_names[first_policy]) != 0) {
+                first_policy++;
+            }
+            if (first_policy == MM_NUM_PLACEMENT_POLICIES) {
+                usage();
+            }
+            last_policy = first_policy;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (arg == argc || iterations < 1) {
+        usage();
+    }
+
+    printf("%-32s %-8s %10s %14s %12s %7s\n", "trace", "alloc", "ops",
+           "ops/sec", "peak heap", "util");
+    if (latency) {
+        printf("  latency %-6s %-9s %10s %10s %10s %10s %10s\n", "op", "class",
+               "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    }
+    for (; arg < argc; arg++) {
+        struct trace trace;
+        read_trace(argv[arg], &trace);
+        for (size_t i = 0; i < num_allocators; i++) {
+            const int is_mm = allocators[i] == &mm_allocator;
+            const int last = is_mm ? last_policy : first_policy;
+            for (int policy = first_policy; policy <= last; policy++) {
+                placement_policy = policy;
+                struct result result;
+                replay(allocators[i], &trace, arena_size, iterations, &result);
+                const double util =
+                    result.peak_heap_bytes > 0
+                        ? 100.0 * result.peak_live_bytes /
+                              result.peak_heap_bytes
+                        : 0;
+                char name[16];
+                snprintf(name, sizeof(name), "%s%s%s", allocators[i]->name,
+                         is_mm && label_policy ? "/" : "",
+                         is_mm && label_policy ? policy_names[policy] : "");
+                printf("%-32s %-8s %10zu %14.0f %12zu %6.1f%%\n", trace.name,
+                       name, trace.num_ops, result.ops_per_sec,
+                       result.peak_heap_bytes, util);
+            }
+        }
+        if (latency) {
+            for (int policy = first_policy; policy <= last_policy; policy++) {
+                placement_policy = policy;
+                replay_latency(&trace, arena_size);
+            }
+        }
+        free(trace.ops);
+    }
+    return 0;
+}
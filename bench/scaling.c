@@ -0,0 +1,554 @@
+// Multi-threaded scalability benchmarks: larson, threadtest and xmalloc
+//
+// Ports of the classic allocator scalability benchmarks. Each runs at 1, 2,
+// ..., N threads against the allocator in src/ and glibc malloc, and reports
+// throughput (allocator calls per second, all threads together) and peak
+// memory. Every thread does the same amount of work at every thread count,
+// so on a scalable allocator throughput grows with the threads and memory
+// grows with the live data.
+//
+//   larson      Server-like: each thread replaces random blocks in an array
+//               of live blocks, and the arrays are handed to other threads
+//               between rounds, so blocks are freed by threads that did not
+//               allocate them.
+//   threadtest  Thread-local churn: each thread allocates a batch of blocks
+//               and frees them all, over and over.
+//   xmalloc     Producer/consumer: each thread allocates batches of blocks
+//               and pushes them onto a shared stack, then pops a batch
+//               (usually another thread's) and frees it.
+//
+// The allocator in src/ has no locking, so its calls go through a mutex:
+//   mm        mm_malloc and mm_free under one mutex
+//   mm-async  mm_malloc under the mutex; mm_free in asynchronous free mode
+//             (mm_set_async_free), which needs no lock
+//   libc      glibc malloc and free
+//
+// Each configuration runs in a child process, so glibc starts from a fresh
+// heap every time. Peak memory is the peak break for mm, and the memory
+// glibc has mapped for all its arenas after the run for libc.
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "mem.h"
+#include "mm.h"
+#include "mm_errno.h"
+
+#define DEFAULT_ARENA_SIZE (256UL << 20)
+#define DEFAULT_OPS 100000
+
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define LARSON_MIN_SIZE 10
+#define LARSON_MAX_SIZE 500
+
+#define THREADTEST_OBJECTS 1000
+#define THREADTEST_SIZE 64
+
+#define XMALLOC_BATCH 64
+#define XMALLOC_MIN_SIZE 8
+#define XMALLOC_MAX_SIZE 256
+
+// Allocator under test
+struct allocator {
+    const char *name;
+    int (*init)(size_t arena_size);
+    void (*thread_init)(void);  // Called by each worker before it starts
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void (*deinit)(void);
+    size_t (*peak_bytes)(void);
+};
+
+struct benchmark {
+    const char *name;
+    void *(*worker)(void *arg);
+    void (*setup)(void);     // Before the threads start (untimed)
+    void (*teardown)(void);  // After peak memory is read (untimed)
+};
+
+struct result {
+    double ops_per_sec;
+    size_t peak_bytes;
+};
+
+static void die(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "scaling: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+// ---------------------------------------------------------------------------
+// Allocators
+// ---------------------------------------------------------------------------
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int mm_bench_init(size_t arena_size) {
+    return mm_init(arena_size);
+}
+
+static void mm_bench_thread_init(void) {
+}
+
+static void *mm_locked_malloc(size_t size) {
+    pthread_mutex_lock(&mm_lock);
+    void *ptr = mm_malloc(size);
+    pthread_mutex_unlock(&mm_lock);
+    return ptr;
+}
+
+static void mm_locked_free(void *ptr) {
+    pthread_mutex_lock(&mm_lock);
+    mm_free(ptr);
+    pthread_mutex_unlock(&mm_lock);
+}
+
+static void mm_async_thread_init(void) {
+    mm_set_async_free(1);
+}
+
+static void mm_bench_deinit(void) {
+    mm_deinit();
+}
+
+static size_t mm_bench_peak_bytes(void) {
+    return (size_t)((const char *)mem_get_peak_brk() -
+                    (const char *)_get_mem_heap_start());
+}
+
+static const struct allocator mm_allocator = {
+    .name = "mm",
+    .init = mm_bench_init,
+    .thread_init = mm_bench_thread_init,
+    .malloc = mm_locked_malloc,
+    .free = mm_locked_free,
+    .deinit = mm_bench_deinit,
+    .peak_bytes = mm_bench_peak_bytes,
+};
+
+static const struct allocator mm_async_allocator = {
+    .name = "mm-async",
+    .init = mm_bench_init,
+    .thread_init = mm_async_thread_init,
+    .malloc = mm_locked_malloc,
+    .free = mm_free,
+    .deinit = mm_bench_deinit,
+    .peak_bytes = mm_bench_peak_bytes,
+};
+
+static size_t libc_base_bytes;
+
+static int libc_init(size_t arena_size) {
+    (void)arena_size;
+    const struct mallinfo2 info = mallinfo2();
+    libc_base_bytes = info.arena + info.hblkhd;
+    return 0;
+}
+
+static void libc_thread_init(void) {
+}
+
+static void libc_deinit(void) {
+}
+
+// Memory mapped for all arenas, minus what was mapped before the run
+static size_t libc_peak_bytes(void) {
+    const struct mallinfo2 info = mallinfo2();
+    const size_t mapped = info.arena + info.hblkhd;
+    return mapped > libc_base_bytes ? mapped - libc_base_bytes : 0;
+}
+
+static const struct allocator libc_allocator = {
+    .name = "libc",
+    .init = libc_init,
+    .thread_init = libc_thread_init,
+    .malloc = malloc,
+    .free = free,
+    .deinit = libc_deinit,
+    .peak_bytes = libc_peak_bytes,
+};
+
+// ---------------------------------------------------------------------------
+// Shared benchmark state
+// ---------------------------------------------------------------------------
+
+static const struct allocator *alloc;
+static size_t num_threads;
+static size_t ops_per_thread;
+static pthread_barrier_t barrier;
+
+struct worker {
+    pthread_t thread;
+    size_t id;
+    uint64_t rng;
+    size_t ops;  // Allocator calls made
+};
+
+static struct worker *workers;
+
+// Every worker is ready after the first wait; the driver reads the clock
+// before joining the second one, which starts them
+static void wait_for_start(void) {
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+}
+
+static uint64_t rng_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static size_t random_size(uint64_t *state, size_t min, size_t max) {
+    return min + rng_next(state) % (max - min + 1);
+}
+
+// Allocates and writes the first and last byte, as a real caller would
+static void *bench_malloc(struct worker *self, size_t size) {
+    unsigned char *ptr = alloc->malloc(size);
+    if (ptr == NULL) {
+        die("%s: malloc(%zu) failed (mm_errno %d)", alloc->name, size,
+            get_mm_errno());
+    }
+    ptr[0] = (unsigned char)size;
+    ptr[size - 1] = (unsigned char)size;
+    self->ops++;
+    return ptr;
+}
+
+static void bench_free(struct worker *self, void *ptr) {
+    alloc->free(ptr);
+    self->ops++;
+}
+
+// ---------------------------------------------------------------------------
+// larson
+// ---------------------------------------------------------------------------
+
+// One array of live blocks per thread. In round r, thread i works on array
+// (i + r) % num_threads.
+static void **larson_slots;
+
+static void larson_setup(void) {
+    larson_slots = calloc(num_threads * LARSON_SLOTS, sizeof(void *));
+    if (larson_slots == NULL) {
+        die("out of memory");
+    }
+    uint64_t rng = 1;
+    for (size_t i = 0; i < num_threads * LARSON_SLOTS; i++) {
+        larson_slots[i] = alloc->malloc(
+            random_size(&rng, LARSON_MIN_SIZE, LARSON_MAX_SIZE));
+        if (larson_slots[i] == NULL) {
+            die("%s: setup allocation failed", alloc->name);
+        }
+    }
+}
+
+static void *larson_worker(void *arg) {
+    struct worker *self = arg;
+    alloc->thread_init();
+    wait_for_start();
+    const size_t per_round = ops_per_thread / (2 * LARSON_ROUNDS);
+    for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+        void **slots =
+            &larson_slots[(self->id + round) % num_threads * LARSON_SLOTS];
+        for (size_t i = 0; i < per_round; i++) {
+            const size_t slot = rng_next(&self->rng) % LARSON_SLOTS;
+            bench_free(self, slots[slot]);
+            slots[slot] = bench_malloc(
+                self, random_size(&self->rng, LARSON_MIN_SIZE, LARSON_MAX_SIZE));
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+static void larson_teardown(void) {
+    for (size_t i = 0; i < num_threads * LARSON_SLOTS; i++) {
+        alloc->free(larson_slots[i]);
+    }
+    free(larson_slots);
+}
+
+// ---------------------------------------------------------------------------
+// threadtest
+// ---------------------------------------------------------------------------
+
+static void *threadtest_worker(void *arg) {
+    struct worker *self = arg;
+    void *objects[THREADTEST_OBJECTS];
+    alloc->thread_init();
+    wait_for_start();
+    const size_t iterations = ops_per_thread / (2 * THREADTEST_OBJECTS);
+    for (size_t iter = 0; iter < iterations; iter++) {
+        for (size_t i = 0; i < THREADTEST_OBJECTS; i++) {
+            objects[i] = bench_malloc(self, THREADTEST_SIZE);
+        }
+        for (size_t i = 0; i < THREADTEST_OBJECTS; i++) {
+            bench_free(self, objects[i]);
+        }
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// xmalloc
+// ---------------------------------------------------------------------------
+
+// A batch is allocated by the allocator under test, like its blocks
+struct batch {
+    struct batch *next;
+    void *blocks[XMALLOC_BATCH];
+};
+
+static pthread_mutex_t xmalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct batch *xmalloc_stack;
+
+static void xmalloc_push(struct batch *batch) {
+    pthread_mutex_lock(&xmalloc_lock);
+    batch->next = xmalloc_stack;
+    xmalloc_stack = batch;
+    pthread_mutex_unlock(&xmalloc_lock);
+}
+
+static struct batch *xmalloc_pop(void) {
+    pthread_mutex_lock(&xmalloc_lock);
+    struct batch *batch = xmalloc_stack;
+    if (batch != NULL) {
+        xmalloc_stack = batch->next;
+    }
+    pthread_mutex_unlock(&xmalloc_lock);
+    return batch;
+}
+
+static void xmalloc_free_batch(struct worker *self, struct batch *batch) {
+    for (size_t i = 0; i < XMALLOC_BATCH; i++) {
+        bench_free(self, batch->blocks[i]);
+    }
+    bench_free(self, batch);
+}
+
+static void xmalloc_setup(void) {
+    xmalloc_stack = NULL;
+}
+
+static void *xmalloc_worker(void *arg) {
+    struct worker *self = arg;
+    alloc->thread_init();
+    wait_for_start();
+    const size_t batches = ops_per_thread / (2 * (XMALLOC_BATCH + 1));
+    for (size_t n = 0; n < batches; n++) {
+        struct batch *batch = bench_malloc(self, sizeof(*batch));
+        for (size_t i = 0; i < XMALLOC_BATCH; i++) {
+            batch->blocks[i] = bench_malloc(
+                self, random_size(&self->rng, XMALLOC_MIN_SIZE, XMALLOC_MAX_SIZE));
+        }
+        xmalloc_push(batch);
+        batch = xmalloc_pop();
+        if (batch != NULL) {
+            xmalloc_free_batch(self, batch);
+        }
+    }
+    return NULL;
+}
+
+static void xmalloc_teardown(void) {
+    struct worker self = {0};
+    struct batch *batch;
+    while ((batch = xmalloc_pop()) != NULL) {
+        xmalloc_free_batch(&self, batch);
+    }
+}
+
+static void no_setup(void) {
+}
+
+static const struct benchmark benchmarks[] = {
+    {"larson", larson_worker, larson_setup, larson_teardown},
+    {"threadtest", threadtest_worker, no_setup, no_setup},
+    {"xmalloc", xmalloc_worker, xmalloc_setup, xmalloc_teardown},
+};
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Runs one benchmark at one thread count in this process. The clock starts
+// once every worker is ready and stops when the last one has finished.
+static void run_here(const struct benchmark *bench, size_t arena_size,
+                     struct result *result) {
+    if (alloc->init(arena_size) != 0) {
+        die("%s: init failed (mm_errno %d)", alloc->name, get_mm_errno());
+    }
+    bench->setup();
+    workers = calloc(num_threads, sizeof(*workers));
+    if (workers == NULL) {
+        die("out of memory");
+    }
+    pthread_barrier_init(&barrier, NULL, (unsigned)num_threads + 1);
+    for (size_t i = 0; i < num_threads; i++) {
+        workers[i].id = i;
+        workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, bench->worker,
+                           &workers[i]) != 0) {
+            die("pthread_create failed");
+        }
+    }
+    pthread_barrier_wait(&barrier);
+    const double start = now_seconds();
+    pthread_barrier_wait(&barrier);
+    // larson's workers also wait at the end of every round
+    if (bench->worker == larson_worker) {
+        for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+            pthread_barrier_wait(&barrier);
+        }
+    }
+    size_t ops = 0;
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+    const double elapsed = now_seconds() - start;
+    result->ops_per_sec = elapsed > 0 ? (double)ops / elapsed : 0;
+    result->peak_bytes = alloc->peak_bytes();
+
+    bench->teardown();
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    alloc->deinit();
+}
+
+// Runs run_here in a child process and collects its result through a pipe
+static void run(const struct benchmark *bench, size_t arena_size,
+                struct result *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        die("pipe failed");
+    }
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        die("fork failed");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        run_here(bench, arena_size, result);
+        const ssize_t written = write(fds[1], result, sizeof(*result));
+        _exit(written == (ssize_t)sizeof(*result) ? 0 : 1);
+    }
+    close(fds[1]);
+    const ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || got != (ssize_t)sizeof(*result)) {
+        die("%s %s with %zu threads failed", bench->name, alloc->name,
+            num_threads);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: scaling [-b larson|threadtest|xmalloc|all] "
+            "[-a mm|mm-async|libc|all] [-t max_threads] "
+            "[-n ops_per_thread] [-s arena_bytes]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const struct allocator *allocators[3] = {&mm_allocator, &mm_async_allocator,
+                                             &libc_allocator};
+    size_t num_allocators = 3;
+    const struct benchmark *selected[3] = {&benchmarks[0], &benchmarks[1],
+                                           &benchmarks[2]};
+    size_t num_benchmarks = 3;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t arena_size = DEFAULT_ARENA_SIZE;
+    ops_per_thread = DEFAULT_OPS;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] != '-' || arg + 1 >= argc) {
+            usage();
+        }
+        const char option = argv[arg][1];
+        const char *value = argv[++arg];
+        switch (option) {
+        case 'a':
+            if (strcmp(value, "mm") == 0) {
+                num_allocators = 1;
+            } else if (strcmp(value, "mm-async") == 0) {
+                allocators[0] = &mm_async_allocator;
+                num_allocators = 1;
+            } else if (strcmp(value, "libc") == 0) {
+                allocators[0] = &libc_allocator;
+                num_allocators = 1;
+            } else if (strcmp(value, "all") != 0) {
+                usage();
+            }
+            break;
+        case 'b':
+            if (strcmp(value, "all") != 0) {
+                num_benchmarks = 0;
+                for (size_t i = 0; i < 3; i++) {
+                    if (strcmp(value, benchmarks[i].name) == 0) {
+                        selected[num_benchmarks++] = &benchmarks[i];
+                    }
+                }
+                if (num_benchmarks == 0) {
+                    usage();
+                }
+            }
+            break;
+        case 't':
+            max_threads = atol(value);
+            break;
+        case 'n':
+            ops_per_thread = strtoul(value, NULL, 0);
+            break;
+        case 's':
+            arena_size = strtoul(value, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (max_threads < 1 || ops_per_thread == 0) {
+        usage();
+    }
+
+    printf("%-10s %-8s %7s %14s %12s\n", "benchmark", "alloc", "threads",
+           "ops/sec", "peak memory");
+    for (size_t b = 0; b < num_benchmarks; b++) {
+        for (size_t a = 0; a < num_allocators; a++) {
+            alloc = allocators[a];
+            for (num_threads = 1; num_threads <= (size_t)max_threads;
+                 num_threads++) {
+                struct result result;
+                run(selected[b], arena_size, &result);
+                printf("%-10s %-8s %7zu %14.0f %12zu\n", selected[b]->name,
+                       alloc->name, num_threads, result.ops_per_sec,
+                       result.peak_bytes);
+            }
+        }
+    }
+    return 0;
+}
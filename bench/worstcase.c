@@ -0,0 +1,267 @@
+// Worst-case latency of single allocator calls on adversarial heaps
+//
+// Times every call with the virtual counter (CNTVCT_EL0) and reports the
+// median and the longest, in counter ticks and nanoseconds. The scenarios
+// build heaps on which a free-list search is as long as it can get, at a
+// growing number of free blocks, so a bounded engine shows flat maxima and
+// an unbounded one maxima that grow with the heap. Build the library with
+// ENGINE=tlsf (see config.mk) to compare the engines.
+//
+//   miss       L free 80-byte blocks, each pinned between allocated ones,
+//              then mm_malloc(72), whose 96-byte block is in the same
+//              segregated class but fits none of them; each block is freed
+//              again before the next call, so every call sees the same heap
+//   churn      L live blocks of random sizes, replaced one at a time in
+//              random order; times every mm_malloc and mm_free
+//   coalesce   mm_free of blocks whose neighbors are both free
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mm.h"
+
+#define ARENA_SIZE (512UL << 20)
+#define DEFAULT_CALLS 2000
+
+static const size_t default_lengths[] = {100, 1000, 10000, 100000};
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t counter(void) {
+    uint64_t ticks;
+    __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) : : "memory");
+    return ticks;
+}
+
+static uint64_t counter_hz(void) {
+    uint64_t hz;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(hz));
+    return hz;
+}
+
+// Call durations of one operation in one scenario
+struct timings {
+    uint64_t *ticks;
+    size_t count;
+    size_t capacity;
+};
+
+static void *xmalloc(size_t size) {
+    void *ptr = mm_malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "worstcase: mm_malloc(%zu) failed\n", size);
+        exit(1);
+    }
+    return ptr;
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *ptr = calloc(n, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "worstcase: out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void record(struct timings *t, uint64_t ticks) {
+    if (t->count < t->capacity) {
+        t->ticks[t->count++] = ticks;
+    }
+}
+
+static void *timed_malloc(struct timings *t, size_t size) {
+    const uint64_t start = counter();
+    void *ptr = mm_malloc(size);
+    record(t, counter() - start);
+    if (ptr == NULL) {
+        fprintf(stderr, "worstcase: mm_malloc(%zu) failed\n", size);
+        exit(1);
+    }
+    return ptr;
+}
+
+static void timed_free(struct timings *t, void *ptr) {
+    const uint64_t start = counter();
+    mm_free(ptr);
+    record(t, counter() - start);
+}
+
+static void run_miss(size_t length, size_t calls, struct timings *malloc_t,
+                     struct timings *free_t) {
+    void **pinned = xcalloc(length, sizeof(pinned[0]));
+    void **holes = xcalloc(length, sizeof(holes[0]));
+    for (size_t i = 0; i < length; i++) {
+        holes[i] = xmalloc(64);
+        pinned[i] = xmalloc(16);
+    }
+    for (size_t i = 0; i < length; i++) {
+        mm_free(holes[i]);
+    }
+    for (size_t i = 0; i < calls; i++) {
+        timed_free(free_t, timed_malloc(malloc_t, 72));
+    }
+    free(pinned);
+    free(holes);
+}
+
+static void run_churn(size_t length, size_t calls, struct timings *malloc_t,
+                      struct timings *free_t) {
+    void **live = xcalloc(length, sizeof(live[0]));
+    for (size_t i = 0; i < length; i++) {
+        live[i] = xmalloc(16 + rng_next() % 2000);
+    }
+    for (size_t i = 0; i < calls; i++) {
+        const size_t slot = rng_next() % length;
+        timed_free(free_t, live[slot]);
+        live[slot] = timed_malloc(malloc_t, 16 + rng_next() % 2000);
+    }
+    free(live);
+}
+
+static void run_coalesce(size_t length, size_t calls, struct timings *malloc_t,
+                         struct timings *free_t) {
+    (void)malloc_t;
+    if (calls > length) {
+        calls = length;
+    }
+    // Blocks a b c per triple; a and c are freed first, then b is timed
+    void **blocks = xcalloc(3 * calls, sizeof(blocks[0]));
+    for (size_t i = 0; i < 3 * calls; i++) {
+        blocks[i] = xmalloc(48);
+    }
+    void *guard = xmalloc(48);
+    for (size_t i = 0; i < calls; i++) {
+        mm_free(blocks[3 * i]);
+        mm_free(blocks[3 * i + 2]);
+    }
+    for (size_t i = 0; i < calls; i++) {
+        timed_free(free_t, blocks[3 * i + 1]);
+    }
+    mm_free(guard);
+    free(blocks);
+}
+
+struct scenario {
+    const char *name;
+    void (*run)(size_t length, size_t calls, struct timings *malloc_t,
+                struct timings *free_t);
+};
+
+static const struct scenario scenarios[] = {
+    {"miss", run_miss},
+    {"churn", run_churn},
+    {"coalesce", run_coalesce},
+};
+
+static int compare_ticks(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *scenario, size_t length, const char *op,
+                   struct timings *t, double ns_per_tick) {
+    if (t->count == 0) {
+        return;
+    }
+    qsort(t->ticks, t->count, sizeof(t->ticks[0]), compare_ticks);
+    const uint64_t median = t->ticks[t->count / 2];
+    const uint64_t max = t->ticks[t->count - 1];
+    printf("%-9s %8zu %-6s %8zu %10llu %10llu %12.0f\n", scenario, length, op,
+           t->count, (unsigned long long)median, (unsigned long long)max,
+           max * ns_per_tick);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: worstcase [-c calls] [-s miss|churn|coalesce|all] "
+            "[free_blocks...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    size_t calls = DEFAULT_CALLS;
+    const char *only = "all";
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (arg + 1 >= argc) {
+            usage();
+        }
+        const char option = argv[arg][1];
+        const char *value = argv[++arg];
+        switch (option) {
+        case 'c':
+            calls = strtoul(value, NULL, 0);
+            break;
+        case 's':
+            only = value;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (calls == 0) {
+        usage();
+    }
+
+    size_t num_lengths = sizeof(default_lengths) / sizeof(default_lengths[0]);
+    size_t *lengths = xcalloc(num_lengths, sizeof(lengths[0]));
+    memcpy(lengths, default_lengths, sizeof(default_lengths));
+    if (arg < argc) {
+        num_lengths = (size_t)(argc - arg);
+        free(lengths);
+        lengths = xcalloc(num_lengths, sizeof(lengths[0]));
+        for (size_t i = 0; i < num_lengths; i++) {
+            lengths[i] = strtoul(argv[arg + i], NULL, 0);
+            if (lengths[i] == 0) {
+                usage();
+            }
+        }
+    }
+
+    const double ns_per_tick = 1e9 / (double)counter_hz();
+    struct timings malloc_t = {xcalloc(calls, sizeof(uint64_t)), 0, calls};
+    struct timings free_t = {xcalloc(calls, sizeof(uint64_t)), 0, calls};
+    int ran = 0;
+
+    printf("%-9s %8s %-6s %8s %10s %10s %12s\n", "scenario", "blocks", "op",
+           "calls", "median", "max", "max ns");
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        if (strcmp(only, "all") != 0 && strcmp(only, scenarios[s].name) != 0) {
+            continue;
+        }
+        ran = 1;
+        for (size_t i = 0; i < num_lengths; i++) {
+            if (mm_init(ARENA_SIZE) != 0) {
+                fprintf(stderr, "worstcase: mm_init failed\n");
+                return 1;
+            }
+            malloc_t.count = 0;
+            free_t.count = 0;
+            scenarios[s].run(lengths[i], calls, &malloc_t, &free_t);
+            report(scenarios[s].name, lengths[i], "malloc", &malloc_t,
+                   ns_per_tick);
+            report(scenarios[s].name, lengths[i], "free", &free_t,
+                   ns_per_tick);
+            mm_deinit();
+        }
+    }
+    if (!ran) {
+        usage();
+    }
+
+    free(malloc_t.ticks);
+    free(free_t.ticks);
+    free(lengths);
+    return 0;
+}
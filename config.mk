@@ -5,8 +5,33 @@
 # Default build mode is debug
 BUILD ?= debug
 
+# Free-list engine: seglist (first fit over 8 segregated lists), tlsf
+# (two-level segregated fit, O(1) mm_malloc and mm_free) or buddy (seglist
+# plus a binary buddy zone for power-of-two requests). Engines other than
+# seglist build into their own directory, e.g. ../build/release-tlsf.
+ENGINE ?= seglist
+
+# Where free blocks keep their list links: inline (in the payload) or side
+# (in a table beside the arena, so list operations never touch the
+# payload). Works with any ENGINE; side builds add -side to the build
+# directory, e.g. ../build/release-tlsf-side.
+LINKS ?= inline
+
+# How boundary tags and inline links are stored: wide (64-bit tags and
+# pointers) or compact (32-bit tags and 32-bit offsets from the heap start,
+# which halves the minimum block to 16 bytes but caps the arena at 4 GiB).
+# Compact builds add -compact to the build directory and need LINKS=inline.
+LAYOUT ?= wide
+ifeq ($(LAYOUT)$(LINKS),compactside)
+$(error LAYOUT=compact keeps its 32-bit links inline and needs LINKS=inline)
+endif
+
 # Directories
-BUILDDIR = ../build/$(BUILD)
+BUILDDIR = ../build/$(BUILD)$(BUILDDIR_SUFFIX_$(ENGINE))$(BUILDDIR_SUFFIX_$(LINKS))$(BUILDDIR_SUFFIX_$(LAYOUT))
+BUILDDIR_SUFFIX_tlsf = -tlsf
+BUILDDIR_SUFFIX_buddy = -buddy
+BUILDDIR_SUFFIX_side = -side
+BUILDDIR_SUFFIX_compact = -compact
 SRCDIR = ../src
 INCLUDEDIR = ../include
 
@@ -14,13 +39,24 @@ INCLUDEDIR = ../include
 CC = aarch64-linux-gnu-gcc
 AS = aarch64-linux-gnu-as
 AR = aarch64-linux-gnu-ar
+NM = aarch64-linux-gnu-nm
 
 # Flags per mode
 CFLAGS_debug = -Wall -O0 -g -I$(INCLUDEDIR) -MMD -MP
-CFLAGS_release = -Wall -O2 -DNDEBUG -I$(INCLUDEDIR)
-ASFLAGS_debug = -g
+CFLAGS_release = -Wall -O2 -fno-omit-frame-pointer -DNDEBUG -I$(INCLUDEDIR)
+ASFLAGS_debug = -g --defsym MM_DEBUG=1
 ASFLAGS_release =
+ASFLAGS_tlsf = --defsym MM_TLSF=1
+ASFLAGS_buddy = --defsym MM_BUDDY=1
+ASFLAGS_side = --defsym MM_SIDE_TABLE=1
+ASFLAGS_compact = --defsym MM_COMPACT=1
+CPPFLAGS_tlsf = -DMM_TLSF
+CPPFLAGS_buddy = -DMM_BUDDY
+CPPFLAGS_side = -DMM_SIDE_TABLE
+CPPFLAGS_compact = -DMM_COMPACT
 
-# Select flags based on BUILD
+# Select flags based on BUILD, ENGINE, LINKS and LAYOUT. CPPFLAGS lets the unit
+# tests enable the suites of the selected engine.
 CFLAGS = $(CFLAGS_$(BUILD))
-ASFLAGS = $(ASFLAGS_$(BUILD))
\ No newline at end of file
+ASFLAGS = $(ASFLAGS_$(BUILD)) $(ASFLAGS_$(ENGINE)) $(ASFLAGS_$(LINKS)) $(ASFLAGS_$(LAYOUT))
+CPPFLAGS = $(CPPFLAGS_$(ENGINE)) $(CPPFLAGS_$(LINKS)) $(CPPFLAGS_$(LAYOUT))
\ No newline at end of file
@@ -8,6 +8,12 @@
 
 #define MEM_SBRK_FAILED ((void *)-1)
 
+// Owner tags of the page map, see mem_page_owner()
+// Keep in sync with src/mem_page_map.inc
+#define MEM_OWNER_NONE 0
+#define MEM_OWNER_HEAP 1
+#define MEM_OWNER_BUDDY 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -24,6 +30,20 @@ void *mem_sbrk(intptr_t increment);
 // Returns 0 on success, or -1 on failure.
 int mem_deinit(void);
 
+// Returns the highest program break reached since mem_init.
+const void *mem_get_peak_brk(void);
+
+// Returns the number of mem_sbrk calls since mem_init.
+size_t mem_get_sbrk_calls(void);
+
+// Returns the number of arena mmap syscalls issued by the memory layer.
+// Nodes of the page map are not counted.
+size_t mem_get_mmap_calls(void);
+
+// Returns the MEM_OWNER_* tag of the page holding `ptr`: MEM_OWNER_HEAP for
+// the arena, MEM_OWNER_BUDDY for the buddy zone, MEM_OWNER_NONE otherwise.
+int mem_page_owner(const void *ptr);
+
 // Returns the start address of the heap memory region.
 // NOTE: Used for testing only.
 const void *_get_mem_heap_start(void);
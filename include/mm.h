@@ -12,11 +12,262 @@
 extern "C" {
 #endif
 
+// Indices into mm_stats.coalesce_cases, matching the _coalesce jump table:
+// (next allocated << 1) | prev allocated
+#define MM_COALESCE_NEITHER_ALLOCATED 0
+#define MM_COALESCE_ONLY_PREV_ALLOCATED 1
+#define MM_COALESCE_ONLY_NEXT_ALLOCATED 2
+#define MM_COALESCE_BOTH_ALLOCATED 3
+#define MM_NUM_COALESCE_CASES 4
+
+// Latency histograms kept while mm_latency_start is on. Calls are timed with
+// CNTVCT_EL0, in ticks of mm_stats.latency_counter_hz per second. Bucket
+// i < 8 counts calls of exactly i ticks; above that each power of two
+// [2^e, 2^(e+1)) is split into four buckets, and a call of t ticks lands in
+// 4 * (e - 1) + (t >> (e - 2)) % 4. The last bucket also counts everything
+// longer.
+#define MM_LATENCY_MALLOC 0  // mm_malloc
+#define MM_LATENCY_FREE 1    // mm_free and mm_free_sized
+#define MM_LATENCY_OPS 2
+#define MM_LATENCY_BUCKETS 192
+#define MM_LATENCY_MAX_THREADS 64  // Later threads share the last histogram
+
+// Placement policies for mm_set_placement_policy. They apply to the size
+// classes below the last one, whose blocks always go to the best-fitting
+// free block of the size tree.
+#define MM_PLACEMENT_FIRST_FIT 0        // LIFO lists, first fit (default)
+#define MM_PLACEMENT_ADDRESS_ORDERED 1  // Lists sorted by address, first fit
+#define MM_PLACEMENT_NEXT_FIT 2         // LIFO lists, first fit from a rover
+#define MM_PLACEMENT_BEST_FIT 3         // LIFO lists, smallest fit in a class
+#define MM_PLACEMENT_WILDERNESS 4       // First fit, top block last, with a
+                                        // last-remainder cache
+#define MM_NUM_PLACEMENT_POLICIES 5
+
+// Latency percentiles of one operation, in ticks. Each percentile is the
+// highest value of the bucket it falls in, capped at `max`.
+struct mm_latency_summary {
+    uint64_t count;  // Calls timed
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;    // Longest call
+};
+
+// Allocator statistics filled in by mm_get_stats. Byte counts are block sizes,
+// boundary tags included. The layout is mirrored by mm_stats_constants.inc.
+struct mm_stats {
+    size_t heap_bytes;                     // Current heap size
+    size_t peak_heap_bytes;                // Largest heap size since mm_init
+    size_t allocated_bytes;                // Bytes in allocated blocks
+    size_t allocated_blocks;               // Number of allocated blocks
+    size_t free_bytes[NUM_SEG_LISTS];      // Free bytes per power-of-two class
+    size_t free_blocks[NUM_SEG_LISTS];     // Free blocks per power-of-two class
+    size_t sbrk_calls;                     // mem_sbrk calls since mm_init
+    size_t mmap_calls;                     // mmap syscalls issued, ever
+    size_t coalesce_cases[MM_NUM_COALESCE_CASES];  // Frees per _coalesce case
+    uint64_t latency_counter_hz;           // CNTFRQ_EL0, latency ticks per second
+    struct mm_latency_summary latency[MM_LATENCY_OPS];  // All threads and classes
+    size_t placement_policy;               // MM_PLACEMENT_* in use
+};
+
 int mm_init(size_t arena_size);
 int mm_deinit(void);
 void *mm_malloc(size_t size);
 void mm_free(void *ptr);
 
+// Like mm_malloc, but also stores the usable size of the block in `*usable`
+// (if `usable` is not NULL), or 0 if the allocation failed.
+void *mm_malloc_sized(size_t size, size_t *usable);
+
+// Returns the number of payload bytes the block at `ptr` can hold, which is at
+// least the size it was allocated with. Returns 0 for NULL.
+size_t mm_usable_size(const void *ptr);
+
+// Grows the block at `ptr` in place toward `max_size` bytes of payload by
+// absorbing a free next block or extending the heap at the epilogue. Never
+// moves the block. Returns the new usable size (at least `min_size`), or 0 if
+// the block could not reach `min_size`, in which case it is left unchanged.
+size_t mm_expand(void *ptr, size_t min_size, size_t max_size);
+
+// Puts the calling thread in (non-zero) or out of (0) asynchronous free mode.
+// In that mode mm_free, mm_free_sized and mm_free_batch only push the block
+// onto a lock-free queue, which is safe to do concurrently with any other
+// allocator call. The blocks are really freed by mm_reclaim.
+void mm_set_async_free(int enable);
+
+// Frees every block queued by asynchronous frees and returns how many there
+// were. mm_malloc and mm_malloc_batch also call it before growing the heap.
+// Like the rest of the allocator, it must not run concurrently with other
+// allocator calls (asynchronous frees excepted).
+size_t mm_reclaim(void);
+
+// Lets the quick lists hold up to `budget` bytes of freed small blocks (0,
+// the default, turns them off). While on, freed blocks of up to 128 bytes
+// (boundary tags included) stay marked allocated on a LIFO list of their
+// exact size, so freeing and reallocating one size neither coalesces nor
+// splits. They are merged back when mm_malloc needs a larger block or finds
+// no fit, when the budget would be exceeded, and when it is lowered.
+// Until then they count as allocated in statistics and heap walks.
+void mm_set_quick_lists(size_t budget);
+
+// Selects how free blocks are ordered and searched (MM_PLACEMENT_*) for the
+// current heap; mm_init starts every heap with MM_PLACEMENT_FIRST_FIT.
+// Switching to MM_PLACEMENT_ADDRESS_ORDERED sorts the existing free lists.
+// Returns 0, or -1 with mm_errno set to MM_ERR_INVAL for an unknown policy
+// (and, in TLSF builds, for anything but the default).
+int mm_set_placement_policy(int policy);
+
+// Lets the size classes of the free lists below 4096 bytes follow the sizes
+// the program asks for. Every `period` calls to mm_malloc, sizes that made up
+// more than 1/16 of the recent requests get a list holding only that size,
+// and the remaining lists split the other sizes at powers of two; the free
+// blocks are moved onto the new lists in one heap walk. 0, the default,
+// turns adaptation off and goes back to the power-of-two classes. The
+// period outlives mm_init. The statistics keep counting power-of-two
+// classes. Returns 0, or -1 with mm_errno set to MM_ERR_INVAL in TLSF
+// builds, whose lists are already exact for small sizes.
+int mm_set_adaptive_classes(size_t period);
+
+// Frees `ptr`, which was allocated with mm_malloc(`size`). `size` may be
+// anything from the requested size up to mm_usable_size(`ptr`). The block
+// size is derived from `size`, so the footer address no longer waits on the
+// header load; the header is still loaded and checked against it. After a
+// successful mm_expand, pass the new size. Debug builds set MM_ERR_INVAL and
+// keep the block allocated (so it leaks) if `size` does not match the
+// header.
+void mm_free_sized(void *ptr, size_t size);
+
+// Allocates `n` blocks of `size` bytes each and stores them in `out`.
+// Returns the number of blocks stored; fewer than `n` only on failure, in
+// which case mm_errno is set and the stored blocks remain allocated.
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+// Frees the `n` pointers in `ptrs`. NULL entries are skipped.
+void mm_free_batch(void *const *ptrs, size_t n);
+
+// Copies the allocator statistics into `*stats`. Returns 0, or -1 with
+// mm_errno set to MM_ERR_INVAL if `stats` is NULL. Takes no lock: the counters
+// are kept up to date by the allocator calls themselves, so a snapshot taken
+// while another thread is allocating may be off by that call.
+int mm_get_stats(struct mm_stats *stats);
+
+// Called by mm_heap_walk for each block, in address order, with its payload
+// pointer, its block size (boundary tags included) and whether it is
+// allocated. Returning non-zero stops the walk. Must not call the allocator.
+typedef int (*mm_walk_fn)(void *ptr, size_t size, int allocated, void *ctx);
+
+// Calls `fn` on every block from the first one after the seg-list prologues
+// up to the epilogue. Returns 0 once every block was visited, the first
+// non-zero value returned by `fn`, or -1 with mm_errno set to MM_ERR_INVAL if
+// `fn` is NULL or MM_ERR_INTERNAL if the heap is not initialized.
+int mm_heap_walk(mm_walk_fn fn, void *ctx);
+
+// First word of an mm_heap_dump snapshot ("ARMHEAP1" in memory)
+#define MM_HEAP_DUMP_MAGIC 0x31504145484d5241ULL
+
+// Writes a snapshot of the heap to `fd` using raw write syscalls. The snapshot
+// is a sequence of native-endian 64-bit words: MM_HEAP_DUMP_MAGIC, the payload
+// address of the first block, then the header of every block in address order
+// (size in the low 60 bits, allocated flag in bit 63, bit 62 set on blocks
+// sampled by the heap profiler), ending with the
+// epilogue header, whose size is 0. Returns 0, or -1 with mm_errno set to
+// MM_ERR_IO if a write fails or MM_ERR_INTERNAL if the heap is not
+// initialized.
+int mm_heap_dump(int fd);
+
+// Checks the next `max_blocks` blocks of the heap, resuming where the last
+// call stopped and starting over after the epilogue. Verifies header/footer
+// agreement, that no two free blocks are adjacent, free-list link symmetry
+// and that free blocks are on the list of their size class. Returns 0, or -1
+// with mm_errno set to MM_ERR_CORRUPT and the offending payload stored in
+// `*bad` (if `bad` is not NULL). Also fails with MM_ERR_INVAL if `max_blocks`
+// is 0 and MM_ERR_INTERNAL if the heap is not initialized.
+int mm_check_incremental(size_t max_blocks, void **bad);
+
+// Mean number of allocated bytes between heap profile samples
+#define MM_PROFILE_DEFAULT_RATE (512 * 1024)
+
+// Starts sampling mm_malloc calls into a fresh heap profile, on average once
+// every `mean_bytes` allocated bytes (MM_PROFILE_DEFAULT_RATE if 0). Each
+// sample records the call stack by following frame pointers, so callers must
+// be built with -fno-omit-frame-pointer for stacks deeper than one frame.
+// Returns 0, or -1 with mm_errno set to MM_ERR_INVAL if `mean_bytes` is above
+// 2^32 or MM_ERR_NOMEM if the profile tables cannot be mapped.
+int mm_profile_start(size_t mean_bytes);
+
+// Stops taking samples. The profile is kept, and sampled blocks still leave
+// it when they are freed.
+void mm_profile_stop(void);
+
+// Writes the heap profile to `fd` in the gperftools heap profile text format
+// read by pprof: live and total sample counts per call stack, followed by a
+// copy of /proc/self/maps. Returns 0, or -1 with mm_errno set to MM_ERR_IO if
+// a write fails.
+int mm_profile_dump(int fd);
+
+// Allocation trace format, mirrored by mm_trace_constants.inc. A trace is a
+// struct mm_trace_header followed by struct mm_trace_event records, in the
+// order each thread's buffer was flushed (sort by timestamp to interleave
+// threads). All fields are native-endian.
+#define MM_TRACE_MAGIC 0x31434152544d5241ULL  // "ARMTRAC1" in memory
+#define MM_TRACE_VERSION 1
+
+// mm_trace_event.op values
+#define MM_TRACE_MALLOC 1  // ptr = result (NULL on failure), size = request
+#define MM_TRACE_FREE 2    // size = mm_free_sized's size, 0 for mm_free
+#define MM_TRACE_EXPAND 3  // size = new usable size, 0 if the block did not grow
+
+struct mm_trace_header {
+    uint64_t magic;       // MM_TRACE_MAGIC
+    uint64_t version;     // MM_TRACE_VERSION
+    uint64_t counter_hz;  // CNTFRQ_EL0, ticks per second of the timestamps
+    uint64_t event_size;  // sizeof(struct mm_trace_event)
+};
+
+struct mm_trace_event {
+    uint64_t timestamp;  // CNTVCT_EL0 when the event was recorded
+    uint64_t ptr;        // Payload pointer
+    uint64_t size;       // See the op values
+    uint32_t thread;     // Kernel thread ID
+    uint32_t op;         // MM_TRACE_MALLOC, MM_TRACE_FREE or MM_TRACE_EXPAND
+};
+
+// Starts recording every mm_malloc, mm_free, mm_free_sized, mm_expand and
+// batch call to `fd`, beginning with a struct mm_trace_header. Events are
+// buffered per thread and written out when a thread's buffer fills. Batches
+// are recorded as one event per block. Returns 0, or -1 with mm_errno set to
+// MM_ERR_INVAL if `fd` is negative or tracing is already on, or MM_ERR_IO if
+// the header cannot be written.
+int mm_trace_start(int fd);
+
+// Stops recording and flushes the calling thread's buffer. Other threads
+// must call mm_trace_flush before tracing starts again; events they still
+// buffer then are dropped. Returns as mm_trace_flush.
+int mm_trace_stop(void);
+
+// Writes out the calling thread's buffered events. Every thread that
+// allocated while tracing must call it before exiting, or its last events
+// are lost. Returns 0, or -1 with mm_errno set to MM_ERR_IO if the write
+// fails, in which case the events are dropped.
+int mm_trace_flush(void);
+
+// Starts timing every mm_malloc, mm_free and mm_free_sized call. Each thread
+// counts its calls in its own histograms, one per operation and size class
+// (the segregated list of the block), so recording takes no lock. Starting
+// again clears the histograms. Returns 0, or -1 with mm_errno set to
+// MM_ERR_NOMEM if the histograms cannot be mapped.
+int mm_latency_start(void);
+
+// Stops timing calls. The histograms are kept.
+void mm_latency_stop(void);
+
+// Sums every thread's histogram of operation `op` (MM_LATENCY_MALLOC or
+// MM_LATENCY_FREE) for size class `size_class`, or for all classes if it is
+// NUM_SEG_LISTS, into `counts`. Returns 0, or -1 with mm_errno set to
+// MM_ERR_INVAL if an argument is out of range or `counts` is NULL.
+int mm_latency_histogram(int op, int size_class,
+                         uint64_t counts[MM_LATENCY_BUCKETS]);
+
 #ifdef __cplusplus
 }
 #endif
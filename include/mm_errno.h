@@ -21,6 +21,9 @@
 // Internal allocator error (e.g., unexpected state or unimplemented case).
 #define MM_ERR_INTERNAL     5
 
+// Writing to a file descriptor failed (e.g., mm_heap_dump to a closed fd).
+#define MM_ERR_IO           6
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -3,6 +3,7 @@
 .include "constants.inc"
 .include "sys_macros.inc"
 .include "mm_errno_constants.inc"
+.include "mem_page_map.inc"
 
 .section .bss
 
@@ -14,6 +15,16 @@ _mem_brk: .skip PTR_SIZE_BYTES  // Points to last byte of heap plus 1
 
 _mem_heap_end: .skip PTR_SIZE_BYTES  // Max legal heap addr plus 1
 
+_mem_peak_brk: .skip PTR_SIZE_BYTES  // Highest _mem_brk since mem_init
+
+_mem_sbrk_calls: .skip WORD_SIZE_BYTES  // mem_sbrk calls since mem_init
+
+_mem_mmap_calls: .skip WORD_SIZE_BYTES  // Arena mmap syscalls issued, ever
+
+// Root of the page map (see mem_page_map.inc): one mid node pointer per
+// 2^PAGE_MAP_ROOT_SHIFT bytes of address space, NULL until first used
+mem_page_map_root: .skip PAGE_MAP_ENTRIES * PTR_SIZE_BYTES
+
 .section .text
 
 .global mem_init
@@ -24,6 +35,14 @@ _mem_heap_end: .skip PTR_SIZE_BYTES  // Max legal heap addr plus 1
 .global _get_mem_brk
 .global _get_mem_heap_end
 
+.global mem_get_peak_brk
+.global mem_get_sbrk_calls
+.global mem_get_mmap_calls
+
+.global mem_page_owner
+.global mem_page_map_root  // Read by PAGE_OWNER in mm.s
+.global _mem_page_map_set
+
 // Retrieves the internal _mem_heap_start value
 // Only used for testing
 _get_mem_heap_start:
@@ -45,6 +64,24 @@ _get_mem_heap_end:
     ldr x0, [x0]
     ret
 
+// Returns the highest program break reached since mem_init
+mem_get_peak_brk:
+    ldr x0, =_mem_peak_brk
+    ldr x0, [x0]
+    ret
+
+// Returns the number of mem_sbrk calls since mem_init
+mem_get_sbrk_calls:
+    ldr x0, =_mem_sbrk_calls
+    ldr x0, [x0]
+    ret
+
+// Returns the number of mmap syscalls issued by the memory layer
+mem_get_mmap_calls:
+    ldr x0, =_mem_mmap_calls
+    ldr x0, [x0]
+    ret
+
 // Initializes a contiguous memory arena of the given size.
 //
 // Arguments:
@@ -60,14 +97,20 @@ _get_mem_heap_end:
 //   x0 - Used for input, temporary values, and return code
 //   x1 - Used for rounding, pointer arithmetic, and addressing
 //   x2–x5 - Clobbered by sys_mmap macro
+//   x6-x7 - Clobbered by _mem_page_map_set
 //   x8 - Set by sys_mmap to syscall number
 //   x19 - Callee-saved: used to store rounded arena size
-//   sp - Adjusted to save/restore x19 and lr
+//   x20 - Callee-saved: used to store the arena start
+//   sp - Adjusted to save/restore x19, x20 and lr
 //
 // Global Data Written:
 //   _mem_heap_start - Set to start of mmap'd memory
 //   _mem_brk        - Set to heap start (current break)
 //   _mem_heap_end   - Set to heap start + arena size
+//   _mem_peak_brk   - Set to heap start
+//   _mem_sbrk_calls - Reset to 0
+//   _mem_mmap_calls - Incremented
+//   Page map        - Every page of the arena tagged MEM_OWNER_HEAP
 //
 // Notes:
 //   - The requested size is rounded up to the nearest multiple of
@@ -75,9 +118,11 @@ _get_mem_heap_end:
 //   - On error, sets mm_errno to:
 //       MM_ERR_INTERNAL (mm_init already called)
 //       MM_ERR_INVAL (called with 0 size)
-//       MM_ERR_NOMEM (mmap failure)
+//       MM_ERR_NOMEM (mmap failure, or no memory for page map nodes, in
+//                     which case the arena is unmapped again)
 mem_init:
     stp x19, lr, [sp, #-16]!
+    str x20, [sp, #-16]!
     cbz x0, .Linit_invalid_size_err  // Size should not be 0
     ldr x1, =_mem_heap_start
     ldr x1, [x1]
@@ -88,13 +133,28 @@ mem_init:
     bic x19, x0, x1
     // mmap(addr=0, length=x1, prot=RW, flags=PRIVATE|ANON, fd=-1, offset=0)
     sys_mmap #0, x19, #PROT_READ | PROT_WRITE, #MAP_PRIVATE | MAP_ANONYMOUS, #-1, #0
+    ldr x1, =_mem_mmap_calls
+    ldr x2, [x1]
+    add x2, x2, #1
+    str x2, [x1]
     cmp x0, #MAP_FAILED
     b.eq .Linit_mmap_err
+    // Tag the arena's pages in the page map
+    mov x20, x0
+    mov x1, x19
+    mov x2, #MEM_OWNER_HEAP
+    bl _mem_page_map_set
+    cbnz x0, .Linit_page_map_err
+    mov x0, x20
     // Save mmap result into the global pointers
     ldr x1, =_mem_heap_start
     str x0, [x1]
     ldr x1, =_mem_brk
     str x0, [x1]
+    ldr x1, =_mem_peak_brk
+    str x0, [x1]
+    ldr x1, =_mem_sbrk_calls
+    str xzr, [x1]
     ldr x1, =_mem_heap_end
     add x0, x0, x19
     str x0, [x1]
@@ -110,12 +170,23 @@ mem_init:
     bl set_mm_errno
     mov x0, #-1  // Return failure
     b .Linit_ret
+.Linit_page_map_err:
+    // _mem_page_map_set set mm_errno; the pages it tagged go back to
+    // MEM_OWNER_NONE, which maps no nodes
+    mov x0, x20
+    mov x1, x19
+    mov x2, #MEM_OWNER_NONE
+    bl _mem_page_map_set
+    sys_munmap x20, x19
+    mov x0, #-1  // Return failure
+    b .Linit_ret
 .Linit_mmap_err:
     mov x0, #MM_ERR_NOMEM
     bl set_mm_errno
     mov x0, #-1  // Return failure
     b .Linit_ret
 .Linit_ret:
+    ldr x20, [sp], #16
     ldp x19, lr, [sp], #16
     ret
 
@@ -144,8 +215,14 @@ mem_init:
 //   x2 - Copy of requested increment
 //   x3 - Calculated new break address
 //   x4 - Temporary: heap start or heap end
+//   x5 - Temporary: call counter and peak break
 //   x8 - Used internally by `set_mm_errno` (syscall stub)
 //
+// Global Data Written:
+//   _mem_brk        - Set to the new break on success
+//   _mem_peak_brk   - Raised to the new break if it is higher
+//   _mem_sbrk_calls - Incremented on every call after mem_init
+//
 // Notes:
 //   - This routine must be called after `mem_init`, which sets `_mem_brk`.
 //   - The break must remain within bounds: [_mem_heap_start, _mem_heap_end).
@@ -156,6 +233,10 @@ mem_sbrk:
     ldr x1, =_mem_brk
     ldr x0, [x1]
     cbz x0, .Lerr_not_initialized  // Fail if _mem_brk is uninitialized
+    ldr x4, =_mem_sbrk_calls
+    ldr x5, [x4]
+    add x5, x5, #1
+    str x5, [x4]
     cbz x2, .Lbrk_ret  // If increment is 0, return current break
     add x3, x0, x2  // Compute new break: new_brk = old_brk + increment
     ldr x4, =_mem_heap_start     // Load heap start
@@ -167,6 +248,11 @@ mem_sbrk:
     cmp x3, x4
     b.ge .Lerr_too_big           // Error if new break is >= heap end
     str x3, [x1]                 // Commit the new break to _mem_brk
+    ldr x4, =_mem_peak_brk
+    ldr x5, [x4]
+    cmp x3, x5
+    b.ls .Lbrk_ret
+    str x3, [x4]                 // New high-water mark
     b .Lbrk_ret                  // Return old break (in x0)
 .Lerr_not_initialized:
     mov x0, #MM_ERR_INTERNAL     // Error: break not initialized
@@ -199,6 +285,7 @@ mem_sbrk:
 // Clobbers (Registers modified):
 //   x0 - Used for arena start, syscall result, and return code
 //   x1 - Used for arena end and intermediate addresses
+//   x2-x7 - Clobbered by _mem_page_map_set
 //   x8 - Set to syscall number by `sys_munmap`
 //
 // Global Data Written:
@@ -214,6 +301,8 @@ mem_sbrk:
 //   - If `munmap` fails, the function returns -1 and sets
 //     `mm_errno = MM_ERR_INTERNAL`; pointers are left unchanged.
 //   - On success, all heap-related global pointers are cleared.
+//   - The arena's pages are tagged MEM_OWNER_NONE in the page map before
+//     the munmap.
 mem_deinit:
     str lr, [sp, #-16]!
     ldr x0, =_mem_heap_start
@@ -223,6 +312,10 @@ mem_deinit:
     ldr x1, [x1]
     subs x1, x1, x0  // Calculate the arena size
     b.le .Ldeinit_invalid_heap_state  // _mem_heap_start > _mem_heap_end
+    stp x0, x1, [sp, #-16]!
+    mov x2, #MEM_OWNER_NONE
+    bl _mem_page_map_set  // The nodes exist since mem_init, so no failure
+    ldp x0, x1, [sp], #16
     sys_munmap x0, x1
     cbnz x0, .Ldeinit_munmap_err
     // Success: Reset the heap pointers to NULL
@@ -233,6 +326,8 @@ mem_deinit:
     str x0, [x1]
     ldr x1, =_mem_heap_end
     str x0, [x1]
+    ldr x1, =_mem_peak_brk
+    str x0, [x1]
 .Ldeinit_ret_success:
     mov x0, #0
     b .Ldeinit_ret
@@ -249,3 +344,114 @@ mem_deinit:
 .Ldeinit_ret:
     ldr lr, [sp], #16
     ret
+
+// Returns the owner tag of the page holding an address.
+//
+// Arguments:
+//   x0 - Any address
+//
+// Returns:
+//   x0 - MEM_OWNER_HEAP for pages of the arena, MEM_OWNER_BUDDY for pages of
+//        the buddy zone, or MEM_OWNER_NONE for anything else
+//
+// Clobbers (Registers modified):
+//   x0-x2
+mem_page_owner:
+    PAGE_OWNER x0, x1, x2, .Lpage_owner_none
+    mov x0, x1
+    ret
+.Lpage_owner_none:
+    mov x0, #MEM_OWNER_NONE
+    ret
+
+// Tags every page overlapping a range with an owner in the page map.
+//
+// Arguments:
+//   x0 - Start of the range
+//   x1 - Length of the range in bytes
+//   x2 - Owner tag (MEM_OWNER_*)
+//
+// Returns:
+//   x0 - 0, or -1 with mm_errno set to MM_ERR_NOMEM if a node could not be
+//        mapped; the pages before it are tagged
+//
+// Clobbers (Registers modified):
+//   x0-x8 - Clobbered (sys_mmap)
+//
+// Notes:
+//   - Missing mid nodes and leaves are mapped as the walk reaches them.
+//     They are not counted in _mem_mmap_calls, which counts arenas.
+//   - Tagging MEM_OWNER_NONE, or retagging a range that was tagged before,
+//     never maps anything, so it cannot fail
+//   - The range must lie below 2^(PAGE_MAP_ROOT_SHIFT + PAGE_MAP_BITS)
+_mem_page_map_set:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    str x22, [sp, #-16]!
+
+    // x19 = current page
+    // x20 = end of the range, rounded up to a page
+    // x21 = owner tag
+    // x22 = slot of the node to load or map
+    mov x3, #PAGE_SIZE_BYTES - 1
+    add x20, x0, x1
+    add x20, x20, x3
+    bic x20, x20, x3
+    bic x19, x0, x3
+    mov x21, x2
+.Lpage_map_set_loop:
+    cmp x19, x20
+    b.hs .Lpage_map_set_done
+
+    ldr x22, =mem_page_map_root
+    lsr x0, x19, #PAGE_MAP_ROOT_SHIFT
+    add x22, x22, x0, LSL #PTR_ALIGN
+    mov x1, #PAGE_MAP_MID_BYTES
+    bl .Lpage_map_node
+    cbz x0, .Lpage_map_set_missing
+
+    ubfx x1, x19, #PAGE_MAP_MID_SHIFT, #PAGE_MAP_BITS
+    add x22, x0, x1, LSL #PTR_ALIGN
+    mov x1, #PAGE_MAP_LEAF_BYTES
+    bl .Lpage_map_node
+    cbz x0, .Lpage_map_set_missing
+
+    ubfx x1, x19, #PAGE_SHIFT, #PAGE_MAP_BITS
+    strb w21, [x0, x1]
+.Lpage_map_set_next:
+    add x19, x19, #PAGE_SIZE_BYTES
+    b .Lpage_map_set_loop
+.Lpage_map_set_missing:
+    // A page without a node already reads MEM_OWNER_NONE
+    cbz x21, .Lpage_map_set_next
+    b .Lpage_map_set_nomem_err
+
+.Lpage_map_set_done:
+    mov x0, #0
+    b .Lpage_map_set_ret
+.Lpage_map_set_nomem_err:
+    mov x0, #MM_ERR_NOMEM
+    bl set_mm_errno
+    mov x0, #-1
+.Lpage_map_set_ret:
+    ldr x22, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+// Returns the node in slot x22, mapping a zeroed one of x1 bytes if the
+// slot is empty. Returns NULL if the mmap fails, or without mapping if the
+// slot is empty and the tag (x21) is MEM_OWNER_NONE. Clobbers x0-x5 and x8.
+.Lpage_map_node:
+    ldr x0, [x22]
+    cbnz x0, .Lpage_map_node_ret
+    cbz x21, .Lpage_map_node_ret
+    sys_mmap #0, x1, #PROT_READ | PROT_WRITE, #MAP_PRIVATE | MAP_ANONYMOUS, #-1, #0
+    cmn x0, #4095
+    b.hs .Lpage_map_node_fail  // -4095..-1 is an error code
+    str x0, [x22]
+    ret
+.Lpage_map_node_fail:
+    mov x0, #0
+.Lpage_map_node_ret:
+    ret
@@ -1,11 +1,306 @@
 .include "constants.inc"
 .include "mm_list_traversal_macros.inc"
+.include "mm_errno_constants.inc"
+.include "sys_macros.inc"
+.include "tls_macros.inc"
+.include "mm_stats_constants.inc"
+.include "mm_buddy_constants.inc"
+.include "mem_page_map.inc"
 
-.equ NUM_SEG_LISTS, 8
+// Free-list engine. The default keeps one first-fit list per size class of
+// _get_seglist_index, or per class derived from the requests with
+// mm_set_adaptive_classes (see _get_free_list_index). Assembling with
+// --defsym MM_TLSF=1 (ENGINE=tlsf in config.mk) selects TLSF, two-level
+// segregated fit: TLSF_FL_COUNT power-of-two first-level ranges, each
+// split into TLSF_SL_COUNT linear second-level lists, with a bitmap per
+// level so _find_fit finds a list whose every block fits in a constant
+// number of instructions. Blocks below 2^TLSF_LINEAR_LOG2 bytes map
+// linearly, one list per DWORD_SIZE_BYTES step, and the ranges cover every
+// block size below 2^TLSF_MAX_BLOCK_LOG2, the whole user address space.
+//
+// Assembling with --defsym MM_BUDDY=1 (ENGINE=buddy) keeps the default
+// lists but serves power-of-two requests up to 2^BUDDY_MAX_ORDER bytes from
+// a binary buddy zone (see mm_buddy.s). The free paths find zone blocks
+// through the page map of the memory layer; every other function that
+// takes a payload pointer checks the zone bounds first with IF_BUDDY_BLOCK.
+//
+// Independently of the engine, assembling with --defsym MM_SIDE_TABLE=1
+// (LINKS=side in config.mk) moves the free-list links out of the payload
+// into a side table beside the arena (see side_table). The link macros of
+// mm_list_traversal_macros.inc then clobber x16 and x17, which nothing else
+// in the allocator uses.
+//
+// Assembling with --defsym MM_COMPACT=1 (LAYOUT=compact) shrinks boundary
+// tags to 32 bits and stores the inline links as 32-bit offsets from
+// link_base, so the minimum block drops from 32 to 16 bytes for arenas up
+// to 4 GiB. Payloads stay 16-byte aligned, which puts every header at
+// 12 mod 16; tags are only ever touched through LOAD_TAG and STORE_TAG, and
+// the link macros clobber x17. MM_COMPACT excludes MM_SIDE_TABLE.
+.ifdef MM_TLSF
+.equ TLSF_SL_LOG2, 3
+.equ TLSF_SL_COUNT, 1 << TLSF_SL_LOG2
+.equ TLSF_GRANULE_LOG2, 4  // Block sizes are multiples of DWORD_SIZE_BYTES
+.equ TLSF_LINEAR_LOG2, TLSF_GRANULE_LOG2 + TLSF_SL_LOG2
+.equ TLSF_MAX_BLOCK_LOG2, 48
+.equ TLSF_FL_COUNT, TLSF_MAX_BLOCK_LOG2 - TLSF_LINEAR_LOG2 + 1
+.equ NUM_FREE_LISTS, TLSF_FL_COUNT * TLSF_SL_COUNT
+.else
+.equ NUM_FREE_LISTS, NUM_SEG_LISTS
+.endif
+
+// Without MM_TLSF, free blocks of the last size class are kept in a size
+// tree instead of its list, so _find_fit takes the best fit among them in
+// O(log n) steps. The tree is a bitwise trie like dlmalloc's treebins: one
+// trie per power of two [2^e, 2^(e+1)), where each level below the root
+// branches on the next lower bit of the size. Blocks of equal size share one
+// tree node and hang off it in a ring through fprev/fnext.
+.ifndef MM_TLSF
+.equ TREE_SEG_LIST, NUM_SEG_LISTS - 1
+.equ TREE_MIN_LOG2, 12  // TREE_SEG_LIST starts at 4096 bytes
+.equ TREE_MIN_BLOCK_BYTES, 1 << TREE_MIN_LOG2
+.equ TREE_NUM_BINS, 60 - TREE_MIN_LOG2  // Sizes fit in 60 bits
+
+// Tree links after fprev/fnext, as header offsets. TREE_RIGHT must follow
+// TREE_LEFT so a child is found at TREE_LEFT + 8 * bit. The links are full
+// pointers in both layouts; with MM_COMPACT they start at 12, which is
+// 8-byte aligned in memory but cannot be paired by ldp/stp.
+.equ TREE_LEFT, FNEXT_OFFSET + LINK_SIZE_BYTES
+.equ TREE_RIGHT, TREE_LEFT + PTR_SIZE_BYTES
+.equ TREE_PARENT, TREE_RIGHT + PTR_SIZE_BYTES  // Root slot for roots, 0 off-tree
+
+// Block sizes below TREE_MIN_BLOCK_BYTES find their list in
+// free_list_classes, one byte per DWORD_SIZE_BYTES step (see
+// FREE_LIST_INDEX). With no hot sizes the table holds the power-of-two
+// classes of _get_seglist_index, whose lowest boundary is 64 bytes.
+.equ CLASS_GRANULE_LOG2, 4  // Block sizes are multiples of DWORD_SIZE_BYTES
+.equ CLASS_TABLE_ENTRIES, TREE_MIN_BLOCK_BYTES >> CLASS_GRANULE_LOG2
+.equ CLASS_MIN_ENTRY, MIN_BLOCK_SIZE_BYTES >> CLASS_GRANULE_LOG2
+.equ CLASS_POW2_MIN_ENTRY, 64 >> CLASS_GRANULE_LOG2
+.equ CLASS_MAX_BOUNDARIES, TREE_SEG_LIST - 1
+.equ CLASS_HOT_LOG2, 4  // Hot sizes take over 1/16 of the requests
+.endif
+
+// Quick lists (see mm_set_quick_lists): one LIFO list per exact block size
+// up to QUICK_MAX_BLOCK_BYTES, indexed by size / DWORD_SIZE_BYTES. The slots
+// below MIN_BLOCK_SIZE_BYTES are never used.
+.equ QUICK_MAX_BLOCK_BYTES, 128
+.equ QUICK_GRANULE_LOG2, 4  // Block sizes are multiples of DWORD_SIZE_BYTES
+.equ QUICK_NUM_LISTS, (QUICK_MAX_BLOCK_BYTES >> QUICK_GRANULE_LOG2) + 1
+
+// Padding, prologues and epilogue laid down by mm_init. Also the offset of
+// the first block's payload from the start of the heap.
+.equ HEAP_OVERHEAD_BYTES, DWORD_SIZE_BYTES + NUM_FREE_LISTS * MIN_BLOCK_SIZE_BYTES
+
+// mm_heap_dump format (mirrors mm.h) and its stack buffer
+.equ MM_HEAP_DUMP_MAGIC, 0x31504145484d5241
+.equ HEAP_DUMP_BUFFER_BYTES, PAGE_SIZE_BYTES
+
+
+// Hands the call to a wrapper from mm_trace.s while tracing or latency timing
+// is on.
+//
+// Syntax:
+//   TRACE_HOOK tracer
+//
+// Parameters:
+//   tracer - Wrapper that records and/or times the call and runs the
+//            untraced body, which starts right after the hook
+//
+// Notes:
+//   - Must come first in the function, before anything is pushed, so the
+//     wrapper sees the caller's arguments and return address
+//   - Clobbers only x9, so the arguments reach the wrapper unchanged
+.macro TRACE_HOOK tracer
+    ldr x9, =call_hooks
+    ldr x9, [x9]  // One byte per feature
+    cbnz x9, \tracer  // Tail call; the wrapper returns to our caller
+.endm
+
+.ifdef MM_BUDDY
+// Branches if a payload pointer lies in the buddy zone.
+//
+// Syntax:
+//   IF_BUDDY_BLOCK ptr_reg, label, tmp1_reg, tmp2_reg
+//
+// Parameters:
+//   ptr_reg  - Payload pointer (preserved)
+//   label    - Branch target for pointers in [buddy_zone_start,
+//              buddy_zone_end)
+//   tmp1_reg - Clobbered
+//   tmp2_reg - Clobbered
+//
+// Notes:
+//   - Below the zone, ccmp sets the carry flag so b.lo is not taken
+.macro IF_BUDDY_BLOCK ptr_reg, label, tmp1_reg, tmp2_reg
+    ldr \tmp1_reg, =buddy_zone_start
+    ldp \tmp1_reg, \tmp2_reg, [\tmp1_reg]
+    cmp \ptr_reg, \tmp1_reg
+    ccmp \ptr_reg, \tmp2_reg, #0b0010, hs
+    b.lo \label
+.endm
+.endif
+
+.ifdef MM_TLSF
+// Maps a block size to its TLSF free list.
+//
+// Syntax:
+//   TLSF_LIST_INDEX size_reg, output_reg, tmp_reg
+//
+// Parameters:
+//   size_reg   - Block size in bytes (preserved)
+//   output_reg - Receives the list index, first level * TLSF_SL_COUNT +
+//                second level; must differ from size_reg
+//   tmp_reg    - Clobbered
+//
+// Behavior:
+//   - With e = floor(log2(size)) and s = max(e - TLSF_LINEAR_LOG2, 0), the
+//     index is (s << TLSF_SL_LOG2) + (size >> (s + TLSF_GRANULE_LOG2)):
+//     the top TLSF_SL_LOG2 + 1 bits of the size pick the second level, and
+//     small sizes fall into first level 0 at DWORD_SIZE_BYTES steps
+.macro TLSF_LIST_INDEX size_reg, output_reg, tmp_reg
+    clz \tmp_reg, \size_reg
+    mov \output_reg, #63 - TLSF_LINEAR_LOG2
+    subs \tmp_reg, \output_reg, \tmp_reg
+    csel \tmp_reg, \tmp_reg, xzr, gt
+    add \output_reg, \tmp_reg, #TLSF_GRANULE_LOG2
+    lsr \output_reg, \size_reg, \output_reg
+    add \output_reg, \output_reg, \tmp_reg, LSL #TLSF_SL_LOG2
+.endm
+.else
+// Maps a block size to its free list through free_list_classes.
+//
+// Syntax:
+//   FREE_LIST_INDEX size_reg, output_reg, tmp_reg
+//
+// Parameters:
+//   size_reg   - Block size in bytes (preserved unless it is output_reg)
+//   output_reg - Receives the list index
+//   tmp_reg    - Clobbered
+//
+// Behavior:
+//   - Sizes from TREE_MIN_BLOCK_BYTES up share the table's last entry,
+//     TREE_SEG_LIST, so the lookup never branches
+.macro FREE_LIST_INDEX size_reg, output_reg, tmp_reg
+    lsr \output_reg, \size_reg, #CLASS_GRANULE_LOG2
+    cmp \output_reg, #CLASS_TABLE_ENTRIES
+    mov \tmp_reg, #CLASS_TABLE_ENTRIES
+    csel \output_reg, \output_reg, \tmp_reg, lo
+    ldr \tmp_reg, =free_list_classes
+    ldrsb \output_reg, [\tmp_reg, \output_reg]  // Lists are below 128
+.endm
+.endif
 
 .section .bss
 
-seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
+seg_listp: .skip NUM_FREE_LISTS * PTR_SIZE_BYTES
+
+.ifdef MM_SIDE_TABLE
+.align PTR_ALIGN
+
+// Side table of free-list entries (see SIDE_ENTRY_P), one per
+// 2 * DWORD_SIZE_BYTES of arena, mapped by mm_init and unmapped by
+// mm_deinit. List operations and searches read and write only the table,
+// so a free block's payload is never touched while it sits on a list. The
+// mapping is MAP_NORESERVE: only the parts that cover free blocks are ever
+// faulted in.
+side_table: .skip PTR_SIZE_BYTES
+side_table_bytes: .skip WORD_SIZE_BYTES
+
+// side_table minus half the arena start, and the arena's first header slot
+side_table_bias: .skip PTR_SIZE_BYTES
+side_heap_base: .skip PTR_SIZE_BYTES
+.endif
+
+.ifdef MM_COMPACT
+.align PTR_ALIGN
+
+// Start of the heap, set by mm_init. With MM_COMPACT the inline free-list
+// links are 32-bit offsets from here (see COMPACT_GET_LINK).
+link_base: .skip PTR_SIZE_BYTES
+.endif
+
+.ifdef MM_TLSF
+.align PTR_ALIGN
+
+// Bit f is set while some list of first level f is non-empty
+tlsf_fl_bitmap: .skip WORD_SIZE_BYTES
+
+// Byte f has bit s set while list f * TLSF_SL_COUNT + s is non-empty
+tlsf_sl_bitmap: .skip TLSF_FL_COUNT
+.align WORD_ALIGN
+tlsf_bitmaps_end:
+.else
+.align PTR_ALIGN
+
+// Bit i is set while tree_roots[i], the trie of sizes
+// [2^(TREE_MIN_LOG2 + i), 2^(TREE_MIN_LOG2 + i + 1)), is non-empty
+tree_bitmap: .skip WORD_SIZE_BYTES
+
+tree_roots: .skip TREE_NUM_BINS * PTR_SIZE_BYTES
+tree_end:
+
+// Next-fit rover of each class: payload of the block (or sentinel) the next
+// search starts at, or NULL for the head of the list
+fit_rovers: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
+
+// Free remainder of the last split for a small request under
+// MM_PLACEMENT_WILDERNESS, or NULL. Never the top block.
+last_remainder: .skip PTR_SIZE_BYTES
+fit_state_end:
+
+// Period set by mm_set_adaptive_classes (0 = off), then the mm_malloc calls
+// left until the classes are derived again
+adapt_period: .skip WORD_SIZE_BYTES
+adapt_countdown: .skip WORD_SIZE_BYTES
+
+// Requests counted per adjusted size below TREE_MIN_BLOCK_BYTES, halved
+// each time the classes are derived
+class_histogram: .skip CLASS_TABLE_ENTRIES * WORD_SIZE_BYTES
+
+// Free list of each block size, indexed by size / DWORD_SIZE_BYTES, plus a
+// last entry for the size tree (see FREE_LIST_INDEX)
+free_list_classes: .skip CLASS_TABLE_ENTRIES + 1
+.align PTR_ALIGN
+.endif
+
+// Placement policy of the heap (MM_PLACEMENT_*), set by
+// mm_set_placement_policy
+placement_policy: .skip WORD_SIZE_BYTES
+
+.align PTR_ALIGN
+
+// Lock-free stack of blocks queued by asynchronous frees (see mm_reclaim)
+async_free_head: .skip PTR_SIZE_BYTES
+
+// Byte budget set by mm_set_quick_lists (0 = off), then the bytes parked on
+// the quick lists; _free_block loads both with one ldp. The lists are linked
+// through the first payload word.
+quick_budget: .skip WORD_SIZE_BYTES
+quick_bytes: .skip WORD_SIZE_BYTES
+quick_lists: .skip QUICK_NUM_LISTS * PTR_SIZE_BYTES
+quick_end:
+
+// Statistics counters reported by mm_get_stats. They are globals apart from
+// the heap, so each update is a load, an add and a store on a line the call
+// would not otherwise touch, and _remove_from_free_list reloads the header
+// and calls _get_seglist_index to find the class. Updates are plain stores
+// by the allocator call that changes the heap; readers take no lock.
+stat_counters:
+stat_free_bytes: .skip NUM_SEG_LISTS * WORD_SIZE_BYTES
+stat_free_blocks: .skip NUM_SEG_LISTS * WORD_SIZE_BYTES
+stat_allocated_blocks: .skip WORD_SIZE_BYTES
+stat_coalesce_cases: .skip MM_NUM_COALESCE_CASES * WORD_SIZE_BYTES
+stat_counters_end:
+
+// Payload of the next block mm_check_incremental looks at, or NULL to start
+// from the first block. Always on a block boundary: blocks that are merged
+// into a predecessor move it to the merged block.
+check_cursor: .skip PTR_SIZE_BYTES
+
+.section .tbss, "awT", @nobits
+
+// Per-thread flag set by mm_set_async_free
+async_free_enabled: .skip 1
 
 .section .text
 
@@ -13,6 +308,32 @@ seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
 .global mm_deinit
 .global mm_malloc
 .global mm_free
+.global mm_malloc_sized
+.global mm_usable_size
+.global mm_free_sized
+.global mm_expand
+.global mm_set_async_free
+.global mm_reclaim
+.global mm_set_quick_lists
+.global mm_set_placement_policy
+.global mm_set_adaptive_classes
+.global mm_malloc_batch
+.global mm_free_batch
+.global mm_get_stats
+.global mm_heap_walk
+.global mm_heap_dump
+.global mm_check_incremental
+
+.global _write_all  // Shared with mm_profile.s and mm_trace.s
+.global _get_seglist_index  // Size classes of mm_latency.s's histograms
+
+// Untraced bodies of the traced entry points, called by mm_trace.s
+.global _malloc_untraced
+.global _free_untraced
+.global _free_sized_untraced
+.global _expand_untraced
+.global _malloc_batch_untraced
+.global _free_batch_untraced
 
 
 // Initializes the memory manager with segregated free lists.
@@ -30,7 +351,7 @@ seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
 //
 // Behavior:
 //   - Initializes the underlying memory system via mem_init
-//   - Allocates space for NUM_SEG_LISTS prologue blocks plus padding and
+//   - Allocates space for NUM_FREE_LISTS prologue blocks plus padding and
 //     epilogue
 //   - Sets up each segregated free list as a circular doubly-linked list
 //   - Creates prologue blocks (allocated sentinel nodes) for each size class
@@ -40,13 +361,13 @@ seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
 //
 // Algorithm:
 //   1. Call mem_init() to initialize memory subsystem
-//   2. Allocate (2 + NUM_SEG_LISTS * 4) words via mem_sbrk:
-//      - 1 word for alignment padding
-//      - NUM_SEG_LISTS * 4 words for prologue blocks (4 words each)
-//      - 1 word for epilogue header
+//   2. Allocate HEAP_OVERHEAD_BYTES via mem_sbrk:
+//      - DWORD_SIZE_BYTES - TAG_SIZE_BYTES of alignment padding
+//      - NUM_FREE_LISTS prologue blocks of MIN_BLOCK_SIZE_BYTES each
+//      - TAG_SIZE_BYTES for the epilogue header
 //   3. Store alignment padding (0) and advance pointer
-//   4. For each segregated list (0 to NUM_SEG_LISTS-1):
-//      - Create prologue header (size=32 bytes, allocated=1)
+//   4. For each segregated list (0 to NUM_FREE_LISTS-1):
+//      - Create prologue header (size=MIN_BLOCK_SIZE_BYTES, allocated=1)
 //      - Set up circular links (fprev=fnext=self)
 //      - Create prologue footer matching header
 //      - Store payload pointer in seg_listp[i] array
@@ -55,7 +376,8 @@ seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
 //   6. Extend heap with PAGE_SIZE free block
 //   7. Return 0 on success, -1 on heap extension failure
 //
-// Memory Layout After Initialization:
+// Memory Layout After Initialization (wide; with MM_COMPACT the padding is
+// 12 bytes, the prologues 16 and the tags 4):
 //   [alignment padding: 8 bytes]
 //   [seg_list[0] prologue: header(32,1) + links + footer(32,1)]
 //   [seg_list[1] prologue: header(32,1) + links + footer(32,1)]
@@ -66,10 +388,11 @@ seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
 //   [new epilogue: header(0,1)]
 //
 // Segregated List Size Classes:
-//   seg_listp[0]: 32-63 bytes      seg_listp[4]: 512-1023 bytes
+//   seg_listp[0]: up to 63 bytes   seg_listp[4]: 512-1023 bytes
 //   seg_listp[1]: 64-127 bytes     seg_listp[5]: 1024-2047 bytes
 //   seg_listp[2]: 128-255 bytes    seg_listp[6]: 2048-4095 bytes
-//   seg_listp[3]: 256-511 bytes    seg_listp[7]: 4096+ bytes
+//   seg_listp[3]: 256-511 bytes    seg_listp[7]: 4096+ bytes (size tree)
+//   (mm_set_adaptive_classes moves the boundaries below 4096 bytes)
 //
 // Example Usage:
 //   bl mm_init                     // Initialize memory manager
@@ -90,125 +413,2988 @@ seg_listp: .skip NUM_SEG_LISTS * PTR_SIZE_BYTES
 //   - extend_heap(words) - Add initial free block
 //
 // Error Conditions:
+//   - With MM_COMPACT, returns -1 with MM_ERR_INVAL for an arena_size above
+//     4 GiB, which 32-bit tags and links cannot span
 //   - Returns mem_init error code if memory initialization fails
 //   - Returns -1 if mem_sbrk fails (insufficient system memory)
 //   - Returns -1 if extend_heap fails (cannot create initial free block)
 //
 // Global State Modified:
 //   - seg_listp[0..7] array populated with prologue payload pointers
+//   - Statistics counters reset to 0
+//   - With MM_TLSF, both list bitmaps are cleared; otherwise the size tree
+//     is emptied and the next-fit rovers and last remainder are reset
+//   - Without MM_TLSF, the free lists go back to the power-of-two classes
+//     and the request histogram is cleared; the adaptive period is kept
+//   - With MM_BUDDY, the buddy zone is forgotten
+//   - With MM_SIDE_TABLE, a side table is mapped for the new arena
+//   - The quick lists are emptied; their budget is kept
+//   - The placement policy goes back to MM_PLACEMENT_FIRST_FIT
+//   - mm_check_incremental restarts from the first block
+//   - The heap profile is emptied (sampling itself keeps running)
 //   - Heap initialized with prologue blocks, epilogue, and initial free space
 //   - Memory manager ready for allocation/deallocation operations
 mm_init:
     str lr, [sp, #-16]!
 
+.ifdef MM_COMPACT
+    // Tags and link offsets are 32 bits wide
+    mov x1, #1 << 32
+    cmp x0, x1
+    b.hi .Linit_inval_err
+.endif
+
     // Call mem_init with x0
     bl mem_init
     cbnz x0, .Linit_ret  // Call failed, return the same result as mem_init
 
+.ifdef MM_SIDE_TABLE
+    // The prologues below are the first blocks with links
+    bl _side_table_map
+    cbnz x0, .Linit_ret
+.endif
+
+    ldr x1, =check_cursor
+    str xzr, [x1]
+
+    // Samples of an earlier heap describe blocks that no longer exist
+    bl _profile_reset
+
+.ifdef MM_BUDDY
+    // The buddy zone was a block of the old heap
+    bl _buddy_reset
+.endif
+
+    // Start the statistics from scratch
+    ldr x1, =stat_counters
+    ldr x2, =stat_counters_end
+.Linit_stats_loop:
+    str xzr, [x1], #WORD_SIZE_BYTES
+    cmp x1, x2
+    b.lo .Linit_stats_loop
+
+    // Nothing is parked on the quick lists (the budget is kept)
+    ldr x1, =quick_bytes
+    ldr x2, =quick_end
+.Linit_quick_loop:
+    str xzr, [x1], #WORD_SIZE_BYTES
+    cmp x1, x2
+    b.lo .Linit_quick_loop
+
+.ifdef MM_TLSF
+    // Every list starts out empty
+    ldr x1, =tlsf_fl_bitmap
+    ldr x2, =tlsf_bitmaps_end
+.Linit_tlsf_loop:
+    str xzr, [x1], #WORD_SIZE_BYTES
+    cmp x1, x2
+    b.lo .Linit_tlsf_loop
+.else
+    // So does the size tree, and no class has a next-fit rover
+    ldr x1, =tree_bitmap
+    ldr x2, =fit_state_end
+.Linit_tree_loop:
+    str xzr, [x1], #WORD_SIZE_BYTES
+    cmp x1, x2
+    b.lo .Linit_tree_loop
+
+    // The lists start on the power-of-two classes, and a new histogram is
+    // counted for as long as the period set by mm_set_adaptive_classes
+    ldr x1, =class_histogram
+    mov x2, #0
+.Linit_histogram_loop:
+    str xzr, [x1, x2, LSL #WORD_ALIGN]
+    add x2, x2, #1
+    cmp x2, #CLASS_TABLE_ENTRIES
+    b.lo .Linit_histogram_loop
+    bl _derive_free_list_classes
+    ldr x1, =adapt_period
+    ldr x2, [x1]
+    str x2, [x1, #WORD_SIZE_BYTES]  // adapt_countdown
+.endif
+
+    // Every heap starts with the default placement
+    ldr x1, =placement_policy
+    mov x2, #MM_PLACEMENT_FIRST_FIT
+    str x2, [x1]
+
     // Allocated space for the empty segmented free list
-    mov x0, #2 + NUM_SEG_LISTS * 4
-    bl mem_sbrk  // mem_sbrk(2 + NUM_SEG_LISTS * 4)
+    mov x0, #HEAP_OVERHEAD_BYTES
+    bl mem_sbrk  // mem_sbrk(HEAP_OVERHEAD_BYTES)
     cmp x0, #-1
     b.eq .Linit_ret  // mem_sbrk failed
 
-    str xzr, [x0], #WORD_SIZE_BYTES  // Alignment padding
+.ifdef MM_COMPACT
+    // Links are offsets from the start of the heap
+    ldr x1, =link_base
+    str x0, [x1]
+.endif
+
+    // Alignment padding, so payloads are DWORD_SIZE_BYTES aligned
+    stp xzr, xzr, [x0]
+    add x0, x0, #DWORD_SIZE_BYTES - TAG_SIZE_BYTES
+
+    // Initialize the segregated free lists
+    mov x2, #MIN_BLOCK_SIZE_BYTES  // Just the tags and links
+    SET_SIZE x1, x2
+    SET_ALLOCATED x1, 1
+    ldr x2, =seg_listp
+    mov x3, #0  // Iteration index
+.Linit_seglists_loop:
+    // Initialize the header
+    STORE_TAG x1, x0
+    SET_FPREV x0, x0
+    SET_FNEXT x0, x0
+
+    // Initialize the footer
+    STORE_TAG x1, x0, MIN_BLOCK_SIZE_BYTES - TAG_SIZE_BYTES
+
+    add x4, x0, #TAG_SIZE_BYTES  // Pointer to payload
+    str x4, [x2, x3, LSL #PTR_ALIGN]  // Update the segmented list array
+
+    add x0, x0, #MIN_BLOCK_SIZE_BYTES  // Next block
+    add x3, x3, #1
+    cmp x3, #NUM_FREE_LISTS
+    b.lt .Linit_seglists_loop
+    // End of loop
+
+    // Store the epilogue header
+    mov x2, #0
+    SET_SIZE x1, x2
+    SET_ALLOCATED x1, 1
+    STORE_TAG x1, x0
+
+    // Extend the heap with a free block of PAGE_SIZE_BYTES
+    mov x0, #PAGE_SIZE_BYTES / WORD_SIZE_BYTES
+    bl _extend_heap
+    cbz x0, .Lmm_init_extend_head_err
+
+    mov x0, #0
+    b .Linit_ret
+.ifdef MM_COMPACT
+.Linit_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+    b .Linit_ret
+.endif
+.Lmm_init_extend_head_err:
+    mov x0, #-1
+.Linit_ret:
+    ldr lr, [sp], #16
+    ret
+
+
+// De-initializes the memory manager and releases system resources.
+//
+// Syntax:
+//   bl mm_deinit
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 - Return status:
+//        0   = Success (arena unmapped or already uninitialized)
+//       -1   = Failure (invalid heap state or munmap failure; mm_errno is set)
+//
+// Behavior:
+//   - With MM_SIDE_TABLE, unmaps the side table first
+//   - Calls mem_deinit to release underlying memory system resources
+//   - Should be called when the memory manager is no longer needed
+//   - After calling, mm_init must be called again before using malloc/free
+//
+// Registers Modified:
+//   x0  - Return value from mem_deinit
+//   lr  - Modified by function call (restored)
+//   Any registers modified by mem_deinit
+//
+// Function Calls:
+//   - mem_deinit() - Releases underlying memory system resources
+//
+// Notes:
+//   - This is a simple wrapper around mem_deinit
+//   - Does not validate that mm_init was previously called
+//   - Does not free individual allocated blocks (caller responsible for this)
+//   - Global state (seg_listp array) is not explicitly cleared
+//
+// Warning:
+//   - Calling mm_malloc or mm_free after mm_deinit results in undefined
+//     behavior
+//   - Must call mm_init again to reinitialize before further use
+mm_deinit:
+    str lr, [sp, #-16]!
+
+    // Blocks still queued for mm_reclaim go away with the arena
+    ldr x1, =async_free_head
+    str xzr, [x1]
+
+.ifdef MM_SIDE_TABLE
+    bl _side_table_unmap
+    cbnz x0, .Ldeinit_ret
+.endif
+
+    bl mem_deinit
+.Ldeinit_ret:
+
+    ldr lr, [sp], #16
+    ret
+
+
+.ifdef MM_SIDE_TABLE
+// Maps the side table for the arena mem_init just reserved.
+//
+// Syntax:
+//   bl _side_table_map
+//
+// Return Value:
+//   x0 [Register]
+//      - 0, or -1 with mm_errno set to MM_ERR_NOMEM if the mmap fails
+//
+// Behavior:
+//   - Maps one SIDE_ENTRY_BYTES entry per 2 * DWORD_SIZE_BYTES of arena,
+//     with MAP_NORESERVE so untouched entries cost nothing
+//   - Sets side_table_bias and side_heap_base for the link macros
+//
+// Registers Modified:
+//   x0-x5, x8 - Clobbered
+//   x19       - Saved/restored (arena start)
+//   lr        - Saved/restored (for function calls)
+_side_table_map:
+    stp lr, x19, [sp, #-16]!
+
+    // x1 = table size
+    bl _get_mem_heap_end
+    mov x1, x0
+    bl _get_mem_heap_start
+    mov x19, x0
+    sub x1, x1, x19
+    lsr x1, x1, #1
+    ldr x2, =side_table_bytes
+    str x1, [x2]
+
+    sys_mmap #0, x1, #PROT_READ | PROT_WRITE, #MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, #-1, #0
+    cmn x0, #4095
+    b.hs .Lside_table_map_nomem_err  // -4095..-1 is an error code
+    ldr x1, =side_table
+    str x0, [x1]
+    sub x0, x0, x19, LSR #1
+    ldr x1, =side_table_bias
+    str x0, [x1]
+    add x0, x19, #WORD_SIZE_BYTES
+    ldr x1, =side_heap_base
+    str x0, [x1]
+    mov x0, #0
+    b .Lside_table_map_ret
+
+.Lside_table_map_nomem_err:
+    mov x0, #MM_ERR_NOMEM
+    bl set_mm_errno
+    mov x0, #-1
+.Lside_table_map_ret:
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Unmaps the side table, if there is one.
+//
+// Syntax:
+//   bl _side_table_unmap
+//
+// Return Value:
+//   x0 [Register]
+//      - 0, or -1 with mm_errno set to MM_ERR_INTERNAL if munmap fails
+//
+// Registers Modified:
+//   x0-x1, x8 - Clobbered
+//   lr        - Saved/restored (for function calls)
+_side_table_unmap:
+    str lr, [sp, #-16]!
+
+    ldr x0, =side_table
+    ldr x0, [x0]
+    cbz x0, .Lside_table_unmap_ret  // x0 = 0, nothing to do
+    ldr x1, =side_table_bytes
+    ldr x1, [x1]
+    sys_munmap x0, x1
+    cbnz x0, .Lside_table_unmap_err
+    ldr x1, =side_table
+    str xzr, [x1]
+    b .Lside_table_unmap_ret
+
+.Lside_table_unmap_err:
+    mov x0, #MM_ERR_INTERNAL
+    bl set_mm_errno
+    mov x0, #-1
+.Lside_table_unmap_ret:
+    ldr lr, [sp], #16
+    ret
+.endif
+
+
+// Allocates a block with at least size bytes of payload.
+//
+// Syntax:
+//   bl mm_malloc
+//
+// Parameters:
+//   x0 [Register]
+//      - Requested payload size in bytes
+//
+// Return Value:
+//   x0 [Register]
+//      - On success: Pointer to a 16-byte aligned payload of at least x0 bytes
+//      - On failure: NULL (0), and mm_errno is set to:
+//          MM_ERR_INVAL (size is 0)
+//          MM_ERR_NOMEM (size too large or the heap cannot be extended)
+//
+// Algorithm:
+//   1. Adjust the size to include the header/footer and alignment. While
+//      adaptive classes are on, count it in the request histogram, and
+//      re-derive the classes with _adapt_free_lists when the period is up.
+//   2. If blocks are parked on the quick lists, pop one of exactly the
+//      adjusted size and skip to step 6; a larger size than the quick
+//      lists hold merges them all with _quick_consolidate first
+//   3. Search the segregated free lists with _find_fit
+//   4. If no block fits, reclaim asynchronous frees and consolidate the
+//      quick lists, then extend the heap by max(adjusted size, PAGE_SIZE)
+//   5. Place the block with _place, splitting off any usable remainder
+//   6. Subtract the block size from profile_countdown and hand the block to
+//      _profile_sample when it runs out (see mm_profile.s)
+//
+// With MM_BUDDY, a power of two up to 2^BUDDY_MAX_ORDER is first tried in
+// the buddy zone with _buddy_malloc, and takes the steps above only if the
+// zone is full. Buddy blocks have no boundary tags to mark, so they are
+// never sampled.
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by the helpers
+//   x19    - Saved/restored (adjusted block size)
+//   lr     - Saved/restored (for function calls)
+mm_malloc:
+    TRACE_HOOK _trace_malloc
+_malloc_untraced:
+    stp lr, x19, [sp, #-16]!
+
+    cbz x0, .Lmalloc_inval_err
+    ldr x1, =MAX_REQUEST_SIZE_BYTES
+    cmp x0, x1
+    b.hi .Lmalloc_nomem_err
+
+.ifdef MM_BUDDY
+    sub x1, x0, #1
+    tst x0, x1
+    b.ne .Lmalloc_boundary_tags  // Not a power of two
+    lsr x1, x0, #BUDDY_MAX_ORDER + 1
+    cbnz x1, .Lmalloc_boundary_tags
+    mov x19, x0
+    bl _buddy_malloc
+    cbnz x0, .Lmalloc_ret
+    mov x0, x19
+.Lmalloc_boundary_tags:
+.endif
+
+    ADJUST_BLOCK_SIZE x0, x19
+
+.ifndef MM_TLSF
+    // Requests are counted while adaptive classes are on
+    ldr x1, =adapt_countdown
+    ldr x2, [x1]
+    cbnz x2, .Lmalloc_adapt
+.Lmalloc_counted:
+.endif
+
+    // Blocks parked on the quick lists are either reused as they are or
+    // merged before a larger block is looked for
+    ldr x1, =quick_bytes
+    ldr x1, [x1]
+    cbnz x1, .Lmalloc_quick
+.Lmalloc_find_fit:
+    mov x0, x19
+    bl _find_fit
+    cbnz x0, .Lmalloc_place
+
+    // Blocks queued by asynchronous frees may hold a fit
+    ldr x0, =async_free_head
+    ldr x0, [x0]
+    cbz x0, .Lmalloc_consolidate
+    bl mm_reclaim
+    mov x0, x19
+    bl _find_fit
+    cbnz x0, .Lmalloc_place
+.Lmalloc_consolidate:
+
+    // So may parked blocks once they are merged
+    ldr x0, =quick_bytes
+    ldr x0, [x0]
+    cbz x0, .Lmalloc_extend
+    bl _quick_consolidate
+    mov x0, x19
+    bl _find_fit
+    cbnz x0, .Lmalloc_place
+.Lmalloc_extend:
+
+    // No fit: extend the heap by max(asize, PAGE_SIZE_BYTES) bytes
+    mov x0, #PAGE_SIZE_BYTES
+    cmp x19, x0
+    csel x0, x19, x0, hi
+    lsr x0, x0, #WORD_ALIGN  // _extend_heap takes a word count
+    bl _extend_heap
+    cbz x0, .Lmalloc_ret  // mem_sbrk already set mm_errno
+
+.Lmalloc_place:
+    mov x1, x19
+    bl _place
+
+.Lmalloc_count:
+    // Sampling costs one subtraction unless the countdown runs out
+    ldr x1, =profile_countdown
+    ldr x2, [x1]
+    subs x2, x2, x19
+    str x2, [x1]
+    b.ls .Lmalloc_sample
+    b .Lmalloc_ret
+
+.Lmalloc_sample:
+    // The caller's return address and frame pointer start the stack
+    mov x19, x0
+    ldr x1, [sp]  // Saved lr
+    mov x2, x29
+    bl _profile_sample
+    mov x0, x19
+    b .Lmalloc_ret
+
+.Lmalloc_quick:
+    // x1 = bytes parked
+    // x2 = quick list slot of this size
+    cmp x19, #QUICK_MAX_BLOCK_BYTES
+    b.hi .Lmalloc_quick_consolidate
+    ldr x2, =quick_lists
+    lsr x3, x19, #QUICK_GRANULE_LOG2
+    add x2, x2, x3, LSL #PTR_ALIGN
+    ldr x0, [x2]
+    cbz x0, .Lmalloc_find_fit
+
+    // The block is still marked allocated; just pop it
+    ldr x3, [x0]
+    str x3, [x2]
+    sub x1, x1, x19
+    ldr x2, =quick_bytes
+    str x1, [x2]
+    b .Lmalloc_count
+
+.Lmalloc_quick_consolidate:
+    bl _quick_consolidate
+    b .Lmalloc_find_fit
+
+.ifndef MM_TLSF
+.Lmalloc_adapt:
+    // x1 = adapt_countdown
+    // x2 = calls left in the period
+    // x3 = histogram entry of this size
+    lsr x3, x19, #CLASS_GRANULE_LOG2
+    cmp x3, #CLASS_TABLE_ENTRIES
+    b.hs .Lmalloc_adapt_countdown  // The size tree keeps its classes
+    ldr x4, =class_histogram
+    ldr x5, [x4, x3, LSL #WORD_ALIGN]
+    add x5, x5, #1
+    str x5, [x4, x3, LSL #WORD_ALIGN]
+.Lmalloc_adapt_countdown:
+    subs x2, x2, #1
+    str x2, [x1]
+    b.ne .Lmalloc_counted
+
+    // No list is being walked, so the blocks can change lists here
+    bl _adapt_free_lists
+    b .Lmalloc_counted
+.endif
+
+.Lmalloc_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #0
+    b .Lmalloc_ret
+.Lmalloc_nomem_err:
+    mov x0, #MM_ERR_NOMEM
+    bl set_mm_errno
+    mov x0, #0
+.Lmalloc_ret:
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Allocates a block and reports how many payload bytes it really holds.
+//
+// Syntax:
+//   bl mm_malloc_sized
+//
+// Parameters:
+//   x0 [Register]
+//      - Requested payload size in bytes
+//   x1 [Register]
+//      - Pointer to a size_t that receives the usable size, or NULL
+//
+// Return Value:
+//   x0 [Register]
+//      - Same as mm_malloc
+//   *x1 [Memory]
+//      - Usable payload size of the block (see mm_usable_size), or 0 if the
+//        allocation failed
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by mm_malloc
+//   x19    - Saved/restored (usable size pointer)
+//   x29    - Saved/restored (frame record, so samples show our caller)
+//   lr     - Saved/restored (for function calls)
+mm_malloc_sized:
+    stp x29, lr, [sp, #-16]!
+    mov x29, sp
+    str x19, [sp, #-16]!
+
+    mov x19, x1
+    bl mm_malloc
+    cbz x19, .Lmalloc_sized_ret
+
+    mov x1, #0
+    cbz x0, .Lmalloc_sized_store
+.ifdef MM_BUDDY
+    IF_BUDDY_BLOCK x0, .Lmalloc_sized_buddy, x1, x2
+.endif
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    LOAD_TAG x1, x1
+    GET_SIZE x1, x1
+    sub x1, x1, #BOUNDARY_TAGS_BYTES  // Header and footer are not usable
+.ifdef MM_BUDDY
+    b .Lmalloc_sized_store
+.Lmalloc_sized_buddy:
+    str x0, [sp, #-16]!
+    bl _buddy_usable_size
+    mov x1, x0
+    ldr x0, [sp], #16
+.endif
+.Lmalloc_sized_store:
+    str x1, [x19]
+.Lmalloc_sized_ret:
+    ldr x19, [sp], #16
+    ldp x29, lr, [sp], #16
+    ret
+
+
+// Returns the number of payload bytes an allocated block can hold.
+//
+// Syntax:
+//   bl mm_usable_size
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer returned by an allocation function, or NULL
+//
+// Return Value:
+//   x0 [Register]
+//      - Block size minus the header and footer, which is at least the
+//        requested size and includes any rounding and unsplit remainder
+//      - 0 if the pointer is NULL
+//      - With MM_BUDDY, the whole block for a block of the buddy zone
+//
+// Registers Modified:
+//   x0    - Return value
+//   x1-x2 - Clobbered with MM_BUDDY
+mm_usable_size:
+    cbz x0, .Lusable_size_ret
+.ifdef MM_BUDDY
+    IF_BUDDY_BLOCK x0, _buddy_usable_size, x1, x2  // Tail call
+.endif
+    HEADER_P_FROM_PAYLOAD_P x0, x0
+    LOAD_TAG x0, x0
+    GET_SIZE x0, x0
+    sub x0, x0, #BOUNDARY_TAGS_BYTES  // Header and footer are not usable
+.Lusable_size_ret:
+    ret
+
+
+// Frees a block previously returned by mm_malloc.
+//
+// Syntax:
+//   bl mm_free
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer to free (NULL is a no-op)
+//
+// Return Value:
+//   None. On a rejected pointer mm_errno is set to:
+//     MM_ERR_INVAL   (pointer is not in memory of the allocator)
+//     MM_ERR_ALIGN   (pointer is not DWORD_SIZE_BYTES aligned)
+//     MM_ERR_CORRUPT (block is not marked allocated, e.g. a double free)
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by _free_block
+//   lr     - Saved/restored (for function calls)
+mm_free:
+    cbz x0, .Lfree_ret_leaf
+    TRACE_HOOK _trace_free
+_free_untraced:
+    TLS_ADDR async_free_enabled, x1
+    ldrb w1, [x1]
+    cbnz w1, _push_async_free  // Tail call; returns to our caller
+    str lr, [sp, #-16]!
+
+    bl _free_block
+
+    ldr lr, [sp], #16
+.Lfree_ret_leaf:
+    ret
+
+
+// Frees a block whose requested size is known to the caller.
+//
+// Syntax:
+//   bl mm_free_sized
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer to free (NULL is a no-op)
+//   x1 [Register]
+//      - The size that was passed to mm_malloc for this block
+//
+// Return Value:
+//   None. On a rejected pointer mm_errno is set as in mm_free. In MM_DEBUG
+//   builds a size that does not match the block sets MM_ERR_INVAL and the
+//   block is left allocated.
+//
+// Behavior:
+//   - Derives the block size from the caller's size instead of the header, so
+//     the footer address no longer depends on the header load
+//   - The header is still loaded, but only compared against the expected
+//     value; when it matches, both boundary tags are rewritten directly
+//   - Blocks that absorbed a split remainder (block size = adjusted size +
+//     MIN_BLOCK_SIZE_BYTES - DWORD_SIZE_BYTES, never with MM_COMPACT) and
+//     sampled blocks take the regular _free_block path
+//   - Without MM_DEBUG, any other mismatch also falls back to _free_block,
+//     which trusts the header
+//   - Pointers outside the heap's pages, including blocks of the buddy
+//     zone with MM_BUDDY, go straight to _free_block
+//   - While the quick lists are on, blocks they can hold also go to
+//     _free_block
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by _coalesce
+//   lr     - Saved/restored (for function calls)
+mm_free_sized:
+    cbz x0, .Lfree_sized_ret_leaf
+    TRACE_HOOK _trace_free_sized
+_free_sized_untraced:
+    TLS_ADDR async_free_enabled, x2
+    ldrb w2, [x2]
+    cbnz w2, _push_async_free  // Tail call; returns to our caller
+    str lr, [sp, #-16]!
+
+    PAGE_OWNER x0, x2, x3, .Lfree_sized_slow
+    cmp x2, #MEM_OWNER_HEAP
+    b.ne .Lfree_sized_slow  // _free_block sorts out foreign pointers
+    tst x0, #DWORD_SIZE_BYTES - 1
+    b.ne .Lfree_sized_slow  // _free_block reports the alignment error
+    ldr x2, =MAX_REQUEST_SIZE_BYTES
+    sub x3, x1, #1
+    cmp x3, x2
+    b.hs .Lfree_sized_bad_size  // size is 0 or too large to be valid
+
+    // x1 = header address
+    // x2 = header value
+    // x3 = block size derived from the caller's size
+    // x4 = expected header value
+    // x5 = footer address + TAG_SIZE_BYTES
+    ADJUST_BLOCK_SIZE x1, x3
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    add x5, x1, x3
+    LOAD_TAG x2, x1
+    PACK_HEADER x3, 1, x4
+    cmp x2, x4
+    b.ne .Lfree_sized_mismatch
+
+    // _free_block parks small blocks while the quick lists are on
+    ldr x6, =quick_budget
+    ldr x6, [x6]
+    cbz x6, .Lfree_sized_unmark
+    cmp x3, #QUICK_MAX_BLOCK_BYTES
+    b.ls .Lfree_sized_slow
+.Lfree_sized_unmark:
+    PACK_HEADER x3, 0, x4
+    STORE_TAG x4, x1  // Store header
+    STORE_TAG x4, x5, -TAG_SIZE_BYTES  // Store footer
+    ldr x1, =stat_allocated_blocks
+    ldr x2, [x1]
+    sub x2, x2, #1
+    str x2, [x1]
+    bl _coalesce
+    b .Lfree_sized_ret
+
+.Lfree_sized_mismatch:
+.ifdef MM_DEBUG
+    // _free_block reports blocks that are not allocated and handles sampled
+    // blocks, and only a split remainder absorbed by _place may make the
+    // block larger
+    tbz x2, #ALLOCATED_BIT, .Lfree_sized_slow
+    and x2, x2, #~SAMPLED_MASK
+    cmp x2, x4
+    b.eq .Lfree_sized_slow
+.if MIN_BLOCK_SIZE_BYTES > DWORD_SIZE_BYTES
+    add x3, x3, #MIN_BLOCK_SIZE_BYTES - DWORD_SIZE_BYTES
+    PACK_HEADER x3, 1, x4
+    cmp x2, x4
+    b.eq .Lfree_sized_slow
+.endif
+.Lfree_sized_bad_size:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    b .Lfree_sized_ret
+.else
+.Lfree_sized_bad_size:
+.endif
+.Lfree_sized_slow:
+    bl _free_block
+.Lfree_sized_ret:
+    ldr lr, [sp], #16
+.Lfree_sized_ret_leaf:
+    ret
+
+
+// Grows an allocated block in place without ever moving it.
+//
+// Syntax:
+//   bl mm_expand
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer of an allocated block
+//   x1 [Register]
+//      - Minimum payload size the block must reach for the call to succeed
+//   x2 [Register]
+//      - Payload size to grow toward; must be at least x1
+//
+// Return Value:
+//   x0 [Register]
+//      - On success: the new usable size of the block (as mm_usable_size),
+//        which is at least x1 and grows no further than needed for x2
+//      - On failure: 0, and the block is left untouched. mm_errno is set to
+//        MM_ERR_INVAL for invalid arguments; it is left alone when the
+//        block simply has no room to grow (apart from MM_ERR_NOMEM from a
+//        failed mem_sbrk). A success never changes mm_errno.
+//
+// Behavior:
+//   - Absorbs the next block if it is free
+//   - If the block (after absorbing) borders the epilogue, extends the heap
+//     with mem_sbrk by the missing amount, or by the amount still needed to
+//     reach the minimum if the arena cannot hold the maximum
+//   - Anything beyond the target that can form a block is split off and
+//     returned to the free lists
+//   - Never copies data or changes the payload address
+//   - With MM_BUDDY, blocks of the buddy zone never grow; the call succeeds
+//     only if the block already holds x1 bytes
+//
+// Algorithm:
+//   1. need = ADJUST(x1), want = ADJUST(x2); return early if the block
+//      already holds want
+//   2. avail = block size + size of the next block if it is free
+//   3. If avail < want and the epilogue follows, grow the heap
+//   4. If avail < need, fail without changes
+//   5. Unlink the absorbed block, allocate min(avail, want) and split off
+//      the rest
+//
+// Registers Modified:
+//   x0-x5   - Clobbered
+//   x19-x24 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+mm_expand:
+    TRACE_HOOK _trace_expand
+_expand_untraced:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    stp x22, x23, [sp, #-16]!
+    str x24, [sp, #-16]!
+
+    // x19 = payload
+    // x20 = block size needed for the minimum
+    // x21 = block size wanted for the maximum
+    // x22 = bytes available in place
+    // x23 = payload of the free next block to absorb, or NULL
+    // x24 = 1 if the epilogue follows the available space, then mm_errno
+    //       before extending the heap
+    mov x19, x0
+    cbz x19, .Lexpand_inval_err
+    cbz x1, .Lexpand_inval_err
+    cmp x1, x2
+    b.hi .Lexpand_inval_err
+    ldr x3, =MAX_REQUEST_SIZE_BYTES
+    cmp x2, x3
+    b.hi .Lexpand_inval_err
+.ifdef MM_BUDDY
+    IF_BUDDY_BLOCK x19, .Lexpand_buddy, x3, x4
+.endif
+    ADJUST_BLOCK_SIZE x1, x20
+    ADJUST_BLOCK_SIZE x2, x21
+
+    HEADER_P_FROM_PAYLOAD_P x19, x3
+    LOAD_TAG x3, x3
+    tbz x3, #ALLOCATED_BIT, .Lexpand_inval_err  // Not allocated
+    GET_SIZE x3, x22
+    cmp x22, x21
+    b.hs .Lexpand_ret_size  // Already large enough
+
+    // Look at the next block
+    // x3 = next payload
+    // x4 = next header value
+    mov x23, #0
+    add x3, x19, x22
+    HEADER_P_FROM_PAYLOAD_P x3, x4
+    LOAD_TAG x4, x4
+    tbnz x4, #ALLOCATED_BIT, .Lexpand_check_top
+    mov x23, x3
+    GET_SIZE x4, x5
+    add x22, x22, x5
+    add x3, x3, x5
+    HEADER_P_FROM_PAYLOAD_P x3, x4
+    LOAD_TAG x4, x4
+.Lexpand_check_top:
+    GET_SIZE x4, x4
+    cmp x4, #0  // Only the epilogue has size 0
+    cset x24, eq
+
+    cmp x22, x21
+    b.hs .Lexpand_have_room
+    cbz x24, .Lexpand_have_room
+
+    // Extend the heap by want - avail, or by need - avail if that fails.
+    // A failed first attempt leaves MM_ERR_NOMEM behind, so mm_errno is
+    // restored if the call succeeds anyway.
+    bl get_mm_errno
+    mov x24, x0
+    sub x0, x21, x22
+    bl mem_sbrk
+    cmn x0, #1
+    b.ne .Lexpand_extended_want
+    cmp x22, x20
+    b.hs .Lexpand_restore_errno  // The minimum is met without extending
+    sub x0, x20, x22
+    bl mem_sbrk
+    cmn x0, #1
+    b.eq .Lexpand_fail
+    mov x22, x20
+    mov x0, x24
+    bl set_mm_errno
+    b .Lexpand_new_epilogue
+.Lexpand_restore_errno:
+    mov x0, x24
+    bl set_mm_errno
+    b .Lexpand_have_room
+.Lexpand_extended_want:
+    mov x22, x21
+.Lexpand_new_epilogue:
+    // The block now ends at the new break; store a new epilogue there
+    add x3, x19, x22
+    mov x4, #0
+    PACK_HEADER x4, 1, x4
+    HEADER_P_FROM_PAYLOAD_P x3, x3
+    STORE_TAG x4, x3
+
+.Lexpand_have_room:
+    cmp x22, x20
+    b.lo .Lexpand_fail
+
+    // Neither the absorbed block nor an epilogue the heap grew over starts
+    // a block anymore; move mm_check_incremental's cursor to this one
+    ldr x1, =check_cursor
+    ldr x2, [x1]
+    sub x3, x2, x19
+    cmp x3, x22
+    b.hs .Lexpand_unlink  // Cursor is outside the available space
+    str x19, [x1]
+
+.Lexpand_unlink:
+    cbz x23, .Lexpand_place
+    mov x0, x23
+    bl _remove_from_free_list
+
+.Lexpand_place:
+    // x3 = new block size
+    // x4 = remainder
+    cmp x22, x21
+    csel x3, x22, x21, lo
+    sub x4, x22, x3
+    cmp x4, #MIN_BLOCK_SIZE_BYTES
+    b.hs .Lexpand_split
+    mov x3, x22  // Too small to split; keep it in the block
+    mov x4, #0
+.Lexpand_split:
+    PACK_HEADER x3, 1, x1
+    HEADER_P_FROM_PAYLOAD_P x19, x2
+    LOAD_TAG x5, x2
+    and x5, x5, #SAMPLED_MASK  // A sampled block stays sampled
+    orr x1, x1, x5
+    STORE_TAG x1, x2  // Store header
+    add x2, x2, x3
+    STORE_TAG x1, x2, -TAG_SIZE_BYTES  // Store footer
+    mov x22, x3
+    cbz x4, .Lexpand_ret_size
+
+    // The remainder is followed by an allocated block or the epilogue, so
+    // it does not need coalescing
+    PACK_HEADER x4, 0, x1
+    STORE_TAG x1, x2  // Store header
+    add x5, x2, x4
+    STORE_TAG x1, x5, -TAG_SIZE_BYTES  // Store footer
+    GET_PAYLOAD_P_FROM_HEADER_P x2, x0
+    bl _add_to_free_list
+
+.Lexpand_ret_size:
+    sub x0, x22, #BOUNDARY_TAGS_BYTES  // Usable size
+    b .Lexpand_ret
+
+.ifdef MM_BUDDY
+.Lexpand_buddy:
+    mov x20, x1
+    mov x0, x19
+    bl _buddy_usable_size
+    cmp x0, x20
+    b.hs .Lexpand_ret
+    b .Lexpand_fail
+.endif
+
+.Lexpand_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+.Lexpand_fail:
+    mov x0, #0
+.Lexpand_ret:
+    ldr x24, [sp], #16
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Designates or undesignates the calling thread for asynchronous frees.
+//
+// Syntax:
+//   bl mm_set_async_free
+//
+// Parameters:
+//   x0 [Register]
+//      - Non-zero to make mm_free/mm_free_sized/mm_free_batch on this thread
+//        only queue blocks for mm_reclaim; 0 to free them immediately again
+//
+// Return Value:
+//   None
+//
+// Notes:
+//   - The flag lives in thread-local storage, so each thread opts in on its
+//     own and other threads keep the regular free path
+//
+// Registers Modified:
+//   x1 - Address of the thread's flag
+mm_set_async_free:
+    cmp x0, #0
+    cset w0, ne
+    TLS_ADDR async_free_enabled, x1
+    strb w0, [x1]
+    ret
+
+
+// Queues a block for the reclaimer instead of freeing it.
+//
+// Syntax:
+//   bl _push_async_free
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer of the block to queue (must not be NULL)
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Pushes the block onto the lock-free stack at async_free_head, using
+//     the first word of the payload as the link
+//   - The block stays marked allocated, so nothing else in the heap is
+//     touched until mm_reclaim frees it
+//   - Safe to call from any number of threads at once; mm_reclaim detaches
+//     the whole stack with one exchange, so there is no ABA problem
+//
+// Registers Modified:
+//   x1-x4 - Clobbered
+_push_async_free:
+    ldr x1, =async_free_head
+    ldr x2, [x1]
+.Lpush_async_free_link:
+    str x2, [x0]  // block->next = head
+.Lpush_async_free_retry:
+    ldxr x3, [x1]
+    cmp x3, x2
+    b.ne .Lpush_async_free_moved
+    stlxr w4, x0, [x1]  // head = block
+    cbnz w4, .Lpush_async_free_retry
+    ret
+.Lpush_async_free_moved:
+    // Another thread pushed in between; relink against the new head
+    clrex
+    mov x2, x3
+    b .Lpush_async_free_link
+
+
+// Frees every block queued by threads in asynchronous free mode.
+//
+// Syntax:
+//   bl mm_reclaim
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - Number of blocks freed
+//
+// Behavior:
+//   - Atomically detaches the whole pending stack, then frees each block
+//     with _free_block (validation, coalescing and list insertion)
+//   - mm_malloc and mm_malloc_batch call this themselves before extending
+//     the heap, so queued blocks are reused even if no reclaimer runs
+//
+// Notes:
+//   - The heap itself is not thread-safe: mm_reclaim must not run at the
+//     same time as any other allocator call except the asynchronous frees
+//
+// Registers Modified:
+//   x0-x15  - Clobbered by _free_block
+//   x19-x20 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+mm_reclaim:
+    stp lr, x19, [sp, #-16]!
+    str x20, [sp, #-16]!
+
+    // x19 = next queued block
+    // x20 = number of blocks freed
+    ldr x1, =async_free_head
+.Lreclaim_detach:
+    ldaxr x19, [x1]
+    stxr w2, xzr, [x1]
+    cbnz w2, .Lreclaim_detach
+
+    mov x20, #0
+.Lreclaim_loop:
+    cbz x19, .Lreclaim_ret
+    mov x0, x19
+    ldr x19, [x19]  // Read the link before the block is freed
+    bl _free_block
+    add x20, x20, #1
+    b .Lreclaim_loop
+
+.Lreclaim_ret:
+    mov x0, x20
+    ldr x20, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Sets how many bytes of freed blocks the quick lists may hold.
+//
+// Syntax:
+//   bl mm_set_quick_lists
+//
+// Parameters:
+//   x0 [Register]
+//      - Budget in bytes (block sizes, boundary tags included); 0 turns
+//        the quick lists off
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - While the budget is non-zero, freed blocks of up to
+//     QUICK_MAX_BLOCK_BYTES are parked on a LIFO list of their exact size.
+//     They stay marked allocated in both boundary tags, so neither the free
+//     nor the next mm_malloc of the same size coalesces or splits anything.
+//   - Parked blocks are merged back by _quick_consolidate when mm_malloc
+//     is asked for a larger block, when no free block fits, and when a
+//     free would exceed the budget
+//   - Lowering the budget below the bytes already parked consolidates at
+//     once
+//
+// Notes:
+//   - Parked blocks count as allocated in mm_get_stats, mm_heap_walk and
+//     mm_heap_dump until they are consolidated
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by _quick_consolidate
+//   lr     - Saved/restored (for function calls)
+mm_set_quick_lists:
+    str lr, [sp, #-16]!
+
+    ldr x1, =quick_budget
+    str x0, [x1]
+    ldr x2, =quick_bytes
+    ldr x2, [x2]
+    cmp x2, x0
+    b.ls .Lset_quick_lists_ret
+    bl _quick_consolidate
+
+.Lset_quick_lists_ret:
+    ldr lr, [sp], #16
+    ret
+
+
+// Merges every block parked on the quick lists back into the free lists.
+//
+// Syntax:
+//   bl _quick_consolidate
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Marks each parked block free and coalesces it. A neighbor that is
+//     still parked looks allocated, and is merged when its own turn comes.
+//   - Leaves every quick list and the parked byte count empty
+//
+// Registers Modified:
+//   x0-x15  - Clobbered by _coalesce
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_quick_consolidate:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+
+    // x19 = next list slot
+    // x20 = next parked block
+    // x21 = number of blocks merged
+    ldr x19, =quick_lists
+    mov x21, #0
+.Lquick_consolidate_list:
+    ldr x20, [x19]
+    str xzr, [x19], #PTR_SIZE_BYTES
+.Lquick_consolidate_block:
+    cbz x20, .Lquick_consolidate_next_list
+    mov x0, x20
+    ldr x20, [x20]  // Read the link before the block is merged
+
+    // Clear the allocated bit in both boundary tags
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    LOAD_TAG x2, x1
+    SET_ALLOCATED x2, 0
+    STORE_TAG x2, x1
+    GET_SIZE x2, x3
+    add x1, x1, x3
+    STORE_TAG x2, x1, -TAG_SIZE_BYTES  // Footer
+
+    add x21, x21, #1
+    bl _coalesce
+    b .Lquick_consolidate_block
+
+.Lquick_consolidate_next_list:
+    ldr x0, =quick_end
+    cmp x19, x0
+    b.lo .Lquick_consolidate_list
+
+    ldr x1, =quick_bytes
+    str xzr, [x1]
+    ldr x1, =stat_allocated_blocks
+    ldr x2, [x1]
+    sub x2, x2, x21
+    str x2, [x1]
+
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Selects the placement policy of the current heap.
+//
+// Syntax:
+//   bl mm_set_placement_policy
+//
+// Parameters:
+//   w0 [Register]
+//      - MM_PLACEMENT_FIRST_FIT, MM_PLACEMENT_ADDRESS_ORDERED,
+//        MM_PLACEMENT_NEXT_FIT, MM_PLACEMENT_BEST_FIT or
+//        MM_PLACEMENT_WILDERNESS
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success, or -1 with mm_errno set to MM_ERR_INVAL for an
+//        unknown policy. TLSF keeps its own good-fit placement, so with
+//        MM_TLSF only MM_PLACEMENT_FIRST_FIT is accepted.
+//
+// Behavior:
+//   - Takes effect on the next _find_fit and _add_to_free_list (see there
+//     for what each policy does). The size tree of the last class is
+//     always searched for the best fit.
+//   - Clears the next-fit rovers, so next fit starts from the list heads,
+//     and the last remainder
+//   - MM_PLACEMENT_ADDRESS_ORDERED sorts the lists with _sort_free_lists,
+//     which walks the heap once
+//   - mm_init puts every new heap back on MM_PLACEMENT_FIRST_FIT
+//
+// Registers Modified:
+//   x0-x4 - Clobbered
+//   x19   - Saved/restored (policy)
+//   lr    - Saved/restored (for function calls)
+mm_set_placement_policy:
+    stp lr, x19, [sp, #-16]!
+
+    cmp w0, #MM_NUM_PLACEMENT_POLICIES
+    b.hs .Lset_placement_policy_inval_err
+.ifdef MM_TLSF
+    cbnz w0, .Lset_placement_policy_inval_err
+.endif
+    mov w19, w0
+    ldr x1, =placement_policy
+    str x19, [x1]
+
+.ifndef MM_TLSF
+    ldr x1, =fit_rovers
+    ldr x2, =fit_state_end
+.Lset_placement_policy_rovers:
+    str xzr, [x1], #PTR_SIZE_BYTES
+    cmp x1, x2
+    b.lo .Lset_placement_policy_rovers
+
+    cmp x19, #MM_PLACEMENT_ADDRESS_ORDERED
+    b.ne .Lset_placement_policy_ok
+    bl _sort_free_lists
+.endif
+
+.Lset_placement_policy_ok:
+    mov x0, #0
+    b .Lset_placement_policy_ret
+.Lset_placement_policy_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+.Lset_placement_policy_ret:
+    ldp lr, x19, [sp], #16
+    ret
+
+
+.ifndef MM_TLSF
+// Rebuilds the free lists below TREE_SEG_LIST in address order.
+//
+// Syntax:
+//   bl _sort_free_lists
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Empties those lists, then walks the heap from the first block to the
+//     epilogue and appends each free block to the tail of its list, so
+//     every list comes out sorted in O(heap blocks)
+//   - Lists are looked up with _get_free_list_index, so after new classes
+//     are derived this also moves every block to its new list
+//   - The statistics count _get_seglist_index's classes, so they are
+//     unchanged
+//   - Does nothing before mm_init
+//
+// Registers Modified:
+//   x0-x4 - Clobbered
+//   x19   - Saved/restored (payload of the current block)
+//   lr    - Saved/restored (for function calls)
+_sort_free_lists:
+    stp lr, x19, [sp, #-16]!
+
+    bl _get_mem_heap_start
+    cbz x0, .Lsort_free_lists_ret
+    mov x1, #HEAP_OVERHEAD_BYTES
+    add x19, x0, x1
+
+    // Point every sentinel back at itself
+    ldr x1, =seg_listp
+    mov x2, #0
+.Lsort_free_lists_empty:
+    ldr x3, [x1, x2, LSL #PTR_ALIGN]
+    HEADER_P_FROM_PAYLOAD_P x3, x3
+    SET_FPREV x3, x3
+    SET_FNEXT x3, x3
+    add x2, x2, #1
+    cmp x2, #TREE_SEG_LIST
+    b.lo .Lsort_free_lists_empty
+
+    // x3 = size of the current block
+    // x4 = its header value
+.Lsort_free_lists_block:
+    HEADER_P_FROM_PAYLOAD_P x19, x4
+    LOAD_TAG x4, x4
+    GET_SIZE x4, x3
+    cbz x3, .Lsort_free_lists_ret  // Epilogue
+    tbnz x4, #ALLOCATED_BIT, .Lsort_free_lists_next  // Allocated
+    cmp x3, #TREE_MIN_BLOCK_BYTES
+    b.hs .Lsort_free_lists_next  // In the size tree
+    mov x0, x3
+    bl _get_free_list_index
+
+    // Append: x1 = sentinel header, x2 = old tail header, x4 = block header
+    ldr x1, =seg_listp
+    ldr x1, [x1, x0, LSL #PTR_ALIGN]
+    HEADER_P_FROM_PAYLOAD_P x1, x1
+    GET_FPREV x1, x2
+    HEADER_P_FROM_PAYLOAD_P x19, x4
+    SET_FNEXT x2, x4
+    SET_FPREV x4, x2
+    SET_FNEXT x4, x1
+    SET_FPREV x1, x4
+.Lsort_free_lists_next:
+    add x19, x19, x3
+    b .Lsort_free_lists_block
+
+.Lsort_free_lists_ret:
+    ldp lr, x19, [sp], #16
+    ret
+.endif
+
+
+// Lets the free lists' size classes follow the sizes the program requests.
+//
+// Syntax:
+//   bl mm_set_adaptive_classes
+//
+// Parameters:
+//   x0 [Register]
+//      - Number of mm_malloc calls between re-derivations; 0 (the default)
+//        turns adaptation off
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success, or -1 with mm_errno set to MM_ERR_INVAL with MM_TLSF,
+//        whose second-level lists are already DWORD_SIZE_BYTES apart for
+//        small blocks
+//
+// Behavior:
+//   - While on, mm_malloc counts each adjusted size below
+//     TREE_MIN_BLOCK_BYTES in class_histogram, and every period calls
+//     _adapt_free_lists before it searches, so hot sizes get lists of
+//     their own (see _derive_free_list_classes)
+//   - Turning it off clears the histogram and moves the lists back to the
+//     power-of-two classes at once
+//   - The period outlives mm_init; the histogram and classes do not
+//
+// Notes:
+//   - mm_malloc_batch is not counted
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+//   lr    - Saved/restored (for function calls)
+mm_set_adaptive_classes:
+    str lr, [sp, #-16]!
+
+.ifdef MM_TLSF
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+.else
+    ldr x1, =adapt_period
+    stp x0, x0, [x1]  // adapt_period, adapt_countdown
+    cbnz x0, .Lset_adaptive_classes_ok
+
+    // Off: without counts, the derived classes are the power-of-two ones
+    ldr x1, =class_histogram
+    mov x2, #0
+.Lset_adaptive_classes_clear:
+    str xzr, [x1, x2, LSL #WORD_ALIGN]
+    add x2, x2, #1
+    cmp x2, #CLASS_TABLE_ENTRIES
+    b.lo .Lset_adaptive_classes_clear
+    bl _adapt_free_lists
+
+.Lset_adaptive_classes_ok:
+    mov x0, #0
+.endif
+    ldr lr, [sp], #16
+    ret
+
+
+.ifndef MM_TLSF
+// Derives new size classes from the request histogram and moves the free
+// blocks onto them.
+//
+// Syntax:
+//   bl _adapt_free_lists
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Rebuilds free_list_classes with _derive_free_list_classes
+//   - Clears the next-fit rovers, whose blocks may change lists; the last
+//     remainder stays on a list and is kept
+//   - Relinks every free block below TREE_MIN_BLOCK_BYTES with
+//     _sort_free_lists, one heap walk, and starts a new period
+//   - Must not run while a list is being walked or a block is half linked
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+//   lr    - Saved/restored (for function calls)
+_adapt_free_lists:
+    str lr, [sp, #-16]!
+
+    bl _derive_free_list_classes
+
+    ldr x1, =fit_rovers
+    mov x2, #0
+.Ladapt_free_lists_rovers:
+    str xzr, [x1, x2, LSL #PTR_ALIGN]
+    add x2, x2, #1
+    cmp x2, #NUM_SEG_LISTS
+    b.lo .Ladapt_free_lists_rovers
+
+    bl _sort_free_lists
+
+    ldr x1, =adapt_period
+    ldr x2, [x1]
+    str x2, [x1, #WORD_SIZE_BYTES]  // adapt_countdown
+
+    ldr lr, [sp], #16
+    ret
+
+
+// Fills free_list_classes from class_histogram.
+//
+// Syntax:
+//   bl _derive_free_list_classes
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - A size counted in more than 1/2^CLASS_HOT_LOG2 of the requests is
+//     hot. In size order, each hot size gets a list that holds only that
+//     size, as long as the boundaries it needs (below and above it; a hot
+//     neighbor shares one) fit in the TREE_SEG_LIST lists below the tree.
+//   - Lists left over split the remaining sizes at the power-of-two
+//     boundaries of _get_seglist_index, largest first, so with no hot
+//     sizes the classes are exactly _get_seglist_index's
+//   - Classes stay contiguous and ordered by size, so _find_fit's walk up
+//     from the request's list still sees every block that fits
+//   - Halves every count, so the next derivation weighs recent requests
+//     most
+//
+// Algorithm:
+//   1. Sum the histogram and clear the table; the table first marks the
+//      entries that start a new list with 1
+//   2. Mark hot sizes as above
+//   3. Mark power-of-two boundaries until CLASS_MAX_BOUNDARIES are marked
+//   4. Turn the marks into list indices with a running sum, halving the
+//      counts on the way, and point the last entry at TREE_SEG_LIST
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+_derive_free_list_classes:
+    // x0 = free_list_classes
+    // x1 = class_histogram
+    // x2 = requests counted, then the hot threshold
+    // x3 = table entry
+    ldr x0, =free_list_classes
+    ldr x1, =class_histogram
+    mov x2, #0
+    mov x3, #0
+.Lderive_classes_total:
+    ldr x5, [x1, x3, LSL #WORD_ALIGN]
+    add x2, x2, x5
+    strb wzr, [x0, x3]
+    add x3, x3, #1
+    cmp x3, #CLASS_TABLE_ENTRIES
+    b.lo .Lderive_classes_total
+    lsr x2, x2, #CLASS_HOT_LOG2
+
+    // x4 = boundaries marked
+    // x5 = 1 if a hot size needs the boundary below it
+    // x6 = boundaries it needs
+    // w8 = 1, the mark
+    mov x3, #CLASS_MIN_ENTRY
+    mov x4, #0
+    mov w8, #1
+.Lderive_classes_hot:
+    ldr x5, [x1, x3, LSL #WORD_ALIGN]
+    cmp x5, x2
+    b.ls .Lderive_classes_hot_next  // Cold
+
+    // The smallest block has nothing below it, and the last entry nothing
+    // above it within the table
+    cmp x3, #CLASS_TABLE_ENTRIES - 1
+    cset x6, lo
+    ldrb w5, [x0, x3]
+    eor w5, w5, #1
+    cmp x3, #CLASS_MIN_ENTRY
+    csel x5, x5, xzr, hi
+    add x6, x6, x5
+    add x7, x4, x6
+    cmp x7, #CLASS_MAX_BOUNDARIES
+    b.hi .Lderive_classes_hot_next  // No lists left for it
+    mov x4, x7
+    cbz x5, .Lderive_classes_hot_above
+    strb w8, [x0, x3]
+.Lderive_classes_hot_above:
+    add x5, x3, #1
+    strb w8, [x0, x5]  // Past the last entry, overwritten below
+.Lderive_classes_hot_next:
+    add x3, x3, #1
+    cmp x3, #CLASS_TABLE_ENTRIES
+    b.lo .Lderive_classes_hot
+
+    mov x3, #CLASS_TABLE_ENTRIES / 2
+.Lderive_classes_pow2:
+    cmp x4, #CLASS_MAX_BOUNDARIES
+    b.hs .Lderive_classes_sum
+    ldrb w5, [x0, x3]
+    cbnz w5, .Lderive_classes_pow2_next
+    strb w8, [x0, x3]
+    add x4, x4, #1
+.Lderive_classes_pow2_next:
+    lsr x3, x3, #1
+    cmp x3, #CLASS_POW2_MIN_ENTRY
+    b.hs .Lderive_classes_pow2
+
+.Lderive_classes_sum:
+    // x4 = list of the current entry
+    mov x3, #0
+    mov x4, #0
+.Lderive_classes_sum_loop:
+    ldrb w5, [x0, x3]
+    add x4, x4, x5
+    strb w4, [x0, x3]
+    ldr x5, [x1, x3, LSL #WORD_ALIGN]
+    lsr x5, x5, #1
+    str x5, [x1, x3, LSL #WORD_ALIGN]
+    add x3, x3, #1
+    cmp x3, #CLASS_TABLE_ENTRIES
+    b.lo .Lderive_classes_sum_loop
+    mov w4, #TREE_SEG_LIST
+    strb w4, [x0, x3]
+    ret
+.endif
+
+
+// Allocates up to n blocks of the same size in one call.
+//
+// Syntax:
+//   bl mm_malloc_batch
+//
+// Parameters:
+//   x0 [Register]
+//      - Requested payload size in bytes for every block
+//   x1 [Register]
+//      - Number of blocks to allocate
+//   x2 [Register]
+//      - Pointer to an array of at least n pointers that receives the
+//        payload pointers
+//
+// Return Value:
+//   x0 [Register]
+//      - Number of blocks written to the output array. Less than n only on
+//        failure, in which case mm_errno is set as in mm_malloc and the
+//        blocks already written remain allocated.
+//
+// Behavior:
+//   - The size is adjusted and the size class looked up once for the whole
+//     batch instead of once per block
+//   - Each fitting free block is unlinked once and carved into as many
+//     blocks as it can hold, front to back, so blocks of one batch are
+//     contiguous in memory
+//   - Only the final remainder of each carved block goes back on a free list
+//   - When nothing fits, the heap is extended once for all remaining blocks
+//
+// Algorithm:
+//   1. Validate and adjust the size (same rules as mm_malloc)
+//   2. While blocks remain:
+//      a. Find a fit for one block; if none, reclaim asynchronous frees
+//         (once per call, as other threads may keep queueing blocks that do
+//         not fit) and consolidate the quick lists, and failing that extend
+//         the heap by
+//         max(remaining * asize, PAGE_SIZE), or by a single block if the
+//         arena cannot hold the rest of the batch
+//      b. Remove the fit from its free list
+//      c. Carve blocks of asize while the fit holds one; the last block
+//         absorbs any tail smaller than MIN_BLOCK_SIZE_BYTES
+//      d. Return a non-empty remainder to the free lists
+//
+// Registers Modified:
+//   x0-x15  - Clobbered by the helpers
+//   x19-x26 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+mm_malloc_batch:
+    TRACE_HOOK _trace_malloc_batch
+_malloc_batch_untraced:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    stp x22, x23, [sp, #-16]!
+    stp x24, x25, [sp, #-16]!
+    str x26, [sp, #-16]!
+
+    // x19 = adjusted block size
+    // x20 = blocks still to allocate
+    // x21 = output array cursor
+    // x22 = number of blocks allocated
+    // x26 = 1 once asynchronous frees were reclaimed
+    mov x20, x1
+    mov x21, x2
+    mov x22, #0
+    mov x26, #0
+    cbz x20, .Lmalloc_batch_ret
+    cbz x0, .Lmalloc_batch_inval_err
+    ldr x1, =MAX_REQUEST_SIZE_BYTES
+    cmp x0, x1
+    b.hi .Lmalloc_batch_nomem_err
+
+    ADJUST_BLOCK_SIZE x0, x19
+
+.Lmalloc_batch_fill:
+    cbz x20, .Lmalloc_batch_ret
+
+    mov x0, x19
+    bl _find_fit
+    cbnz x0, .Lmalloc_batch_carve
+
+    // Blocks queued by asynchronous frees may hold a fit
+    cbnz x26, .Lmalloc_batch_consolidate
+    ldr x0, =async_free_head
+    ldr x0, [x0]
+    cbz x0, .Lmalloc_batch_consolidate
+    mov x26, #1
+    bl mm_reclaim
+    b .Lmalloc_batch_fill
+.Lmalloc_batch_consolidate:
+
+    // So may parked blocks once they are merged
+    ldr x0, =quick_bytes
+    ldr x0, [x0]
+    cbz x0, .Lmalloc_batch_extend
+    bl _quick_consolidate
+    b .Lmalloc_batch_fill
+.Lmalloc_batch_extend:
+
+    // No fit: extend once for everything still needed
+    umulh x1, x19, x20
+    cbnz x1, .Lmalloc_batch_nomem_err  // remaining * asize overflows
+    mul x0, x19, x20
+    mov x1, #PAGE_SIZE_BYTES
+    cmp x0, x1
+    csel x0, x0, x1, hi
+    lsr x0, x0, #WORD_ALIGN  // _extend_heap takes a word count
+    bl _extend_heap
+    cbnz x0, .Lmalloc_batch_carve
+
+    // The arena cannot hold the whole rest of the batch; fall back to
+    // extending for a single block so the batch fills as far as it can.
+    cmp x20, #1
+    b.eq .Lmalloc_batch_ret  // mem_sbrk already set mm_errno
+    mov x0, #PAGE_SIZE_BYTES
+    cmp x19, x0
+    csel x0, x19, x0, hi
+    lsr x0, x0, #WORD_ALIGN
+    bl _extend_heap
+    cbz x0, .Lmalloc_batch_ret  // mem_sbrk already set mm_errno
+
+.Lmalloc_batch_carve:
+    // x23 = payload of the next block to carve
+    // x24 = bytes left in the fit
+    mov x23, x0
+    HEADER_P_FROM_PAYLOAD_P x23, x1
+    LOAD_TAG x1, x1
+    GET_SIZE x1, x24
+    bl _remove_from_free_list  // x0 still holds the fit's payload
+
+.Lmalloc_batch_carve_loop:
+    cbz x20, .Lmalloc_batch_remainder
+    cmp x24, x19
+    b.lo .Lmalloc_batch_remainder
+
+    // x25 = size of this block; takes the whole tail if it cannot be split
+    mov x25, x19
+    sub x1, x24, x19
+    cmp x1, #MIN_BLOCK_SIZE_BYTES
+    csel x25, x24, x25, lo
+
+    PACK_HEADER x25, 1, x1
+    HEADER_P_FROM_PAYLOAD_P x23, x2
+    STORE_TAG x1, x2  // Store header
+    add x2, x2, x25
+    STORE_TAG x1, x2, -TAG_SIZE_BYTES  // Store footer
+
+    str x23, [x21], #PTR_SIZE_BYTES
+    add x22, x22, #1
+    sub x20, x20, #1
+    add x23, x23, x25
+    sub x24, x24, x25
+    b .Lmalloc_batch_carve_loop
+
+.Lmalloc_batch_remainder:
+    // The fit's physical neighbors were allocated, so the remainder never
+    // needs coalescing.
+    cbz x24, .Lmalloc_batch_fill
+    PACK_HEADER x24, 0, x1
+    HEADER_P_FROM_PAYLOAD_P x23, x2
+    STORE_TAG x1, x2  // Store header
+    add x2, x2, x24
+    STORE_TAG x1, x2, -TAG_SIZE_BYTES  // Store footer
+    mov x0, x23
+    bl _add_to_free_list
+    b .Lmalloc_batch_fill
+
+.Lmalloc_batch_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    b .Lmalloc_batch_ret
+.Lmalloc_batch_nomem_err:
+    mov x0, #MM_ERR_NOMEM
+    bl set_mm_errno
+.Lmalloc_batch_ret:
+    ldr x1, =stat_allocated_blocks
+    ldr x2, [x1]
+    add x2, x2, x22
+    str x2, [x1]
+
+    mov x0, x22
+    ldr x26, [sp], #16
+    ldp x24, x25, [sp], #16
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Frees every pointer in an array in one call.
+//
+// Syntax:
+//   bl mm_free_batch
+//
+// Parameters:
+//   x0 [Register]
+//      - Pointer to an array of payload pointers (NULL entries are skipped)
+//   x1 [Register]
+//      - Number of entries in the array
+//
+// Return Value:
+//   None. Invalid entries are skipped and mm_errno is set as in mm_free.
+//
+// Behavior:
+//   - Sets up a single stack frame for the whole batch and feeds each entry
+//     straight to _free_block, or to _push_async_free if the calling thread
+//     is in asynchronous free mode
+//
+// Registers Modified:
+//   x0-x15  - Clobbered by _free_block
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+mm_free_batch:
+    TRACE_HOOK _trace_free_batch
+_free_batch_untraced:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+
+    // x19 = array cursor
+    // x20 = entries left
+    // x21 = routine applied to each entry, chosen once for the batch
+    mov x19, x0
+    mov x20, x1
+    adr x21, _free_block
+    TLS_ADDR async_free_enabled, x1
+    ldrb w1, [x1]
+    cbz w1, .Lfree_batch_loop
+    adr x21, _push_async_free
+.Lfree_batch_loop:
+    cbz x20, .Lfree_batch_ret
+    ldr x0, [x19], #PTR_SIZE_BYTES
+    sub x20, x20, #1
+    cbz x0, .Lfree_batch_loop
+    blr x21
+    b .Lfree_batch_loop
+
+.Lfree_batch_ret:
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Copies the allocator statistics into a caller-provided struct mm_stats.
+//
+// Syntax:
+//   bl mm_get_stats
+//
+// Parameters:
+//   x0 [Register]
+//      - Pointer to a struct mm_stats (see mm.h and mm_stats_constants.inc)
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 if the pointer is NULL (mm_errno is set to MM_ERR_INVAL)
+//
+// Behavior:
+//   - Heap size, peak heap size and the sbrk/mmap call counts come from the
+//     memory layer
+//   - Per-class free bytes and blocks, the allocated block count and the
+//     _coalesce case counts are copied from the counters the allocator
+//     maintains as it goes
+//   - Allocated bytes are derived as the heap size minus the fixed prologue
+//     and epilogue overhead and the free bytes, so blocks waiting in the
+//     asynchronous free queue count as allocated
+//   - The latency fields are summarized by _latency_summarize from the
+//     per-thread histograms
+//
+// Registers Modified:
+//   x0-x15  - Clobbered
+//   x19-x20 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+//
+// Notes:
+//   - Takes no lock. Every counter is an aligned 64-bit word, so each field
+//     is read atomically, but a snapshot taken while another thread is in
+//     the allocator may mix values from before and after its call.
+mm_get_stats:
+    stp lr, x19, [sp, #-16]!
+    str x20, [sp, #-16]!
+
+    // x19 = output struct
+    // x20 = heap start
+    mov x19, x0
+    cbz x19, .Lget_stats_inval_err
+
+    bl _get_mem_heap_start
+    mov x20, x0
+    bl _get_mem_brk
+    sub x0, x0, x20
+    str x0, [x19, #MM_STATS_HEAP_BYTES]
+    bl mem_get_peak_brk
+    sub x0, x0, x20
+    str x0, [x19, #MM_STATS_PEAK_HEAP_BYTES]
+    bl mem_get_sbrk_calls
+    str x0, [x19, #MM_STATS_SBRK_CALLS]
+    bl mem_get_mmap_calls
+    str x0, [x19, #MM_STATS_MMAP_CALLS]
+
+    // Copy the per-class counters, summing the free bytes
+    // x1 = counter index
+    // x2 = free bytes counters
+    // x3 = free block counters
+    // x4 = total free bytes
+    // x5 = output free bytes array
+    // x6 = output free blocks array
+    mov x1, #0
+    ldr x2, =stat_free_bytes
+    ldr x3, =stat_free_blocks
+    mov x4, #0
+    add x5, x19, #MM_STATS_FREE_BYTES
+    add x6, x19, #MM_STATS_FREE_BLOCKS
+.Lget_stats_class_loop:
+    ldr x7, [x2, x1, LSL #3]
+    add x4, x4, x7
+    str x7, [x5, x1, LSL #3]
+    ldr x7, [x3, x1, LSL #3]
+    str x7, [x6, x1, LSL #3]
+    add x1, x1, #1
+    cmp x1, #NUM_SEG_LISTS
+    b.lo .Lget_stats_class_loop
+
+    // allocated bytes = heap size - overhead - free bytes (0 before mm_init)
+    ldr x0, [x19, #MM_STATS_HEAP_BYTES]
+    cbz x0, .Lget_stats_allocated_bytes
+    mov x1, #HEAP_OVERHEAD_BYTES
+    sub x0, x0, x1
+    sub x0, x0, x4
+.Lget_stats_allocated_bytes:
+    str x0, [x19, #MM_STATS_ALLOCATED_BYTES]
+
+    ldr x1, =stat_allocated_blocks
+    ldr x1, [x1]
+    str x1, [x19, #MM_STATS_ALLOCATED_BLOCKS]
+
+    ldr x1, =placement_policy
+    ldr x1, [x1]
+    str x1, [x19, #MM_STATS_PLACEMENT_POLICY]
+
+    mov x1, #0
+    ldr x2, =stat_coalesce_cases
+    add x3, x19, #MM_STATS_COALESCE_CASES
+.Lget_stats_coalesce_loop:
+    ldr x4, [x2, x1, LSL #3]
+    str x4, [x3, x1, LSL #3]
+    add x1, x1, #1
+    cmp x1, #MM_NUM_COALESCE_CASES
+    b.lo .Lget_stats_coalesce_loop
+
+    mov x0, x19
+    bl _latency_summarize
+
+    mov x0, #0
+    b .Lget_stats_ret
+
+.Lget_stats_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+.Lget_stats_ret:
+    ldr x20, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Calls a function on every block of the heap, in address order.
+//
+// Syntax:
+//   bl mm_heap_walk
+//
+// Parameters:
+//   x0 [Register]
+//      - Callback: int fn(void *payload, size_t size, int allocated,
+//        void *ctx)
+//   x1 [Register]
+//      - Context pointer passed through to the callback
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 once every block was visited
+//      - The first non-zero value returned by the callback
+//      - -1 on error, with mm_errno set to:
+//          MM_ERR_INVAL    (the callback is NULL)
+//          MM_ERR_INTERNAL (the heap is not initialized)
+//
+// Behavior:
+//   - Starts at the first block after the seg-list prologues and follows
+//     NEXT_PAYLOAD_P until the epilogue (size 0)
+//   - Reports the block size from the header, boundary tags included, and
+//     the allocated bit as 0 or 1
+//
+// Registers Modified:
+//   x0-x18  - Clobbered by the callback
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+//
+// Notes:
+//   - The callback must not call into the allocator, since the walk reads
+//     the next header only after the callback returns
+mm_heap_walk:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+
+    // x19 = callback
+    // x20 = context
+    // x21 = payload of the current block
+    mov x19, x0
+    mov x20, x1
+    cbz x19, .Lheap_walk_inval_err
+    bl _get_mem_heap_start
+    cbz x0, .Lheap_walk_internal_err
+    mov x1, #HEAP_OVERHEAD_BYTES
+    add x21, x0, x1
+
+.Lheap_walk_loop:
+    HEADER_P_FROM_PAYLOAD_P x21, x2
+    LOAD_TAG x2, x2
+    GET_SIZE x2, x1
+    cbz x1, .Lheap_walk_done  // Reached the epilogue
+    GET_ALLOCATED x2, x2
+    mov x0, x21
+    mov x3, x20
+    blr x19
+    cbnz w0, .Lheap_walk_stopped
+    NEXT_PAYLOAD_P x21, x2
+    mov x21, x2
+    b .Lheap_walk_loop
+
+.Lheap_walk_stopped:
+    sxtw x0, w0  // Return the callback's int as is
+    b .Lheap_walk_ret
+.Lheap_walk_done:
+    mov x0, #0
+    b .Lheap_walk_ret
+.Lheap_walk_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+    b .Lheap_walk_ret
+.Lheap_walk_internal_err:
+    mov x0, #MM_ERR_INTERNAL
+    bl set_mm_errno
+    mov x0, #-1
+.Lheap_walk_ret:
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Writes a binary snapshot of the heap to a file descriptor.
+//
+// Syntax:
+//   bl mm_heap_dump
+//
+// Parameters:
+//   x0 [Register]
+//      - File descriptor to write to
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 on error, with mm_errno set to:
+//          MM_ERR_IO       (a write syscall failed)
+//          MM_ERR_INTERNAL (the heap is not initialized)
+//
+// Behavior:
+//   - Performs the same traversal as mm_heap_walk, copying each block's
+//     header into a HEAP_DUMP_BUFFER_BYTES buffer on the stack
+//   - The snapshot is MM_HEAP_DUMP_MAGIC, the first block's payload address,
+//     then every header up to and including the epilogue's; block addresses
+//     follow from the first address and the sizes
+//   - With MM_COMPACT, headers are widened to the 64-bit encoding first, so
+//     the format does not depend on the layout
+//   - Flushes the buffer with _write_all whenever it fills, so the heap is
+//     only read between syscalls and a snapshot costs one write per
+//     HEAP_DUMP_BUFFER_BYTES / WORD_SIZE_BYTES blocks
+//
+// Registers Modified:
+//   x0-x8   - Clobbered
+//   x19-x22 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+//
+// Notes:
+//   - If a write fails part of the snapshot may already have been written;
+//     readers detect it by the missing epilogue header
+mm_heap_dump:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    str x22, [sp, #-16]!
+    sub sp, sp, #HEAP_DUMP_BUFFER_BYTES
+
+    // x19 = file descriptor
+    // x20 = payload of the current block
+    // x21 = buffer
+    // x22 = buffer cursor
+    mov x19, x0
+    mov x21, sp
+    bl _get_mem_heap_start
+    cbz x0, .Lheap_dump_internal_err
+    mov x1, #HEAP_OVERHEAD_BYTES
+    add x20, x0, x1
+
+    ldr x1, =MM_HEAP_DUMP_MAGIC
+    stp x1, x20, [x21]
+    add x22, x21, #2 * WORD_SIZE_BYTES
+
+.Lheap_dump_loop:
+    HEADER_P_FROM_PAYLOAD_P x20, x1
+    LOAD_TAG x1, x1
+    GET_SIZE x1, x2
+.ifdef MM_COMPACT
+    // The dump keeps the wide header encoding of mm.h
+    orr x3, x2, x1, LSL #63  // Allocated
+    ubfx x1, x1, #SAMPLED_BIT, #1
+    orr x1, x3, x1, LSL #62  // Sampled
+.endif
+    str x1, [x22], #WORD_SIZE_BYTES
+    cbz x2, .Lheap_dump_last  // Wrote the epilogue
+    add x20, x20, x2  // Next payload
+    add x3, x21, #HEAP_DUMP_BUFFER_BYTES
+    cmp x22, x3
+    b.lo .Lheap_dump_loop
+
+    // The buffer is full
+    mov x0, x19
+    mov x1, x21
+    sub x2, x22, x21
+    bl _write_all
+    cbnz x0, .Lheap_dump_ret
+    mov x22, x21
+    b .Lheap_dump_loop
+
+.Lheap_dump_last:
+    mov x0, x19
+    mov x1, x21
+    sub x2, x22, x21
+    bl _write_all
+    b .Lheap_dump_ret
+
+.Lheap_dump_internal_err:
+    mov x0, #MM_ERR_INTERNAL
+    bl set_mm_errno
+    mov x0, #-1
+.Lheap_dump_ret:
+    add sp, sp, #HEAP_DUMP_BUFFER_BYTES
+    ldr x22, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Writes a whole buffer to a file descriptor.
+//
+// Syntax:
+//   bl _write_all
+//
+// Parameters:
+//   x0 [Register]
+//      - File descriptor
+//   x1 [Register]
+//      - Buffer address
+//   x2 [Register]
+//      - Number of bytes to write
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 once every byte was written
+//      - -1 if a write failed or made no progress (mm_errno is set to
+//        MM_ERR_IO)
+//
+// Behavior:
+//   - Repeats the write syscall after short writes and after EINTR
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+//   x8    - Used for the syscall number
+//   lr    - Saved/restored (for function calls)
+_write_all:
+    str lr, [sp, #-16]!
+
+    // x3 = file descriptor
+    // x4 = next byte to write
+    // x5 = bytes left
+    mov x3, x0
+    mov x4, x1
+    mov x5, x2
+.Lwrite_all_loop:
+    cbz x5, .Lwrite_all_done
+    sys_write x3, x4, x5
+    cmn x0, #EINTR
+    b.eq .Lwrite_all_loop  // Interrupted before writing anything; retry
+    cmp x0, #0
+    b.le .Lwrite_all_err
+    add x4, x4, x0
+    sub x5, x5, x0
+    b .Lwrite_all_loop
+
+.Lwrite_all_done:
+    mov x0, #0
+    b .Lwrite_all_ret
+.Lwrite_all_err:
+    mov x0, #MM_ERR_IO
+    bl set_mm_errno
+    mov x0, #-1
+.Lwrite_all_ret:
+    ldr lr, [sp], #16
+    ret
+
+
+// Checks the consistency of the next slice of the heap.
+//
+// Syntax:
+//   bl mm_check_incremental
+//
+// Parameters:
+//   x0 [Register]
+//      - Maximum number of blocks to check (must not be 0)
+//   x1 [Register]
+//      - Where to store the payload of the offending block, or NULL
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 if every block checked was consistent
+//      - -1 on error, with mm_errno set to:
+//          MM_ERR_CORRUPT  (a check failed; the block is stored through x1)
+//          MM_ERR_INVAL    (the budget is 0)
+//          MM_ERR_INTERNAL (the heap is not initialized)
+//
+// Behavior:
+//   - Resumes at check_cursor, or at the first block after the prologues,
+//     and walks at most x0 blocks in address order
+//   - For every block, checks that the size is a multiple of
+//     DWORD_SIZE_BYTES, at least MIN_BLOCK_SIZE_BYTES and within the heap,
+//     and that the header and footer agree
+//   - For every free block, also checks that:
+//       * the previous block is allocated (no adjacent free blocks)
+//       * fprev and fnext point to headers inside the heap whose fnext and
+//         fprev point back (link symmetry)
+//       * each list neighbor is either the sentinel of the block's own free
+//         list or a free block of that list (list membership)
+//       * with MM_SIDE_TABLE, the size in its side-table entry matches the
+//         header
+//   - Reaching the epilogue checks that it sits at the break and wraps the
+//     cursor, so the next call starts over
+//   - On failure the cursor stays on the offending block
+//
+// Registers Modified:
+//   x0-x5   - Clobbered
+//   x19-x27 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+//
+// Notes:
+//   - Every check only reads the block, its footer, its physical
+//     predecessor's footer and its two list neighbors, so a call costs
+//     O(x0) regardless of the heap size
+//   - Must not run concurrently with other allocator calls
+mm_check_incremental:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    stp x22, x23, [sp, #-16]!
+    stp x24, x25, [sp, #-16]!
+    stp x26, x27, [sp, #-16]!
+
+    // x19 = blocks left in the budget
+    // x20 = where to report the offending block
+    // x21 = heap start
+    // x22 = break
+    // x23 = payload of the block being checked
+    mov x19, x0
+    mov x20, x1
+    cbz x19, .Lcheck_inval_err
+    bl _get_mem_heap_start
+    cbz x0, .Lcheck_internal_err
+    mov x21, x0
+    bl _get_mem_brk
+    mov x22, x0
+    ldr x23, =check_cursor
+    ldr x23, [x23]
+    cbnz x23, .Lcheck_loop
+    mov x1, #HEAP_OVERHEAD_BYTES
+    add x23, x21, x1
+
+.Lcheck_loop:
+    cbz x19, .Lcheck_pause
+
+    // x24 = header address
+    // x2  = header value
+    // x3  = block size
+    HEADER_P_FROM_PAYLOAD_P x23, x24
+    LOAD_TAG x2, x24
+    GET_SIZE x2, x3
+    cbz x3, .Lcheck_epilogue
+
+    // The size must be well formed and leave room for the next header
+    tst x3, #DWORD_SIZE_BYTES - 1
+    b.ne .Lcheck_corrupt
+    cmp x3, #MIN_BLOCK_SIZE_BYTES
+    b.lo .Lcheck_corrupt
+    sub x4, x22, x24
+    sub x4, x4, #TAG_SIZE_BYTES  // Bytes up to the last header slot
+    cmp x3, x4
+    b.hi .Lcheck_corrupt
+
+    // Header and footer must agree
+    add x4, x24, x3
+    LOAD_TAG x4, x4, -TAG_SIZE_BYTES
+    cmp x4, x2
+    b.ne .Lcheck_corrupt
+
+    tbnz x2, #ALLOCATED_BIT, .Lcheck_next  // Allocated; nothing else to check
+
+    // No two free blocks may be adjacent
+    LOAD_TAG x4, x24, -TAG_SIZE_BYTES  // Previous block's footer
+    tbz x4, #ALLOCATED_BIT, .Lcheck_corrupt
+
+    // x25 = free list of the block
+    // x26 = header of that list's sentinel
+    mov x0, x3
+    bl _get_free_list_index
+    mov x25, x0
+    ldr x1, =seg_listp
+    ldr x26, [x1, x25, LSL #PTR_ALIGN]
+    HEADER_P_FROM_PAYLOAD_P x26, x26
+
+.ifdef MM_SIDE_TABLE
+    // The table's copy of the size must match the header
+    GET_FREE_SIZE x24, x4
+    cmp x4, x3
+    b.ne .Lcheck_corrupt
+.endif
+
+    // Check fprev (x27 = 0), then fnext (x27 = 1)
+    mov x27, #0
+.Lcheck_link_loop:
+    // x0 = header of the list neighbor
+    cbnz x27, .Lcheck_link_fnext
+    GET_FPREV x24, x0
+    b .Lcheck_link_range
+.Lcheck_link_fnext:
+    GET_FNEXT x24, x0
+.Lcheck_link_range:
+
+    // It must be a header inside the heap with room for its links
+    and x1, x0, #DWORD_SIZE_BYTES - 1
+    cmp x1, #DWORD_SIZE_BYTES - TAG_SIZE_BYTES
+    b.ne .Lcheck_corrupt
+    sub x1, x0, x21
+    sub x2, x22, x21
+    sub x2, x2, #TAG_SIZE_BYTES + 2 * LINK_SIZE_BYTES
+    cmp x1, x2
+    b.hi .Lcheck_corrupt
+
+    // Its opposite link must point back at this block
+    cbnz x27, .Lcheck_link_back_fprev
+    GET_FNEXT x0, x2
+    b .Lcheck_link_back
+.Lcheck_link_back_fprev:
+    GET_FPREV x0, x2
+.Lcheck_link_back:
+    cmp x2, x24
+    b.ne .Lcheck_corrupt
+
+    // It must be this list's sentinel or a free block of the same list
+    cmp x0, x26
+    b.eq .Lcheck_link_next
+    LOAD_TAG x1, x0
+    tbnz x1, #ALLOCATED_BIT, .Lcheck_corrupt
+    GET_SIZE x1, x0
+    bl _get_free_list_index
+    cmp x0, x25
+    b.ne .Lcheck_corrupt
+
+.Lcheck_link_next:
+    add x27, x27, #1
+    cmp x27, #2
+    b.lo .Lcheck_link_loop
+
+.Lcheck_next:
+    HEADER_P_FROM_PAYLOAD_P x23, x1
+    LOAD_TAG x1, x1
+    GET_SIZE x1, x1
+    add x23, x23, x1
+    sub x19, x19, #1
+    b .Lcheck_loop
+
+.Lcheck_epilogue:
+    // The epilogue must be the last tag below the break
+    add x1, x24, #TAG_SIZE_BYTES
+    cmp x1, x22
+    b.ne .Lcheck_corrupt
+    tbz x2, #ALLOCATED_BIT, .Lcheck_corrupt
+    mov x23, #0  // Start over on the next call
+
+.Lcheck_pause:
+    ldr x1, =check_cursor
+    str x23, [x1]
+    mov x0, #0
+    b .Lcheck_ret
+
+.Lcheck_corrupt:
+    ldr x1, =check_cursor
+    str x23, [x1]
+    cbz x20, .Lcheck_corrupt_errno
+    str x23, [x20]
+.Lcheck_corrupt_errno:
+    mov x0, #MM_ERR_CORRUPT
+    bl set_mm_errno
+    mov x0, #-1
+    b .Lcheck_ret
+.Lcheck_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+    b .Lcheck_ret
+.Lcheck_internal_err:
+    mov x0, #MM_ERR_INTERNAL
+    bl set_mm_errno
+    mov x0, #-1
+.Lcheck_ret:
+    ldp x26, x27, [sp], #16
+    ldp x24, x25, [sp], #16
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Validates an allocated block, marks it free and coalesces it.
+//
+// Syntax:
+//   bl _free_block
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer of the block to free (must not be NULL)
+//
+// Return Value:
+//   None. On a rejected pointer mm_errno is set to:
+//     MM_ERR_INVAL   (page map owner is not the heap, or the buddy zone)
+//     MM_ERR_ALIGN   (pointer is not DWORD_SIZE_BYTES aligned)
+//     MM_ERR_CORRUPT (block is not marked allocated, e.g. a double free)
+//
+// Behavior:
+//   - The owner of the pointer's page is looked up in the page map first
+//     (PAGE_OWNER, three dependent loads), so no header is read for a
+//     pointer the allocator never handed out
+//   - Sampled blocks are first removed from the heap profile with
+//     _profile_forget
+//   - With MM_BUDDY, blocks of the buddy zone are handed to _buddy_free
+//   - While the quick lists are on (see mm_set_quick_lists), blocks of up
+//     to QUICK_MAX_BLOCK_BYTES are pushed onto the list of their size
+//     without touching the boundary tags. A push that would exceed the
+//     budget consolidates the lists first and frees the block normally.
+//     Only a block freed twice in a row is caught as a double free.
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by _coalesce
+//   lr     - Saved/restored (for function calls)
+_free_block:
+    PAGE_OWNER x0, x1, x2, .Lfree_block_foreign_err
+    cmp x1, #MEM_OWNER_HEAP
+    b.ne .Lfree_block_not_heap
+    str lr, [sp, #-16]!
+
+    tst x0, #DWORD_SIZE_BYTES - 1
+    b.ne .Lfree_block_align_err
+
+    // x1 = header address
+    // x2 = header value
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    LOAD_TAG x2, x1
+    tbz x2, #ALLOCATED_BIT, .Lfree_block_corrupt_err  // Not allocated
+    tbz x2, #SAMPLED_BIT, .Lfree_block_unmark
+
+    // Drop the block from the heap profile, which also clears SAMPLED_MASK
+    stp x0, x1, [sp, #-16]!
+    bl _profile_forget
+    ldp x0, x1, [sp], #16
+    LOAD_TAG x2, x1
+
+.Lfree_block_unmark:
+    // While the quick lists are on, a block they can hold is parked on the
+    // list of its exact size and keeps its allocated bit
+    // x4 = quick_budget address
+    // x5 = budget
+    // x6 = bytes parked, including this block
+    // x7 = quick list slot of this size
+    // x8 = head of that list
+    ldr x4, =quick_budget
+    ldp x5, x6, [x4]
+    cbz x5, .Lfree_block_coalesce
+    GET_SIZE x2, x3
+    cmp x3, #QUICK_MAX_BLOCK_BYTES
+    b.hi .Lfree_block_coalesce
+    add x6, x6, x3
+    cmp x6, x5
+    b.hi .Lfree_block_consolidate
+    ldr x7, =quick_lists
+    lsr x8, x3, #QUICK_GRANULE_LOG2
+    add x7, x7, x8, LSL #PTR_ALIGN
+    ldr x8, [x7]
+    cmp x8, x0
+    b.eq .Lfree_block_corrupt_err  // Parked just before: a double free
+    str x8, [x0]
+    str x0, [x7]
+    str x6, [x4, #WORD_SIZE_BYTES]
+    b .Lfree_block_ret
+
+.Lfree_block_consolidate:
+    // Over budget: merge everything parked, then free this block normally
+    stp x0, x1, [sp, #-16]!
+    bl _quick_consolidate
+    ldp x0, x1, [sp], #16
+    LOAD_TAG x2, x1
+
+.Lfree_block_coalesce:
+    // Clear the allocated bit in both boundary tags
+    SET_ALLOCATED x2, 0
+    STORE_TAG x2, x1
+    GET_SIZE x2, x3
+    add x1, x1, x3
+    STORE_TAG x2, x1, -TAG_SIZE_BYTES  // Footer
+
+    ldr x1, =stat_allocated_blocks
+    ldr x2, [x1]
+    sub x2, x2, #1
+    str x2, [x1]
+
+    bl _coalesce
+    b .Lfree_block_ret
+
+.Lfree_block_align_err:
+    mov x0, #MM_ERR_ALIGN
+    bl set_mm_errno
+    b .Lfree_block_ret
+.Lfree_block_corrupt_err:
+    mov x0, #MM_ERR_CORRUPT
+    bl set_mm_errno
+.Lfree_block_ret:
+    ldr lr, [sp], #16
+    ret
+.Lfree_block_not_heap:
+.ifdef MM_BUDDY
+    cmp x1, #MEM_OWNER_BUDDY
+    b.eq _buddy_free  // Tail call
+.endif
+.Lfree_block_foreign_err:
+    mov x0, #MM_ERR_INVAL
+    b set_mm_errno  // Tail call
+
+
+.ifdef MM_TLSF
+// Finds a free block large enough for a block of the given size in O(1).
+//
+// Syntax:
+//   bl _find_fit
+//
+// Parameters:
+//   x0 [Register]
+//      - Adjusted block size in bytes (header and footer included)
+//
+// Return Value:
+//   x0 [Register]
+//      - Payload pointer of the first block of the smallest non-empty list
+//        whose blocks all fit, or NULL (0) if there is none
+//
+// Behavior:
+//   - Rounds the size up to the next list boundary, so the list it maps to
+//     (and every list above) only holds blocks that fit
+//   - Looks for a non-empty list at or above that second level in the
+//     first level's bitmap, else takes the lowest non-empty first level
+//     above it from tlsf_fl_bitmap; no list is ever walked
+//   - A free block in the size's own list that happens to be large enough
+//     is not found, which is the price of the bounded search (TLSF's good
+//     fit)
+//   - Does not remove the block from its free list (see _place)
+//
+// Registers Modified:
+//   x0-x4 - Clobbered
+_find_fit:
+    // Round up by the step between the lists at this size, less one
+    clz x1, x0
+    mov x2, #63 - TLSF_LINEAR_LOG2
+    subs x1, x2, x1
+    csel x1, x1, xzr, gt
+    add x1, x1, #TLSF_GRANULE_LOG2
+    mov x2, #1
+    lsl x2, x2, x1
+    sub x2, x2, #1
+    add x0, x0, x2
+
+    // x1 = second level
+    // x2 = first level
+    TLSF_LIST_INDEX x0, x1, x2
+    lsr x2, x1, #TLSF_SL_LOG2
+    cmp x2, #TLSF_FL_COUNT
+    b.hs .Lfind_fit_none  // Larger than any block can be
+    and x1, x1, #TLSF_SL_COUNT - 1
+
+    // x3 = non-empty lists of the first level, from the second level up
+    // x4 = tlsf_sl_bitmap
+    ldr x4, =tlsf_sl_bitmap
+    ldrb w3, [x4, x2]
+    lsr w3, w3, w1
+    lsl w3, w3, w1
+    cbnz w3, .Lfind_fit_found
+
+    // x3 = non-empty first levels above this one
+    ldr x3, =tlsf_fl_bitmap
+    ldr x3, [x3]
+    add x2, x2, #1
+    lsr x3, x3, x2
+    lsl x3, x3, x2
+    cbz x3, .Lfind_fit_none
+    rbit x3, x3
+    clz x2, x3  // Lowest set bit
+    ldrb w3, [x4, x2]  // Any of its lists will do
+
+.Lfind_fit_found:
+    rbit w3, w3
+    clz w3, w3  // Lowest set bit
+    add x1, x3, x2, LSL #TLSF_SL_LOG2
+    ldr x2, =seg_listp
+    ldr x2, [x2, x1, LSL #PTR_ALIGN]
+    NEXT_FREE_PAYLOAD_P x2, x0
+    ret
+
+.Lfind_fit_none:
+    mov x0, #0
+    ret
+.else
+// Finds a free block large enough for a block of the given size, as the
+// placement policy chooses.
+//
+// Syntax:
+//   bl _find_fit
+//
+// Parameters:
+//   x0 [Register]
+//      - Adjusted block size in bytes (header and footer included)
+//
+// Return Value:
+//   x0 [Register]
+//      - Payload pointer of a fitting free block, or NULL (0) if no free
+//        block is large enough
+//
+// Behavior:
+//   - Starts at the list returned by _get_free_list_index and moves to
+//     larger classes when a list has no fit
+//   - MM_PLACEMENT_FIRST_FIT and MM_PLACEMENT_ADDRESS_ORDERED walk each
+//     circular list from its sentinel's fnext back to the sentinel and take
+//     the first fit; the lists differ only in how _add_to_free_list orders
+//     them
+//   - MM_PLACEMENT_NEXT_FIT walks each list once around from the class's
+//     rover instead, and leaves the rover on the block it returns
+//   - MM_PLACEMENT_BEST_FIT walks the whole list and takes its smallest
+//     fit, stopping early on an exact fit. Every block of a larger class is
+//     larger, so the first class with a fit holds the best one.
+//   - The last class is searched with _tree_find_fit instead, which returns
+//     its smallest block that fits
+//   - Does not remove the block from its free list (see _place)
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+//   x19   - Saved/restored (requested size)
+//   lr    - Saved/restored (for function calls)
+_find_fit:
+    stp lr, x19, [sp, #-16]!
+
+    mov x19, x0
+    bl _get_free_list_index  // x0 = first list to search
+
+    // x1 = seg_listp
+    // x2 = sentinel payload of the current list
+    // x3 = payload of the current free block
+    // x4 = size of the current free block
+    ldr x1, =seg_listp
+    ldr x5, =placement_policy
+    ldr x5, [x5]
+    cbz x5, .Lfind_fit_list_check  // MM_PLACEMENT_FIRST_FIT
+    cmp x5, #MM_PLACEMENT_NEXT_FIT
+    b.eq .Lfind_fit_next_fit
+    cmp x5, #MM_PLACEMENT_BEST_FIT
+    b.eq .Lfind_fit_best_fit_check
+    cmp x5, #MM_PLACEMENT_WILDERNESS
+    b.eq .Lfind_fit_wilderness
+    b .Lfind_fit_list_check
+.Lfind_fit_list_loop:
+    ldr x2, [x1, x0, LSL #PTR_ALIGN]
+    NEXT_FREE_PAYLOAD_P x2, x3
+.Lfind_fit_block_loop:
+    cmp x3, x2
+    b.eq .Lfind_fit_next_list  // Back at the sentinel
+    HEADER_P_FROM_PAYLOAD_P x3, x4
+    GET_FREE_SIZE x4, x4
+    cmp x4, x19
+    b.hs .Lfind_fit_found
+    NEXT_FREE_PAYLOAD_P x3, x3
+    b .Lfind_fit_block_loop
+
+.Lfind_fit_next_list:
+    add x0, x0, #1
+.Lfind_fit_list_check:
+    cmp x0, #TREE_SEG_LIST
+    b.lo .Lfind_fit_list_loop
+.Lfind_fit_tree:
+    mov x0, x19
+    bl _tree_find_fit
+    b .Lfind_fit_ret
+
+.Lfind_fit_next_fit:
+    // x5 = block the walk started at
+    // x6 = fit_rovers
+    ldr x6, =fit_rovers
+    b .Lfind_fit_next_fit_check
+.Lfind_fit_next_fit_loop:
+    ldr x2, [x1, x0, LSL #PTR_ALIGN]
+    ldr x5, [x6, x0, LSL #PTR_ALIGN]
+    cmp x5, #0
+    csel x5, x2, x5, eq  // No rover: start at the sentinel
+    mov x3, x5
+.Lfind_fit_next_fit_block:
+    cmp x3, x2
+    b.eq .Lfind_fit_next_fit_advance  // Skip the sentinel
+    HEADER_P_FROM_PAYLOAD_P x3, x4
+    GET_FREE_SIZE x4, x4
+    cmp x4, x19
+    b.hs .Lfind_fit_next_fit_found
+.Lfind_fit_next_fit_advance:
+    NEXT_FREE_PAYLOAD_P x3, x3
+    cmp x3, x5
+    b.ne .Lfind_fit_next_fit_block
+    add x0, x0, #1
+.Lfind_fit_next_fit_check:
+    cmp x0, #TREE_SEG_LIST
+    b.lo .Lfind_fit_next_fit_loop
+    b .Lfind_fit_tree
+.Lfind_fit_next_fit_found:
+    // When _place takes the block, _remove_from_free_list moves the rover
+    // on to its successor
+    str x3, [x6, x0, LSL #PTR_ALIGN]
+    b .Lfind_fit_found
+
+.Lfind_fit_best_fit_loop:
+    // x5 = smallest fit so far, or NULL
+    // x6 = its size
+    ldr x2, [x1, x0, LSL #PTR_ALIGN]
+    mov x5, #0
+    mov x6, #-1
+    NEXT_FREE_PAYLOAD_P x2, x3
+.Lfind_fit_best_fit_block:
+    cmp x3, x2
+    b.eq .Lfind_fit_best_fit_end  // Back at the sentinel
+    HEADER_P_FROM_PAYLOAD_P x3, x4
+    GET_FREE_SIZE x4, x4
+    cmp x4, x19
+    b.lo .Lfind_fit_best_fit_next
+    b.eq .Lfind_fit_found  // Exact fit
+    cmp x4, x6
+    csel x5, x3, x5, lo
+    csel x6, x4, x6, lo
+.Lfind_fit_best_fit_next:
+    NEXT_FREE_PAYLOAD_P x3, x3
+    b .Lfind_fit_best_fit_block
+.Lfind_fit_best_fit_end:
+    mov x3, x5
+    cbnz x3, .Lfind_fit_found
+    add x0, x0, #1
+.Lfind_fit_best_fit_check:
+    cmp x0, #TREE_SEG_LIST
+    b.lo .Lfind_fit_best_fit_loop
+    b .Lfind_fit_tree
+
+.Lfind_fit_found:
+    mov x0, x3
+.Lfind_fit_ret:
+    ldp lr, x19, [sp], #16
+    ret
+
+.Lfind_fit_wilderness:
+    mov x0, x19
+    ldp lr, x19, [sp], #16
+    b _find_fit_wilderness  // Tail call
+
+
+// Finds a free block for MM_PLACEMENT_WILDERNESS, sparing the top block.
+//
+// Syntax:
+//   bl _find_fit_wilderness
+//
+// Parameters:
+//   x0 [Register]
+//      - Adjusted block size in bytes (header and footer included)
+//
+// Return Value:
+//   x0 [Register]
+//      - Payload pointer of a fitting free block, or NULL (0)
+//
+// Behavior:
+//   - Blocks below TREE_MIN_BLOCK_BYTES are first carved from the last
+//     remainder if it is large enough, so consecutive small allocations
+//     come out back to back
+//   - Otherwise takes the first fit as MM_PLACEMENT_FIRST_FIT does, except
+//     that the top block (the free block before the epilogue, which
+//     _extend_heap and mm_expand grow) is skipped
+//   - If the size tree's best fit is the top block, the tree is searched
+//     again with the top block taken out
+//   - Only when nothing else fits is the top block returned
+//
+// Registers Modified:
+//   x0-x8   - Clobbered
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_find_fit_wilderness:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
 
-    // Initialize the segregated free lists
-    mov x2, #2 * DWORD_SIZE_BYTES  // The size of all the header and footers
-    SET_SIZE x1, x2
-    SET_ALLOCATED x1, 1
-    ldr x2, =seg_listp
-    mov x3, #0  // Iteration index
-.Linit_seglists_loop:
-    // Initialize the header
-    str x1, [x0]
-    SET_FPREV x0, x0
-    SET_FNEXT x0, x0
+    // x19 = requested size
+    // x20 = payload of the top block, or NULL if the last block is allocated
+    // x21 = free list being searched
+    mov x19, x0
+    cmp x19, #TREE_MIN_BLOCK_BYTES
+    b.hs .Lfind_fit_wilderness_top
+    ldr x0, =last_remainder
+    ldr x0, [x0]
+    cbz x0, .Lfind_fit_wilderness_top
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    LOAD_TAG x1, x1
+    GET_SIZE x1, x1
+    cmp x1, x19
+    b.hs .Lfind_fit_wilderness_ret
 
-    // Initialize the footer
-    str x1, [x0, #3 * WORD_SIZE_BYTES]
+.Lfind_fit_wilderness_top:
+    // The last block's footer sits just below the epilogue header
+    bl _get_mem_brk
+    LOAD_TAG x1, x0, -BOUNDARY_TAGS_BYTES
+    GET_SIZE x1, x2
+    sub x20, x0, x2
+    tst x1, #ALLOCATED_MASK
+    csel x20, xzr, x20, ne
 
-    add x4, x0, #WORD_SIZE_BYTES  // Pointer to payload
-    str x4, [x2, x3, LSL #PTR_ALIGN]  // Update the segmented list array
+    mov x0, x19
+    bl _get_free_list_index
+    mov x21, x0
 
-    add x0, x0, #2 * DWORD_SIZE_BYTES  // Next block
-    add x3, x3, #1
-    cmp x3, #NUM_SEG_LISTS
-    b.lt .Linit_seglists_loop
-    // End of loop
+    // x1 = seg_listp
+    // x2 = sentinel payload of the current list
+    // x3 = payload of the current free block
+    // x4 = size of the current free block
+    ldr x1, =seg_listp
+    b .Lfind_fit_wilderness_list_check
+.Lfind_fit_wilderness_list_loop:
+    ldr x2, [x1, x21, LSL #PTR_ALIGN]
+    NEXT_FREE_PAYLOAD_P x2, x3
+.Lfind_fit_wilderness_block_loop:
+    cmp x3, x2
+    b.eq .Lfind_fit_wilderness_next_list  // Back at the sentinel
+    cmp x3, x20
+    b.eq .Lfind_fit_wilderness_next_block  // Last resort
+    HEADER_P_FROM_PAYLOAD_P x3, x4
+    GET_FREE_SIZE x4, x4
+    cmp x4, x19
+    b.hs .Lfind_fit_wilderness_found
+.Lfind_fit_wilderness_next_block:
+    NEXT_FREE_PAYLOAD_P x3, x3
+    b .Lfind_fit_wilderness_block_loop
+.Lfind_fit_wilderness_next_list:
+    add x21, x21, #1
+.Lfind_fit_wilderness_list_check:
+    cmp x21, #TREE_SEG_LIST
+    b.lo .Lfind_fit_wilderness_list_loop
 
-    // Store the epilogue header
-    mov x2, #0
-    SET_SIZE x1, x2
-    SET_ALLOCATED x1, 1
-    str x1, [x0]
+    mov x0, x19
+    bl _tree_find_fit
+    cbz x0, .Lfind_fit_wilderness_last_resort
+    cmp x0, x20
+    b.ne .Lfind_fit_wilderness_ret
 
-    // Extend the heap with a free block of PAGE_SIZE_BYTES
-    mov x0, #PAGE_SIZE_BYTES / WORD_SIZE_BYTES
-    bl _extend_heap
-    cbz x0, .Lmm_init_extend_head_err
+    // The top block is the tree's best fit; look again without it
+    mov x0, x20
+    bl _remove_from_free_list
+    mov x0, x19
+    bl _tree_find_fit
+    mov x21, x0
+    mov x0, x20
+    bl _add_to_free_list
+    mov x0, x21
+    cbnz x0, .Lfind_fit_wilderness_ret
 
+.Lfind_fit_wilderness_last_resort:
     mov x0, #0
-    b .Linit_ret
-.Lmm_init_extend_head_err:
-    mov x0, #-1
-.Linit_ret:
-    ldr lr, [sp], #16
+    cbz x20, .Lfind_fit_wilderness_ret
+    HEADER_P_FROM_PAYLOAD_P x20, x1
+    LOAD_TAG x1, x1
+    GET_SIZE x1, x1
+    cmp x1, x19
+    csel x0, x20, xzr, hs
+    b .Lfind_fit_wilderness_ret
+
+.Lfind_fit_wilderness_found:
+    mov x0, x3
+.Lfind_fit_wilderness_ret:
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
     ret
+.endif
 
 
-// De-initializes the memory manager and releases system resources.
+// Allocates a block of the given size out of a free block.
 //
 // Syntax:
-//   bl mm_deinit
+//   bl _place
 //
 // Parameters:
-//   None
+//   x0 [Register]
+//      - Payload pointer of a free block currently on a free list
+//   x1 [Register]
+//      - Adjusted block size in bytes; must not exceed the free block's size
 //
 // Return Value:
-//   x0 - Return status:
-//        0   = Success (arena unmapped or already uninitialized)
-//       -1   = Failure (invalid heap state or munmap failure; mm_errno is set)
+//   x0 [Register]
+//      - The same payload pointer, now marked allocated
 //
 // Behavior:
-//   - Calls mem_deinit to release underlying memory system resources
-//   - Should be called when the memory manager is no longer needed
-//   - After calling, mm_init must be called again before using malloc/free
+//   - Removes the block from its free list
+//   - If the remainder is at least MIN_BLOCK_SIZE_BYTES, splits it off as a
+//     new free block and adds it to the free lists
+//   - Otherwise the whole block is allocated
+//   - The remainder never needs coalescing since the free block's physical
+//     neighbors are always allocated
+//   - Under MM_PLACEMENT_WILDERNESS, the remainder of a block below
+//     TREE_MIN_BLOCK_BYTES becomes the last remainder unless it is the top
+//     block
 //
 // Registers Modified:
-//   x0  - Return value from mem_deinit
-//   lr  - Modified by function call (restored)
-//   Any registers modified by mem_deinit
-//
-// Function Calls:
-//   - mem_deinit() - Releases underlying memory system resources
-//
-// Notes:
-//   - This is a simple wrapper around mem_deinit
-//   - Does not validate that mm_init was previously called
-//   - Does not free individual allocated blocks (caller responsible for this)
-//   - Global state (seg_listp array) is not explicitly cleared
-//
-// Warning:
-//   - Calling mm_malloc or mm_free after mm_deinit results in undefined
-//     behavior
-//   - Must call mm_init again to reinitialize before further use
-mm_deinit:
-    str lr, [sp, #-16]!
+//   x0-x7   - Clobbered
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_place:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
 
-    bl mem_deinit
+    // x19 = payload
+    // x20 = requested block size
+    // x21 = current block size
+    mov x19, x0
+    mov x20, x1
+    HEADER_P_FROM_PAYLOAD_P x19, x2
+    LOAD_TAG x2, x2
+    GET_SIZE x2, x21
 
-    ldr lr, [sp], #16
-    ret
+    bl _remove_from_free_list
 
+    sub x3, x21, x20  // Remainder
+    cmp x3, #MIN_BLOCK_SIZE_BYTES
+    b.lo .Lplace_no_split
 
-// Allocates a block with at least size bytes of payload.
-mm_malloc:
-    ret
+    // Allocated part
+    PACK_HEADER x20, 1, x1
+    HEADER_P_FROM_PAYLOAD_P x19, x2
+    STORE_TAG x1, x2  // Store header
+    add x2, x2, x20
+    STORE_TAG x1, x2, -TAG_SIZE_BYTES  // Store footer
+
+    // Free remainder
+    // x2 = remainder header address
+    PACK_HEADER x3, 0, x1
+    STORE_TAG x1, x2  // Store header
+    add x4, x2, x3
+    STORE_TAG x1, x4, -TAG_SIZE_BYTES  // Store footer
+    GET_PAYLOAD_P_FROM_HEADER_P x2, x0
+    bl _add_to_free_list
 
+.ifndef MM_TLSF
+    // Under MM_PLACEMENT_WILDERNESS the remainder of a small request
+    // serves the next ones, unless it is the top block
+    ldr x0, =placement_policy
+    ldr x0, [x0]
+    cmp x0, #MM_PLACEMENT_WILDERNESS
+    b.ne .Lplace_ret
+    cmp x20, #TREE_MIN_BLOCK_BYTES
+    b.hs .Lplace_ret
+    bl _get_mem_brk
+    // x1 = remainder payload
+    // x2 = its end
+    add x1, x19, x20
+    HEADER_P_FROM_PAYLOAD_P x1, x2
+    LOAD_TAG x2, x2
+    GET_SIZE x2, x2
+    add x2, x1, x2
+    cmp x2, x0
+    b.eq .Lplace_ret
+    ldr x2, =last_remainder
+    str x1, [x2]
+.endif
+    b .Lplace_ret
 
-// Frees a block
-mm_free:
+.Lplace_no_split:
+    PACK_HEADER x21, 1, x1
+    HEADER_P_FROM_PAYLOAD_P x19, x2
+    STORE_TAG x1, x2  // Store header
+    add x2, x2, x21
+    STORE_TAG x1, x2, -TAG_SIZE_BYTES  // Store footer
+
+.Lplace_ret:
+    ldr x1, =stat_allocated_blocks
+    ldr x2, [x1]
+    add x2, x2, #1
+    str x2, [x1]
+
+    mov x0, x19
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
     ret
 
 
@@ -289,20 +3475,19 @@ _extend_heap:
     b.eq .Lextend_heap_sbrk_failed
 
     // Set up the free block's header and footer
-    SET_SIZE x1, x19
-    SET_ALLOCATED x1, 0
+    PACK_HEADER x19, 0, x1
 
     HEADER_P_FROM_PAYLOAD_P x0, x2
-    str x1, [x2]  // Store header
+    STORE_TAG x1, x2  // Store header
     FOOTER_P_FROM_PAYLOAD_P x0, x2
-    str x1, [x2]  // Store footer
+    STORE_TAG x1, x2  // Store footer
 
     // Create new epilogue
     NEXT_PAYLOAD_P x0, x2
     HEADER_P_FROM_PAYLOAD_P x2, x2
     mov x1, #0  // This will zero-out the size as well
     SET_ALLOCATED x1, 1
-    str x1, [x2]
+    STORE_TAG x1, x2
 
     bl _coalesce
     b .Lextend_heap_ret
@@ -410,20 +3595,20 @@ _coalesce:
     // x4 = contents of header
     // x5 = size of the block
     HEADER_P_FROM_PAYLOAD_P x0, x3
-    ldr x4, [x3]
+    LOAD_TAG x4, x3
     GET_SIZE x4, x5
 
     // Retrieve some information for the previous block
     // x6 = address of header
     // x7 = contents of header
     HEADER_P_FROM_PAYLOAD_P x1, x6
-    ldr x7, [x6]
+    LOAD_TAG x7, x6
 
     // Retrieve some information for the next block
     // x8 = address of header
     // x9 = contents of header
     HEADER_P_FROM_PAYLOAD_P x2, x8
-    ldr x9, [x8]
+    LOAD_TAG x9, x8
 
     // Calculate the jump table index
     // index = (next.allocated << 1) | prev.allocated
@@ -434,6 +3619,12 @@ _coalesce:
     GET_ALLOCATED x9, x11
     orr w12, w10, w11, LSL #1
 
+    // Count the case
+    ldr x13, =stat_coalesce_cases
+    ldr x14, [x13, x12, LSL #3]
+    add x14, x14, #1
+    str x14, [x13, x12, LSL #3]
+
     // Jump table dispatch
     // x13 = jump table branch address
     adrp x13, .coalesce_jump_table  // Get the page address
@@ -461,29 +3652,32 @@ _coalesce:
     add x5, x5, x10
     add x5, x5, x11
 
-    // Set the size in prev's header
-    SET_SIZE x7, x5
-    str x7, [x6]
-
-    // Set the size in next's footer
     // x14 = &next.footer
-    // x15 = *x14
     FOOTER_P_FROM_PAYLOAD_P x2, x14
-    ldr x15, [x14]
-    SET_SIZE x15, x5
-    str x15, [x14]
 
     mov x19, x1  // Save the prev block's payload address
 
-    // Remove prev block from free list
-    mov x0, x1
+    // Unlink both neighbors while their headers still hold their own sizes,
+    // which _remove_from_free_list reads. Remove the next block first since
+    // _remove_from_free_list clobbers x0-x4
+    mov x0, x2
     bl _remove_from_free_list
 
-    // Remove the next block from free list
-    mov x0, x2
+    // Remove prev block from free list
+    mov x0, x19
     bl _remove_from_free_list
 
-    b .Lcoalesce_add_to_list
+    // Set the size in prev's header
+    SET_SIZE x7, x5
+    STORE_TAG x7, x6
+
+    // Set the size in next's footer
+    // x15 = *x14
+    LOAD_TAG x15, x14
+    SET_SIZE x15, x5
+    STORE_TAG x15, x14
+
+    b .Lcoalesce_merged
 
 .Lcoalesce_case_only_prev_allocated:
     // Should coalesce the current and next blocks
@@ -496,22 +3690,22 @@ _coalesce:
 
     // Set the size in the current header
     SET_SIZE x4, x5
-    str x4, [x3]
+    STORE_TAG x4, x3
 
     // Set the size in the new footer
     // x14 = address of the new footer
     // x15 = contents of the footer
     FOOTER_P_FROM_PAYLOAD_P x0, x14
-    ldr x15, [x14]
+    LOAD_TAG x15, x14
     SET_SIZE x15, x5
-    str x15, [x14]
+    STORE_TAG x15, x14
 
     // Remove the next block from the free list
     mov x19, x0  // Save the current block's payload address
     mov x0, x2
     bl _remove_from_free_list
 
-    b .Lcoalesce_add_to_list
+    b .Lcoalesce_merged
 
 .Lcoalesce_case_only_next_allocated:
     // Should coalesce the previous and current blocks
@@ -522,21 +3716,21 @@ _coalesce:
     // x5 = combined size
     add x5, x5, x10
 
+    // Remove the prev block from the free list before its header changes
+    mov x19, x1  // Save the previous block's payload address
+    mov x0, x1
+    bl _remove_from_free_list
+
     // Set the size in previous block's header
     SET_SIZE x7, x5
-    str x7, [x6]
+    STORE_TAG x7, x6
 
     // Set the size in the new footer (current block's footer)
     // x14 = address of the new footer
-    FOOTER_P_FROM_PAYLOAD_P x1, x14
-    str x7, [x14]
-
-    // Remove the prev block from the free list
-    mov x19, x1  // Save the previous block's payload address
-    mov x0, x1
-    bl _remove_from_free_list
+    FOOTER_P_FROM_PAYLOAD_P x19, x14
+    STORE_TAG x7, x14
 
-    b .Lcoalesce_add_to_list
+    b .Lcoalesce_merged
 
 .Lcoalesce_case_both_allocated:
     // Nothing to coalesce
@@ -546,7 +3740,17 @@ _coalesce:
     b .Lcoalesce_add_to_list
 
 // After the branches above, x19 should contain the pointer to the payload
-// of the coalesced block to add to the free list.
+// of the coalesced block to add to the free list, and x5 its size.
+.Lcoalesce_merged:
+    // A block merged into its predecessor no longer starts a block; move
+    // mm_check_incremental's cursor to the start of the merged one
+    ldr x1, =check_cursor
+    ldr x2, [x1]
+    sub x3, x2, x19
+    cmp x3, x5
+    b.hs .Lcoalesce_add_to_list  // Cursor is outside the merged block
+    str x19, [x1]
+
 .Lcoalesce_add_to_list:
     mov x0, x19  // Save the payload address
     bl _add_to_free_list
@@ -572,22 +3776,31 @@ _coalesce:
 // Behavior:
 //   - Determines the size of the block from its header
 //   - Finds the corresponding segregated free list based on the block size
-//   - Inserts the block at the beginning of the list (after the sentinel node)
+//   - Inserts the block at the beginning of the list (after the sentinel node),
+//     or under MM_PLACEMENT_ADDRESS_ORDERED after the last block at a lower
+//     address, which walks the list
 //   - Updates fnext and fprev pointers of the block, the sentinel, and the
 //     original first free block
+//   - With MM_SIDE_TABLE, also copies the block size into its side-table
+//     entry for GET_FREE_SIZE
 //   - Ensures the doubly-linked free list remains consistent
 //
 // Algorithm:
 //   1. Save lr and payload pointer (x19) on stack
 //   2. Load header from payload, then read block size
-//   3. Call _get_seglist_index to get the free list index
-//   4. Load the sentinel pointer of the appropriate segregated free list
-//   5. Load the original first free block in the list
-//   6. Set new block's fnext to the original first free block
-//   7. Set new block's fprev to the sentinel
-//   8. Set original first free block's fprev to the new block
-//   9. Set sentinel's fnext to the new block
-//   10. Restore registers and return
+//   3. Call _get_seglist_index to get the block's size class
+//   4. Add the block to the class's free byte and block counters
+//   5. Load the sentinel pointer of the block's free list: the list of
+//      FREE_LIST_INDEX, or with MM_TLSF the block's TLSF list, whose bits
+//      are set in both bitmaps. Without MM_TLSF, blocks of the last class
+//      go into the size tree with _tree_insert instead, and the steps
+//      below are skipped.
+//   6. Load the original first free block in the list
+//   7. Set new block's fnext to the original first free block
+//   8. Set new block's fprev to the sentinel
+//   9. Set original first free block's fprev to the new block
+//   10. Set sentinel's fnext to the new block
+//   11. Restore registers and return
 //
 // Registers Modified:
 //   x0 - Temporary, used for block size and free list index
@@ -595,6 +3808,7 @@ _coalesce:
 //   x2 - Header of sentinel node
 //   x3 - Header of original first free block
 //   x4 - Header of the block being inserted
+//   x5-x7 - Clobbered by _tree_insert
 //   x19 - Saved payload pointer
 //   lr  - Link register saved/restored
 _add_to_free_list:
@@ -604,18 +3818,88 @@ _add_to_free_list:
 
     // Get the size of the block
     HEADER_P_FROM_PAYLOAD_P x19, x1
-    ldr x0, [x1]
+    LOAD_TAG x0, x1
     GET_SIZE x0, x0
+    mov x3, x0  // _get_seglist_index only clobbers x0-x2
+
+.ifdef MM_SIDE_TABLE
+    // Searches read the size from the table instead of the header
+    SIDE_ENTRY_P x1
+    str x3, [x16, #SIDE_ENTRY_SIZE]
+.endif
 
-    // Get the header of the free list to insert into
+    // Account for the block in its class
     bl _get_seglist_index
+    ldr x1, =stat_free_bytes
+    ldr x2, [x1, x0, LSL #3]
+    add x2, x2, x3
+    str x2, [x1, x0, LSL #3]
+    ldr x1, =stat_free_blocks
+    ldr x2, [x1, x0, LSL #3]
+    add x2, x2, #1
+    str x2, [x1, x0, LSL #3]
+
+.ifdef MM_TLSF
+    // x0 = free list
+    // x1 = first level
+    // x2 = second level bit
+    TLSF_LIST_INDEX x3, x0, x1
+    lsr x1, x0, #TLSF_SL_LOG2
+    and x2, x0, #TLSF_SL_COUNT - 1
+    mov x3, #1
+    lsl x2, x3, x2
+
+    // Mark the list non-empty at both levels
+    ldr x4, =tlsf_sl_bitmap
+    ldrb w3, [x4, x1]
+    orr w3, w3, w2
+    strb w3, [x4, x1]
+    ldr x4, =tlsf_fl_bitmap
+    ldr x3, [x4]
+    mov x2, #1
+    lsl x2, x2, x1
+    orr x3, x3, x2
+    str x3, [x4]
+.else
+    cmp x3, #TREE_MIN_BLOCK_BYTES
+    b.lo .Ladd_to_free_list_link
+    HEADER_P_FROM_PAYLOAD_P x19, x0
+    mov x1, x3
+    bl _tree_insert
+    b .Ladd_to_free_list_ret
+.Ladd_to_free_list_link:
+    FREE_LIST_INDEX x3, x0, x1
+.endif
+
     ldr x1, =seg_listp
     ldr x1, [x1, x0, LSL #PTR_ALIGN]
 
-    // Get the header of the list's sentinel node
+.ifndef MM_TLSF
+    // Address order: link the block after the last block below it
+    // x1 = block to link after
+    // x2 = sentinel payload
+    // x3 = payload of the block after x1
+    ldr x2, =placement_policy
+    ldr x2, [x2]
+    cmp x2, #MM_PLACEMENT_ADDRESS_ORDERED
+    b.ne .Ladd_to_free_list_insert
+    mov x2, x1
+.Ladd_to_free_list_ordered:
+    NEXT_FREE_PAYLOAD_P x1, x3
+    cmp x3, x2
+    b.eq .Ladd_to_free_list_insert  // Highest address in the list
+    cmp x3, x19
+    b.hi .Ladd_to_free_list_insert
+    mov x1, x3
+    b .Ladd_to_free_list_ordered
+.Ladd_to_free_list_insert:
+.endif
+
+    // Get the header of the node to link after (the sentinel, unless the
+    // list is kept in address order)
     HEADER_P_FROM_PAYLOAD_P x1, x2
 
-    // Get the header of the original first free payload in the list
+    // Get the header of the free payload that follows it
     NEXT_FREE_PAYLOAD_P x1, x3
     HEADER_P_FROM_PAYLOAD_P x3, x3
 
@@ -630,6 +3914,7 @@ _add_to_free_list:
     // Set the fnext of the header to point to the new payload
     SET_FNEXT x2, x4
 
+.Ladd_to_free_list_ret:
     ldp lr, x19, [sp], #16
     ret
 
@@ -668,16 +3953,43 @@ _add_to_free_list:
 //      next block (x4)
 //   7. Set the fprev pointer of the next block (x2) to the header of the
 //      previous block (x3)
-//   8. Restore lr and return
+//   8. With MM_TLSF, clear the list's bitmap bits if it is now empty.
+//      Without it, blocks of the last class are unlinked by _tree_remove
+//      instead of steps 2-7.
+//   9. Subtract the block from its class's free byte and block counters
+//   10. Without MM_TLSF, if the next-fit rover of the block's list is on
+//       the block, move it to the block's successor; if the block is the
+//       last remainder, forget it
+//   11. Restore lr and return
 //
 // Registers Modified:
+//   x0 - Block size, then its size class and free list
 //   x1 - Payload address of previous free block
 //   x2 - Payload address of next free block
-//   x3 - Header address of previous free block
-//   x4 - Header address of next free block
+//   x3 - Header address of previous free block, then the payload
+//   x4 - Header address of next free block, then block size
+//
+// Notes:
+//   - The block's header must still hold its own size, so callers that merge
+//     it into a neighbor rewrite the tags after removing it
+//   - x5 and up are preserved, which _coalesce relies on
 _remove_from_free_list:
     str lr, [sp, #-16]!
 
+.ifndef MM_TLSF
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    LOAD_TAG x2, x1
+    GET_SIZE x2, x2
+    cmp x2, #TREE_MIN_BLOCK_BYTES
+    b.lo .Lremove_from_free_list_unlink
+    str x0, [sp, #-16]!
+    mov x0, x1
+    bl _tree_remove
+    ldr x0, [sp], #16
+    b .Lremove_from_free_list_unlinked
+.Lremove_from_free_list_unlink:
+.endif
+
     // Retrieve the payload addresses of the previous and next free blocks
     // x1 = payload address of the previous free block
     // x2 = payload address of the next free block
@@ -698,11 +4010,465 @@ _remove_from_free_list:
     // previus free payload's header
     SET_FPREV x4, x3
 
+.ifdef MM_TLSF
+    // x3 = 1 if the list is now empty, i.e. the sentinel links to itself
+    cmp x3, x4
+    cset x3, eq
+.endif
+
+.Lremove_from_free_list_unlinked:
+    // Take the block out of its class's counters
+    // x4 = block size
+    HEADER_P_FROM_PAYLOAD_P x0, x4
+    LOAD_TAG x4, x4
+    GET_SIZE x4, x4
+
+.ifdef MM_TLSF
+    cbz x3, .Lremove_from_free_list_counters
+
+    // x0 = second level
+    // x1 = first level
+    // x2 = first level's byte in tlsf_sl_bitmap
+    TLSF_LIST_INDEX x4, x0, x1
+    lsr x1, x0, #TLSF_SL_LOG2
+    and x0, x0, #TLSF_SL_COUNT - 1
+    ldr x2, =tlsf_sl_bitmap
+    add x2, x2, x1
+
+    // Clear the list's bit, and the first level's once its last list empties
+    mov w3, #1
+    lsl w0, w3, w0
+    ldrb w3, [x2]
+    bic w3, w3, w0
+    strb w3, [x2]
+    cbnz w3, .Lremove_from_free_list_counters
+    ldr x2, =tlsf_fl_bitmap
+    ldr x3, [x2]
+    mov x0, #1
+    lsl x0, x0, x1
+    bic x3, x3, x0
+    str x3, [x2]
+.Lremove_from_free_list_counters:
+.else
+    mov x3, x0  // Payload, for the rover and last remainder checks below
+.endif
+    mov x0, x4
+    bl _get_seglist_index
+    ldr x1, =stat_free_bytes
+    ldr x2, [x1, x0, LSL #3]
+    sub x2, x2, x4
+    str x2, [x1, x0, LSL #3]
+    ldr x1, =stat_free_blocks
+    ldr x2, [x1, x0, LSL #3]
+    sub x2, x2, #1
+    str x2, [x1, x0, LSL #3]
+
+.ifndef MM_TLSF
+    ldr x1, =placement_policy
+    ldr x1, [x1]
+    cmp x1, #MM_PLACEMENT_NEXT_FIT
+    b.eq .Lremove_from_free_list_rover
+    cmp x1, #MM_PLACEMENT_WILDERNESS
+    b.ne .Lremove_from_free_list_ret
+
+    // The last remainder is forgotten once it leaves the list
+    ldr x1, =last_remainder
+    ldr x2, [x1]
+    cmp x2, x3
+    b.ne .Lremove_from_free_list_ret
+    str xzr, [x1]
+    b .Lremove_from_free_list_ret
+
+.Lremove_from_free_list_rover:
+    // A next-fit rover on the block moves on to its successor, which the
+    // block's own links still name
+    FREE_LIST_INDEX x4, x0, x2
+    ldr x1, =fit_rovers
+    ldr x2, [x1, x0, LSL #PTR_ALIGN]
+    cmp x2, x3
+    b.ne .Lremove_from_free_list_ret
+    NEXT_FREE_PAYLOAD_P x3, x2
+    str x2, [x1, x0, LSL #PTR_ALIGN]
+.Lremove_from_free_list_ret:
+.endif
+
     ldr lr, [sp], #16
     ret
 
 
-// Returns the index into the segregated free list corresponding to a given block size.
+.ifndef MM_TLSF
+// Inserts a free block of the last size class into the size tree.
+//
+// Syntax:
+//   bl _tree_insert
+//
+// Parameters:
+//   x0 [Register]
+//      - Header address of the block
+//   x1 [Register]
+//      - Block size, at least TREE_MIN_BLOCK_BYTES
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - An empty trie takes the block as its root and sets its tree_bitmap bit
+//   - Otherwise walks down from the root, branching on the size bits below
+//     its leading one, until it reaches a node of the same size, which the
+//     block joins in its ring, or an empty child slot, which it takes
+//
+// Registers Modified:
+//   x0-x7 - Clobbered
+_tree_insert:
+    // x2 = trie index
+    // x3 = root slot
+    // x4 = current node
+    clz x2, x1
+    mov x3, #63 - TREE_MIN_LOG2
+    sub x2, x3, x2
+.ifdef MM_COMPACT
+    str xzr, [x0, #TREE_LEFT]  // Not 8-byte aligned from the header
+    str xzr, [x0, #TREE_RIGHT]
+.else
+    stp xzr, xzr, [x0, #TREE_LEFT]
+.endif
+    ldr x3, =tree_roots
+    add x3, x3, x2, LSL #PTR_ALIGN
+    ldr x4, [x3]
+    cbnz x4, .Ltree_insert_walk
+
+    str x0, [x3]
+    str x3, [x0, #TREE_PARENT]
+    SET_FPREV x0, x0
+    SET_FNEXT x0, x0
+    ldr x4, =tree_bitmap
+    ldr x5, [x4]
+    mov x6, #1
+    lsl x6, x6, x2
+    orr x5, x5, x6
+    str x5, [x4]
+    ret
+
+.Ltree_insert_walk:
+    // x5 = size bits still to branch on, the next one in bit 63
+    add x5, x2, #TREE_MIN_LOG2
+    neg x5, x5
+    lsl x5, x1, x5
+.Ltree_insert_loop:
+    LOAD_TAG x6, x4
+    GET_SIZE x6, x6
+    cmp x6, x1
+    b.eq .Ltree_insert_same
+    // x6 = address of the child slot to follow, minus TREE_LEFT
+    lsr x6, x5, #63
+    lsl x5, x5, #1
+    add x6, x4, x6, LSL #PTR_ALIGN
+    ldr x7, [x6, #TREE_LEFT]
+    cbz x7, .Ltree_insert_leaf
+    mov x4, x7
+    b .Ltree_insert_loop
+
+.Ltree_insert_leaf:
+    str x0, [x6, #TREE_LEFT]
+    str x4, [x0, #TREE_PARENT]
+    SET_FPREV x0, x0
+    SET_FNEXT x0, x0
+    ret
+
+.Ltree_insert_same:
+    // Join the node's ring right after it; only the node is in the tree
+    GET_FNEXT x4, x6
+    SET_FNEXT x4, x0
+    SET_FPREV x6, x0
+    SET_FNEXT x0, x6
+    SET_FPREV x0, x4
+    str xzr, [x0, #TREE_PARENT]
+    ret
+
+
+// Removes a free block from the size tree.
+//
+// Syntax:
+//   bl _tree_remove
+//
+// Parameters:
+//   x0 [Register]
+//      - Header address of a block in the size tree (its header must still
+//        hold its own size)
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - A block that shares its size is unlinked from the ring; if it was the
+//     tree node, the next ring member takes its place
+//   - Otherwise a leaf below the block, found by always stepping to the right
+//     child if there is one, is detached and takes its place, which keeps
+//     every node on the path its size bits lead to
+//   - Clears the tree_bitmap bit of a trie that becomes empty
+//
+// Registers Modified:
+//   x0-x4 - Clobbered
+//
+// Notes:
+//   - x5 and up are preserved, as _remove_from_free_list promises
+_tree_remove:
+    stp x5, x6, [sp, #-16]!
+
+    // x1 = replacement node, or NULL
+    // x5 = parent, or 0 if the block is only in a ring
+    ldr x5, [x0, #TREE_PARENT]
+    GET_FPREV x0, x1
+    cmp x1, x0
+    b.eq .Ltree_remove_find_leaf
+    GET_FNEXT x0, x2
+    SET_FPREV x2, x1
+    SET_FNEXT x1, x2
+    b .Ltree_remove_relink
+
+.Ltree_remove_find_leaf:
+    // x2 = slot that holds x1
+    add x2, x0, #TREE_RIGHT
+    ldr x1, [x2]
+    cbnz x1, .Ltree_remove_descend
+    add x2, x0, #TREE_LEFT
+    ldr x1, [x2]
+    cbz x1, .Ltree_remove_relink  // The block is a leaf itself
+.Ltree_remove_descend:
+    add x3, x1, #TREE_RIGHT
+    ldr x4, [x3]
+    cbnz x4, .Ltree_remove_step
+    add x3, x1, #TREE_LEFT
+    ldr x4, [x3]
+    cbz x4, .Ltree_remove_detach
+.Ltree_remove_step:
+    mov x2, x3
+    mov x1, x4
+    b .Ltree_remove_descend
+.Ltree_remove_detach:
+    str xzr, [x2]
+
+.Ltree_remove_relink:
+    cbz x5, .Ltree_remove_ret
+
+    // x2 = trie index
+    // x3 = root slot
+    LOAD_TAG x2, x0
+    GET_SIZE x2, x2
+    clz x2, x2
+    mov x3, #63 - TREE_MIN_LOG2
+    sub x2, x3, x2
+    ldr x3, =tree_roots
+    add x3, x3, x2, LSL #PTR_ALIGN
+    ldr x4, [x3]
+    cmp x4, x0
+    b.ne .Ltree_remove_child
+    str x1, [x3]
+    cbnz x1, .Ltree_remove_adopt
+    ldr x3, =tree_bitmap
+    ldr x4, [x3]
+    mov x6, #1
+    lsl x6, x6, x2
+    bic x4, x4, x6
+    str x4, [x3]
+    b .Ltree_remove_ret
+
+.Ltree_remove_child:
+    ldr x4, [x5, #TREE_LEFT]
+    cmp x4, x0
+    b.ne .Ltree_remove_right_child
+    str x1, [x5, #TREE_LEFT]
+    b .Ltree_remove_replaced
+.Ltree_remove_right_child:
+    str x1, [x5, #TREE_RIGHT]
+.Ltree_remove_replaced:
+    cbz x1, .Ltree_remove_ret
+
+.Ltree_remove_adopt:
+    // The replacement takes the block's parent and children
+    str x5, [x1, #TREE_PARENT]
+.ifdef MM_COMPACT
+    ldr x2, [x0, #TREE_LEFT]
+    ldr x3, [x0, #TREE_RIGHT]
+    str x2, [x1, #TREE_LEFT]
+    str x3, [x1, #TREE_RIGHT]
+.else
+    ldp x2, x3, [x0, #TREE_LEFT]
+    stp x2, x3, [x1, #TREE_LEFT]
+.endif
+    cbz x2, .Ltree_remove_adopt_right
+    str x1, [x2, #TREE_PARENT]
+.Ltree_remove_adopt_right:
+    cbz x3, .Ltree_remove_ret
+    str x1, [x3, #TREE_PARENT]
+
+.Ltree_remove_ret:
+    ldp x5, x6, [sp], #16
+    ret
+
+
+// Finds the smallest free block in the size tree that fits a given size.
+//
+// Syntax:
+//   bl _tree_find_fit
+//
+// Parameters:
+//   x0 [Register]
+//      - Adjusted block size in bytes
+//
+// Return Value:
+//   x0 [Register]
+//      - Payload pointer of the best fit, or NULL (0) if no block fits
+//
+// Algorithm (dlmalloc's tmalloc_large):
+//   1. In the trie of the size, walk down the path of its bits, keeping the
+//      best fit seen and the last right subtree skipped by going left, all
+//      of whose sizes are larger than the request
+//   2. Without an exact match, the smallest block larger than the path is
+//      in that subtree; without such a subtree or any fit on the path, it
+//      is the smallest block of the next non-empty trie in tree_bitmap
+//   3. The smallest block of a subtree lies on its leftmost path, since all
+//      sizes below a left child are smaller than those below the right one
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+_tree_find_fit:
+    // x1 = best fit, or 0
+    // x2 = its size minus the request; sizes below the request wrap past
+    //      the initial value
+    // x3 = current node
+    // x6 = trie index of the size
+    neg x2, x0
+    mov x1, #0
+    clz x6, x0
+    mov x7, #63 - TREE_MIN_LOG2
+    subs x6, x7, x6
+    b.lt .Ltree_find_fit_any_trie  // Smaller than every block in the tree
+    ldr x7, =tree_roots
+    ldr x3, [x7, x6, LSL #PTR_ALIGN]
+    cbz x3, .Ltree_find_fit_next_trie
+
+    // x4 = size bits still to branch on, the next one in bit 63
+    // x5 = last right subtree skipped, or 0
+    add x4, x6, #TREE_MIN_LOG2
+    neg x4, x4
+    lsl x4, x0, x4
+    mov x5, #0
+.Ltree_find_fit_walk:
+    LOAD_TAG x7, x3
+    GET_SIZE x7, x7
+    sub x7, x7, x0
+    cmp x7, x2
+    b.hs .Ltree_find_fit_branch
+    mov x1, x3
+    mov x2, x7
+    cbz x2, .Ltree_find_fit_done  // Exact fit
+.Ltree_find_fit_branch:
+    ldr x8, [x3, #TREE_RIGHT]
+    lsr x7, x4, #63
+    add x7, x3, x7, LSL #PTR_ALIGN
+    ldr x3, [x7, #TREE_LEFT]
+    cbz x8, .Ltree_find_fit_follow
+    cmp x8, x3
+    csel x5, x8, x5, ne
+.Ltree_find_fit_follow:
+    lsl x4, x4, #1
+    cbnz x3, .Ltree_find_fit_walk
+
+    mov x3, x5
+    cbnz x3, .Ltree_find_fit_smallest
+    cbnz x1, .Ltree_find_fit_done
+
+.Ltree_find_fit_next_trie:
+    // x7 = non-empty tries of larger sizes
+    ldr x7, =tree_bitmap
+    ldr x7, [x7]
+    add x6, x6, #1
+    lsr x7, x7, x6
+    lsl x7, x7, x6
+    b .Ltree_find_fit_pick_trie
+.Ltree_find_fit_any_trie:
+    ldr x7, =tree_bitmap
+    ldr x7, [x7]
+.Ltree_find_fit_pick_trie:
+    cbz x7, .Ltree_find_fit_done
+    rbit x7, x7
+    clz x7, x7  // Lowest set bit
+    ldr x3, =tree_roots
+    ldr x3, [x3, x7, LSL #PTR_ALIGN]
+
+.Ltree_find_fit_smallest:
+    LOAD_TAG x7, x3
+    GET_SIZE x7, x7
+    sub x7, x7, x0
+    cmp x7, x2
+    b.hs .Ltree_find_fit_leftmost
+    mov x1, x3
+    mov x2, x7
+.Ltree_find_fit_leftmost:
+    ldr x7, [x3, #TREE_LEFT]
+    cbnz x7, .Ltree_find_fit_descend
+    ldr x7, [x3, #TREE_RIGHT]
+.Ltree_find_fit_descend:
+    mov x3, x7
+    cbnz x3, .Ltree_find_fit_smallest
+
+.Ltree_find_fit_done:
+    mov x0, #0
+    cbz x1, .Ltree_find_fit_ret
+    GET_PAYLOAD_P_FROM_HEADER_P x1, x0
+.Ltree_find_fit_ret:
+    ret
+.endif
+
+
+.ifdef MM_TLSF
+// Returns the TLSF free list that holds free blocks of a given size.
+//
+// Syntax:
+//   bl _get_free_list_index
+//
+// Parameters:
+//   x0 [Register]
+//      - Size of the memory block in bytes
+//
+// Return Value:
+//   x0 [Register]
+//      - Index into seg_listp (see TLSF_LIST_INDEX)
+//
+// Registers Modified:
+//   x0-x2 - Clobbered
+_get_free_list_index:
+    TLSF_LIST_INDEX x0, x1, x2
+    mov x0, x1
+    ret
+.else
+// Returns the free list that holds free blocks of a given size.
+//
+// Syntax:
+//   bl _get_free_list_index
+//
+// Parameters:
+//   x0 [Register]
+//      - Size of the memory block in bytes
+//
+// Return Value:
+//   x0 [Register]
+//      - Index into seg_listp (see FREE_LIST_INDEX)
+//
+// Notes:
+//   - The same as _get_seglist_index until mm_set_adaptive_classes derives
+//     other classes
+//
+// Registers Modified:
+//   x0-x1 - Clobbered
+_get_free_list_index:
+    FREE_LIST_INDEX x0, x0, x1
+    ret
+.endif
+
+
+// Returns the size class of a given block size.
 //
 // Syntax:
 //   bl _get_seglist_index
@@ -713,13 +4479,13 @@ _remove_from_free_list:
 //
 // Return Value:
 //   x0 [Register]
-//      - Index of the segregated free list for the given block size
+//      - Size class of the given block size
 //
 // Behavior:
-//   - Determines which segregated free list a block belongs to based on its
-//     size
-//   - First divides size by 2^6 (64) since the first list handles blocks 32–63
-//     bytes
+//   - Determines which power-of-two size class a block belongs to based on
+//     its size
+//   - First divides size by 2^6 (64) since the first list handles blocks
+//     below 64 bytes
 //   - Uses log2 to determine which power-of-two bucket the adjusted size falls
 //     into
 //   - Clamps the result at NUM_SEG_LISTS - 1 to prevent overflow
@@ -737,9 +4503,14 @@ _remove_from_free_list:
 //   x0 - Input size / return value (seglist index)
 //   x1 - Temporary for clz result
 //   w2 - Temporary for calculations
+//
+// Notes:
+//   - The statistics and latency histograms count blocks by these classes.
+//     Without MM_TLSF the free lists start out on them too, but follow
+//     free_list_classes (see _get_free_list_index).
 _get_seglist_index:
     // Divide the block size by 2^6 = 64 as the first list contains blocks
-    // of size 32 <= x < 64
+    // of size MIN_BLOCK_SIZE_BYTES <= x < 64
     lsr x0, x0, #6
     cbz x0, .Lget_seglist_index_zero
 
@@ -0,0 +1,406 @@
+// Defines the buddy zone behind ENGINE=buddy
+//
+// With --defsym MM_BUDDY=1, mm_malloc sends requests for a power of two of
+// at most 2^BUDDY_MAX_ORDER bytes here. The zone is one allocated block of
+// the boundary-tag heap, taken on the first such request, page aligned and
+// tagged MEM_OWNER_BUDDY in the page map so mm_free finds its blocks. It is
+// managed as a binary buddy system: every block is 2^k bytes at a multiple
+// of 2^k from the zone start, so its buddy is found by flipping bit k of the
+// offset.
+// Buddy blocks carry no boundary tags. The order of each block lives in
+// buddy_orders, one byte per BUDDY_MIN_BLOCK_BYTES granule, so a 64-byte
+// request takes exactly 64 bytes. Requests the zone cannot serve fall back
+// to the boundary-tag heap.
+
+.include "constants.inc"
+.include "mm_errno_constants.inc"
+.include "mm_buddy_constants.inc"
+.include "mem_page_map.inc"
+
+.ifdef MM_BUDDY
+
+.if BUDDY_ZONE_ORDER < PAGE_SHIFT
+.error "The buddy zone must cover whole pages of the page map"
+.endif
+
+// buddy_orders entry: order of the block starting at the granule, with
+// BUDDY_FREE_MASK while it is free, or 0 if no block starts there
+.equ BUDDY_FREE_BIT, 7
+.equ BUDDY_FREE_MASK, 1 << BUDDY_FREE_BIT
+
+// Links at the start of a free block, payload pointers; lists end in NULL
+.equ BUDDY_NEXT, 0
+.equ BUDDY_PREV, 8
+
+.section .bss
+
+.align PTR_ALIGN
+
+// Payload range [start, end) of the zone. Both are 0 until the zone is
+// created, and 1 after creating it failed, which matches no pointer.
+buddy_zone_start: .skip PTR_SIZE_BYTES
+buddy_zone_end: .skip PTR_SIZE_BYTES
+
+// Bit k is set while the list of order k is non-empty
+buddy_order_bitmap: .skip WORD_SIZE_BYTES
+
+// First free block of each order, indexed by the order itself
+buddy_free_heads: .skip (BUDDY_ZONE_ORDER + 1) * PTR_SIZE_BYTES
+buddy_state_end:
+
+// One entry per granule of the zone. Only entries of block starts are
+// read, so stale entries inside larger blocks never need clearing.
+buddy_orders: .skip BUDDY_ZONE_BYTES >> BUDDY_MIN_ORDER
+
+.section .text
+
+.global buddy_zone_start
+.global _buddy_malloc
+.global _buddy_free
+.global _buddy_usable_size
+.global _buddy_reset
+
+
+// Forgets the zone of an earlier heap.
+//
+// Syntax:
+//   bl _buddy_reset
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Called by mm_init; the next routed request creates a new zone
+//
+// Registers Modified:
+//   x0-x1 - Clobbered
+_buddy_reset:
+    ldr x0, =buddy_zone_start
+    ldr x1, =buddy_state_end
+.Lbuddy_reset_loop:
+    str xzr, [x0], #WORD_SIZE_BYTES
+    cmp x0, x1
+    b.lo .Lbuddy_reset_loop
+    ret
+
+
+// Allocates a block from the zone.
+//
+// Syntax:
+//   bl _buddy_malloc
+//
+// Parameters:
+//   x0 [Register]
+//      - Requested size, a power of two no larger than 2^BUDDY_MAX_ORDER
+//
+// Return Value:
+//   x0 [Register]
+//      - Payload of a block of max(x0, BUDDY_MIN_BLOCK_BYTES) bytes, or NULL
+//        if the zone has no room (mm_errno is left alone)
+//
+// Algorithm:
+//   1. k = max(log2(x0), BUDDY_MIN_ORDER)
+//   2. The lowest set bit of the order bitmap at or above k names the
+//      smallest non-empty list j that fits; create the zone if there is
+//      none yet
+//   3. Pop the first block of list j
+//   4. While j > k, halve the block and put the upper half on list j - 1,
+//      which was empty since j was the smallest non-empty order
+//
+// Registers Modified:
+//   x0-x14 - Clobbered
+//   lr     - Saved/restored (only while creating the zone)
+_buddy_malloc:
+    // x1 = order k of the request
+    clz x1, x0
+    mov x2, #63
+    sub x1, x2, x1
+    mov x2, #BUDDY_MIN_ORDER
+    cmp x1, x2
+    csel x1, x1, x2, hs
+
+.Lbuddy_malloc_search:
+    // x3 = address of the order bitmap
+    // x4 = order bitmap
+    // x5 = order j of the block taken
+    ldr x3, =buddy_order_bitmap
+    ldr x4, [x3]
+    lsr x5, x4, x1
+    cbz x5, .Lbuddy_malloc_empty
+    rbit x5, x5
+    clz x5, x5
+    add x5, x5, x1
+
+    // x0 = block
+    // x6 = list heads
+    ldr x6, =buddy_free_heads
+    ldr x0, [x6, x5, LSL #PTR_ALIGN]
+    ldr x7, [x0, #BUDDY_NEXT]
+    str x7, [x6, x5, LSL #PTR_ALIGN]
+    mov x8, #1
+    cbz x7, .Lbuddy_malloc_last
+    str xzr, [x7, #BUDDY_PREV]
+    b .Lbuddy_malloc_split
+.Lbuddy_malloc_last:
+    lsl x9, x8, x5
+    bic x4, x4, x9
+
+.Lbuddy_malloc_split:
+    // x9  = zone start
+    // x10 = order table
+    ldr x9, =buddy_zone_start
+    ldr x9, [x9]
+    ldr x10, =buddy_orders
+.Lbuddy_malloc_split_loop:
+    cmp x5, x1
+    b.ls .Lbuddy_malloc_done
+    sub x5, x5, #1
+    // x11 = upper half, alone on the list of order x5
+    lsl x12, x8, x5
+    add x11, x0, x12
+    stp xzr, xzr, [x11]  // No next, no prev
+    str x11, [x6, x5, LSL #PTR_ALIGN]
+    orr x4, x4, x12
+    sub x13, x11, x9
+    lsr x13, x13, #BUDDY_MIN_ORDER
+    orr x14, x5, #BUDDY_FREE_MASK
+    strb w14, [x10, x13]
+    b .Lbuddy_malloc_split_loop
+
+.Lbuddy_malloc_done:
+    str x4, [x3]
+    sub x13, x0, x9
+    lsr x13, x13, #BUDDY_MIN_ORDER
+    strb w1, [x10, x13]  // Allocated, order k
+    ret
+
+.Lbuddy_malloc_empty:
+    ldr x2, =buddy_zone_start
+    ldr x2, [x2]
+    cbnz x2, .Lbuddy_malloc_fail  // The zone exists, or cannot
+    stp lr, x1, [sp, #-16]!
+    bl _buddy_create_zone
+    ldp lr, x1, [sp], #16
+    cbz x0, .Lbuddy_malloc_search
+.Lbuddy_malloc_fail:
+    mov x0, #0
+    ret
+
+
+// Takes the zone from the boundary-tag heap.
+//
+// Syntax:
+//   bl _buddy_create_zone
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 if the zone was created, as a single free block of order
+//        BUDDY_ZONE_ORDER starting at the first page boundary of the heap
+//        block, with its pages tagged MEM_OWNER_BUDDY
+//      - -1 if the heap could not supply it. The zone bounds are then set
+//        so that no pointer matches and creation is not tried again until
+//        mm_init; mm_errno keeps its earlier value.
+//
+// Registers Modified:
+//   x0-x15 - Clobbered by _malloc_untraced
+//   x19    - Saved/restored (mm_errno before the attempt)
+//   lr     - Saved/restored (for function calls)
+_buddy_create_zone:
+    stp lr, x19, [sp, #-16]!
+
+    bl get_mm_errno
+    mov x19, x0
+    ldr x0, =BUDDY_ZONE_BYTES + PAGE_SIZE_BYTES - DWORD_SIZE_BYTES
+    bl _malloc_untraced  // Too large to be routed back here
+    cbz x0, .Lbuddy_create_zone_fail
+
+    add x0, x0, #PAGE_SIZE_BYTES - 1
+    and x0, x0, #~(PAGE_SIZE_BYTES - 1)
+    ldr x1, =buddy_zone_start
+    mov x2, #BUDDY_ZONE_BYTES
+    add x2, x0, x2
+    stp x0, x2, [x1]  // buddy_zone_start, buddy_zone_end
+
+    // The arena's pages have their nodes already, so this cannot fail
+    str x0, [sp, #-16]!
+    mov x1, #BUDDY_ZONE_BYTES
+    mov x2, #MEM_OWNER_BUDDY
+    bl _mem_page_map_set
+    ldr x0, [sp], #16
+
+    stp xzr, xzr, [x0]  // No next, no prev
+    ldr x1, =buddy_free_heads
+    str x0, [x1, #BUDDY_ZONE_ORDER * PTR_SIZE_BYTES]
+    ldr x1, =buddy_order_bitmap
+    mov x2, #1 << BUDDY_ZONE_ORDER
+    str x2, [x1]
+    ldr x1, =buddy_orders
+    mov w2, #BUDDY_ZONE_ORDER | BUDDY_FREE_MASK
+    strb w2, [x1]
+
+    mov x0, #0
+    b .Lbuddy_create_zone_ret
+
+.Lbuddy_create_zone_fail:
+    mov x0, #1
+    ldr x1, =buddy_zone_start
+    stp x0, x0, [x1]
+    mov x0, x19
+    bl set_mm_errno
+    mov x0, #-1
+.Lbuddy_create_zone_ret:
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Frees a block of the zone and merges it with its free buddies.
+//
+// Syntax:
+//   bl _buddy_free
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer inside the zone
+//
+// Return Value:
+//   None. On a rejected pointer mm_errno is set to:
+//     MM_ERR_ALIGN   (pointer is not BUDDY_MIN_BLOCK_BYTES aligned)
+//     MM_ERR_CORRUPT (no allocated block starts there, e.g. a double free)
+//
+// Algorithm:
+//   1. Read the order k of the block from its buddy_orders entry
+//   2. While k < BUDDY_ZONE_ORDER and the entry of the buddy at offset
+//      (offset ^ 2^k) says free with order k: unlink the buddy, clear the
+//      entry of the upper half, keep the lower offset and increment k
+//   3. Push the merged block on list k and mark it free
+//
+// Registers Modified:
+//   x0-x15 - Clobbered
+//   lr     - Saved/restored (only to report an error)
+_buddy_free:
+    tst x0, #BUDDY_MIN_BLOCK_BYTES - 1
+    b.ne .Lbuddy_free_align_err
+
+    // x1 = zone start
+    // x2 = order table
+    // x3 = offset of the block in the zone
+    // x5 = order of the block
+    ldr x1, =buddy_zone_start
+    ldr x1, [x1]
+    ldr x2, =buddy_orders
+    sub x3, x0, x1
+    lsr x4, x3, #BUDDY_MIN_ORDER
+    ldrb w5, [x2, x4]
+    sub x4, x5, #BUDDY_MIN_ORDER
+    cmp x4, #BUDDY_MAX_ORDER - BUDDY_MIN_ORDER
+    b.hi .Lbuddy_free_corrupt_err  // Free, or no block starts here
+    mov x6, #1
+    lsl x7, x6, x5
+    sub x7, x7, #1
+    tst x3, x7
+    b.ne .Lbuddy_free_corrupt_err  // Stale entry inside a larger block
+
+    // x9  = list heads
+    // x10 = address of the order bitmap
+    // x11 = order bitmap
+    ldr x9, =buddy_free_heads
+    ldr x10, =buddy_order_bitmap
+    ldr x11, [x10]
+.Lbuddy_free_merge:
+    cmp x5, #BUDDY_ZONE_ORDER
+    b.hs .Lbuddy_free_insert
+    // x7 = block size, x12 = buddy offset
+    lsl x7, x6, x5
+    eor x12, x3, x7
+    lsr x13, x12, #BUDDY_MIN_ORDER
+    ldrb w14, [x2, x13]
+    orr x15, x5, #BUDDY_FREE_MASK
+    cmp x14, x15
+    b.ne .Lbuddy_free_insert
+
+    // Unlink the buddy
+    // x12 = buddy, x13 = its next, x14 = its prev
+    add x12, x1, x12
+    ldp x13, x14, [x12]
+    cbz x14, .Lbuddy_free_unlink_head
+    str x13, [x14, #BUDDY_NEXT]
+    b .Lbuddy_free_unlink_next
+.Lbuddy_free_unlink_head:
+    str x13, [x9, x5, LSL #PTR_ALIGN]
+    cbnz x13, .Lbuddy_free_unlink_next
+    bic x11, x11, x7  // The list is now empty
+.Lbuddy_free_unlink_next:
+    cbz x13, .Lbuddy_free_unlinked
+    str x14, [x13, #BUDDY_PREV]
+.Lbuddy_free_unlinked:
+
+    // The upper half no longer starts a block
+    orr x13, x3, x7
+    lsr x13, x13, #BUDDY_MIN_ORDER
+    strb wzr, [x2, x13]
+    bic x3, x3, x7
+    add x5, x5, #1
+    b .Lbuddy_free_merge
+
+.Lbuddy_free_insert:
+    // x12 = merged block, x13 = old head of its list
+    add x12, x1, x3
+    ldr x13, [x9, x5, LSL #PTR_ALIGN]
+    stp x13, xzr, [x12]  // next = old head, no prev
+    cbz x13, .Lbuddy_free_insert_head
+    str x12, [x13, #BUDDY_PREV]
+.Lbuddy_free_insert_head:
+    str x12, [x9, x5, LSL #PTR_ALIGN]
+    lsl x7, x6, x5
+    orr x11, x11, x7
+    str x11, [x10]
+    orr x14, x5, #BUDDY_FREE_MASK
+    lsr x13, x3, #BUDDY_MIN_ORDER
+    strb w14, [x2, x13]
+    ret
+
+.Lbuddy_free_align_err:
+    mov x0, #MM_ERR_ALIGN
+    b .Lbuddy_free_err
+.Lbuddy_free_corrupt_err:
+    mov x0, #MM_ERR_CORRUPT
+.Lbuddy_free_err:
+    str lr, [sp, #-16]!
+    bl set_mm_errno
+    ldr lr, [sp], #16
+    ret
+
+
+// Returns the size of an allocated block of the zone.
+//
+// Syntax:
+//   bl _buddy_usable_size
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer of an allocated block inside the zone
+//
+// Return Value:
+//   x0 [Register]
+//      - 2^k for a block of order k; the whole block is usable
+//
+// Registers Modified:
+//   x0-x1 - Clobbered
+_buddy_usable_size:
+    ldr x1, =buddy_zone_start
+    ldr x1, [x1]
+    sub x0, x0, x1
+    lsr x0, x0, #BUDDY_MIN_ORDER
+    ldr x1, =buddy_orders
+    ldrb w1, [x1, x0]
+    mov x0, #1
+    lsl x0, x0, x1
+    ret
+
+.endif
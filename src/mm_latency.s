@@ -0,0 +1,558 @@
+// Defines the per-call latency histograms
+//
+// While latency_enabled is set, the wrappers in mm_trace.s read CNTVCT_EL0
+// around each mm_malloc, mm_free and mm_free_sized call and pass the elapsed
+// ticks to _latency_end. Each thread counts into its own slot of a table
+// mapped outside the heap: one log-bucketed histogram per operation and size
+// class, plus the longest call per operation. A thread claims its slot on its
+// first timed call and keeps it, so recording is plain loads and stores.
+// Readers sum the slots without a lock.
+
+.include "constants.inc"
+.include "mm_errno_constants.inc"
+.include "mm_stats_constants.inc"
+.include "sys_macros.inc"
+.include "tls_macros.inc"
+
+// Buckets below this count exact tick values (see mm.h)
+.equ LATENCY_LINEAR_BUCKETS, 8
+
+// Layout of a slot
+.equ SLOT_MAX, 0  // Longest call, one word per operation
+.equ SLOT_COUNTS, 64  // Histograms, [operation][size class][bucket]
+.equ LATENCY_HISTOGRAM_BYTES, MM_LATENCY_BUCKETS * WORD_SIZE_BYTES
+.equ SLOT_BYTES, SLOT_COUNTS + MM_LATENCY_OPS * NUM_SEG_LISTS * LATENCY_HISTOGRAM_BYTES
+.equ LATENCY_SLOTS_BYTES, MM_LATENCY_MAX_THREADS * SLOT_BYTES
+
+
+// Finds the slots handed out so far.
+//
+// Syntax:
+//   LATENCY_USED_SLOTS base_reg, count_reg, tmp_reg
+//
+// Parameters:
+//   base_reg  - Receives the first slot (NULL before the first start)
+//   count_reg - Receives the number of slots in use
+//   tmp_reg   - Clobbered
+//
+// Notes:
+//   - Slots are only claimed while timing is on, which needs the table, so
+//     the count is 0 whenever the table is not mapped
+.macro LATENCY_USED_SLOTS base_reg, count_reg, tmp_reg
+    ldr \base_reg, =latency_slots
+    ldr \base_reg, [\base_reg]
+    ldr \count_reg, =latency_threads
+    ldr \count_reg, [\count_reg]
+    mov \tmp_reg, #MM_LATENCY_MAX_THREADS
+    cmp \count_reg, \tmp_reg
+    csel \count_reg, \count_reg, \tmp_reg, lo
+.endm
+
+.section .bss
+
+.align PTR_ALIGN
+
+latency_slots: .skip PTR_SIZE_BYTES  // Slot table, NULL until mapped
+
+// Slots claimed, ever. Threads past MM_LATENCY_MAX_THREADS share the last
+// slot.
+latency_threads: .skip WORD_SIZE_BYTES
+
+.section .tbss, "awT", @nobits
+
+.align PTR_ALIGN
+
+// Calling thread's slot, NULL until its first timed call
+latency_slot: .skip PTR_SIZE_BYTES
+
+.section .text
+
+.global mm_latency_start
+.global mm_latency_stop
+.global mm_latency_histogram
+
+.global _latency_begin
+.global _latency_end
+.global _latency_summarize
+
+
+// Starts timing allocator calls into cleared histograms.
+//
+// Syntax:
+//   bl mm_latency_start
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 if the slot table could not be mapped (mm_errno is set to
+//        MM_ERR_NOMEM)
+//
+// Behavior:
+//   - Maps the slot table with mmap the first time, outside the heap
+//   - Later starts zero the slots in use; threads keep their slots
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+//   lr    - Saved/restored (for function calls)
+mm_latency_start:
+    str lr, [sp, #-16]!
+
+    ldr x0, =latency_slots
+    ldr x0, [x0]
+    cbnz x0, .Llatency_start_reset
+
+    ldr x1, =LATENCY_SLOTS_BYTES
+    sys_mmap #0, x1, #PROT_READ | PROT_WRITE, #MAP_PRIVATE | MAP_ANONYMOUS, #-1, #0
+    cmn x0, #4095
+    b.hs .Llatency_start_nomem_err  // -4095..-1 is an error code
+    ldr x1, =latency_slots
+    str x0, [x1]
+    b .Llatency_start_enable
+
+.Llatency_start_reset:
+    // x0 = next word to clear
+    // x1 = end of the slots in use
+    LATENCY_USED_SLOTS x0, x1, x2
+    ldr x2, =SLOT_BYTES
+    madd x1, x1, x2, x0
+.Llatency_start_clear:
+    cmp x0, x1
+    b.hs .Llatency_start_enable
+    stp xzr, xzr, [x0], #16
+    b .Llatency_start_clear
+
+.Llatency_start_enable:
+    mov w1, #1
+    ldr x0, =latency_enabled
+    stlrb w1, [x0]
+    mov x0, #0
+    b .Llatency_start_ret
+
+.Llatency_start_nomem_err:
+    mov x0, #MM_ERR_NOMEM
+    bl set_mm_errno
+    mov x0, #-1
+.Llatency_start_ret:
+    ldr lr, [sp], #16
+    ret
+
+
+// Stops timing allocator calls.
+//
+// Syntax:
+//   bl mm_latency_stop
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Notes:
+//   - The histograms are kept for mm_latency_histogram and mm_get_stats
+//
+// Registers Modified:
+//   x0 - Clobbered
+mm_latency_stop:
+    ldr x0, =latency_enabled
+    strb wzr, [x0]
+    ret
+
+
+// Sums the histograms of one operation over every thread.
+//
+// Syntax:
+//   bl mm_latency_histogram
+//
+// Parameters:
+//   w0 [Register]
+//      - Operation (MM_LATENCY_MALLOC or MM_LATENCY_FREE)
+//   w1 [Register]
+//      - Size class, or NUM_SEG_LISTS for all classes
+//   x2 [Register]
+//      - Output array of MM_LATENCY_BUCKETS words
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 if an argument is out of range or the array is NULL (mm_errno
+//        is set to MM_ERR_INVAL)
+//
+// Behavior:
+//   - The histograms of consecutive classes are adjacent in a slot, so all
+//     classes are summed by walking NUM_SEG_LISTS histograms in a row
+//
+// Registers Modified:
+//   x0-x13 - Clobbered
+//   lr     - Saved/restored (for function calls)
+mm_latency_histogram:
+    str lr, [sp, #-16]!
+
+    sxtw x0, w0  // int
+    sxtw x1, w1  // int
+    cmp x0, #MM_LATENCY_OPS
+    b.hs .Llatency_histogram_inval_err  // Negative values compare high
+    cmp x1, #NUM_SEG_LISTS
+    b.hi .Llatency_histogram_inval_err
+    cbz x2, .Llatency_histogram_inval_err
+
+    mov x3, #0
+.Llatency_histogram_zero:
+    str xzr, [x2, x3, LSL #WORD_ALIGN]
+    add x3, x3, #1
+    cmp x3, #MM_LATENCY_BUCKETS
+    b.lo .Llatency_histogram_zero
+
+    // x3 = first class
+    // x4 = classes to sum
+    mov x3, x1
+    mov x4, #1
+    cmp x1, #NUM_SEG_LISTS
+    b.ne .Llatency_histogram_classes
+    mov x3, #0
+    mov x4, #NUM_SEG_LISTS
+.Llatency_histogram_classes:
+
+    // x5 = slot
+    // x6 = slots left
+    // x8 = offset of the first histogram in a slot
+    LATENCY_USED_SLOTS x5, x6, x7
+    mov x7, #NUM_SEG_LISTS
+    madd x8, x0, x7, x3
+    mov x7, #LATENCY_HISTOGRAM_BYTES
+    mul x8, x8, x7
+    add x8, x8, #SLOT_COUNTS
+.Llatency_histogram_slot_loop:
+    cbz x6, .Llatency_histogram_done
+    // x9 = next count in the slot
+    // x10 = classes left
+    // x11 = bucket
+    add x9, x5, x8
+    mov x10, x4
+.Llatency_histogram_class_loop:
+    mov x11, #0
+.Llatency_histogram_bucket_loop:
+    ldr x12, [x9], #WORD_SIZE_BYTES
+    ldr x13, [x2, x11, LSL #WORD_ALIGN]
+    add x13, x13, x12
+    str x13, [x2, x11, LSL #WORD_ALIGN]
+    add x11, x11, #1
+    cmp x11, #MM_LATENCY_BUCKETS
+    b.lo .Llatency_histogram_bucket_loop
+    subs x10, x10, #1
+    b.ne .Llatency_histogram_class_loop
+
+    ldr x7, =SLOT_BYTES
+    add x5, x5, x7
+    sub x6, x6, #1
+    b .Llatency_histogram_slot_loop
+
+.Llatency_histogram_done:
+    mov x0, #0
+    b .Llatency_histogram_ret
+
+.Llatency_histogram_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+.Llatency_histogram_ret:
+    ldr lr, [sp], #16
+    ret
+
+
+// Reads the counter at the start of a timed call.
+//
+// Syntax:
+//   bl _latency_begin
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - CNTVCT_EL0, or 0 if timing is off
+//
+// Notes:
+//   - The isb keeps earlier instructions from running into the timed call
+//
+// Registers Modified:
+//   x0 - Return value
+_latency_begin:
+    ldr x0, =latency_enabled
+    ldrb w0, [x0]
+    cbz w0, .Llatency_begin_ret
+    isb
+    mrs x0, cntvct_el0
+.Llatency_begin_ret:
+    ret
+
+
+// Counts a timed call in the calling thread's histograms.
+//
+// Syntax:
+//   bl _latency_end
+//
+// Parameters:
+//   x0 [Register]
+//      - Operation (MM_LATENCY_MALLOC or MM_LATENCY_FREE)
+//   x1 [Register]
+//      - Block size, which selects the size class
+//   x2 [Register]
+//      - Counter returned by _latency_begin; 0 records nothing
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Claims a slot with an atomic increment of latency_threads on the
+//     thread's first timed call
+//   - Updates the operation's longest call and increments one bucket
+//
+// Registers Modified:
+//   x0-x8   - Clobbered
+//   x19-x20 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_latency_end:
+    cbz x2, .Llatency_end_leaf_ret
+    isb
+    mrs x3, cntvct_el0
+    stp lr, x19, [sp, #-16]!
+    str x20, [sp, #-16]!
+
+    // x19 = operation
+    // x20 = ticks
+    mov x19, x0
+    sub x20, x3, x2
+    mov x0, x1
+    bl _get_seglist_index
+    mov x1, x0
+    mov x0, x19
+    mov x2, x20
+
+    // x3 = address of latency_slot
+    // x4 = slot
+    TLS_ADDR latency_slot, x3
+    ldr x4, [x3]
+    cbz x4, .Llatency_end_claim
+.Llatency_end_count:
+    add x5, x4, x0, LSL #WORD_ALIGN
+    ldr x6, [x5, #SLOT_MAX]
+    cmp x2, x6
+    csel x6, x2, x6, hi
+    str x6, [x5, #SLOT_MAX]
+
+    // x5 = bucket: the ticks below LATENCY_LINEAR_BUCKETS, else
+    // 4 * (e - 1) plus the two bits below the leading one at bit e
+    mov x5, x2
+    cmp x2, #LATENCY_LINEAR_BUCKETS
+    b.lo .Llatency_end_bucket
+    clz x6, x2
+    mov x7, #62
+    sub x6, x7, x6  // e - 1
+    sub x7, x6, #1
+    lsr x7, x2, x7
+    and x7, x7, #3
+    orr x5, x7, x6, LSL #2
+    mov x6, #MM_LATENCY_BUCKETS - 1
+    cmp x5, x6
+    csel x5, x5, x6, lo
+.Llatency_end_bucket:
+    // x6 = count to increment
+    mov x7, #NUM_SEG_LISTS
+    madd x6, x0, x7, x1
+    mov x7, #MM_LATENCY_BUCKETS
+    madd x6, x6, x7, x5
+    add x6, x4, x6, LSL #WORD_ALIGN
+    ldr x7, [x6, #SLOT_COUNTS]
+    add x7, x7, #1
+    str x7, [x6, #SLOT_COUNTS]
+
+    ldr x20, [sp], #16
+    ldp lr, x19, [sp], #16
+.Llatency_end_leaf_ret:
+    ret
+
+.Llatency_end_claim:
+    // x6 = slot index
+    ldr x5, =latency_threads
+.Llatency_end_claim_retry:
+    ldxr x6, [x5]
+    add x7, x6, #1
+    stxr w8, x7, [x5]
+    cbnz w8, .Llatency_end_claim_retry
+    mov x7, #MM_LATENCY_MAX_THREADS - 1
+    cmp x6, x7
+    csel x6, x6, x7, lo
+    ldr x7, =SLOT_BYTES
+    ldr x4, =latency_slots
+    ldr x4, [x4]
+    madd x4, x6, x7, x4
+    str x4, [x3]
+    b .Llatency_end_count
+
+
+// Fills in the latency fields of a struct mm_stats.
+//
+// Syntax:
+//   bl _latency_summarize
+//
+// Parameters:
+//   x0 [Register]
+//      - Pointer to the struct mm_stats being filled in
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Sums each operation's histograms over every thread and class into a
+//     stack buffer, then walks it once per percentile
+//   - All zero (apart from the counter frequency) if timing never ran
+//
+// Registers Modified:
+//   x0-x13  - Clobbered
+//   x19-x23 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_latency_summarize:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    stp x22, x23, [sp, #-16]!
+    sub sp, sp, #LATENCY_HISTOGRAM_BYTES
+
+    // x19 = output struct
+    // x20 = operation
+    // x21 = output summary
+    // x22 = calls timed
+    // x23 = longest call
+    mov x19, x0
+    mrs x0, cntfrq_el0
+    str x0, [x19, #MM_STATS_LATENCY_COUNTER_HZ]
+    mov x20, #0
+.Llatency_summarize_op_loop:
+    mov x0, #MM_LATENCY_SUMMARY_BYTES
+    madd x21, x20, x0, x19
+    add x21, x21, #MM_STATS_LATENCY
+
+    mov x0, x20
+    mov x1, #NUM_SEG_LISTS
+    mov x2, sp
+    bl mm_latency_histogram
+
+    mov x22, #0
+    mov x0, #0
+.Llatency_summarize_count_loop:
+    ldr x1, [sp, x0, LSL #WORD_ALIGN]
+    add x22, x22, x1
+    add x0, x0, #1
+    cmp x0, #MM_LATENCY_BUCKETS
+    b.lo .Llatency_summarize_count_loop
+
+    mov x23, #0
+    LATENCY_USED_SLOTS x0, x1, x2
+.Llatency_summarize_max_loop:
+    cbz x1, .Llatency_summarize_percentiles
+    ldr x2, [x0, x20, LSL #WORD_ALIGN]  // SLOT_MAX
+    cmp x2, x23
+    csel x23, x2, x23, hi
+    ldr x2, =SLOT_BYTES
+    add x0, x0, x2
+    sub x1, x1, #1
+    b .Llatency_summarize_max_loop
+
+.Llatency_summarize_percentiles:
+    str x22, [x21, #MM_LATENCY_SUMMARY_COUNT]
+    str x23, [x21, #MM_LATENCY_SUMMARY_MAX]
+    mov x0, #500
+    mov x1, x22
+    mov x2, x23
+    mov x3, sp
+    bl _latency_percentile
+    str x0, [x21, #MM_LATENCY_SUMMARY_P50]
+    mov x0, #990
+    mov x1, x22
+    mov x2, x23
+    mov x3, sp
+    bl _latency_percentile
+    str x0, [x21, #MM_LATENCY_SUMMARY_P99]
+    mov x0, #999
+    mov x1, x22
+    mov x2, x23
+    mov x3, sp
+    bl _latency_percentile
+    str x0, [x21, #MM_LATENCY_SUMMARY_P999]
+
+    add x20, x20, #1
+    cmp x20, #MM_LATENCY_OPS
+    b.lo .Llatency_summarize_op_loop
+
+    add sp, sp, #LATENCY_HISTOGRAM_BYTES
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Finds a percentile in a histogram.
+//
+// Syntax:
+//   bl _latency_percentile
+//
+// Parameters:
+//   x0 [Register]
+//      - Percentile in thousandths (500 for p50)
+//   x1 [Register]
+//      - Total count of the histogram
+//   x2 [Register]
+//      - Longest call, which caps the result
+//   x3 [Register]
+//      - Histogram of MM_LATENCY_BUCKETS words
+//
+// Return Value:
+//   x0 [Register]
+//      - Highest value of the bucket holding call number
+//        ceil(count * x0 / 1000), at most x2; 0 for an empty histogram
+//
+// Registers Modified:
+//   x0-x7 - Clobbered
+_latency_percentile:
+    cbz x1, .Llatency_percentile_empty
+
+    // x4 = rank of the call to find
+    // x5 = bucket
+    // x6 = calls up to and including the bucket
+    mul x4, x1, x0
+    add x4, x4, #999
+    mov x5, #1000
+    udiv x4, x4, x5
+    mov x5, #0
+    mov x6, #0
+.Llatency_percentile_loop:
+    ldr x7, [x3, x5, LSL #WORD_ALIGN]
+    add x6, x6, x7
+    cmp x6, x4
+    b.hs .Llatency_percentile_found
+    add x5, x5, #1
+    cmp x5, #MM_LATENCY_BUCKETS - 1
+    b.lo .Llatency_percentile_loop  // The last bucket holds the rest
+
+.Llatency_percentile_found:
+    // Highest value: ((4 + sub + 1) << (e - 2)) - 1 where e - 2 = bucket / 4 - 1
+    mov x0, x5
+    cmp x5, #LATENCY_LINEAR_BUCKETS
+    b.lo .Llatency_percentile_cap
+    lsr x6, x5, #2
+    sub x6, x6, #1
+    and x7, x5, #3
+    add x7, x7, #5
+    lsl x0, x7, x6
+    sub x0, x0, #1
+.Llatency_percentile_cap:
+    cmp x0, x2
+    csel x0, x0, x2, lo
+    ret
+
+.Llatency_percentile_empty:
+    mov x0, #0
+    ret
@@ -0,0 +1,963 @@
+// Defines the sampling heap profiler
+//
+// mm_malloc counts allocated bytes down in profile_countdown and calls
+// _profile_sample when it runs out. The sampled block is marked with
+// SAMPLED_MASK in its boundary tags and recorded in a side table together
+// with the call stack, so _free_block only calls _profile_forget for blocks
+// that carry the mark.
+
+.include "constants.inc"
+.include "mm_list_traversal_macros.inc"
+.include "mm_errno_constants.inc"
+.include "sys_macros.inc"
+
+// Sampling rates (mirrors mm.h)
+.equ PROFILE_DEFAULT_RATE, 512 * 1024
+.equ PROFILE_MAX_RATE, 1 << 32
+
+// Stack capture limits
+.equ PROFILE_MAX_DEPTH, 16
+.equ PROFILE_MAX_FRAME_BYTES, 1 << 23  // Largest gap between frame records
+
+// Stack table: one entry per distinct call stack, open addressing
+.equ PROFILE_STACK_SLOTS_LOG2, 10
+.equ PROFILE_STACK_SLOTS, 1 << PROFILE_STACK_SLOTS_LOG2
+.equ STACK_DEPTH, 0  // Number of pcs, 0 if the slot is empty
+.equ STACK_ALLOC_OBJS, 8
+.equ STACK_ALLOC_BYTES, 16
+.equ STACK_INUSE_OBJS, 24
+.equ STACK_INUSE_BYTES, 32
+.equ STACK_PCS, 40
+.equ STACK_ENTRY_BYTES, STACK_PCS + PROFILE_MAX_DEPTH * PTR_SIZE_BYTES
+
+// Sample table: one entry per live sampled block, open addressing
+.equ PROFILE_SAMPLE_SLOTS_LOG2, 13
+.equ PROFILE_SAMPLE_SLOTS, 1 << PROFILE_SAMPLE_SLOTS_LOG2
+.equ PROFILE_MAX_LIVE_SAMPLES, PROFILE_SAMPLE_SLOTS / 4 * 3
+.equ SAMPLE_KEY, 0  // Payload, 0 if never used, SAMPLE_TOMBSTONE if freed
+.equ SAMPLE_STACK, 8  // Stack table entry
+.equ SAMPLE_SIZE, 16  // Usable size when sampled
+.equ SAMPLE_ENTRY_BYTES, 24
+.equ SAMPLE_TOMBSTONE, 1
+
+.equ PROFILE_TABLES_BYTES, PROFILE_STACK_SLOTS * STACK_ENTRY_BYTES + PROFILE_SAMPLE_SLOTS * SAMPLE_ENTRY_BYTES
+
+// Multiplicative hashing (2^64 / golden ratio)
+.equ PROFILE_HASH_MULTIPLIER, 0x9e3779b97f4a7c15
+
+// xorshift64* output multiplier
+.equ PROFILE_RNG_MULTIPLIER, 0x2545f4914f6cdd1d
+
+// Fixed-point (Q16) constants for the sampling interval
+.equ PROFILE_RANDOM_BITS, 26
+.equ LOG2_CORRECTION_Q16, 22713  // ~0.3466, see _profile_next_interval
+.equ LN2_Q16, 45426
+
+.equ PROFILE_DUMP_BUFFER_BYTES, PAGE_SIZE_BYTES
+.equ PROFILE_DUMP_LINE_BYTES, 512  // Longest line mm_profile_dump formats
+
+.section .rodata
+
+.Lstr_heap_profile: .asciz "heap profile: "
+.Lstr_heap_v2: .asciz " heap_v2/"
+.Lstr_mapped_libraries: .asciz "\nMAPPED_LIBRARIES:\n"
+.Lstr_proc_self_maps: .asciz "/proc/self/maps"
+
+.section .data
+
+.align PTR_ALIGN
+
+// Bytes mm_malloc may still allocate before the next sample. Starts out of
+// reach, so mm_malloc never samples until mm_profile_start draws the first
+// interval from the same distribution as the others.
+profile_countdown: .quad -1
+
+.section .bss
+
+.align PTR_ALIGN
+
+profile_sampling: .skip WORD_SIZE_BYTES  // 1 between start and stop
+
+profile_rate: .skip WORD_SIZE_BYTES  // Mean bytes between samples
+
+profile_rng: .skip WORD_SIZE_BYTES  // xorshift64* state, seeded lazily
+
+profile_stacks: .skip PTR_SIZE_BYTES  // Stack table, NULL until mapped
+
+profile_samples: .skip PTR_SIZE_BYTES  // Sample table, NULL until mapped
+
+profile_live_samples: .skip WORD_SIZE_BYTES  // Used sample table slots
+
+.section .text
+
+.global mm_profile_start
+.global mm_profile_stop
+.global mm_profile_dump
+
+.global profile_countdown
+.global _profile_sample
+.global _profile_forget
+.global _profile_reset
+
+
+// Starts sampling allocations into a fresh profile.
+//
+// Syntax:
+//   bl mm_profile_start
+//
+// Parameters:
+//   x0 [Register]
+//      - Mean number of allocated bytes between samples, or 0 for
+//        PROFILE_DEFAULT_RATE
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 on error, with mm_errno set to:
+//          MM_ERR_INVAL (the rate is above PROFILE_MAX_RATE)
+//          MM_ERR_NOMEM (the profile tables could not be mapped)
+//
+// Behavior:
+//   - Maps the stack and sample tables with mmap the first time, outside the
+//     heap so profiling does not change what it measures
+//   - Discards any earlier profile and draws the first sampling interval
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+//   x19   - Saved/restored
+//   lr    - Saved/restored (for function calls)
+mm_profile_start:
+    stp lr, x19, [sp, #-16]!
+
+    // x19 = sampling rate
+    mov x19, x0
+    cbnz x19, .Lprofile_start_check_rate
+    mov x19, #PROFILE_DEFAULT_RATE
+.Lprofile_start_check_rate:
+    mov x0, #PROFILE_MAX_RATE
+    cmp x19, x0
+    b.hi .Lprofile_start_inval_err
+
+    ldr x0, =profile_stacks
+    ldr x0, [x0]
+    cbnz x0, .Lprofile_start_reset
+
+    ldr x1, =PROFILE_TABLES_BYTES
+    sys_mmap #0, x1, #PROT_READ | PROT_WRITE, #MAP_PRIVATE | MAP_ANONYMOUS, #-1, #0
+    cmn x0, #4095
+    b.hs .Lprofile_start_nomem_err  // -4095..-1 is an error code
+    ldr x1, =profile_stacks
+    str x0, [x1]
+    ldr x2, =PROFILE_STACK_SLOTS * STACK_ENTRY_BYTES
+    add x0, x0, x2
+    ldr x1, =profile_samples
+    str x0, [x1]
+
+.Lprofile_start_reset:
+    bl _profile_reset
+    ldr x0, =profile_rate
+    str x19, [x0]
+    mov x1, #1
+    ldr x0, =profile_sampling
+    str x1, [x0]
+    bl _profile_next_interval
+    ldr x1, =profile_countdown
+    str x0, [x1]
+
+    mov x0, #0
+    b .Lprofile_start_ret
+
+.Lprofile_start_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+    b .Lprofile_start_ret
+.Lprofile_start_nomem_err:
+    mov x0, #MM_ERR_NOMEM
+    bl set_mm_errno
+    mov x0, #-1
+.Lprofile_start_ret:
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Stops taking new samples.
+//
+// Syntax:
+//   bl mm_profile_stop
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - The profile is kept for mm_profile_dump, and sampled blocks still
+//     leave the live profile when they are freed
+//   - Pushes profile_countdown out of reach so mm_malloc stops calling
+//     _profile_sample
+//
+// Registers Modified:
+//   x0-x1 - Clobbered
+mm_profile_stop:
+    ldr x0, =profile_sampling
+    str xzr, [x0]
+    mov x1, #-1
+    ldr x0, =profile_countdown
+    str x1, [x0]
+    ret
+
+
+// Empties the stack and sample tables.
+//
+// Syntax:
+//   bl _profile_reset
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Does nothing if the tables were never mapped
+//   - Called by mm_profile_start and by mm_init, since samples of a previous
+//     heap describe blocks that no longer exist. Blocks that still carry
+//     SAMPLED_MASK are simply not found by _profile_forget.
+//
+// Registers Modified:
+//   x0-x2 - Clobbered
+_profile_reset:
+    ldr x0, =profile_live_samples
+    str xzr, [x0]
+    ldr x0, =profile_stacks
+    ldr x0, [x0]
+    cbz x0, .Lprofile_reset_ret
+    ldr x1, =PROFILE_TABLES_BYTES
+    add x1, x0, x1
+.Lprofile_reset_loop:
+    stp xzr, xzr, [x0], #2 * WORD_SIZE_BYTES
+    cmp x0, x1
+    b.lo .Lprofile_reset_loop
+.Lprofile_reset_ret:
+    ret
+
+
+// Draws the number of bytes until the next sample.
+//
+// Syntax:
+//   bl _profile_next_interval
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - An exponentially distributed interval with mean profile_rate, at
+//        least 1
+//
+// Behavior:
+//   - Sampling every allocated byte with probability 1 / profile_rate makes
+//     the distance between samples exponential, so large blocks are sampled
+//     in proportion to their size and the samples can be unbiased later
+//   - Computes -ln(U) * profile_rate for a uniform U in (0, 1] as
+//     (PROFILE_RANDOM_BITS - log2(r)) * ln(2) * profile_rate, with r a
+//     PROFILE_RANDOM_BITS-bit random integer
+//   - log2(r) is done in Q16 fixed point: the integer part from clz and the
+//     fraction f of the normalized mantissa corrected by
+//     f * (1 - f) * 0.3466, which is within 0.01 of log2(1 + f)
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+_profile_next_interval:
+    // xorshift64*, seeded from the virtual counter on first use
+    ldr x1, =profile_rng
+    ldr x0, [x1]
+    cbnz x0, .Lprofile_next_interval_step
+    mrs x0, cntvct_el0
+    orr x0, x0, #1  // The state must not be 0
+.Lprofile_next_interval_step:
+    eor x0, x0, x0, LSR #12
+    eor x0, x0, x0, LSL #25
+    eor x0, x0, x0, LSR #27
+    str x0, [x1]
+    ldr x2, =PROFILE_RNG_MULTIPLIER
+    mul x0, x0, x2
+
+    // x0 = r in [1, 2^PROFILE_RANDOM_BITS]
+    lsr x0, x0, #64 - PROFILE_RANDOM_BITS
+    add x0, x0, #1
+
+    // x3 = log2(r) in Q16
+    // x2 = integer part
+    clz x1, x0
+    mov x2, #63
+    sub x2, x2, x1
+    lsl x3, x0, x1
+    lsl x3, x3, #1  // Drop the leading 1
+    lsr x3, x3, #64 - 16  // f
+    mov x4, #1 << 16
+    sub x4, x4, x3
+    mul x4, x4, x3
+    lsr x4, x4, #16  // f * (1 - f)
+    mov x5, #LOG2_CORRECTION_Q16
+    mul x4, x4, x5
+    lsr x4, x4, #16
+    add x3, x3, x4
+    add x3, x3, x2, LSL #16
+
+    // x3 = -log2(U) in Q16
+    mov x4, #PROFILE_RANDOM_BITS << 16
+    sub x3, x4, x3
+
+    // x0 = -log2(U) * ln(2) * profile_rate; the rate is at most 2^32, so
+    // neither product overflows
+    ldr x1, =profile_rate
+    ldr x1, [x1]
+    mul x0, x1, x3
+    lsr x0, x0, #16
+    mov x4, #LN2_Q16
+    mul x0, x0, x4
+    lsr x0, x0, #16
+    cmp x0, #0
+    cinc x0, x0, eq
+    ret
+
+
+// Records a sample for a block mm_malloc just allocated.
+//
+// Syntax:
+//   bl _profile_sample
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload of the allocated block
+//   x1 [Register]
+//      - Return address of the mm_malloc call (first pc of the stack)
+//   x2 [Register]
+//      - Caller's frame pointer (x29 at the mm_malloc call)
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - If sampling is stopped, only moves profile_countdown out of reach
+//   - Otherwise draws the next interval, then:
+//       1. Captures up to PROFILE_MAX_DEPTH pcs by following the frame
+//          records ({previous x29, return address}) from x2, stopping at a
+//          NULL or misaligned frame pointer or one that does not move up the
+//          stack by at most PROFILE_MAX_FRAME_BYTES
+//       2. Finds or adds the stack in the stack table and adds the block's
+//          usable size to its allocated and in-use totals
+//       3. Adds the block to the sample table and sets SAMPLED_MASK in its
+//          header and footer
+//   - Drops the sample if either table is full
+//
+// Registers Modified:
+//   x0-x6   - Clobbered
+//   x19-x24 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+//
+// Notes:
+//   - Relies on code being built with frame pointers; without them the
+//     stack is cut short, never misread
+_profile_sample:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    stp x22, x23, [sp, #-16]!
+    str x24, [sp, #-16]!
+    sub sp, sp, #PROFILE_MAX_DEPTH * PTR_SIZE_BYTES
+
+    // x19 = payload
+    // x20 = first pc
+    // x21 = frame pointer
+    mov x19, x0
+    mov x20, x1
+    mov x21, x2
+
+    ldr x0, =profile_sampling
+    ldr x0, [x0]
+    cbz x0, .Lprofile_sample_off
+
+    bl _profile_next_interval
+    ldr x1, =profile_countdown
+    str x0, [x1]
+
+    ldr x0, =profile_live_samples
+    ldr x0, [x0]
+    mov x1, #PROFILE_MAX_LIVE_SAMPLES
+    cmp x0, x1
+    b.hs .Lprofile_sample_ret  // Sample table is full
+
+    // Capture the stack into the buffer at sp
+    // x22 = depth
+    str x20, [sp]
+    mov x22, #1
+.Lprofile_sample_walk:
+    cmp x22, #PROFILE_MAX_DEPTH
+    b.hs .Lprofile_sample_hash
+    cbz x21, .Lprofile_sample_hash
+    tst x21, #DWORD_SIZE_BYTES - 1
+    b.ne .Lprofile_sample_hash
+    ldp x0, x1, [x21]  // Caller's frame pointer and return address
+    cbz x1, .Lprofile_sample_hash
+    str x1, [sp, x22, LSL #PTR_ALIGN]
+    add x22, x22, #1
+    sub x2, x0, x21
+    sub x2, x2, #1
+    mov x3, #PROFILE_MAX_FRAME_BYTES
+    cmp x2, x3
+    b.hs .Lprofile_sample_hash  // Not a frame further up the stack
+    mov x21, x0
+    b .Lprofile_sample_walk
+
+.Lprofile_sample_hash:
+    // x23 = hash of the stack, then its stack table index
+    mov x23, x22
+    ldr x2, =PROFILE_HASH_MULTIPLIER
+    mov x0, #0
+.Lprofile_sample_hash_loop:
+    ldr x1, [sp, x0, LSL #PTR_ALIGN]
+    eor x23, x23, x1
+    mul x23, x23, x2
+    add x0, x0, #1
+    cmp x0, x22
+    b.lo .Lprofile_sample_hash_loop
+    lsr x23, x23, #64 - PROFILE_STACK_SLOTS_LOG2
+
+    // Find the stack's entry or an empty slot
+    // x24 = stack table entry
+    // x3  = stack table
+    // x4  = probes made
+    ldr x3, =profile_stacks
+    ldr x3, [x3]
+    mov x4, #0
+.Lprofile_sample_probe:
+    mov x5, #STACK_ENTRY_BYTES
+    madd x24, x23, x5, x3
+    ldr x0, [x24, #STACK_DEPTH]
+    cbz x0, .Lprofile_sample_new_stack
+    cmp x0, x22
+    b.ne .Lprofile_sample_probe_next
+    add x5, x24, #STACK_PCS
+    mov x0, #0
+.Lprofile_sample_compare:
+    ldr x1, [sp, x0, LSL #PTR_ALIGN]
+    ldr x6, [x5, x0, LSL #PTR_ALIGN]
+    cmp x1, x6
+    b.ne .Lprofile_sample_probe_next
+    add x0, x0, #1
+    cmp x0, x22
+    b.lo .Lprofile_sample_compare
+    b .Lprofile_sample_count
+.Lprofile_sample_probe_next:
+    add x23, x23, #1
+    and x23, x23, #PROFILE_STACK_SLOTS - 1
+    add x4, x4, #1
+    cmp x4, #PROFILE_STACK_SLOTS
+    b.lo .Lprofile_sample_probe
+    b .Lprofile_sample_ret  // Stack table is full
+
+.Lprofile_sample_new_stack:
+    str x22, [x24, #STACK_DEPTH]
+    add x5, x24, #STACK_PCS
+    mov x0, #0
+.Lprofile_sample_copy:
+    ldr x1, [sp, x0, LSL #PTR_ALIGN]
+    str x1, [x5, x0, LSL #PTR_ALIGN]
+    add x0, x0, #1
+    cmp x0, x22
+    b.lo .Lprofile_sample_copy
+
+.Lprofile_sample_count:
+    // x5 = usable size of the block
+    HEADER_P_FROM_PAYLOAD_P x19, x0
+    LOAD_TAG x0, x0
+    GET_SIZE x0, x5
+    sub x5, x5, #BOUNDARY_TAGS_BYTES
+
+    ldp x0, x1, [x24, #STACK_ALLOC_OBJS]
+    add x0, x0, #1
+    add x1, x1, x5
+    stp x0, x1, [x24, #STACK_ALLOC_OBJS]
+    ldp x0, x1, [x24, #STACK_INUSE_OBJS]
+    add x0, x0, #1
+    add x1, x1, x5
+    stp x0, x1, [x24, #STACK_INUSE_OBJS]
+
+    // Add the block to the sample table; the live sample limit guarantees
+    // a free slot
+    // x0 = slot index
+    // x1 = sample table
+    ldr x0, =PROFILE_HASH_MULTIPLIER
+    mul x0, x19, x0
+    lsr x0, x0, #64 - PROFILE_SAMPLE_SLOTS_LOG2
+    ldr x1, =profile_samples
+    ldr x1, [x1]
+    mov x2, #SAMPLE_ENTRY_BYTES
+.Lprofile_sample_slot:
+    madd x3, x0, x2, x1
+    ldr x4, [x3, #SAMPLE_KEY]
+    cmp x4, #SAMPLE_TOMBSTONE
+    b.ls .Lprofile_sample_store  // Never used or freed
+    add x0, x0, #1
+    and x0, x0, #PROFILE_SAMPLE_SLOTS - 1
+    b .Lprofile_sample_slot
+.Lprofile_sample_store:
+    str x19, [x3, #SAMPLE_KEY]
+    stp x24, x5, [x3, #SAMPLE_STACK]
+    ldr x0, =profile_live_samples
+    ldr x1, [x0]
+    add x1, x1, #1
+    str x1, [x0]
+
+    // Mark the block so _free_block knows to call _profile_forget
+    HEADER_P_FROM_PAYLOAD_P x19, x0
+    LOAD_TAG x1, x0
+    orr x1, x1, #SAMPLED_MASK
+    STORE_TAG x1, x0
+    GET_SIZE x1, x2
+    add x0, x0, x2
+    STORE_TAG x1, x0, -TAG_SIZE_BYTES  // Footer
+    b .Lprofile_sample_ret
+
+.Lprofile_sample_off:
+    mov x1, #-1
+    ldr x0, =profile_countdown
+    str x1, [x0]
+.Lprofile_sample_ret:
+    add sp, sp, #PROFILE_MAX_DEPTH * PTR_SIZE_BYTES
+    ldr x24, [sp], #16
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Removes a sampled block from the live profile.
+//
+// Syntax:
+//   bl _profile_forget
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload of an allocated block whose header has SAMPLED_MASK set
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Looks the block up in the sample table, subtracts it from its stack's
+//     in-use totals and leaves a tombstone in its slot
+//   - Clears SAMPLED_MASK in the block's header and footer, whether or not
+//     the block was found (it is not after a reset)
+//
+// Registers Modified:
+//   x0-x7 - Clobbered
+_profile_forget:
+    // x1 = sample table
+    // x2 = slot index
+    // x3 = probes made
+    ldr x1, =profile_samples
+    ldr x1, [x1]
+    cbz x1, .Lprofile_forget_unmark
+    ldr x2, =PROFILE_HASH_MULTIPLIER
+    mul x2, x0, x2
+    lsr x2, x2, #64 - PROFILE_SAMPLE_SLOTS_LOG2
+    mov x3, #0
+    mov x7, #PROFILE_SAMPLE_SLOTS
+.Lprofile_forget_probe:
+    mov x4, #SAMPLE_ENTRY_BYTES
+    madd x4, x2, x4, x1
+    ldr x5, [x4, #SAMPLE_KEY]
+    cmp x5, x0
+    b.eq .Lprofile_forget_found
+    cbz x5, .Lprofile_forget_unmark  // Never sampled since the last reset
+    add x2, x2, #1
+    and x2, x2, #PROFILE_SAMPLE_SLOTS - 1
+    add x3, x3, #1
+    cmp x3, x7
+    b.lo .Lprofile_forget_probe
+    b .Lprofile_forget_unmark
+
+.Lprofile_forget_found:
+    // x5 = stack table entry
+    // x6 = usable size when sampled
+    ldp x5, x6, [x4, #SAMPLE_STACK]
+    mov x2, #SAMPLE_TOMBSTONE
+    str x2, [x4, #SAMPLE_KEY]
+    ldp x2, x3, [x5, #STACK_INUSE_OBJS]
+    sub x2, x2, #1
+    sub x3, x3, x6
+    stp x2, x3, [x5, #STACK_INUSE_OBJS]
+    ldr x2, =profile_live_samples
+    ldr x3, [x2]
+    sub x3, x3, #1
+    str x3, [x2]
+
+.Lprofile_forget_unmark:
+    HEADER_P_FROM_PAYLOAD_P x0, x1
+    LOAD_TAG x2, x1
+    and x2, x2, #~SAMPLED_MASK
+    STORE_TAG x2, x1
+    GET_SIZE x2, x3
+    add x1, x1, x3
+    STORE_TAG x2, x1, -TAG_SIZE_BYTES  // Footer
+    ret
+
+
+// Writes the heap profile to a file descriptor.
+//
+// Syntax:
+//   bl mm_profile_dump
+//
+// Parameters:
+//   x0 [Register]
+//      - File descriptor to write to
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 if a write failed (mm_errno is set to MM_ERR_IO)
+//
+// Behavior:
+//   - Writes the gperftools heap profile format that pprof reads:
+//       heap profile: <in-use objs>: <in-use bytes> [<alloc objs>: <alloc bytes>] @ heap_v2/<rate>
+//       <in-use objs>: <in-use bytes> [<alloc objs>: <alloc bytes>] @ <pc> <pc> ...
+//       ...
+//
+//       MAPPED_LIBRARIES:
+//       <contents of /proc/self/maps>
+//   - One line per distinct stack gives both the live heap (in use) and the
+//     cumulative profile (allocated since mm_profile_start); counts are raw
+//     samples, which pprof scales using the rate
+//   - Formats into a PROFILE_DUMP_BUFFER_BYTES buffer on the stack and writes
+//     it out with _write_all whenever a line might not fit
+//   - An unreadable /proc/self/maps leaves the section empty
+//
+// Registers Modified:
+//   x0-x8   - Clobbered
+//   x19-x26 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+mm_profile_dump:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    stp x22, x23, [sp, #-16]!
+    stp x24, x25, [sp, #-16]!
+    str x26, [sp, #-16]!
+    sub sp, sp, #PROFILE_DUMP_BUFFER_BYTES
+
+    // x19 = file descriptor
+    // x20 = buffer
+    // x21 = buffer cursor
+    // x22 = stack table entry
+    // x23 = stack table end
+    mov x19, x0
+    mov x20, sp
+    mov x21, sp
+    ldr x22, =profile_stacks
+    ldr x22, [x22]
+    ldr x23, =PROFILE_STACK_SLOTS * STACK_ENTRY_BYTES
+    add x23, x22, x23
+    cbnz x22, .Lprofile_dump_totals
+    mov x23, #0  // Never mapped: no stacks
+
+.Lprofile_dump_totals:
+    // x1-x4 = totals over every stack
+    mov x1, #0
+    mov x2, #0
+    mov x3, #0
+    mov x4, #0
+    mov x5, x22
+.Lprofile_dump_totals_loop:
+    cmp x5, x23
+    b.hs .Lprofile_dump_header
+    ldp x6, x7, [x5, #STACK_INUSE_OBJS]
+    add x1, x1, x6
+    add x2, x2, x7
+    ldp x6, x7, [x5, #STACK_ALLOC_OBJS]
+    add x3, x3, x6
+    add x4, x4, x7
+    add x5, x5, #STACK_ENTRY_BYTES
+    b .Lprofile_dump_totals_loop
+
+.Lprofile_dump_header:
+    stp x1, x2, [sp, #-16]!
+    mov x0, x21
+    ldr x1, =.Lstr_heap_profile
+    bl _fmt_str
+    ldp x1, x2, [sp], #16
+    bl _fmt_counts
+    ldr x1, =.Lstr_heap_v2
+    bl _fmt_str
+    ldr x1, =profile_rate
+    ldr x1, [x1]
+    cbnz x1, .Lprofile_dump_rate
+    mov x1, #PROFILE_DEFAULT_RATE  // Never started
+.Lprofile_dump_rate:
+    bl _fmt_dec
+    mov w1, #'\n'
+    strb w1, [x0], #1
+    mov x21, x0
+
+.Lprofile_dump_stack_loop:
+    cmp x22, x23
+    b.hs .Lprofile_dump_maps
+    ldr x24, [x22, #STACK_DEPTH]
+    cbz x24, .Lprofile_dump_stack_next
+
+    // Make sure the longest possible line fits
+    sub x0, x21, x20
+    cmp x0, #PROFILE_DUMP_BUFFER_BYTES - PROFILE_DUMP_LINE_BYTES
+    b.lo .Lprofile_dump_format_stack
+    bl .Lprofile_dump_flush
+    cbnz x0, .Lprofile_dump_ret
+
+.Lprofile_dump_format_stack:
+    mov x0, x21
+    ldp x1, x2, [x22, #STACK_INUSE_OBJS]
+    ldp x3, x4, [x22, #STACK_ALLOC_OBJS]
+    bl _fmt_counts
+    // x25 = pc index
+    mov x25, #0
+.Lprofile_dump_pc_loop:
+    mov w1, #' '
+    strb w1, [x0], #1
+    add x1, x22, #STACK_PCS
+    ldr x1, [x1, x25, LSL #PTR_ALIGN]
+    bl _fmt_hex
+    add x25, x25, #1
+    cmp x25, x24
+    b.lo .Lprofile_dump_pc_loop
+    mov w1, #'\n'
+    strb w1, [x0], #1
+    mov x21, x0
+
+.Lprofile_dump_stack_next:
+    add x22, x22, #STACK_ENTRY_BYTES
+    b .Lprofile_dump_stack_loop
+
+.Lprofile_dump_maps:
+    mov x0, x21
+    ldr x1, =.Lstr_mapped_libraries
+    bl _fmt_str
+    mov x21, x0
+    bl .Lprofile_dump_flush
+    cbnz x0, .Lprofile_dump_ret
+
+    // x26 = /proc/self/maps file descriptor
+    ldr x1, =.Lstr_proc_self_maps
+    sys_openat #AT_FDCWD, x1, #O_RDONLY
+    tbnz x0, #63, .Lprofile_dump_done  // No maps available
+    mov x26, x0
+.Lprofile_dump_maps_loop:
+    mov x2, #PROFILE_DUMP_BUFFER_BYTES
+    sys_read x26, x20, x2
+    cmn x0, #EINTR
+    b.eq .Lprofile_dump_maps_loop
+    cmp x0, #0
+    b.le .Lprofile_dump_maps_close  // End of file, or unreadable
+    mov x2, x0
+    mov x0, x19
+    mov x1, x20
+    bl _write_all
+    cbz x0, .Lprofile_dump_maps_loop
+    sys_close x26
+    mov x0, #-1
+    b .Lprofile_dump_ret
+.Lprofile_dump_maps_close:
+    sys_close x26
+
+.Lprofile_dump_done:
+    mov x0, #0
+.Lprofile_dump_ret:
+    add sp, sp, #PROFILE_DUMP_BUFFER_BYTES
+    ldr x26, [sp], #16
+    ldp x24, x25, [sp], #16
+    ldp x22, x23, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+// Writes out the buffer and rewinds the cursor; returns _write_all's result.
+// Only called from mm_profile_dump, whose frame it shares.
+.Lprofile_dump_flush:
+    str lr, [sp, #-16]!
+    mov x0, x19
+    mov x1, x20
+    sub x2, x21, x20
+    mov x21, x20
+    bl _write_all
+    ldr lr, [sp], #16
+    ret
+
+
+// Formats the counts of a heap profile line.
+//
+// Syntax:
+//   bl _fmt_counts
+//
+// Parameters:
+//   x0 [Register]
+//      - Output cursor
+//   x1-x4 [Registers]
+//      - In-use objects, in-use bytes, allocated objects, allocated bytes
+//
+// Return Value:
+//   x0 [Register]
+//      - Cursor past "<x1>: <x2> [<x3>: <x4>] @"
+//
+// Registers Modified:
+//   x0-x5   - Clobbered
+//   x20-x22 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_fmt_counts:
+    stp lr, x20, [sp, #-16]!
+    stp x21, x22, [sp, #-16]!
+
+    mov x20, x2
+    mov x21, x3
+    mov x22, x4
+    bl _fmt_dec
+    mov w1, #':'
+    strb w1, [x0], #1
+    mov w1, #' '
+    strb w1, [x0], #1
+    mov x1, x20
+    bl _fmt_dec
+    mov w1, #' '
+    strb w1, [x0], #1
+    mov w1, #'['
+    strb w1, [x0], #1
+    mov x1, x21
+    bl _fmt_dec
+    mov w1, #':'
+    strb w1, [x0], #1
+    mov w1, #' '
+    strb w1, [x0], #1
+    mov x1, x22
+    bl _fmt_dec
+    mov w1, #']'
+    strb w1, [x0], #1
+    mov w1, #' '
+    strb w1, [x0], #1
+    mov w1, #'@'
+    strb w1, [x0], #1
+
+    ldp x21, x22, [sp], #16
+    ldp lr, x20, [sp], #16
+    ret
+
+
+// Formats an unsigned integer in decimal.
+//
+// Syntax:
+//   bl _fmt_dec
+//
+// Parameters:
+//   x0 [Register]
+//      - Output cursor
+//   x1 [Register]
+//      - Value
+//
+// Return Value:
+//   x0 [Register]
+//      - Cursor past the digits
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+_fmt_dec:
+    sub sp, sp, #32  // Room for the 20 digits of UINT64_MAX
+
+    // Produce the digits backwards from the end of the scratch space
+    // x2 = first digit produced so far
+    add x2, sp, #32
+    mov x4, #10
+.Lfmt_dec_digit:
+    udiv x3, x1, x4
+    msub x5, x3, x4, x1
+    add x5, x5, #'0'
+    strb w5, [x2, #-1]!
+    mov x1, x3
+    cbnz x1, .Lfmt_dec_digit
+
+    add x3, sp, #32
+.Lfmt_dec_copy:
+    ldrb w5, [x2], #1
+    strb w5, [x0], #1
+    cmp x2, x3
+    b.lo .Lfmt_dec_copy
+
+    add sp, sp, #32
+    ret
+
+
+// Formats an unsigned integer as 0x followed by hex digits.
+//
+// Syntax:
+//   bl _fmt_hex
+//
+// Parameters:
+//   x0 [Register]
+//      - Output cursor
+//   x1 [Register]
+//      - Value
+//
+// Return Value:
+//   x0 [Register]
+//      - Cursor past the digits
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+_fmt_hex:
+    mov w2, #'0'
+    strb w2, [x0], #1
+    mov w2, #'x'
+    strb w2, [x0], #1
+
+    // x2 = number of digits, at least 1
+    clz x2, x1
+    mov x3, #64 + 3
+    sub x2, x3, x2
+    lsr x2, x2, #2
+    cmp x2, #0
+    cinc x2, x2, eq
+.Lfmt_hex_digit:
+    sub x2, x2, #1
+    lsl x3, x2, #2
+    lsr x3, x1, x3
+    and x3, x3, #0xf
+    add x4, x3, #'0'
+    add x5, x3, #'a' - 10
+    cmp x3, #10
+    csel x3, x4, x5, lo
+    strb w3, [x0], #1
+    cbnz x2, .Lfmt_hex_digit
+    ret
+
+
+// Copies a NUL-terminated string, without the NUL.
+//
+// Syntax:
+//   bl _fmt_str
+//
+// Parameters:
+//   x0 [Register]
+//      - Output cursor
+//   x1 [Register]
+//      - String
+//
+// Return Value:
+//   x0 [Register]
+//      - Cursor past the copied characters
+//
+// Registers Modified:
+//   x0-x2 - Clobbered
+_fmt_str:
+    ldrb w2, [x1], #1
+    cbz w2, .Lfmt_str_ret
+    strb w2, [x0], #1
+    b _fmt_str
+.Lfmt_str_ret:
+    ret
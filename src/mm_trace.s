@@ -0,0 +1,617 @@
+// Defines the allocation tracer
+//
+// While tracing or latency timing is on, the TRACE_HOOK at the top of each
+// traced entry point in mm.s jumps to a wrapper here. The wrapper runs the
+// untraced body, appends an event to the calling thread's buffer in
+// thread-local storage if tracing, and times the call with mm_latency.s if
+// timing.
+// Each thread only touches its own buffer, so recording takes no lock and no
+// atomic; a full buffer is written out by its own thread with one write
+// syscall, and the kernel keeps concurrent writes to the same file apart.
+// Buffers are stamped with the session (mm_trace_start call) their events
+// belong to, so events a thread never flushed are dropped rather than
+// written into the next session's file.
+
+.include "constants.inc"
+.include "mm_list_traversal_macros.inc"
+.include "mm_errno_constants.inc"
+.include "mm_stats_constants.inc"
+.include "mm_trace_constants.inc"
+.include "sys_macros.inc"
+.include "tls_macros.inc"
+
+// Branches to a label unless tracing is on.
+//
+// Syntax:
+//   UNLESS_TRACING label
+//
+// Parameters:
+//   label - Where to go when tracing is off (only latency timing is on)
+//
+// Registers Modified:
+//   x9 - Clobbered, so the wrapper's arguments are unchanged
+.macro UNLESS_TRACING label
+    ldr x9, =trace_enabled
+    ldrb w9, [x9]
+    cbz w9, \label
+.endm
+
+// Events buffered per thread before they are written out
+.equ TRACE_BUFFER_CAPACITY, 128
+
+// Layout of trace_buffer
+.equ TRACE_BUFFER_COUNT, 0  // Events buffered
+.equ TRACE_BUFFER_TID, 8  // Thread ID, 0 until the first event
+.equ TRACE_BUFFER_SESSION, 16  // trace_session of the buffered events
+.equ TRACE_BUFFER_EVENTS, 24
+.equ TRACE_BUFFER_BYTES, TRACE_BUFFER_EVENTS + TRACE_BUFFER_CAPACITY * MM_TRACE_EVENT_BYTES
+
+.section .bss
+
+.align PTR_ALIGN
+
+// Read as one word by TRACE_HOOK in mm.s, which calls the wrappers while any
+// byte is non-zero. Each feature owns a byte, so starting or stopping one
+// never overwrites the other.
+call_hooks:
+trace_enabled: .skip 1  // Non-zero while tracing
+latency_enabled: .skip 1  // Non-zero while timing calls (mm_latency.s)
+.skip WORD_SIZE_BYTES - 2
+
+trace_fd: .skip WORD_SIZE_BYTES  // File descriptor events are written to
+
+trace_session: .skip WORD_SIZE_BYTES  // Incremented by every mm_trace_start
+
+.section .tbss, "awT", @nobits
+
+.align PTR_ALIGN
+
+// Per-thread event buffer
+trace_buffer: .skip TRACE_BUFFER_BYTES
+
+.section .text
+
+.global mm_trace_start
+.global mm_trace_stop
+.global mm_trace_flush
+
+.global call_hooks
+.global latency_enabled
+.global _trace_malloc
+.global _trace_free
+.global _trace_free_sized
+.global _trace_expand
+.global _trace_malloc_batch
+.global _trace_free_batch
+
+
+// Starts recording allocator calls to a file descriptor.
+//
+// Syntax:
+//   bl mm_trace_start
+//
+// Parameters:
+//   x0 [Register]
+//      - File descriptor to write the trace to
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success
+//      - -1 on error, with mm_errno set to:
+//          MM_ERR_INVAL (negative descriptor, or tracing is already on)
+//          MM_ERR_IO    (the trace header could not be written)
+//
+// Behavior:
+//   - Writes a struct mm_trace_header with the counter frequency, so
+//     timestamps can be converted to seconds
+//   - Starts a new session, so events any thread still buffers from an
+//     earlier one are discarded instead of written to this descriptor
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+//   x8    - Used for the syscall number
+//   x19   - Saved/restored (file descriptor)
+//   lr    - Saved/restored (for function calls)
+mm_trace_start:
+    stp lr, x19, [sp, #-16]!
+    sub sp, sp, #MM_TRACE_HEADER_BYTES
+
+    sxtw x19, w0  // int
+    tbnz x19, #63, .Ltrace_start_inval_err
+    ldr x1, =trace_enabled
+    ldrb w1, [x1]
+    cbnz w1, .Ltrace_start_inval_err
+
+    ldr x1, =MM_TRACE_MAGIC
+    mov x2, #MM_TRACE_VERSION
+    stp x1, x2, [sp, #MM_TRACE_HEADER_MAGIC]
+    mrs x1, cntfrq_el0
+    mov x2, #MM_TRACE_EVENT_BYTES
+    stp x1, x2, [sp, #MM_TRACE_HEADER_COUNTER_HZ]
+    mov x1, sp
+    mov x2, #MM_TRACE_HEADER_BYTES
+    bl _write_all
+    cbnz x0, .Ltrace_start_ret  // _write_all set mm_errno
+
+    ldr x1, =trace_fd
+    str x19, [x1]
+    ldr x1, =trace_session
+    ldr x2, [x1]
+    add x2, x2, #1
+    str x2, [x1]
+
+    // Publish the descriptor and session before other threads start
+    // recording
+    mov w2, #1
+    ldr x1, =trace_enabled
+    stlrb w2, [x1]
+
+    mov x0, #0
+    b .Ltrace_start_ret
+
+.Ltrace_start_inval_err:
+    mov x0, #MM_ERR_INVAL
+    bl set_mm_errno
+    mov x0, #-1
+.Ltrace_start_ret:
+    add sp, sp, #MM_TRACE_HEADER_BYTES
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Stops recording and writes out the calling thread's buffered events.
+//
+// Syntax:
+//   bl mm_trace_stop
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - Same as mm_trace_flush
+//
+// Notes:
+//   - Other threads keep their buffered events until they call
+//     mm_trace_flush, which still writes to the same descriptor. Once
+//     mm_trace_start is called again, those events are dropped.
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+//   x8    - Used for the syscall number
+mm_trace_stop:
+    ldr x0, =trace_enabled
+    strb wzr, [x0]
+    b mm_trace_flush  // Tail call
+
+
+// Writes out the events buffered by the calling thread.
+//
+// Syntax:
+//   bl mm_trace_flush
+//
+// Parameters:
+//   None
+//
+// Return Value:
+//   x0 [Register]
+//      - 0 on success, or if nothing was buffered
+//      - -1 if the write failed (mm_errno is set to MM_ERR_IO); the events
+//        are dropped
+//
+// Behavior:
+//   - Drops the events without writing them if they belong to an earlier
+//     session than trace_session
+//
+// Notes:
+//   - Threads must call it before they exit, or their last events are lost
+//
+// Registers Modified:
+//   x0-x5 - Clobbered
+//   x8    - Used for the syscall number
+mm_trace_flush:
+    TLS_ADDR trace_buffer, x1
+    ldr x2, [x1, #TRACE_BUFFER_COUNT]
+    cbz x2, .Ltrace_flush_empty
+    str xzr, [x1, #TRACE_BUFFER_COUNT]
+    ldr x3, =trace_session
+    ldr x3, [x3]
+    ldr x4, [x1, #TRACE_BUFFER_SESSION]
+    cmp x3, x4
+    b.ne .Ltrace_flush_empty  // Left over from an earlier session
+    add x1, x1, #TRACE_BUFFER_EVENTS
+    lsl x2, x2, #MM_TRACE_EVENT_ALIGN
+    ldr x0, =trace_fd
+    ldr x0, [x0]
+    b _write_all  // Tail call
+.Ltrace_flush_empty:
+    mov x0, #0
+    ret
+
+
+// Appends an event to the calling thread's buffer.
+//
+// Syntax:
+//   bl _trace_record
+//
+// Parameters:
+//   x0 [Register]
+//      - Operation (MM_TRACE_MALLOC, MM_TRACE_FREE or MM_TRACE_EXPAND)
+//   x1 [Register]
+//      - Payload pointer
+//   x2 [Register]
+//      - Size (see struct mm_trace_event)
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Timestamps the event with CNTVCT_EL0
+//   - Looks the thread ID up with gettid on the thread's first event only
+//   - Drops buffered events of an earlier session and stamps the buffer
+//     with the current one
+//   - Flushes the buffer when it becomes full; a failed flush drops the
+//     events and sets mm_errno to MM_ERR_IO
+//
+// Registers Modified:
+//   x0-x8 - Clobbered
+_trace_record:
+    // x3 = thread's buffer
+    // x4 = thread ID
+    TLS_ADDR trace_buffer, x3
+    ldr x4, [x3, #TRACE_BUFFER_TID]
+    cbz x4, .Ltrace_record_tid
+.Ltrace_record_store:
+    // x5 = current session, then events buffered
+    // x6 = buffer's session, then next event
+    ldr x5, =trace_session
+    ldr x5, [x5]
+    ldr x6, [x3, #TRACE_BUFFER_SESSION]
+    cmp x5, x6
+    b.ne .Ltrace_record_new_session
+    ldr x5, [x3, #TRACE_BUFFER_COUNT]
+.Ltrace_record_append:
+    add x6, x3, #TRACE_BUFFER_EVENTS
+    add x6, x6, x5, LSL #MM_TRACE_EVENT_ALIGN
+    mrs x7, cntvct_el0
+    stp x7, x1, [x6, #MM_TRACE_EVENT_TIMESTAMP]
+    orr x4, x4, x0, LSL #32  // Thread and operation share a word
+    stp x2, x4, [x6, #MM_TRACE_EVENT_SIZE]
+    add x5, x5, #1
+    str x5, [x3, #TRACE_BUFFER_COUNT]
+    cmp x5, #TRACE_BUFFER_CAPACITY
+    b.hs mm_trace_flush  // Tail call
+    ret
+.Ltrace_record_new_session:
+    str x5, [x3, #TRACE_BUFFER_SESSION]
+    mov x5, #0
+    b .Ltrace_record_append
+.Ltrace_record_tid:
+    mov x5, x0
+    sys_gettid
+    mov w4, w0
+    str x4, [x3, #TRACE_BUFFER_TID]
+    mov x0, x5
+    b .Ltrace_record_store
+
+
+// Traces and times mm_malloc.
+//
+// Syntax:
+//   b _trace_malloc (from TRACE_HOOK in mm_malloc)
+//
+// Parameters:
+//   x0 [Register]
+//      - Requested payload size in bytes
+//
+// Return Value:
+//   x0 [Register]
+//      - Same as mm_malloc
+//
+// Behavior:
+//   - Times the call as MM_LATENCY_MALLOC in the size class of the adjusted
+//     request
+//   - Records MM_TRACE_MALLOC with the result, after the call, so no other
+//     thread can record a free of the block before its allocation
+//
+// Registers Modified:
+//   x0-x15  - Clobbered
+//   x19-x21 - Saved/restored
+//   x29     - Saved/restored (frame record, so profiler samples see the
+//             caller)
+//   lr      - Saved/restored (for function calls)
+_trace_malloc:
+    stp x29, lr, [sp, #-16]!
+    mov x29, sp
+    stp x19, x20, [sp, #-16]!
+    str x21, [sp, #-16]!
+
+    // x19 = requested size
+    // x20 = result
+    // x21 = counter before the call, 0 if not timing
+    mov x19, x0
+    bl _latency_begin
+    mov x21, x0
+    mov x0, x19
+    bl _malloc_untraced
+    mov x20, x0
+
+    mov x0, #MM_LATENCY_MALLOC
+    ADJUST_BLOCK_SIZE x19, x1
+    mov x2, x21
+    bl _latency_end
+
+    UNLESS_TRACING .Ltrace_malloc_ret
+    mov x0, #MM_TRACE_MALLOC
+    mov x1, x20
+    mov x2, x19
+    bl _trace_record
+
+.Ltrace_malloc_ret:
+    mov x0, x20
+    ldr x21, [sp], #16
+    ldp x19, x20, [sp], #16
+    ldp x29, lr, [sp], #16
+    ret
+
+
+// Traces and times mm_free.
+//
+// Syntax:
+//   b _trace_free (from TRACE_HOOK in mm_free)
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer to free (never NULL; mm_free returns first)
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Records MM_TRACE_FREE with size 0 before the call, so no other thread
+//     can record an allocation of the same address before the free
+//   - Times the call as MM_LATENCY_FREE in the size class of the block,
+//     read from its header before the free can merge it (class 0 for a
+//     misaligned pointer, which mm_free rejects without reading it)
+//
+// Registers Modified:
+//   x0-x15  - Clobbered
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_trace_free:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+
+    // x19 = payload
+    // x20 = block size
+    // x21 = counter before the call, 0 if not timing
+    mov x19, x0
+    UNLESS_TRACING .Ltrace_free_size
+    mov x1, x0
+    mov x2, #0
+    mov x0, #MM_TRACE_FREE
+    bl _trace_record
+
+.Ltrace_free_size:
+    mov x20, #0
+    tst x19, #DWORD_SIZE_BYTES - 1
+    b.ne .Ltrace_free_call
+    LOAD_TAG x20, x19, -TAG_SIZE_BYTES  // Header
+    GET_SIZE x20, x20
+.Ltrace_free_call:
+    bl _latency_begin
+    mov x21, x0
+    mov x0, x19
+    bl _free_untraced
+
+    mov x0, #MM_LATENCY_FREE
+    mov x1, x20
+    mov x2, x21
+    bl _latency_end
+
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Traces and times mm_free_sized.
+//
+// Syntax:
+//   b _trace_free_sized (from TRACE_HOOK in mm_free_sized)
+//
+// Parameters:
+//   x0 [Register]
+//      - Payload pointer to free (never NULL)
+//   x1 [Register]
+//      - The size that was passed to mm_malloc for this block
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Records MM_TRACE_FREE with the caller's size before the call
+//   - Times the call as MM_LATENCY_FREE in the size class of the adjusted
+//     size, like mm_free_sized itself
+//
+// Registers Modified:
+//   x0-x15  - Clobbered
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_trace_free_sized:
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+
+    // x19 = payload
+    // x20 = caller's size
+    // x21 = counter before the call, 0 if not timing
+    mov x19, x0
+    mov x20, x1
+    UNLESS_TRACING .Ltrace_free_sized_call
+    mov x2, x1
+    mov x1, x0
+    mov x0, #MM_TRACE_FREE
+    bl _trace_record
+
+.Ltrace_free_sized_call:
+    bl _latency_begin
+    mov x21, x0
+    mov x0, x19
+    mov x1, x20
+    bl _free_sized_untraced
+
+    mov x0, #MM_LATENCY_FREE
+    ADJUST_BLOCK_SIZE x20, x1
+    mov x2, x21
+    bl _latency_end
+
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Traces mm_expand.
+//
+// Syntax:
+//   b _trace_expand (from TRACE_HOOK in mm_expand)
+//
+// Parameters:
+//   x0-x2 [Registers]
+//      - Same as mm_expand
+//
+// Return Value:
+//   x0 [Register]
+//      - Same as mm_expand
+//
+// Behavior:
+//   - Runs the untraced body directly if only latency timing is on
+//   - Records MM_TRACE_EXPAND with the new usable size, or 0 if the block
+//     could not grow
+//
+// Registers Modified:
+//   x0-x8   - Clobbered
+//   x19-x20 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_trace_expand:
+    UNLESS_TRACING _expand_untraced  // Tail call
+    stp lr, x19, [sp, #-16]!
+    str x20, [sp, #-16]!
+
+    mov x19, x0
+    bl _expand_untraced
+    mov x20, x0
+    mov x2, x0
+    mov x1, x19
+    mov x0, #MM_TRACE_EXPAND
+    bl _trace_record
+    mov x0, x20
+
+    ldr x20, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Traces mm_malloc_batch.
+//
+// Syntax:
+//   b _trace_malloc_batch (from TRACE_HOOK in mm_malloc_batch)
+//
+// Parameters:
+//   x0-x2 [Registers]
+//      - Same as mm_malloc_batch
+//
+// Return Value:
+//   x0 [Register]
+//      - Same as mm_malloc_batch
+//
+// Behavior:
+//   - Runs the untraced body directly if only latency timing is on
+//   - Records one MM_TRACE_MALLOC per block stored, so a replay does not
+//     need to know about batches
+//
+// Registers Modified:
+//   x0-x15  - Clobbered
+//   x19-x22 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_trace_malloc_batch:
+    UNLESS_TRACING _malloc_batch_untraced  // Tail call
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+    str x22, [sp, #-16]!
+
+    // x19 = requested size
+    // x20 = output array
+    // x21 = blocks stored
+    // x22 = blocks recorded
+    mov x19, x0
+    mov x20, x2
+    bl _malloc_batch_untraced
+    mov x21, x0
+    mov x22, #0
+.Ltrace_malloc_batch_loop:
+    cmp x22, x21
+    b.hs .Ltrace_malloc_batch_ret
+    ldr x1, [x20, x22, LSL #PTR_ALIGN]
+    mov x2, x19
+    mov x0, #MM_TRACE_MALLOC
+    bl _trace_record
+    add x22, x22, #1
+    b .Ltrace_malloc_batch_loop
+
+.Ltrace_malloc_batch_ret:
+    mov x0, x21
+    ldr x22, [sp], #16
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
+
+
+// Traces mm_free_batch.
+//
+// Syntax:
+//   b _trace_free_batch (from TRACE_HOOK in mm_free_batch)
+//
+// Parameters:
+//   x0-x1 [Registers]
+//      - Same as mm_free_batch
+//
+// Return Value:
+//   None
+//
+// Behavior:
+//   - Runs the untraced body directly if only latency timing is on
+//   - Records one MM_TRACE_FREE per non-NULL entry before freeing the batch
+//
+// Registers Modified:
+//   x0-x15  - Clobbered
+//   x19-x21 - Saved/restored
+//   lr      - Saved/restored (for function calls)
+_trace_free_batch:
+    UNLESS_TRACING _free_batch_untraced  // Tail call
+    stp lr, x19, [sp, #-16]!
+    stp x20, x21, [sp, #-16]!
+
+    // x19 = array
+    // x20 = entries
+    // x21 = entries recorded
+    mov x19, x0
+    mov x20, x1
+    mov x21, #0
+.Ltrace_free_batch_loop:
+    cmp x21, x20
+    b.hs .Ltrace_free_batch_free
+    ldr x1, [x19, x21, LSL #PTR_ALIGN]
+    add x21, x21, #1
+    cbz x1, .Ltrace_free_batch_loop
+    mov x2, #0
+    mov x0, #MM_TRACE_FREE
+    bl _trace_record
+    b .Ltrace_free_batch_loop
+
+.Ltrace_free_batch_free:
+    mov x0, x19
+    mov x1, x20
+    bl _free_batch_untraced
+
+    ldp x20, x21, [sp], #16
+    ldp lr, x19, [sp], #16
+    ret
@@ -514,3 +514,63 @@ Test(mem_sbrk, mem_init_not_called) {
                 "from %p to %p", prev_brk, new_brk);
     }
 }
+
+// Tests that mem_sbrk() calls and the peak break are counted from mem_init()
+Test(mem_sbrk, counters) {
+    const size_t mmap_calls = mem_get_mmap_calls();
+    cr_assert_eq(mem_init(4096), 0, "mem_init() failed");
+
+    const void *heap_start = _get_mem_heap_start();
+    cr_assert_eq(
+        mem_get_mmap_calls(), mmap_calls + 1,
+        "Expected mem_init() to issue one mmap");
+    cr_assert_eq(mem_get_sbrk_calls(), 0, "Expected no mem_sbrk() calls yet");
+    cr_assert_eq(
+        mem_get_peak_brk(), heap_start, "Expected the peak to start at %p",
+        heap_start);
+
+    mem_sbrk(1024);
+    mem_sbrk(-512);
+    mem_sbrk(0);
+
+    cr_assert_eq(
+        mem_get_sbrk_calls(), 3, "Expected 3 mem_sbrk() calls but got %zu",
+        mem_get_sbrk_calls());
+    cr_assert_eq(
+        mem_get_peak_brk(), PTR_ADD(heap_start, 1024),
+        "Expected the peak break to stay at the highest break");
+
+    cr_assert_eq(mem_deinit(), 0, "mem_deinit() failed");
+}
+
+TestSuite(mem_page_owner);
+
+// Tests that the page map tags the arena while it is mapped
+Test(mem_page_owner, tags_arena) {
+    const size_t arena_size = 3 * 4096;
+    int on_stack = 0;
+    cr_assert_eq(
+        mem_page_owner(&on_stack), MEM_OWNER_NONE,
+        "Expected a stack address to have no owner");
+    cr_assert_eq(mem_init(arena_size), 0, "mem_init() failed");
+
+    const void *heap_start = _get_mem_heap_start();
+    const void *heap_end = _get_mem_heap_end();
+    cr_assert_eq(
+        mem_page_owner(heap_start), MEM_OWNER_HEAP,
+        "Expected the first page of the arena to belong to the heap");
+    cr_assert_eq(
+        mem_page_owner(PTR_ADD(heap_end, -1)), MEM_OWNER_HEAP,
+        "Expected the last byte of the arena to belong to the heap");
+    cr_assert_eq(
+        mem_page_owner(heap_end), MEM_OWNER_NONE,
+        "Expected the page after the arena to have no owner");
+    cr_assert_eq(
+        mem_page_owner(&on_stack), MEM_OWNER_NONE,
+        "Expected a stack address to have no owner");
+
+    cr_assert_eq(mem_deinit(), 0, "mem_deinit() failed");
+    cr_assert_eq(
+        mem_page_owner(heap_start), MEM_OWNER_NONE,
+        "Expected mem_deinit() to clear the arena's pages");
+}
@@ -2,9 +2,13 @@
 
 #include <criterion/criterion.h>
 #include <criterion/parameterized.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include "mem.h"
 #include "mm.h"
 #include "mm_errno.h"
 
@@ -67,3 +71,1708 @@ ParameterizedTest(
     mm_init, parameterized_arena_size_return_code_test) {
 }
 
+
+TestSuite(mm_malloc);
+
+#define TEST_ARENA_SIZE (1 << 20)
+
+// Header plus footer, and the smallest block (see LAYOUT in config.mk)
+#ifdef MM_COMPACT
+#define TAGS_BYTES 8
+#define MIN_BLOCK_BYTES 16
+#else
+#define TAGS_BYTES 16
+#define MIN_BLOCK_BYTES 32
+#endif
+
+// Size of the block that holds a request of n bytes
+#define ROUNDED_BYTES(n) (((n) + TAGS_BYTES + 15) & ~(size_t)15)
+#define BLOCK_BYTES(n) \
+    (ROUNDED_BYTES(n) < MIN_BLOCK_BYTES ? MIN_BLOCK_BYTES : ROUNDED_BYTES(n))
+
+// Tests that a basic allocation returns an aligned payload inside the arena
+Test(mm_malloc, single_allocation) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    char *p = mm_malloc(24);
+
+    cr_assert_not_null(p, "Expected mm_malloc(24) to return a pointer");
+    cr_assert_eq(
+        (uintptr_t)p % 16, 0, "Expected a 16-byte aligned payload, got %p", p);
+    cr_assert(
+        (const void *)p >= _get_mem_heap_start()
+            && (const void *)(p + 24) <= _get_mem_brk(),
+        "Expected the payload %p to lie inside the heap", p);
+
+    mm_free(p);
+    mm_deinit();
+}
+
+// Tests that mm_malloc(0) fails with MM_ERR_INVAL
+Test(mm_malloc, zero_size) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    set_mm_errno(MM_ERR_NONE);
+
+    void *p = mm_malloc(0);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_null(p, "Expected mm_malloc(0) to return NULL, got %p", p);
+    cr_assert_eq(
+        mm_errno, MM_ERR_INVAL,
+        "Expected mm_errno to be MM_ERR_INVAL but it is %d", mm_errno);
+
+    mm_deinit();
+}
+
+// Tests that allocations larger than the initial free block extend the heap
+Test(mm_malloc, extends_heap) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    const void *brk_before = _get_mem_brk();
+    void *p = mm_malloc(3 * 4096);
+
+    cr_assert_not_null(p, "Expected mm_malloc(3 * 4096) to succeed");
+    cr_assert_gt(
+        _get_mem_brk(), brk_before, "Expected the heap break to move");
+
+    mm_free(p);
+    mm_deinit();
+}
+
+TestSuite(mm_free);
+
+// Tests that a freed block is reused by the next allocation of the same size
+Test(mm_free, reuse_after_free) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(100);
+    mm_free(a);
+    void *b = mm_malloc(100);
+
+    cr_assert_eq(a, b, "Expected %p to be reused but got %p", a, b);
+
+    mm_free(b);
+    mm_deinit();
+}
+
+// Tests that freeing the same block twice is reported as corruption
+Test(mm_free, double_free) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(100);
+    mm_free(a);
+    set_mm_errno(MM_ERR_NONE);
+    mm_free(a);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_eq(
+        mm_errno, MM_ERR_CORRUPT,
+        "Expected mm_errno to be MM_ERR_CORRUPT but it is %d", mm_errno);
+
+    mm_deinit();
+}
+
+// Tests that freeing memory the allocator does not own is rejected
+Test(mm_free, foreign_pointer) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    _Alignas(16) char stack_block[64] = {0};
+    set_mm_errno(MM_ERR_NONE);
+    mm_free(stack_block + 16);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_eq(
+        mm_errno, MM_ERR_INVAL,
+        "Expected mm_errno to be MM_ERR_INVAL but it is %d", mm_errno);
+
+    mm_deinit();
+}
+
+// Tests that freeing neighbors coalesces them into one block
+Test(mm_free, coalesce_neighbors) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    char *a = mm_malloc(64);
+    char *b = mm_malloc(64);
+    char *c = mm_malloc(64);
+    mm_free(a);
+    mm_free(c);
+    mm_free(b);
+
+    // The three blocks (and the rest of the initial free block) merged
+    char *d = mm_malloc(3 * 64);
+    cr_assert_eq(d, a, "Expected the coalesced block at %p but got %p", a, d);
+
+    mm_free(d);
+    mm_deinit();
+}
+
+TestSuite(mm_malloc_sized);
+
+// Tests that the reported usable size covers the request and the rounding
+Test(mm_malloc_sized, reports_usable_size) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    size_t usable = 0;
+    char *p = mm_malloc_sized(17, &usable);
+
+    cr_assert_not_null(p, "Expected mm_malloc_sized(17) to succeed");
+    // 17 bytes + the header/footer rounds up to a 48-byte block (32 bytes
+    // with MM_COMPACT)
+    const size_t expected = BLOCK_BYTES(17) - TAGS_BYTES;
+    cr_assert_eq(
+        usable, expected, "Expected %zu usable bytes but got %zu", expected,
+        usable);
+    cr_assert_eq(
+        mm_usable_size(p), usable,
+        "Expected mm_usable_size() to agree with mm_malloc_sized()");
+
+    // The whole usable size can be written without corrupting the heap
+    memset(p, 0xab, usable);
+    mm_free_sized(p, usable);
+    void *q = mm_malloc(usable);
+    cr_assert_eq(q, p, "Expected %p to be reused but got %p", p, q);
+
+    mm_free(q);
+    mm_deinit();
+}
+
+#ifndef MM_COMPACT
+// Tests that an unsplit remainder is reported as usable space. With
+// MM_COMPACT every remainder is large enough to split.
+Test(mm_malloc_sized, includes_unsplit_remainder) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(48);
+    void *b = mm_malloc(48);
+    mm_free(a);
+
+    size_t usable = 0;
+    void *c = mm_malloc_sized(32, &usable);
+    cr_assert_eq(c, a, "Expected %p to be reused but got %p", a, c);
+    cr_assert_eq(usable, 48, "Expected 48 usable bytes but got %zu", usable);
+
+    mm_free(c);
+    mm_free(b);
+    mm_deinit();
+}
+#endif
+
+// Tests that a failed allocation reports a usable size of 0
+Test(mm_malloc_sized, failure_reports_zero) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    size_t usable = 123;
+    void *p = mm_malloc_sized(2 * TEST_ARENA_SIZE, &usable);
+
+    cr_assert_null(p, "Expected the allocation to fail");
+    cr_assert_eq(usable, 0, "Expected 0 usable bytes but got %zu", usable);
+    cr_assert_eq(mm_usable_size(NULL), 0, "Expected 0 for NULL");
+
+    mm_deinit();
+}
+
+TestSuite(mm_expand);
+
+// Tests that a block grows into a free neighbor without moving
+Test(mm_expand, absorbs_free_neighbor) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(32);
+    void *b = mm_malloc(32);
+    void *c = mm_malloc(32);
+
+    // b's neighbor is allocated, so b cannot grow
+    cr_assert_eq(mm_expand(b, 100, 200), 0, "Expected mm_expand() to fail");
+    cr_assert_eq(
+        mm_usable_size(b), BLOCK_BYTES(32) - TAGS_BYTES,
+        "Expected b to be unchanged");
+
+    mm_free(c);
+    const size_t usable = mm_expand(b, 40, 64);
+    const size_t expected = BLOCK_BYTES(64) - TAGS_BYTES;
+    cr_assert_eq(
+        usable, expected, "Expected %zu usable bytes but got %zu", expected,
+        usable);
+    cr_assert_eq(
+        mm_usable_size(b), usable, "Expected mm_usable_size() to agree");
+
+    // The rest of c's space was split off and is still usable
+    void *d = mm_malloc(16);
+    cr_assert_not_null(d, "Expected mm_malloc(16) to succeed");
+
+    mm_free(d);
+    mm_free(b);
+    mm_free(a);
+    mm_deinit();
+}
+
+// Tests that the last block grows by extending the heap
+Test(mm_expand, extends_heap) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *p = mm_malloc(3000);
+    const void *brk_before = _get_mem_brk();
+    const size_t usable = mm_expand(p, 100000, 200000);
+
+    cr_assert(
+        usable >= 100000 && usable <= 200000 + 16,
+        "Expected between 100000 and 200016 usable bytes but got %zu", usable);
+    cr_assert_gt(_get_mem_brk(), brk_before, "Expected the heap to grow");
+
+    // Asking for more than the arena holds fails and changes nothing
+    cr_assert_eq(
+        mm_expand(p, 2 * TEST_ARENA_SIZE, 4 * TEST_ARENA_SIZE), 0,
+        "Expected mm_expand() beyond the arena to fail");
+    cr_assert_eq(
+        mm_usable_size(p), usable, "Expected the block to be unchanged");
+
+    mm_free(p);
+    mm_deinit();
+}
+
+// Tests that falling back to the minimum leaves mm_errno untouched
+Test(mm_expand, minimum_fallback_keeps_errno) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *p = mm_malloc(3000);
+    set_mm_errno(MM_ERR_NONE);
+    const size_t usable = mm_expand(p, 8000, 4 * TEST_ARENA_SIZE);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_geq(
+        usable, 8000, "Expected at least 8000 usable bytes but got %zu",
+        usable);
+    cr_assert_eq(
+        mm_errno, MM_ERR_NONE,
+        "Expected mm_errno to be MM_ERR_NONE but it is %d", mm_errno);
+
+    mm_free(p);
+    mm_deinit();
+}
+
+// Tests that invalid arguments are rejected
+Test(mm_expand, invalid_arguments) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *p = mm_malloc(64);
+    set_mm_errno(MM_ERR_NONE);
+
+    cr_assert_eq(mm_expand(p, 100, 50), 0, "Expected min > max to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+    cr_assert_eq(mm_expand(NULL, 10, 50), 0, "Expected NULL to fail");
+
+    mm_free(p);
+    mm_deinit();
+}
+
+TestSuite(mm_free_sized);
+
+// Tests that sized frees leave the heap as reusable as regular frees
+Test(mm_free_sized, reuse_after_free) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(100);
+    void *b = mm_malloc(200);
+    set_mm_errno(MM_ERR_NONE);
+    mm_free_sized(b, 200);
+    mm_free_sized(a, 100);
+
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_NONE, "Expected mm_errno to be MM_ERR_NONE");
+
+    void *c = mm_malloc(300);
+    cr_assert_eq(c, a, "Expected %p to be reused but got %p", a, c);
+
+    mm_free(c);
+    mm_deinit();
+}
+
+// Tests a block that absorbed a remainder too small to split off
+Test(mm_free_sized, unsplit_block) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    // Leave a 64-byte free block between two allocated blocks, then allocate
+    // a 48-byte block out of it, which cannot split off 16 bytes
+    void *a = mm_malloc(48);
+    void *b = mm_malloc(48);
+    mm_free(a);
+    void *c = mm_malloc(32);
+    cr_assert_eq(c, a, "Expected %p to be reused but got %p", a, c);
+
+    set_mm_errno(MM_ERR_NONE);
+    mm_free_sized(c, 32);
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_NONE, "Expected mm_errno to be MM_ERR_NONE");
+
+    void *d = mm_malloc(48);
+    cr_assert_eq(d, a, "Expected %p to be reused but got %p", a, d);
+
+    mm_free(d);
+    mm_free(b);
+    mm_deinit();
+}
+
+#ifndef NDEBUG
+// Tests that debug builds reject a size that does not match the block
+Test(mm_free_sized, size_mismatch) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(48);
+    set_mm_errno(MM_ERR_NONE);
+    mm_free_sized(a, 500);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_eq(
+        mm_errno, MM_ERR_INVAL,
+        "Expected mm_errno to be MM_ERR_INVAL but it is %d", mm_errno);
+
+    // The block is still allocated and can be freed correctly
+    set_mm_errno(MM_ERR_NONE);
+    mm_free_sized(a, 48);
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_NONE, "Expected mm_errno to be MM_ERR_NONE");
+
+    mm_deinit();
+}
+#endif
+
+TestSuite(mm_async_free);
+
+#define NUM_ASYNC_BLOCKS 16
+
+// Tests that asynchronous frees are deferred until mm_reclaim
+Test(mm_async_free, deferred_until_reclaim) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *ptrs[NUM_ASYNC_BLOCKS];
+    for (size_t i = 0; i < NUM_ASYNC_BLOCKS; i++) {
+        ptrs[i] = mm_malloc(100);
+    }
+
+    mm_set_async_free(1);
+    for (size_t i = 0; i < NUM_ASYNC_BLOCKS / 2; i++) {
+        mm_free(ptrs[i]);
+    }
+    mm_free_batch(ptrs + NUM_ASYNC_BLOCKS / 2, NUM_ASYNC_BLOCKS / 2);
+    mm_set_async_free(0);
+
+    // Nothing was freed yet, so the space is not reused
+    void *p = mm_malloc(100);
+    for (size_t i = 0; i < NUM_ASYNC_BLOCKS; i++) {
+        cr_assert_neq(p, ptrs[i], "Expected block %zu to still be queued", i);
+    }
+    mm_free(p);
+
+    const size_t reclaimed = mm_reclaim();
+    cr_assert_eq(
+        reclaimed, NUM_ASYNC_BLOCKS,
+        "Expected %d blocks to be reclaimed but got %zu",
+        NUM_ASYNC_BLOCKS, reclaimed);
+    cr_assert_eq(mm_reclaim(), 0, "Expected the queue to be empty");
+
+    p = mm_malloc(100);
+    cr_assert_eq(p, ptrs[0], "Expected %p to be reused but got %p", ptrs[0], p);
+
+    mm_free(p);
+    mm_deinit();
+}
+
+// Tests that mm_malloc reclaims queued blocks before growing the heap
+Test(mm_async_free, malloc_reclaims_before_extending) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(3000);
+    mm_set_async_free(1);
+    mm_free(a);
+    mm_set_async_free(0);
+
+    const void *brk_before = _get_mem_brk();
+    void *b = mm_malloc(3500);
+
+    cr_assert_eq(b, a, "Expected %p to be reused but got %p", a, b);
+    cr_assert_eq(
+        _get_mem_brk(), brk_before, "Expected the heap not to grow");
+
+    mm_free(b);
+    mm_deinit();
+}
+
+// Tests that a batch refill is served from queued blocks
+Test(mm_async_free, batch_reclaims_before_extending) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(3000);
+    mm_set_async_free(1);
+    mm_free(a);
+    mm_set_async_free(0);
+
+    // Neither block fits in what is left of the initial free block
+    const void *brk_before = _get_mem_brk();
+    void *ptrs[2];
+    cr_assert_eq(
+        mm_malloc_batch(1400, 2, ptrs), 2, "mm_malloc_batch() failed");
+
+    cr_assert_eq(ptrs[0], a, "Expected %p to be reused but got %p", a, ptrs[0]);
+    cr_assert_eq(
+        _get_mem_brk(), brk_before, "Expected the heap not to grow");
+    cr_assert_eq(mm_reclaim(), 0, "Expected the queue to be empty");
+
+    mm_free_batch(ptrs, 2);
+    mm_deinit();
+}
+
+static void *async_free_worker(void *arg) {
+    void **ptrs = arg;
+    mm_set_async_free(1);
+    for (size_t i = 0; i < NUM_ASYNC_BLOCKS; i++) {
+        mm_free(ptrs[i]);
+    }
+    return NULL;
+}
+
+// Tests that the designation is per thread
+Test(mm_async_free, designation_is_per_thread) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *ptrs[NUM_ASYNC_BLOCKS];
+    for (size_t i = 0; i < NUM_ASYNC_BLOCKS; i++) {
+        ptrs[i] = mm_malloc(64);
+    }
+
+    pthread_t worker;
+    cr_assert_eq(
+        pthread_create(&worker, NULL, async_free_worker, ptrs), 0,
+        "pthread_create() failed");
+    pthread_join(worker, NULL);
+
+    // This thread never opted in, so its free is immediate
+    void *p = mm_malloc(64);
+    mm_free(p);
+    void *q = mm_malloc(64);
+    cr_assert_eq(q, p, "Expected %p to be reused but got %p", p, q);
+    mm_free(q);
+
+    const size_t reclaimed = mm_reclaim();
+    cr_assert_eq(
+        reclaimed, NUM_ASYNC_BLOCKS,
+        "Expected %d blocks to be reclaimed but got %zu",
+        NUM_ASYNC_BLOCKS, reclaimed);
+
+    mm_deinit();
+}
+
+TestSuite(mm_quick_lists);
+
+#define QUICK_BUDGET 4096
+
+static size_t total_coalesce_cases(void) {
+    struct mm_stats stats;
+    mm_get_stats(&stats);
+    size_t total = 0;
+    for (size_t i = 0; i < MM_NUM_COALESCE_CASES; i++) {
+        total += stats.coalesce_cases[i];
+    }
+    return total;
+}
+
+// Tests that freeing and reallocating one size never coalesces
+Test(mm_quick_lists, same_size_churn) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    mm_set_quick_lists(QUICK_BUDGET);
+
+    void *a = mm_malloc(48);
+    void *b = mm_malloc(48);
+    const size_t before = total_coalesce_cases();
+    for (int i = 0; i < 100; i++) {
+        mm_free(a);
+        void *p = mm_malloc(48);
+        cr_assert_eq(p, a, "Expected %p to be reused but got %p", a, p);
+        mm_free_sized(a, 48);
+        p = mm_malloc(48);
+        cr_assert_eq(p, a, "Expected %p to be reused but got %p", a, p);
+    }
+    cr_assert_eq(
+        total_coalesce_cases(), before, "Expected no block to be coalesced");
+
+    // Only a block freed twice in a row is caught
+    mm_free(a);
+    set_mm_errno(MM_ERR_NONE);
+    mm_free(a);
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_CORRUPT, "Expected mm_errno to be MM_ERR_CORRUPT");
+
+    mm_free(b);
+    mm_set_quick_lists(0);
+    mm_deinit();
+}
+
+// Tests that a larger request merges the parked blocks first
+Test(mm_quick_lists, consolidates_for_larger_request) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    mm_set_quick_lists(QUICK_BUDGET);
+
+    char *a = mm_malloc(48);
+    char *b = mm_malloc(48);
+    char *c = mm_malloc(48);
+    mm_free(a);
+    mm_free(c);
+    mm_free(b);
+
+    struct mm_stats stats;
+    mm_get_stats(&stats);
+    cr_assert_eq(
+        stats.allocated_blocks, 3, "Expected parked blocks to count as allocated");
+
+    char *d = mm_malloc(1000);
+    cr_assert_eq(d, a, "Expected the merged block at %p but got %p", a, d);
+    mm_get_stats(&stats);
+    cr_assert_eq(
+        stats.allocated_blocks, 1, "Expected 1 allocated block but got %zu",
+        stats.allocated_blocks);
+
+    mm_free(d);
+    mm_set_quick_lists(0);
+    mm_deinit();
+}
+
+#ifndef MM_TLSF
+TestSuite(mm_size_tree);
+
+static void check_heap(const char *step) {
+    void *bad = NULL;
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, &bad), 0, "Check failed at %p after %s",
+        bad, step);
+}
+
+// Tests that the tree hands out the smallest free block that fits, across
+// nodes of one trie and across tries
+Test(mm_size_tree, best_fit_among_large_blocks) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *mid = mm_malloc(6000);
+    void *sep1 = mm_malloc(100);
+    void *small = mm_malloc(5000);
+    void *sep2 = mm_malloc(100);
+    void *large = mm_malloc(8000);
+    void *sep3 = mm_malloc(100);
+    void *huge = mm_malloc(12000);
+    void *sep4 = mm_malloc(100);
+
+    // mid becomes the root of its trie, with small and large on either side
+    mm_free(mid);
+    check_heap("freeing mid");
+    mm_free(small);
+    check_heap("freeing small");
+    mm_free(large);
+    check_heap("freeing large");
+    mm_free(huge);
+    check_heap("freeing huge");
+
+    // Taking mid removes a node with two children
+    void *p = mm_malloc(5500);
+    cr_assert_eq(p, mid, "Expected mid %p but got %p", mid, p);
+    check_heap("taking mid");
+    p = mm_malloc(4500);
+    cr_assert_eq(p, small, "Expected small %p but got %p", small, p);
+    check_heap("taking small");
+    p = mm_malloc(7000);
+    cr_assert_eq(p, large, "Expected large %p but got %p", large, p);
+    check_heap("taking large");
+    p = mm_malloc(9000);
+    cr_assert_eq(p, huge, "Expected huge %p but got %p", huge, p);
+    check_heap("taking huge");
+
+    mm_free(sep1);
+    mm_free(sep2);
+    mm_free(sep3);
+    mm_free(sep4);
+    mm_deinit();
+}
+
+// Tests that blocks of equal size share a node and both come back, after
+// which their trie is empty
+Test(mm_size_tree, equal_sizes) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(10000);
+    void *sep1 = mm_malloc(100);
+    void *b = mm_malloc(10000);
+    void *sep2 = mm_malloc(100);
+
+    mm_free(a);
+    check_heap("freeing a");
+    mm_free(b);
+    check_heap("freeing b");
+
+    void *p = mm_malloc(10000);
+    check_heap("taking the first block");
+    void *q = mm_malloc(10000);
+    check_heap("taking the second block");
+    cr_assert(
+        (p == a && q == b) || (p == b && q == a),
+        "Expected %p and %p back but got %p and %p", a, b, p, q);
+
+    // Nothing of that size is left, so the heap grows
+    void *r = mm_malloc(10000);
+    check_heap("extending the heap");
+    cr_assert(r != a && r != b, "Expected a new block but got %p", r);
+
+    mm_free(sep1);
+    mm_free(sep2);
+    mm_deinit();
+}
+#endif
+
+#ifndef MM_TLSF
+TestSuite(mm_placement);
+
+// Tests that address order reuses the lowest free block, not the last freed
+Test(mm_placement, address_ordered) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(
+        mm_set_placement_policy(MM_PLACEMENT_ADDRESS_ORDERED), 0,
+        "mm_set_placement_policy() failed");
+
+    void *a = mm_malloc(100);
+    void *sep1 = mm_malloc(100);
+    void *c = mm_malloc(100);
+    void *sep2 = mm_malloc(100);
+    mm_free(a);
+    mm_free(c);
+
+    void *p = mm_malloc(100);
+    cr_assert_eq(p, a, "Expected the lower block %p but got %p", a, p);
+
+    struct mm_stats stats;
+    mm_get_stats(&stats);
+    cr_assert_eq(
+        stats.placement_policy, MM_PLACEMENT_ADDRESS_ORDERED,
+        "Expected the policy to be reported");
+
+    mm_free(p);
+    mm_free(sep1);
+    mm_free(sep2);
+    mm_deinit();
+}
+
+// Tests that next fit goes around each list from its rover instead of
+// restarting at the head, and that a rover on a block that is coalesced
+// away leaves the heap consistent
+Test(mm_placement, next_fit) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(
+        mm_set_placement_policy(MM_PLACEMENT_NEXT_FIT), 0,
+        "mm_set_placement_policy() failed");
+
+    // Blocks of one class, separated by blocks of another
+    void *blocks[4];
+    void *seps[4];
+    for (size_t i = 0; i < 4; i++) {
+        blocks[i] = mm_malloc(80);
+        seps[i] = mm_malloc(200);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        mm_free(blocks[i]);  // The list is now blocks 3, 2, 1, 0
+    }
+
+    // Block 3 goes back to the head, but the rover has moved past it
+    void *p = mm_malloc(80);
+    cr_assert_eq(p, blocks[3], "Expected %p but got %p", blocks[3], p);
+    mm_free(p);
+    for (size_t i = 3; i-- > 0;) {
+        p = mm_malloc(80);
+        cr_assert_eq(
+            p, blocks[i], "Expected block %zu (%p) but got %p", i, blocks[i],
+            p);
+    }
+
+    // Past the end of the list, the walk wraps around to the head
+    p = mm_malloc(80);
+    cr_assert_eq(p, blocks[3], "Expected %p but got %p", blocks[3], p);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after wrapping");
+
+    // Leave the rover on block 1, then merge block 1 into its neighbor
+    mm_free(blocks[1]);
+    mm_free(blocks[0]);  // The list is now blocks 0, 1
+    p = mm_malloc(80);
+    cr_assert_eq(p, blocks[0], "Expected %p but got %p", blocks[0], p);
+    mm_free(seps[1]);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after merge");
+
+    void *q = mm_malloc(80);
+    cr_assert_not_null(q, "Expected mm_malloc() to succeed");
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after reuse");
+
+    mm_free(q);
+    mm_free(p);
+    mm_free(blocks[2]);
+    mm_free(blocks[3]);
+    mm_free(seps[0]);
+    mm_free(seps[2]);
+    mm_free(seps[3]);
+    mm_deinit();
+}
+
+// Tests that best fit takes the smallest block that fits
+Test(mm_placement, best_fit) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(
+        mm_set_placement_policy(MM_PLACEMENT_BEST_FIT), 0,
+        "mm_set_placement_policy() failed");
+
+    void *large = mm_malloc(200);
+    void *sep1 = mm_malloc(100);
+    void *small = mm_malloc(150);
+    void *sep2 = mm_malloc(100);
+    mm_free(small);
+    mm_free(large);  // First fit would take this one
+
+    void *p = mm_malloc(140);
+    cr_assert_eq(p, small, "Expected the smaller block %p but got %p", small, p);
+
+    mm_free(p);
+    mm_free(sep1);
+    mm_free(sep2);
+    mm_deinit();
+}
+
+// Tests that the wilderness policy carves small requests back to back from
+// the last remainder and spares the top block
+Test(mm_placement, wilderness) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(
+        mm_set_placement_policy(MM_PLACEMENT_WILDERNESS), 0,
+        "mm_set_placement_policy() failed");
+
+    char *hole = mm_malloc(2000);
+    void *sep = mm_malloc(100);
+    mm_free(hole);
+
+    // The first block comes from the hole, not the top block, and the rest
+    // follow it
+    char *prev = mm_malloc(40);
+    cr_assert_eq(prev, hole, "Expected %p but got %p", hole, prev);
+    for (int i = 0; i < 8; i++) {
+        char *p = mm_malloc(40);
+        cr_assert_eq(
+            p, prev + mm_usable_size(prev) + TAGS_BYTES,
+            "Expected block %d right after %p but got %p", i, prev, p);
+        prev = p;
+    }
+
+    mm_free(sep);
+    mm_deinit();
+}
+
+// Tests that unknown policies are rejected
+Test(mm_placement, invalid_policy) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    cr_assert_eq(
+        mm_set_placement_policy(MM_NUM_PLACEMENT_POLICIES), -1,
+        "Expected an unknown policy to be rejected");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+
+    mm_deinit();
+}
+#endif
+
+#ifndef MM_TLSF
+TestSuite(mm_adaptive_classes);
+
+// Tests that a hot size gets a list of its own, which serves it before a
+// larger block that shared its power-of-two class
+Test(mm_adaptive_classes, hot_size_gets_own_list) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(
+        mm_set_adaptive_classes(64), 0, "mm_set_adaptive_classes() failed");
+
+    // The 64th request ends the period
+    void *hot[64];
+    for (int i = 0; i < 64; i++) {
+        hot[i] = mm_malloc(80);
+    }
+
+    void *a = mm_malloc(80);
+    void *sep1 = mm_malloc(100);
+    void *b = mm_malloc(96);
+    void *sep2 = mm_malloc(100);
+    mm_free(a);
+    mm_free(b);  // First fit in the 64-127 byte class would take this one
+
+    void *p = mm_malloc(80);
+    cr_assert_eq(p, a, "Expected the exact block %p but got %p", a, p);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after adapting");
+
+    // Turning it off moves the free blocks back to the power-of-two lists
+    cr_assert_eq(
+        mm_set_adaptive_classes(0), 0, "mm_set_adaptive_classes() failed");
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after reset");
+
+    mm_free(p);
+    mm_free(sep1);
+    mm_free(sep2);
+    for (int i = 0; i < 64; i++) {
+        mm_free(hot[i]);
+    }
+    mm_deinit();
+}
+#endif
+
+TestSuite(mm_malloc_batch);
+
+#define BATCH_SIZE 64
+
+// Tests that a batch returns distinct, contiguous blocks carved front to back
+Test(mm_malloc_batch, contiguous_blocks) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *ptrs[BATCH_SIZE];
+    const size_t n = mm_malloc_batch(48, BATCH_SIZE, ptrs);
+
+    cr_assert_eq(
+        n, BATCH_SIZE, "Expected %d blocks but got %zu", BATCH_SIZE, n);
+    for (size_t i = 1; i < n; i++) {
+        // 48 bytes of payload + the header/footer
+        cr_assert_eq(
+            (size_t)((char *)ptrs[i] - (char *)ptrs[i - 1]), BLOCK_BYTES(48),
+            "Expected block %zu (%p) to follow block %zu (%p)",
+            i, ptrs[i], i - 1, ptrs[i - 1]);
+    }
+
+    mm_free_batch(ptrs, n);
+
+    // Everything coalesced back, so a single allocation reuses the space
+    void *p = mm_malloc(BATCH_SIZE * 48);
+    cr_assert_eq(p, ptrs[0], "Expected %p to be reused but got %p", ptrs[0], p);
+
+    mm_free(p);
+    mm_deinit();
+}
+
+// Tests that a batch larger than the free space extends the heap once
+Test(mm_malloc_batch, extends_heap) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *ptrs[BATCH_SIZE];
+    const size_t n = mm_malloc_batch(1000, BATCH_SIZE, ptrs);
+
+    cr_assert_eq(
+        n, BATCH_SIZE, "Expected %d blocks but got %zu", BATCH_SIZE, n);
+
+    mm_free_batch(ptrs, n);
+    mm_deinit();
+}
+
+// Tests that a batch that exhausts the arena reports a partial count
+Test(mm_malloc_batch, partial_on_nomem) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    set_mm_errno(MM_ERR_NONE);
+
+    void *ptrs[BATCH_SIZE];
+    const size_t n = mm_malloc_batch(100000, BATCH_SIZE, ptrs);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert(n > 0 && n < BATCH_SIZE, "Expected a partial batch, got %zu", n);
+    cr_assert_eq(
+        mm_errno, MM_ERR_NOMEM,
+        "Expected mm_errno to be MM_ERR_NOMEM but it is %d", mm_errno);
+
+    mm_free_batch(ptrs, n);
+    mm_deinit();
+}
+
+// Tests that invalid sizes and empty batches allocate nothing
+Test(mm_malloc_batch, invalid_arguments) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *ptrs[1];
+    set_mm_errno(MM_ERR_NONE);
+    cr_assert_eq(mm_malloc_batch(16, 0, ptrs), 0, "Expected an empty batch");
+    cr_assert_eq(mm_malloc_batch(0, 1, ptrs), 0, "Expected size 0 to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+
+    mm_deinit();
+}
+
+TestSuite(mm_get_stats);
+
+// Tests that the counters follow allocations, frees and coalescing
+Test(mm_get_stats, tracks_blocks) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    struct mm_stats before;
+    cr_assert_eq(mm_get_stats(&before), 0, "mm_get_stats() failed");
+    cr_assert_eq(before.allocated_blocks, 0, "Expected no allocated blocks");
+    cr_assert_eq(before.allocated_bytes, 0, "Expected no allocated bytes");
+    cr_assert_eq(before.mmap_calls > 0, 1, "Expected mm_init() to mmap");
+    cr_assert_eq(
+        before.peak_heap_bytes, before.heap_bytes,
+        "Expected the peak heap size to be the current heap size");
+
+    void *a = mm_malloc(100);
+    void *b = mm_malloc(100);
+    void *c = mm_malloc(100);
+    const size_t block_size = mm_usable_size(a) + TAGS_BYTES;
+
+    struct mm_stats during;
+    mm_get_stats(&during);
+    cr_assert_eq(
+        during.allocated_blocks, 3, "Expected 3 allocated blocks but got %zu",
+        during.allocated_blocks);
+    cr_assert_eq(
+        during.allocated_bytes, 3 * block_size,
+        "Expected %zu allocated bytes but got %zu", 3 * block_size,
+        during.allocated_bytes);
+
+    mm_free(a);
+    mm_free(c);
+    mm_free(b);
+
+    struct mm_stats after;
+    mm_get_stats(&after);
+    cr_assert_eq(after.allocated_blocks, 0, "Expected no allocated blocks");
+    cr_assert_eq(after.allocated_bytes, 0, "Expected no allocated bytes");
+    cr_assert_eq(
+        after.coalesce_cases[MM_COALESCE_BOTH_ALLOCATED],
+        before.coalesce_cases[MM_COALESCE_BOTH_ALLOCATED] + 1,
+        "Expected a to be freed between two allocated blocks");
+    cr_assert_eq(
+        after.coalesce_cases[MM_COALESCE_ONLY_PREV_ALLOCATED],
+        before.coalesce_cases[MM_COALESCE_ONLY_PREV_ALLOCATED] + 1,
+        "Expected c to merge with the free space after it");
+    cr_assert_eq(
+        after.coalesce_cases[MM_COALESCE_NEITHER_ALLOCATED],
+        before.coalesce_cases[MM_COALESCE_NEITHER_ALLOCATED] + 1,
+        "Expected b to merge with both neighbors");
+
+    size_t free_blocks = 0;
+    for (size_t i = 0; i < NUM_SEG_LISTS; i++) {
+        free_blocks += after.free_blocks[i];
+    }
+    cr_assert_eq(
+        free_blocks, 1, "Expected one free block but got %zu", free_blocks);
+
+    // Only the prologues and the epilogue are left outside the free block
+    const size_t overhead =
+        before.heap_bytes - before.free_bytes[NUM_SEG_LISTS - 1];
+    cr_assert_eq(
+        after.free_bytes[NUM_SEG_LISTS - 1], after.heap_bytes - overhead,
+        "Expected the whole heap to be one large free block");
+
+    mm_deinit();
+}
+
+// Tests that a NULL argument is rejected
+Test(mm_get_stats, null_argument) {
+    set_mm_errno(MM_ERR_NONE);
+    cr_assert_eq(mm_get_stats(NULL), -1, "Expected mm_get_stats(NULL) to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+}
+
+TestSuite(mm_heap_walk);
+
+typedef struct {
+    size_t num_blocks;
+    size_t num_allocated;
+    size_t total_size;
+    const void *target;
+    int target_allocated;
+} walk_summary_t;
+
+static int summarize_block(void *ptr, size_t size, int allocated, void *ctx) {
+    walk_summary_t *summary = ctx;
+    summary->num_blocks++;
+    summary->num_allocated += allocated;
+    summary->total_size += size;
+    if (ptr == summary->target) {
+        summary->target_allocated = allocated;
+    }
+    return 0;
+}
+
+static int stop_at_second_block(void *ptr, size_t size, int allocated,
+                                void *ctx) {
+    (void)ptr;
+    (void)size;
+    (void)allocated;
+    return ++*(int *)ctx == 2 ? 42 : 0;
+}
+
+// Tests that the walk visits every block and reports its state
+Test(mm_heap_walk, visits_every_block) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(100);
+    void *b = mm_malloc(100);
+    void *c = mm_malloc(100);
+    mm_free(b);
+
+    walk_summary_t summary = {.target = b, .target_allocated = -1};
+    cr_assert_eq(
+        mm_heap_walk(summarize_block, &summary), 0, "mm_heap_walk() failed");
+
+    struct mm_stats stats;
+    mm_get_stats(&stats);
+
+    // a, b, c and the rest of the initial free block
+    cr_assert_eq(
+        summary.num_blocks, 4, "Expected 4 blocks but got %zu",
+        summary.num_blocks);
+    cr_assert_eq(
+        summary.num_allocated, 2, "Expected 2 allocated blocks but got %zu",
+        summary.num_allocated);
+    cr_assert_eq(summary.target_allocated, 0, "Expected b to be free");
+    size_t free_bytes = 0;
+    for (size_t i = 0; i < NUM_SEG_LISTS; i++) {
+        free_bytes += stats.free_bytes[i];
+    }
+    cr_assert_eq(
+        summary.total_size, stats.allocated_bytes + free_bytes,
+        "Expected the blocks to add up to %zu bytes but got %zu",
+        stats.allocated_bytes + free_bytes, summary.total_size);
+
+    int calls = 0;
+    cr_assert_eq(
+        mm_heap_walk(stop_at_second_block, &calls), 42,
+        "Expected the callback's return value");
+    cr_assert_eq(calls, 2, "Expected the walk to stop after 2 blocks");
+
+    mm_free(a);
+    mm_free(c);
+    mm_deinit();
+}
+
+// Tests that the binary dump describes the same blocks as the walk
+Test(mm_heap_walk, dump_matches_walk) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(100);
+    void *b = mm_malloc(3000);
+    void *c = mm_malloc(100);
+    mm_free(b);
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0, "pipe() failed");
+    cr_assert_eq(mm_heap_dump(fds[1]), 0, "mm_heap_dump() failed");
+    close(fds[1]);
+
+    uint64_t words[64];
+    const ssize_t len = read(fds[0], words, sizeof(words));
+    close(fds[0]);
+
+    // Magic, first payload, 4 headers and the epilogue
+    cr_assert_eq(
+        len, 7 * sizeof(uint64_t), "Expected 7 words but read %zd bytes", len);
+    cr_assert_eq(words[0], MM_HEAP_DUMP_MAGIC, "Bad magic %#lx", words[0]);
+    cr_assert_eq(
+        (void *)(uintptr_t)words[1], a, "Expected the first block to be a");
+
+    char *p = (char *)(uintptr_t)words[1];
+    const void *expected[] = {a, b, c};
+    for (size_t i = 0; i < 3; i++) {
+        const uint64_t header = words[2 + i];
+        cr_assert_eq(p, expected[i], "Block %zu is at the wrong address", i);
+        cr_assert_eq(
+            header >> 63, expected[i] != b,
+            "Block %zu has the wrong allocated bit", i);
+        p += header & ~(1ULL << 63);
+    }
+    cr_assert_eq(
+        words[6], 1ULL << 63, "Expected the dump to end with the epilogue");
+
+    mm_free(a);
+    mm_free(c);
+    mm_deinit();
+}
+
+// Tests that a failed write is reported
+Test(mm_heap_walk, dump_to_bad_fd) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    set_mm_errno(MM_ERR_NONE);
+
+    cr_assert_eq(mm_heap_dump(-1), -1, "Expected mm_heap_dump(-1) to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_IO, "Expected mm_errno to be MM_ERR_IO");
+
+    mm_deinit();
+}
+
+TestSuite(mm_check_incremental);
+
+// Tests that a healthy heap passes slice after slice while it changes
+Test(mm_check_incremental, healthy_heap) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *ptrs[64];
+    for (size_t i = 0; i < 64; i++) {
+        ptrs[i] = mm_malloc(16 + 40 * i);
+        cr_assert_eq(
+            mm_check_incremental(3, NULL), 0,
+            "Check failed after allocation %zu", i);
+    }
+    for (size_t i = 0; i < 64; i += 2) {
+        mm_free(ptrs[i]);
+        cr_assert_eq(
+            mm_check_incremental(3, NULL), 0, "Check failed after free %zu", i);
+    }
+    for (size_t i = 1; i < 64; i += 2) {
+        mm_free(ptrs[i]);
+        cr_assert_eq(
+            mm_check_incremental(3, NULL), 0, "Check failed after free %zu", i);
+    }
+
+    mm_deinit();
+}
+
+// Tests that an overrun into the footer is reported with the block
+Test(mm_check_incremental, detects_overrun) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(32);
+    void *b = mm_malloc(32);
+    void *c = mm_malloc(32);
+    const size_t usable = mm_usable_size(b);
+    memset(b, 0xab, usable + 1);  // One byte into the footer
+
+    void *bad = NULL;
+    set_mm_errno(MM_ERR_NONE);
+    int result = 0;
+    for (int i = 0; i < 16 && result == 0; i++) {
+        result = mm_check_incremental(1, &bad);
+    }
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_eq(result, -1, "Expected the overrun to be detected");
+    cr_assert_eq(
+        mm_errno, MM_ERR_CORRUPT,
+        "Expected mm_errno to be MM_ERR_CORRUPT but it is %d", mm_errno);
+    cr_assert_eq(bad, b, "Expected %p to be reported but got %p", b, bad);
+
+    (void)a;
+    (void)c;
+    mm_deinit();
+}
+
+// Tests that a check paused on the epilogue resumes cleanly after the top
+// block grows over it
+Test(mm_check_incremental, paused_at_epilogue) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *p = mm_malloc(3000);
+    walk_summary_t summary = {0};
+    cr_assert_eq(
+        mm_heap_walk(summarize_block, &summary), 0, "mm_heap_walk() failed");
+
+    // Check every block, so the budget runs out on the epilogue
+    cr_assert_eq(
+        mm_check_incremental(summary.num_blocks, NULL), 0, "Check failed");
+    cr_assert_gt(mm_expand(p, 100000, 100000), 0, "mm_expand() failed");
+
+    void *bad = NULL;
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, &bad), 0, "Check failed at %p", bad);
+
+    mm_free(p);
+    mm_deinit();
+}
+
+// Tests that a zero budget is rejected
+Test(mm_check_incremental, zero_budget) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    set_mm_errno(MM_ERR_NONE);
+
+    cr_assert_eq(
+        mm_check_incremental(0, NULL), -1, "Expected a zero budget to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+
+    mm_deinit();
+}
+
+TestSuite(mm_profile);
+
+// Tests that with a mean of one byte every allocation is sampled, and that
+// freed blocks leave the live profile but not the cumulative one
+Test(mm_profile, samples_every_allocation) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(mm_profile_start(1), 0, "mm_profile_start() failed");
+
+    // One call site, so every sample has the same stack
+    void *ptrs[3];
+    for (size_t i = 0; i < 3; i++) {
+        ptrs[i] = mm_malloc(100);
+    }
+    mm_free(ptrs[1]);
+    mm_profile_stop();
+    void *d = mm_malloc(100);  // Not sampled
+
+    FILE *file = tmpfile();
+    cr_assert_not_null(file, "tmpfile() failed");
+    cr_assert_eq(mm_profile_dump(fileno(file)), 0, "mm_profile_dump() failed");
+    rewind(file);
+
+    const size_t usable = BLOCK_BYTES(100) - TAGS_BYTES;
+    char totals[64];
+    snprintf(
+        totals, sizeof(totals), "2: %zu [3: %zu] @ ", 2 * usable, 3 * usable);
+    char expected[128];
+    snprintf(
+        expected, sizeof(expected), "heap profile: %sheap_v2/1\n", totals);
+
+    char line[256];
+    cr_assert_not_null(fgets(line, sizeof(line), file), "Empty profile");
+    cr_assert_eq(
+        strcmp(line, expected), 0, "Unexpected header line: %s", line);
+    cr_assert_not_null(fgets(line, sizeof(line), file), "Missing stack line");
+    cr_assert(
+        strncmp(line, totals, strlen(totals)) == 0 &&
+            strncmp(line + strlen(totals), "0x", 2) == 0,
+        "Unexpected stack line: %s", line);
+
+    int found_maps = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strcmp(line, "MAPPED_LIBRARIES:\n") == 0) {
+            found_maps = 1;
+        }
+    }
+    fclose(file);
+    cr_assert(found_maps, "Expected a MAPPED_LIBRARIES section");
+
+    mm_free(ptrs[0]);
+    mm_free(ptrs[2]);
+    mm_free(d);
+    mm_deinit();
+}
+
+// Tests that a mean above 2^32 bytes is rejected
+Test(mm_profile, rate_too_large) {
+    set_mm_errno(MM_ERR_NONE);
+
+    cr_assert_eq(
+        mm_profile_start((1ULL << 32) + 1), -1,
+        "Expected mm_profile_start() to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+}
+
+TestSuite(mm_trace);
+
+// Tests that allocations and frees are recorded in order after the header
+Test(mm_trace, records_events) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    FILE *file = tmpfile();
+    cr_assert_not_null(file, "tmpfile() failed");
+    cr_assert_eq(mm_trace_start(fileno(file)), 0, "mm_trace_start() failed");
+
+    void *a = mm_malloc(100);
+    void *b = mm_malloc(200);
+    mm_free(a);
+    mm_free_sized(b, 200);
+    cr_assert_eq(mm_trace_stop(), 0, "mm_trace_stop() failed");
+    mm_free(mm_malloc(10));  // Not recorded
+    rewind(file);
+
+    struct mm_trace_header header;
+    cr_assert_eq(
+        fread(&header, sizeof(header), 1, file), 1, "Missing trace header");
+    cr_assert_eq(header.magic, MM_TRACE_MAGIC, "Bad magic %#lx", header.magic);
+    cr_assert_eq(
+        header.event_size, sizeof(struct mm_trace_event),
+        "Unexpected event size %lu", header.event_size);
+
+    struct mm_trace_event events[8];
+    const size_t n = fread(events, sizeof(events[0]), 8, file);
+    fclose(file);
+    cr_assert_eq(n, 4, "Expected 4 events but read %zu", n);
+
+    const struct {
+        uint32_t op;
+        void *ptr;
+        uint64_t size;
+    } expected[] = {
+        {MM_TRACE_MALLOC, a, 100},
+        {MM_TRACE_MALLOC, b, 200},
+        {MM_TRACE_FREE, a, 0},
+        {MM_TRACE_FREE, b, 200},
+    };
+    for (size_t i = 0; i < n; i++) {
+        cr_assert_eq(
+            events[i].op, expected[i].op, "Event %zu has op %u", i,
+            events[i].op);
+        cr_assert_eq(
+            (void *)(uintptr_t)events[i].ptr, expected[i].ptr,
+            "Event %zu has the wrong pointer", i);
+        cr_assert_eq(
+            events[i].size, expected[i].size, "Event %zu has size %lu", i,
+            events[i].size);
+        cr_assert_neq(events[i].thread, 0, "Event %zu has no thread", i);
+        if (i > 0) {
+            cr_assert_eq(
+                events[i].thread, events[0].thread,
+                "Event %zu has the wrong thread", i);
+            cr_assert_geq(
+                events[i].timestamp, events[i - 1].timestamp,
+                "Event %zu went back in time", i);
+        }
+    }
+
+    mm_deinit();
+}
+
+// Tests that starting twice is rejected
+Test(mm_trace, start_twice) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    FILE *file = tmpfile();
+    cr_assert_not_null(file, "tmpfile() failed");
+    cr_assert_eq(mm_trace_start(fileno(file)), 0, "mm_trace_start() failed");
+    set_mm_errno(MM_ERR_NONE);
+
+    cr_assert_eq(
+        mm_trace_start(fileno(file)), -1, "Expected the second start to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+
+    mm_trace_stop();
+    fclose(file);
+    mm_deinit();
+}
+
+static pthread_barrier_t trace_barrier;
+
+static void *trace_unflushed_worker(void *arg) {
+    (void)arg;
+    mm_free(mm_malloc(100));  // Recorded in the first session
+    pthread_barrier_wait(&trace_barrier);
+    pthread_barrier_wait(&trace_barrier);  // Tracing restarted
+    mm_trace_flush();
+    return NULL;
+}
+
+// Tests that events another thread buffered in an earlier session are not
+// written to the next session's file
+Test(mm_trace, restart_drops_stale_events) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    FILE *first = tmpfile();
+    FILE *second = tmpfile();
+    cr_assert(first != NULL && second != NULL, "tmpfile() failed");
+    pthread_barrier_init(&trace_barrier, NULL, 2);
+
+    cr_assert_eq(mm_trace_start(fileno(first)), 0, "mm_trace_start() failed");
+    pthread_t thread;
+    pthread_create(&thread, NULL, trace_unflushed_worker, NULL);
+    pthread_barrier_wait(&trace_barrier);
+    cr_assert_eq(mm_trace_stop(), 0, "mm_trace_stop() failed");
+    cr_assert_eq(
+        mm_trace_start(fileno(second)), 0, "mm_trace_start() failed");
+    pthread_barrier_wait(&trace_barrier);
+    pthread_join(thread, NULL);
+    cr_assert_eq(mm_trace_stop(), 0, "mm_trace_stop() failed");
+
+    cr_assert_eq(fseek(second, 0, SEEK_END), 0, "fseek() failed");
+    const long bytes = ftell(second);
+    cr_assert_eq(
+        bytes, (long)sizeof(struct mm_trace_header),
+        "Expected only the header but the trace has %ld bytes", bytes);
+
+    pthread_barrier_destroy(&trace_barrier);
+    fclose(first);
+    fclose(second);
+    mm_deinit();
+}
+
+TestSuite(mm_latency);
+
+// Tests that timed calls are counted in their size class and summarized
+Test(mm_latency, counts_calls) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+    cr_assert_eq(mm_latency_start(), 0, "mm_latency_start() failed");
+    void *ptrs[10];
+    for (int i = 0; i < 10; i++) {
+        ptrs[i] = mm_malloc(24);
+    }
+    for (int i = 0; i < 10; i++) {
+        mm_free(ptrs[i]);
+    }
+    mm_latency_stop();
+    mm_free(mm_malloc(24));  // Not timed
+
+    uint64_t counts[MM_LATENCY_BUCKETS];
+    for (int op = 0; op < MM_LATENCY_OPS; op++) {
+        cr_assert_eq(
+            mm_latency_histogram(op, NUM_SEG_LISTS, counts), 0,
+            "mm_latency_histogram() failed");
+        uint64_t total = 0;
+        for (int i = 0; i < MM_LATENCY_BUCKETS; i++) {
+            total += counts[i];
+        }
+        cr_assert_eq(total, 10, "Op %d timed %lu calls", op, total);
+    }
+
+    struct mm_stats stats;
+    cr_assert_eq(mm_get_stats(&stats), 0, "mm_get_stats() failed");
+    cr_assert_neq(stats.latency_counter_hz, 0, "Missing counter frequency");
+    for (int op = 0; op < MM_LATENCY_OPS; op++) {
+        const struct mm_latency_summary *s = &stats.latency[op];
+        cr_assert_eq(s->count, 10, "Op %d has count %lu", op, s->count);
+        cr_assert(
+            s->p50 <= s->p99 && s->p99 <= s->p999 && s->p999 <= s->max,
+            "Op %d percentiles out of order", op);
+    }
+
+    // Starting again clears the histograms
+    cr_assert_eq(mm_latency_start(), 0, "mm_latency_start() failed");
+    mm_latency_stop();
+    cr_assert_eq(mm_get_stats(&stats), 0, "mm_get_stats() failed");
+    cr_assert_eq(stats.latency[MM_LATENCY_MALLOC].count, 0, "Not cleared");
+
+    mm_deinit();
+}
+
+// Tests that out-of-range arguments are rejected
+Test(mm_latency, bad_arguments) {
+    uint64_t counts[MM_LATENCY_BUCKETS];
+    set_mm_errno(MM_ERR_NONE);
+    cr_assert_eq(
+        mm_latency_histogram(MM_LATENCY_OPS, 0, counts), -1,
+        "Expected a bad op to fail");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+    cr_assert_eq(
+        mm_latency_histogram(MM_LATENCY_FREE, NUM_SEG_LISTS + 1, counts), -1,
+        "Expected a bad size class to fail");
+    cr_assert_eq(
+        mm_latency_histogram(MM_LATENCY_FREE, 0, NULL), -1,
+        "Expected NULL counts to fail");
+}
+
+#ifdef MM_TLSF
+TestSuite(mm_tlsf);
+
+// Payload size of a block of exactly `n` bytes
+#define PAYLOAD_FOR_BLOCK(n) ((n) - TAGS_BYTES)
+
+// Power-of-two class of 512-1023 byte blocks in the statistics
+#define CLASS_512 4
+
+// Tests that the list bits are set when a list gains its only block and
+// cleared when it loses it again
+Test(mm_tlsf, list_bits_follow_the_list) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    // The only block of the [576, 640) list
+    void *a = mm_malloc(PAYLOAD_FOR_BLOCK(576));
+    void *sep = mm_malloc(100);
+    struct mm_stats before;
+    mm_get_stats(&before);
+
+    mm_free(a);
+    struct mm_stats stats;
+    mm_get_stats(&stats);
+    cr_assert_eq(
+        stats.free_blocks[CLASS_512], before.free_blocks[CLASS_512] + 1,
+        "Expected a to be counted as free");
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after free");
+
+    void *p = mm_malloc(PAYLOAD_FOR_BLOCK(576));
+    cr_assert_eq(p, a, "Expected %p to be reused but got %p", a, p);
+    mm_get_stats(&stats);
+    cr_assert_eq(
+        stats.free_blocks[CLASS_512], before.free_blocks[CLASS_512],
+        "Expected a to no longer be counted as free");
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after reuse");
+
+    // The list is empty again, so the next block comes from elsewhere
+    void *q = mm_malloc(PAYLOAD_FOR_BLOCK(576));
+    cr_assert_not_null(q, "Expected mm_malloc() to succeed");
+    cr_assert_neq(q, a, "Expected a new block but got %p", q);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after refill");
+
+    mm_free(q);
+    mm_free(p);
+    mm_free(sep);
+    mm_deinit();
+}
+
+// Tests that a request just above a list boundary rounds up to the next
+// list and skips a large enough block in its own list
+Test(mm_tlsf, rounds_up_to_next_list) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(PAYLOAD_FOR_BLOCK(624));  // In [576, 640)
+    void *sep = mm_malloc(100);
+    mm_free(a);
+
+    void *p = mm_malloc(PAYLOAD_FOR_BLOCK(592));
+    cr_assert_not_null(p, "Expected mm_malloc() to succeed");
+    cr_assert_neq(p, a, "Expected %p to be skipped", a);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after skip");
+
+    // A request on the boundary takes it
+    void *q = mm_malloc(PAYLOAD_FOR_BLOCK(576));
+    cr_assert_eq(q, a, "Expected %p but got %p", a, q);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after reuse");
+
+    mm_free(q);
+    mm_free(p);
+    mm_free(sep);
+    mm_deinit();
+}
+
+// Tests that a request just below a first-level boundary is served from the
+// first list of the next first level
+Test(mm_tlsf, below_first_level_boundary) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *c = mm_malloc(PAYLOAD_FOR_BLOCK(1008));  // In [960, 1024)
+    void *sep1 = mm_malloc(100);
+    void *b = mm_malloc(PAYLOAD_FOR_BLOCK(1024));  // In [1024, 1152)
+    void *sep2 = mm_malloc(100);
+    mm_free(c);
+    mm_free(b);
+
+    void *p = mm_malloc(PAYLOAD_FOR_BLOCK(1008));
+    cr_assert_eq(p, b, "Expected %p but got %p", b, p);
+    cr_assert_eq(
+        mm_check_incremental(SIZE_MAX, NULL), 0, "Check failed after reuse");
+
+    mm_free(p);
+    mm_free(sep1);
+    mm_free(sep2);
+    mm_deinit();
+}
+#endif
+
+#ifdef MM_BUDDY
+TestSuite(mm_buddy);
+
+// The buddy zone is a 1 MiB block of the heap, so it needs a larger arena
+#define BUDDY_ARENA_SIZE (4 * TEST_ARENA_SIZE)
+
+// Tests that power-of-two blocks are exact, split in halves and merge back
+Test(mm_buddy, split_and_merge) {
+    cr_assert_eq(mm_init(BUDDY_ARENA_SIZE), 0, "mm_init() failed");
+
+    char *a = mm_malloc(64);
+    char *b = mm_malloc(64);
+    cr_assert_eq(mm_usable_size(a), 64, "Expected a 64-byte block");
+    cr_assert_eq(b, a + 64, "Expected %p to be a's buddy but got %p", a + 64, b);
+
+    // Non powers of two still come from the boundary-tag heap
+    char *c = mm_malloc(100);
+    cr_assert(c < a || c >= a + (1 << 20), "Expected %p outside the zone", c);
+
+    mm_free(b);
+    mm_free(a);
+    void *d = mm_malloc(128);
+    cr_assert_eq(d, a, "Expected the merged block at %p but got %p", a, d);
+
+    mm_free(d);
+    mm_free(c);
+    mm_deinit();
+}
+
+// Tests that freeing a buddy block twice is reported as corruption
+Test(mm_buddy, double_free) {
+    cr_assert_eq(mm_init(BUDDY_ARENA_SIZE), 0, "mm_init() failed");
+
+    void *a = mm_malloc(256);
+    mm_free(a);
+    set_mm_errno(MM_ERR_NONE);
+    mm_free(a);
+    const int mm_errno = get_mm_errno();
+
+    cr_assert_eq(
+        mm_errno, MM_ERR_CORRUPT,
+        "Expected mm_errno to be MM_ERR_CORRUPT but it is %d", mm_errno);
+
+    mm_deinit();
+}
+#endif
+
+#ifdef MM_SIDE_TABLE
+TestSuite(mm_side_table);
+
+// Tests that list operations and searches leave free payloads untouched
+Test(mm_side_table, free_payload_untouched) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    unsigned char *a = mm_malloc(200);
+    void *sep1 = mm_malloc(32);
+    unsigned char *b = mm_malloc(200);
+    void *sep2 = mm_malloc(32);
+    const size_t usable = mm_usable_size(a);
+    memset(a, 0xab, usable);
+    memset(b, 0xab, usable);
+
+    // a and b share a list, and a search in it walks past both
+    mm_free(a);
+    mm_free(b);
+    void *big = mm_malloc(220);
+    cr_assert_eq(
+        mm_check_incremental(1 << 20, NULL), 0, "Expected a consistent heap");
+
+    for (size_t i = 0; i < usable; i++) {
+        cr_assert_eq(a[i], 0xab, "Byte %zu of a was written", i);
+        cr_assert_eq(b[i], 0xab, "Byte %zu of b was written", i);
+    }
+
+    mm_free(big);
+    mm_free(sep1);
+    mm_free(sep2);
+    mm_deinit();
+}
+#endif
+
+#ifdef MM_COMPACT
+TestSuite(mm_compact);
+
+// Tests that a small request gets a 16-byte block with 8 usable bytes
+Test(mm_compact, minimum_block) {
+    cr_assert_eq(mm_init(TEST_ARENA_SIZE), 0, "mm_init() failed");
+
+    char *a = mm_malloc(5);
+    char *b = mm_malloc(5);
+    cr_assert_eq(mm_usable_size(a), 8, "Expected 8 usable bytes");
+    cr_assert_eq(b, a + 16, "Expected %p to follow %p but got %p", a + 16, a, b);
+    memset(a, 0xab, 8);
+    memset(b, 0xcd, 8);
+
+    // A freed minimum block holds both links and is reused as is
+    mm_free(a);
+    cr_assert_eq(
+        mm_check_incremental(1 << 20, NULL), 0, "Expected a consistent heap");
+    void *c = mm_malloc(3);
+    cr_assert_eq(c, a, "Expected %p to be reused but got %p", a, c);
+
+    mm_free(c);
+    mm_free(b);
+    mm_deinit();
+}
+
+// Tests that an arena the 32-bit tags cannot span is rejected
+Test(mm_compact, arena_too_large) {
+    set_mm_errno(MM_ERR_NONE);
+    cr_assert_eq(
+        mm_init(((size_t)1 << 32) + 1), -1,
+        "Expected mm_init() to reject an arena above 4 GiB");
+    cr_assert_eq(
+        get_mm_errno(), MM_ERR_INVAL, "Expected mm_errno to be MM_ERR_INVAL");
+}
+#endif